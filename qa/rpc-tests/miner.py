@@ -0,0 +1,47 @@
+#!/usr/bin/env python2
+# Copyright (c) 2014 The Bitcoin Core developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#
+# Test the internal miner started with -gen.
+# In regtest mode the miner stops after finding one block: the
+# worker threads must exit, the coordinator must stop with them
+# and the node must stay responsive.
+#
+
+from test_framework import BitcoinTestFramework
+from util import *
+import time
+
+class MinerTest(BitcoinTestFramework):
+
+    def setup_network(self):
+        # Just need one node, mining with two worker threads
+        args = ["-gen", "-genproclimit=2"]
+        self.nodes = []
+        self.nodes.append(start_node(0, self.options.tmpdir, args))
+        self.is_network_split = False
+
+    def run_test(self):
+        node = self.nodes[0]
+
+        # Wait for the miner to find its block
+        for i in xrange(120):
+            if node.getblockcount() > 200:
+                break
+            time.sleep(0.5)
+        assert_equal(node.getblockcount(), 201)
+
+        # Once the block is found mining ends; no more blocks appear
+        time.sleep(3)
+        assert_equal(node.getblockcount(), 201)
+
+        # Tearing the stopped miner down must not hang, and on-demand
+        # mining still works afterwards
+        node.setgenerate(False)
+        node.setgenerate(True, 1)
+        assert_equal(node.getblockcount(), 202)
+
+if __name__ == '__main__':
+    MinerTest().main()
@@ -11,6 +11,7 @@
 #include <string.h>
 #include <vector>
 
+#include <boost/pool/pool_alloc.hpp>
 #include <boost/thread/mutex.hpp>
 #include <boost/thread/once.hpp>
 
@@ -259,6 +260,61 @@ struct zero_after_free_allocator : public std::allocator<T> {
     }
 };
 
+//
+// Allocator for node-based containers. Single objects (the nodes) come from a
+// free list shared by all containers with the same node size, so inserting and
+// erasing does not go through malloc. Larger requests, such as the bucket
+// array of a hash table, go to the heap.
+//
+// Pooled memory is kept for reuse and never returned to the system, so each
+// pool stays at the peak number of nodes that were live at once. That is a
+// deliberate trade-off: the free list is unordered, which keeps allocate and
+// deallocate O(1) but rules out boost::pool's release_memory(), and an ordered
+// free list would make every erase linear in the number of free nodes. Only use
+// this allocator for containers whose peak size is already bounded by a memory
+// limit: the coins cache is held under -dbcache (Flush() trims it back below
+// its budget, after which the freed nodes are reused rather than new ones
+// allocated) and the mempool under -maxmempool.
+//
+template <typename T>
+struct node_pool_allocator : public std::allocator<T> {
+    // MSVC8 default copy constructor is broken
+    typedef std::allocator<T> base;
+    typedef typename base::size_type size_type;
+    typedef typename base::difference_type difference_type;
+    typedef typename base::pointer pointer;
+    typedef typename base::const_pointer const_pointer;
+    typedef typename base::reference reference;
+    typedef typename base::const_reference const_reference;
+    typedef typename base::value_type value_type;
+    node_pool_allocator() throw() {}
+    node_pool_allocator(const node_pool_allocator& a) throw() : base(a) {}
+    template <typename U>
+    node_pool_allocator(const node_pool_allocator<U>& a) throw() : base(a)
+    {
+    }
+    ~node_pool_allocator() throw() {}
+    template <typename _Other>
+    struct rebind {
+        typedef node_pool_allocator<_Other> other;
+    };
+
+    T* allocate(std::size_t n, const void* hint = 0)
+    {
+        if (n == 1)
+            return boost::fast_pool_allocator<T>::allocate(1);
+        return std::allocator<T>::allocate(n, hint);
+    }
+
+    void deallocate(T* p, std::size_t n)
+    {
+        if (n == 1)
+            boost::fast_pool_allocator<T>::deallocate(p, 1);
+        else
+            std::allocator<T>::deallocate(p, n);
+    }
+};
+
 // This is exactly like std::string, but with a custom allocator.
 typedef std::basic_string<char, std::char_traits<char>, secure_allocator<char> > SecureString;
 
@@ -0,0 +1,109 @@
+// Copyright (c) 2016 The HealthHeldToken developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "crypto/bthhash.h"
+#include "crypto/bthhash_batch.h"
+#include "crypto/bthhash_midstate.h"
+
+#include <string.h>
+#include <vector>
+
+/** Number of nonces hashed per batch call, roughly what a mining thread asks for at once. */
+static const size_t BENCH_BATCH_SIZE = 256;
+
+static void HeaderForBench(unsigned char* header)
+{
+    for (size_t i = 0; i < BTHHASH_HEADER_SIZE; i++)
+        header[i] = (unsigned char)(i * 7 + 1);
+}
+
+static void BthHashSingle(benchmark::State& state)
+{
+    unsigned char header[BTHHASH_HEADER_SIZE];
+    HeaderForBench(header);
+    uint32_t nNonce = 0;
+    state.SetItemsProcessed(1);
+    while (state.KeepRunning()) {
+        memcpy(header + 76, &nNonce, 4);
+        bthhash(header, header + BTHHASH_HEADER_SIZE);
+        nNonce++;
+    }
+}
+
+static void BthHashMidstate(benchmark::State& state)
+{
+    unsigned char header[BTHHASH_HEADER_SIZE];
+    HeaderForBench(header);
+    CBthHashMidstate midstate(header);
+    uint32_t nNonce = 0;
+    state.SetItemsProcessed(1);
+    while (state.KeepRunning())
+        midstate.GetHash(nNonce++);
+}
+
+/** The first stage alone, where the midstate saves work. */
+static void Blake512Header(benchmark::State& state)
+{
+    unsigned char header[BTHHASH_HEADER_SIZE];
+    unsigned char hash[64];
+    HeaderForBench(header);
+    uint32_t nNonce = 0;
+    state.SetItemsProcessed(1);
+    while (state.KeepRunning()) {
+        memcpy(header + 76, &nNonce, 4);
+        sph_blake512_context ctx;
+        sph_blake512_init(&ctx);
+        sph_blake512(&ctx, header, BTHHASH_HEADER_SIZE);
+        sph_blake512_close(&ctx, hash);
+        nNonce++;
+    }
+}
+
+static void Blake512HeaderMidstate(benchmark::State& state)
+{
+    unsigned char header[BTHHASH_HEADER_SIZE];
+    unsigned char hash[64];
+    HeaderForBench(header);
+    CBthHashMidstate midstate(header);
+    uint32_t nNonce = 0;
+    state.SetItemsProcessed(1);
+    while (state.KeepRunning())
+        midstate.Blake512(nNonce++, hash);
+}
+
+static void BthHashBatch(benchmark::State& state, bool fSimd)
+{
+    unsigned char header[BTHHASH_HEADER_SIZE];
+    HeaderForBench(header);
+    std::vector<unsigned char> vOut(BENCH_BATCH_SIZE * BTHHASH_OUTPUT_SIZE);
+    if (fSimd)
+        bthhash_detect_simd();
+    else
+        bthhash_use_scalar();
+    uint32_t nNonce = 0;
+    state.SetItemsProcessed(BENCH_BATCH_SIZE);
+    while (state.KeepRunning()) {
+        bthhash_batch_nonces(header, nNonce, BENCH_BATCH_SIZE, &vOut[0]);
+        nNonce += BENCH_BATCH_SIZE;
+    }
+}
+
+static void BthHashBatchScalar(benchmark::State& state)
+{
+    BthHashBatch(state, false);
+}
+
+static void BthHashBatchSIMD(benchmark::State& state)
+{
+    BthHashBatch(state, true);
+}
+
+BENCHMARK(BthHashSingle);
+BENCHMARK(BthHashMidstate);
+BENCHMARK(Blake512Header);
+BENCHMARK(Blake512HeaderMidstate);
+BENCHMARK(BthHashBatchScalar);
+BENCHMARK(BthHashBatchSIMD);
@@ -0,0 +1,181 @@
+// Copyright (c) 2016 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockencodings.h"
+
+#include "crypto/common.h"
+#include "crypto/sha256.h"
+#include "hash.h"
+#include "random.h"
+#include "streams.h"
+#include "txmempool.h"
+#include "util.h"
+
+#include <boost/unordered_map.hpp>
+
+CBlockHeaderAndShortTxIDs::CBlockHeaderAndShortTxIDs(const CBlock& block) :
+        nonce(GetRand(std::numeric_limits<uint64_t>::max())),
+        shorttxids(block.vtx.size() - 1), prefilledtxn(1), header(block.GetBlockHeader())
+{
+    FillShortTxIDSelector();
+    // The coinbase is never in anyone's mempool
+    prefilledtxn[0].index = 0;
+    prefilledtxn[0].tx = block.vtx[0];
+    for (size_t i = 1; i < block.vtx.size(); i++)
+        shorttxids[i - 1] = GetShortID(block.vtx[i].GetHash());
+}
+
+void CBlockHeaderAndShortTxIDs::FillShortTxIDSelector() const
+{
+    // Salting with the header and a per-announcement nonce means nobody can
+    // grind transactions that collide for every peer at once.
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << header << nonce;
+    unsigned char hash[CSHA256::OUTPUT_SIZE];
+    CSHA256().Write((const unsigned char*)&stream[0], stream.size()).Finalize(hash);
+    shorttxidk0 = ReadLE64(&hash[0]);
+    shorttxidk1 = ReadLE64(&hash[8]);
+}
+
+uint64_t CBlockHeaderAndShortTxIDs::GetShortID(const uint256& txhash) const
+{
+    return SipHashUint256(shorttxidk0, shorttxidk1, txhash) & 0xffffffffffffULL;
+}
+
+ReadStatus PartiallyDownloadedBlock::InitData(const CBlockHeaderAndShortTxIDs& cmpctblock)
+{
+    if (cmpctblock.header.IsNull() || (cmpctblock.shorttxids.empty() && cmpctblock.prefilledtxn.empty()))
+        return READ_STATUS_INVALID;
+    if (cmpctblock.BlockTxCount() > MAX_BLOCK_SIZE / 60) // smallest possible transaction
+        return READ_STATUS_INVALID;
+
+    assert(header.IsNull() && txn_available.empty());
+    header = cmpctblock.header;
+    txn_available.resize(cmpctblock.BlockTxCount());
+    vAvailable.assign(cmpctblock.BlockTxCount(), false);
+
+    int32_t nLastPrefilled = -1;
+    for (size_t i = 0; i < cmpctblock.prefilledtxn.size(); i++) {
+        if (cmpctblock.prefilledtxn[i].tx.IsNull())
+            return READ_STATUS_INVALID;
+
+        // Differential encoding: each index is relative to the previous one
+        nLastPrefilled += cmpctblock.prefilledtxn[i].index + 1;
+        if (nLastPrefilled > std::numeric_limits<uint16_t>::max())
+            return READ_STATUS_INVALID;
+        if ((uint32_t)nLastPrefilled > cmpctblock.shorttxids.size() + i) {
+            // The prefilled transactions must fit between the short IDs, so
+            // no index may be past the end of the block
+            return READ_STATUS_INVALID;
+        }
+        txn_available[nLastPrefilled] = cmpctblock.prefilledtxn[i].tx;
+        vAvailable[nLastPrefilled] = true;
+    }
+    nPrefilled = cmpctblock.prefilledtxn.size();
+
+    // Map each short ID to its position in the block, skipping the slots
+    // the prefilled transactions took.
+    boost::unordered_map<uint64_t, uint16_t> mapShortIDs;
+    mapShortIDs.rehash(cmpctblock.shorttxids.size());
+    uint16_t nIndexOffset = 0;
+    for (size_t i = 0; i < cmpctblock.shorttxids.size(); i++) {
+        while (vAvailable[i + nIndexOffset])
+            nIndexOffset++;
+        if (!mapShortIDs.insert(std::make_pair(cmpctblock.shorttxids[i], i + nIndexOffset)).second) {
+            // Two transactions in the block share a short ID; we cannot tell
+            // which mempool transaction goes where, so get the full block.
+            return READ_STATUS_FAILED;
+        }
+    }
+
+    std::vector<bool> vHaveCollision(txn_available.size(), false);
+    {
+        LOCK(pool->cs);
+        for (CTxMemPool::indexed_transaction_set::const_iterator it = pool->mapTx.begin(); it != pool->mapTx.end(); ++it) {
+            const CTransaction& tx = it->GetTx();
+            boost::unordered_map<uint64_t, uint16_t>::iterator idit = mapShortIDs.find(cmpctblock.GetShortID(tx.GetHash()));
+            if (idit == mapShortIDs.end())
+                continue;
+            uint16_t nIndex = idit->second;
+            if (vHaveCollision[nIndex])
+                continue;
+            if (!vAvailable[nIndex]) {
+                txn_available[nIndex] = tx;
+                vAvailable[nIndex] = true;
+                nMempool++;
+            } else {
+                // Two mempool transactions match the same short ID. Leave the
+                // slot empty so it is requested with getblocktxn rather than
+                // guessing and failing the merkle root check.
+                txn_available[nIndex] = CTransaction();
+                vAvailable[nIndex] = false;
+                vHaveCollision[nIndex] = true;
+                nMempool--;
+            }
+            // Nothing left to find once every short ID is matched
+            if (nMempool == mapShortIDs.size())
+                break;
+        }
+    }
+
+    LogPrint("cmpctblock", "Initialized PartiallyDownloadedBlock for block %s using a cmpctblock of size %lu\n",
+             cmpctblock.header.GetHash().ToString(), ::GetSerializeSize(cmpctblock, SER_NETWORK, PROTOCOL_VERSION));
+
+    return READ_STATUS_OK;
+}
+
+bool PartiallyDownloadedBlock::IsTxAvailable(size_t index) const
+{
+    assert(!header.IsNull());
+    assert(index < vAvailable.size());
+    return vAvailable[index];
+}
+
+void PartiallyDownloadedBlock::GetMissingIndexes(std::vector<uint16_t>& vIndexes) const
+{
+    vIndexes.clear();
+    for (size_t i = 0; i < vAvailable.size(); i++) {
+        if (!vAvailable[i])
+            vIndexes.push_back(i);
+    }
+}
+
+ReadStatus PartiallyDownloadedBlock::FillBlock(CBlock& block, const std::vector<CTransaction>& vtx_missing)
+{
+    assert(!header.IsNull());
+    block = header;
+    block.vtx.resize(txn_available.size());
+
+    size_t nMissingUsed = 0;
+    for (size_t i = 0; i < txn_available.size(); i++) {
+        if (vAvailable[i]) {
+            block.vtx[i] = txn_available[i];
+        } else {
+            if (nMissingUsed >= vtx_missing.size())
+                return READ_STATUS_INVALID;
+            block.vtx[i] = vtx_missing[nMissingUsed++];
+        }
+    }
+
+    // Make sure the object can't be used again
+    header.SetNull();
+    txn_available.clear();
+    vAvailable.clear();
+
+    if (nMissingUsed != vtx_missing.size())
+        return READ_STATUS_INVALID;
+
+    bool fMutated = false;
+    if (block.BuildMerkleTree(&fMutated) != block.hashMerkleRoot || fMutated) {
+        // A short ID collision with a transaction the block does not contain
+        // is indistinguishable from a bad announcement, so do not punish the
+        // peer; the caller falls back to requesting the full block.
+        return READ_STATUS_FAILED;
+    }
+
+    LogPrint("cmpctblock", "Successfully reconstructed block %s with %lu txn prefilled, %lu txn from mempool and %lu txn requested\n",
+             block.GetHash().ToString(), nPrefilled, nMempool, vtx_missing.size());
+
+    return READ_STATUS_OK;
+}
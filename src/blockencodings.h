@@ -0,0 +1,204 @@
+// Copyright (c) 2016 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKENCODINGS_H
+#define BITCOIN_BLOCKENCODINGS_H
+
+#include "primitives/block.h"
+#include "serialize.h"
+
+#include <ios>
+#include <vector>
+
+class CTxMemPool;
+
+/**
+ * Compact block relay.
+ *
+ * Once both sides of a connection have COMPACT_BLOCKS_VERSION and one of
+ * them asked for it with "sendcmpct", new blocks are announced with a
+ * "cmpctblock" message carrying the header, a 6-byte salted short ID per
+ * transaction and a few prefilled transactions (at least the coinbase). The
+ * receiver rebuilds the block from its mempool and asks for whatever it
+ * could not find with "getblocktxn"; the sender answers with "blocktxn".
+ */
+
+//! Short transaction IDs are the low 48 bits of a salted SipHash of the txid
+static const int SHORTTXIDS_LENGTH = 6;
+
+//! Transaction indexes in compact blocks are 16 bits, enough for MAX_BLOCK_SIZE
+static const unsigned int MAX_COMPACT_BLOCK_TXS = 0xffff;
+
+/** Transactions of a block, requested by index ("getblocktxn") */
+class BlockTransactionsRequest
+{
+public:
+    uint256 blockhash;
+    std::vector<uint16_t> indexes;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(blockhash);
+        uint64_t nCount = indexes.size();
+        READWRITE(COMPACTSIZE(nCount));
+        if (ser_action.ForRead()) {
+            if (nCount > MAX_COMPACT_BLOCK_TXS)
+                throw std::ios_base::failure("BlockTransactionsRequest : too many indexes");
+            indexes.resize(nCount);
+        }
+        // Indexes are sorted and sent as the difference to the previous one
+        // minus one, which keeps almost every one of them to a single byte.
+        uint64_t nOffset = 0;
+        for (size_t i = 0; i < indexes.size(); i++) {
+            uint64_t nDiff = indexes[i] - nOffset;
+            READWRITE(COMPACTSIZE(nDiff));
+            if (ser_action.ForRead()) {
+                if (nDiff + nOffset > MAX_COMPACT_BLOCK_TXS)
+                    throw std::ios_base::failure("BlockTransactionsRequest : index overflowed 16 bits");
+                indexes[i] = nDiff + nOffset;
+            }
+            nOffset = indexes[i] + 1;
+        }
+    }
+};
+
+/** Transactions answering a BlockTransactionsRequest ("blocktxn") */
+class BlockTransactions
+{
+public:
+    uint256 blockhash;
+    std::vector<CTransaction> txn;
+
+    BlockTransactions() {}
+    BlockTransactions(const BlockTransactionsRequest& req) :
+        blockhash(req.blockhash), txn(req.indexes.size()) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(blockhash);
+        READWRITE(txn);
+    }
+};
+
+/** A transaction sent in full with a compact block */
+struct PrefilledTransaction
+{
+    //! Differentially encoded in CBlockHeaderAndShortTxIDs, absolute after
+    //! PartiallyDownloadedBlock::InitData
+    uint16_t index;
+    CTransaction tx;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        uint64_t nIndex = index;
+        READWRITE(COMPACTSIZE(nIndex));
+        if (nIndex > MAX_COMPACT_BLOCK_TXS)
+            throw std::ios_base::failure("PrefilledTransaction : index overflowed 16 bits");
+        index = nIndex;
+        READWRITE(tx);
+    }
+};
+
+/** Header and short transaction IDs of a block ("cmpctblock") */
+class CBlockHeaderAndShortTxIDs
+{
+private:
+    mutable uint64_t shorttxidk0, shorttxidk1;
+    uint64_t nonce;
+
+    void FillShortTxIDSelector() const;
+
+    friend class PartiallyDownloadedBlock;
+
+protected:
+    std::vector<uint64_t> shorttxids;
+    std::vector<PrefilledTransaction> prefilledtxn;
+
+public:
+    CBlockHeader header;
+
+    // Dummy for deserialization
+    CBlockHeaderAndShortTxIDs() {}
+
+    //! Encode block, prefilling only the coinbase
+    CBlockHeaderAndShortTxIDs(const CBlock& block);
+
+    uint64_t GetShortID(const uint256& txhash) const;
+
+    size_t BlockTxCount() const { return shorttxids.size() + prefilledtxn.size(); }
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(header);
+        READWRITE(nonce);
+
+        uint64_t nShortTxIDs = shorttxids.size();
+        READWRITE(COMPACTSIZE(nShortTxIDs));
+        if (ser_action.ForRead()) {
+            if (nShortTxIDs > MAX_COMPACT_BLOCK_TXS)
+                throw std::ios_base::failure("CBlockHeaderAndShortTxIDs : too many short IDs");
+            shorttxids.resize(nShortTxIDs);
+        }
+        for (size_t i = 0; i < shorttxids.size(); i++) {
+            uint32_t nLow = shorttxids[i] & 0xffffffff;
+            uint16_t nHigh = (shorttxids[i] >> 32) & 0xffff;
+            READWRITE(nLow);
+            READWRITE(nHigh);
+            if (ser_action.ForRead())
+                shorttxids[i] = ((uint64_t)nHigh << 32) | nLow;
+        }
+
+        READWRITE(prefilledtxn);
+
+        if (ser_action.ForRead()) {
+            if (BlockTxCount() > MAX_COMPACT_BLOCK_TXS)
+                throw std::ios_base::failure("CBlockHeaderAndShortTxIDs : too many transactions");
+            FillShortTxIDSelector();
+        }
+    }
+};
+
+/** Result of reconstructing a block from a compact block */
+enum ReadStatus
+{
+    READ_STATUS_OK,
+    READ_STATUS_INVALID, //! Malformed data, the peer is misbehaving
+    READ_STATUS_FAILED,  //! Could not reconstruct (e.g. a short ID collision), fetch the full block
+};
+
+/** A block being rebuilt from a compact block and the mempool */
+class PartiallyDownloadedBlock
+{
+private:
+    std::vector<CTransaction> txn_available;
+    std::vector<bool> vAvailable;
+    size_t nPrefilled, nMempool;
+    CTxMemPool* pool;
+
+public:
+    CBlockHeader header;
+
+    PartiallyDownloadedBlock(CTxMemPool* poolIn) : nPrefilled(0), nMempool(0), pool(poolIn) {}
+
+    //! Fill in the prefilled transactions and whatever the mempool has
+    ReadStatus InitData(const CBlockHeaderAndShortTxIDs& cmpctblock);
+    bool IsTxAvailable(size_t index) const;
+    //! Indexes to ask for with getblocktxn
+    void GetMissingIndexes(std::vector<uint16_t>& vIndexes) const;
+    //! Assemble the block using vtx_missing for the gaps, in index order
+    ReadStatus FillBlock(CBlock& block, const std::vector<CTransaction>& vtx_missing);
+
+    size_t GetPrefilledCount() const { return nPrefilled; }
+    size_t GetMempoolCount() const { return nMempool; }
+};
+
+#endif // BITCOIN_BLOCKENCODINGS_H
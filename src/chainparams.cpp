@@ -214,6 +214,10 @@ public:
         fMineBlocksOnDemand = false;
         fSkipProofOfWorkCheck = false;//false
         fTestnetToBeDeprecatedFieldRPC = false;
+        // No mainnet block past genesis is checkpointed yet, so there is nothing
+        // to assume valid. Set this to a recent block, buried by at least a few
+        // thousand blocks, whenever the checkpoints are next updated.
+        defaultAssumeValid = uint256();
 
         // healthheldtoken: Mainnet v2 enforced as of block 710k
         nEnforceV2AfterHeight = 710000;
@@ -274,6 +278,8 @@ public:
         fRequireStandard = false;
         fMineBlocksOnDemand = false;
         fTestnetToBeDeprecatedFieldRPC = true;
+        // Nothing uses the assumed-valid block yet (see Checkpoints::IsAssumedValid)
+        defaultAssumeValid = uint256();
 
         // healthheldtoken: Testnet v2 enforced as of block 400k
         nEnforceV2AfterHeight = 400000;
@@ -322,6 +328,7 @@ public:
         fRequireStandard = false;
         fMineBlocksOnDemand = true;
         fTestnetToBeDeprecatedFieldRPC = false;
+        defaultAssumeValid = 0;
 
         // healthheldtoken: v2 enforced using Bitcoin's supermajority rule
         nEnforceV2AfterHeight = -1;
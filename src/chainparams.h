@@ -79,6 +79,8 @@ public:
     const std::vector<unsigned char>& Base58Prefix(Base58Type type) const { return base58Prefixes[type]; }
     const std::vector<CAddress>& FixedSeeds() const { return vFixedSeeds; }
     virtual const Checkpoints::CCheckpointData& Checkpoints() const = 0;
+    /** Default for -assumevalid: a known-good block whose ancestors' scripts are not checked, 0 for none */
+    const uint256& DefaultAssumeValid() const { return defaultAssumeValid; }
 
     // healthheldtoken: Height to enforce v2 block
     int EnforceV2AfterHeight() const { return nEnforceV2AfterHeight; }
@@ -112,6 +114,7 @@ protected:
     bool fMineBlocksOnDemand;
     bool fSkipProofOfWorkCheck;
     bool fTestnetToBeDeprecatedFieldRPC;
+    uint256 defaultAssumeValid;
 
     // healthheldtoken: Height to enforce v2 blocks
     int nEnforceV2AfterHeight;
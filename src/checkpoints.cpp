@@ -6,6 +6,7 @@
 
 #include "chainparams.h"
 #include "main.h"
+#include "pow.h"
 #include "uint256.h"
 
 #include <stdint.h>
@@ -23,7 +24,15 @@ namespace Checkpoints {
      */
     static const double SIGCHECK_VERIFICATION_FACTOR = 5.0;
 
+    /**
+     * How deep, in seconds of work at the current difficulty, a block must be
+     * below the best header before its scripts are skipped. Forging two weeks
+     * of work on top of an invalid chain costs more than it could win.
+     */
+    static const int64_t ASSUMEVALID_MIN_BURY_TIME = 60 * 60 * 24 * 7 * 2;
+
     bool fEnabled = true;
+    uint256 hashAssumeValid;
 
     bool CheckBlock(int nHeight, const uint256& hash)
     {
@@ -96,4 +105,22 @@ namespace Checkpoints {
         return NULL;
     }
 
+    bool IsAssumedValid(const CBlockIndex* pindex, const CBlockIndex* pindexBestHeader)
+    {
+        if (hashAssumeValid == 0 || pindex == NULL || pindexBestHeader == NULL)
+            return false;
+
+        // Until the header of the assumed-valid block arrives, check everything
+        BlockMap::const_iterator it = mapBlockIndex.find(hashAssumeValid);
+        if (it == mapBlockIndex.end())
+            return false;
+        const CBlockIndex* pindexAssumeValid = it->second;
+
+        if (pindexAssumeValid->GetAncestor(pindex->nHeight) != pindex)
+            return false;
+        if (pindexBestHeader->GetAncestor(pindexAssumeValid->nHeight) != pindexAssumeValid)
+            return false;
+        return GetBlockProofEquivalentTime(*pindexBestHeader, *pindex, *pindexBestHeader) > ASSUMEVALID_MIN_BURY_TIME;
+    }
+
 } // namespace Checkpoints
@@ -37,8 +37,20 @@ CBlockIndex* GetLastCheckpoint();
 
 double GuessVerificationProgress(CBlockIndex* pindex, bool fSigchecks = true);
 
+/**
+ * Returns true if the scripts of pindex need not be verified: it is an
+ * ancestor of the -assumevalid block, that block is on the best header chain
+ * and enough work is built on top of pindex. Transaction amounts, the UTXO
+ * set and proof-of-work are still checked in full. Requires cs_main.
+ * Block validation does not call this yet, so no scripts are skipped.
+ */
+bool IsAssumedValid(const CBlockIndex* pindex, const CBlockIndex* pindexBestHeader);
+
 extern bool fEnabled;
 
+//! Block set by -assumevalid, 0 to verify every script
+extern uint256 hashAssumeValid;
+
 } //namespace Checkpoints
 
 #endif // BITCOIN_CHECKPOINTS_H
@@ -36,7 +36,11 @@ bool CCoins::Spend(const COutPoint &out, CTxInUndo &undo) {
         return false;
     if (vout[out.n].IsNull())
         return false;
-    undo = CTxInUndo(vout[out.n]);
+    // Hand the script over to the undo data instead of copying it, so the
+    // spent output gives its memory back
+    undo = CTxInUndo();
+    undo.txout.nValue = vout[out.n].nValue;
+    undo.txout.scriptPubKey.swap(vout[out.n].scriptPubKey);
     vout[out.n].SetNull();
     Cleanup();
     if (vout.size() == 0) {
@@ -57,7 +61,7 @@ bool CCoins::Spend(int nPos) {
 bool CCoinsView::GetCoins(const uint256 &txid, CCoins &coins) const { return false; }
 bool CCoinsView::HaveCoins(const uint256 &txid) const { return false; }
 uint256 CCoinsView::GetBestBlock() const { return uint256(0); }
-bool CCoinsView::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) { return false; }
+bool CCoinsView::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock, bool fErase) { return false; }
 bool CCoinsView::GetStats(CCoinsStats &stats) const { return false; }
 
 
@@ -66,22 +70,30 @@ bool CCoinsViewBacked::GetCoins(const uint256 &txid, CCoins &coins) const { retu
 bool CCoinsViewBacked::HaveCoins(const uint256 &txid) const { return base->HaveCoins(txid); }
 uint256 CCoinsViewBacked::GetBestBlock() const { return base->GetBestBlock(); }
 void CCoinsViewBacked::SetBackend(CCoinsView &viewIn) { base = &viewIn; }
-bool CCoinsViewBacked::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) { return base->BatchWrite(mapCoins, hashBlock); }
+bool CCoinsViewBacked::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock, bool fErase) { return base->BatchWrite(mapCoins, hashBlock, fErase); }
 bool CCoinsViewBacked::GetStats(CCoinsStats &stats) const { return base->GetStats(stats); }
 
 CCoinsKeyHasher::CCoinsKeyHasher() : salt(GetRandHash()) {}
 
-CCoinsViewCache::CCoinsViewCache(CCoinsView *baseIn) : CCoinsViewBacked(baseIn), hasModifier(false), hashBlock(0) { }
+CCoinsViewCache::CCoinsViewCache(CCoinsView *baseIn) : CCoinsViewBacked(baseIn), hasModifier(false), hashBlock(0), cachedCoinsUsage(0), nCacheHits(0), nCacheMisses(0), nMaxUsage(0), nMaxEntries(0) { }
 
 CCoinsViewCache::~CCoinsViewCache()
 {
     assert(!hasModifier);
 }
 
+size_t CCoinsViewCache::DynamicMemoryUsage() const {
+    return memusage::DynamicUsage(cacheCoins) + cachedCoinsUsage;
+}
+
 CCoinsMap::const_iterator CCoinsViewCache::FetchCoins(const uint256 &txid) const {
     CCoinsMap::iterator it = cacheCoins.find(txid);
-    if (it != cacheCoins.end())
+    if (it != cacheCoins.end()) {
+        nCacheHits++;
+        it->second.flags |= CCoinsCacheEntry::ACCESSED;
         return it;
+    }
+    nCacheMisses++;
     CCoins tmp;
     if (!base->GetCoins(txid, tmp))
         return cacheCoins.end();
@@ -92,6 +104,8 @@ CCoinsMap::const_iterator CCoinsViewCache::FetchCoins(const uint256 &txid) const
         // version as fresh.
         ret->second.flags = CCoinsCacheEntry::FRESH;
     }
+    ret->second.flags |= CCoinsCacheEntry::ACCESSED;
+    cachedCoinsUsage += ret->second.coins.DynamicMemoryUsage();
     return ret;
 }
 
@@ -107,7 +121,9 @@ bool CCoinsViewCache::GetCoins(const uint256 &txid, CCoins &coins) const {
 CCoinsModifier CCoinsViewCache::ModifyCoins(const uint256 &txid) {
     assert(!hasModifier);
     std::pair<CCoinsMap::iterator, bool> ret = cacheCoins.insert(std::make_pair(txid, CCoinsCacheEntry()));
+    size_t cachedCoinUsage = 0;
     if (ret.second) {
+        nCacheMisses++;
         if (!base->GetCoins(txid, ret.first->second.coins)) {
             // The parent view does not have this entry; mark it as fresh.
             ret.first->second.coins.Clear();
@@ -116,10 +132,13 @@ CCoinsModifier CCoinsViewCache::ModifyCoins(const uint256 &txid) {
             // The parent view only has a pruned entry for this; mark it as fresh.
             ret.first->second.flags = CCoinsCacheEntry::FRESH;
         }
+    } else {
+        nCacheHits++;
+        cachedCoinUsage = ret.first->second.coins.DynamicMemoryUsage();
     }
     // Assume that whenever ModifyCoins is called, the entry will be modified.
-    ret.first->second.flags |= CCoinsCacheEntry::DIRTY;
-    return CCoinsModifier(*this, ret.first);
+    ret.first->second.flags |= CCoinsCacheEntry::DIRTY | CCoinsCacheEntry::ACCESSED;
+    return CCoinsModifier(*this, ret.first, cachedCoinUsage);
 }
 
 const CCoins* CCoinsViewCache::AccessCoins(const uint256 &txid) const {
@@ -150,23 +169,29 @@ void CCoinsViewCache::SetBestBlock(const uint256 &hashBlockIn) {
     hashBlock = hashBlockIn;
 }
 
-bool CCoinsViewCache::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlockIn) {
+bool CCoinsViewCache::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlockIn, bool fErase) {
     assert(!hasModifier);
     for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end();) {
         if (it->second.flags & CCoinsCacheEntry::DIRTY) { // Ignore non-dirty entries (optimization).
             CCoinsMap::iterator itUs = cacheCoins.find(it->first);
             if (itUs == cacheCoins.end()) {
-                if (!it->second.coins.IsPruned()) {
+                if (!(it->second.flags & CCoinsCacheEntry::FRESH) || !it->second.coins.IsPruned()) {
                     // The parent cache does not have an entry, while the child
-                    // cache does have (a non-pruned) one. Move the data up, and
-                    // mark it as fresh (if the grandparent did have it, we
-                    // would have pulled it in at first GetCoins).
-                    assert(it->second.flags & CCoinsCacheEntry::FRESH);
+                    // cache does have a modified one. Move the data up. It is
+                    // only fresh here if it was fresh in the child: the entry
+                    // may have been trimmed from or synced out of this cache
+                    // while the grandparent still has it, in which case even
+                    // a pruned entry has to be written down.
                     CCoinsCacheEntry& entry = cacheCoins[it->first];
-                    entry.coins.swap(it->second.coins);
-                    entry.flags = CCoinsCacheEntry::DIRTY | CCoinsCacheEntry::FRESH;
+                    if (fErase)
+                        entry.coins.swap(it->second.coins);
+                    else
+                        entry.coins = it->second.coins;
+                    cachedCoinsUsage += entry.coins.DynamicMemoryUsage();
+                    entry.flags = CCoinsCacheEntry::DIRTY | CCoinsCacheEntry::ACCESSED | (it->second.flags & CCoinsCacheEntry::FRESH);
                 }
             } else {
+                cachedCoinsUsage -= itUs->second.coins.DynamicMemoryUsage();
                 if ((itUs->second.flags & CCoinsCacheEntry::FRESH) && it->second.coins.IsPruned()) {
                     // The grandparent does not have an entry, and the child is
                     // modified and being pruned. This means we can just delete
@@ -174,24 +199,83 @@ bool CCoinsViewCache::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlockIn
                     cacheCoins.erase(itUs);
                 } else {
                     // A normal modification.
-                    itUs->second.coins.swap(it->second.coins);
-                    itUs->second.flags |= CCoinsCacheEntry::DIRTY;
+                    if (fErase)
+                        itUs->second.coins.swap(it->second.coins);
+                    else
+                        itUs->second.coins = it->second.coins;
+                    cachedCoinsUsage += itUs->second.coins.DynamicMemoryUsage();
+                    itUs->second.flags |= CCoinsCacheEntry::DIRTY | CCoinsCacheEntry::ACCESSED;
                 }
             }
         }
-        CCoinsMap::iterator itOld = it++;
-        mapCoins.erase(itOld);
+        if (fErase) {
+            CCoinsMap::iterator itOld = it++;
+            mapCoins.erase(itOld);
+        } else {
+            it++;
+        }
     }
     hashBlock = hashBlockIn;
     return true;
 }
 
 bool CCoinsViewCache::Flush() {
+    if (nMaxUsage > 0) {
+        if (!Sync())
+            return false;
+        Trim(nMaxUsage / 4 * 3, nMaxEntries > 0 ? nMaxEntries / 4 * 3 : std::numeric_limits<size_t>::max());
+        return true;
+    }
     bool fOk = base->BatchWrite(cacheCoins, hashBlock);
     cacheCoins.clear();
+    cachedCoinsUsage = 0;
     return fOk;
 }
 
+bool CCoinsViewCache::Sync() {
+    assert(!hasModifier);
+    if (!base->BatchWrite(cacheCoins, hashBlock, false))
+        return false;
+    for (CCoinsMap::iterator it = cacheCoins.begin(); it != cacheCoins.end();) {
+        if (it->second.flags & CCoinsCacheEntry::DIRTY) {
+            if (it->second.coins.IsPruned()) {
+                // The base has it pruned or not at all now; no point keeping it.
+                cachedCoinsUsage -= it->second.coins.DynamicMemoryUsage();
+                CCoinsMap::iterator itOld = it++;
+                cacheCoins.erase(itOld);
+                continue;
+            }
+            // The base has this version now
+            it->second.flags &= ~(CCoinsCacheEntry::DIRTY | CCoinsCacheEntry::FRESH);
+        }
+        it++;
+    }
+    return true;
+}
+
+void CCoinsViewCache::Trim(size_t nTargetUsage, size_t nTargetEntries) {
+    assert(!hasModifier);
+    // Second-chance eviction: the first sweep drops clean entries that were
+    // not used since the last Trim() and clears the mark on the others, the
+    // second drops any clean entry.
+    for (int nPass = 0; nPass < 2 && (DynamicMemoryUsage() > nTargetUsage || cacheCoins.size() > nTargetEntries); nPass++) {
+        for (CCoinsMap::iterator it = cacheCoins.begin(); it != cacheCoins.end() && (DynamicMemoryUsage() > nTargetUsage || cacheCoins.size() > nTargetEntries);) {
+            if (it->second.flags & CCoinsCacheEntry::DIRTY) {
+                it++;
+                continue;
+            }
+            if (nPass == 0 && (it->second.flags & CCoinsCacheEntry::ACCESSED)) {
+                it->second.flags &= ~CCoinsCacheEntry::ACCESSED;
+                it++;
+                continue;
+            }
+            cachedCoinsUsage -= it->second.coins.DynamicMemoryUsage();
+            CCoinsMap::iterator itOld = it++;
+            cacheCoins.erase(itOld);
+        }
+    }
+}
+
 unsigned int CCoinsViewCache::GetCacheSize() const {
     return cacheCoins.size();
 }
@@ -246,7 +330,7 @@ double CCoinsViewCache::GetPriority(const CTransaction &tx, int nHeight) const
     return tx.ComputePriority(dResult);
 }
 
-CCoinsModifier::CCoinsModifier(CCoinsViewCache& cache_, CCoinsMap::iterator it_) : cache(cache_), it(it_) {
+CCoinsModifier::CCoinsModifier(CCoinsViewCache& cache_, CCoinsMap::iterator it_, size_t usage) : cache(cache_), it(it_), cachedCoinUsage(usage) {
     assert(!cache.hasModifier);
     cache.hasModifier = true;
 }
@@ -256,7 +340,11 @@ CCoinsModifier::~CCoinsModifier()
     assert(cache.hasModifier);
     cache.hasModifier = false;
     it->second.coins.Cleanup();
+    cache.cachedCoinsUsage -= cachedCoinUsage; // Subtract the old usage
     if ((it->second.flags & CCoinsCacheEntry::FRESH) && it->second.coins.IsPruned()) {
         cache.cacheCoins.erase(it);
+    } else {
+        // If the coin still exists after the modification, add the new usage
+        cache.cachedCoinsUsage += it->second.coins.DynamicMemoryUsage();
     }
 }
@@ -6,12 +6,16 @@
 #ifndef BITCOIN_COINS_H
 #define BITCOIN_COINS_H
 
+#include "allocators.h"
 #include "compressor.h"
+#include "core_memusage.h"
+#include "memusage.h"
 #include "serialize.h"
 #include "uint256.h"
 #include "undo.h"
 
 #include <assert.h>
+#include <limits>
 #include <stdint.h>
 
 #include <boost/foreach.hpp>
@@ -114,12 +118,26 @@ public:
             vout.pop_back();
         if (vout.empty())
             std::vector<CTxOut>().swap(vout);
+        else if (vout.capacity() >= 2 * vout.size())
+            ShrinkToFit();
+    }
+
+    //! give back the unused capacity of vout; the scripts are moved, not copied
+    void ShrinkToFit() {
+        std::vector<CTxOut> voutNew(vout.size());
+        for (unsigned int i = 0; i < vout.size(); i++) {
+            voutNew[i].nValue = vout[i].nValue;
+            voutNew[i].scriptPubKey.swap(vout[i].scriptPubKey);
+        }
+        vout.swap(voutNew);
     }
 
     void ClearUnspendable() {
         BOOST_FOREACH(CTxOut &txout, vout) {
-            if (txout.scriptPubKey.IsUnspendable())
+            if (txout.scriptPubKey.IsUnspendable()) {
                 txout.SetNull();
+                CScript().swap(txout.scriptPubKey);
+            }
         }
         Cleanup();
     }
@@ -256,6 +274,14 @@ public:
                 return false;
         return true;
     }
+
+    //! heap memory held by vout and the scripts in it
+    size_t DynamicMemoryUsage() const {
+        size_t ret = memusage::DynamicUsage(vout);
+        BOOST_FOREACH(const CTxOut &out, vout)
+            ret += RecursiveDynamicUsage(out.scriptPubKey);
+        return ret;
+    }
 };
 
 class CCoinsKeyHasher
@@ -284,12 +310,20 @@ struct CCoinsCacheEntry
     enum Flags {
         DIRTY = (1 << 0), // This cache entry is potentially different from the version in the parent view.
         FRESH = (1 << 1), // The parent view does not have this entry (or it is pruned).
+        ACCESSED = (1 << 2), // Used since Trim() last passed over this entry; clean entries without it are evicted first.
     };
 
     CCoinsCacheEntry() : coins(), flags(0) {}
 };
 
-typedef boost::unordered_map<uint256, CCoinsCacheEntry, CCoinsKeyHasher> CCoinsMap;
+/**
+ * The cache entries are the bulk of a node's memory, and blocks insert and
+ * erase thousands of them, so the map nodes come from a pool rather than one
+ * malloc call each (see node_pool_allocator). The pool keeps the peak number
+ * of entries allocated, so its size follows the cache's memory budget.
+ */
+typedef boost::unordered_map<uint256, CCoinsCacheEntry, CCoinsKeyHasher, std::equal_to<uint256>,
+                             node_pool_allocator<std::pair<const uint256, CCoinsCacheEntry> > > CCoinsMap;
 
 struct CCoinsStats
 {
@@ -320,8 +354,9 @@ public:
     virtual uint256 GetBestBlock() const;
 
     //! Do a bulk modification (multiple CCoins changes + BestBlock change).
-    //! The passed mapCoins can be modified.
-    virtual bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock);
+    //! With fErase the passed mapCoins can be modified and emptied, otherwise
+    //! it is left as it was.
+    virtual bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock, bool fErase = true);
 
     //! Calculate statistics about the unspent transaction output set
     virtual bool GetStats(CCoinsStats &stats) const;
@@ -343,7 +378,7 @@ public:
     bool HaveCoins(const uint256 &txid) const;
     uint256 GetBestBlock() const;
     void SetBackend(CCoinsView &viewIn);
-    bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock);
+    bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock, bool fErase = true);
     bool GetStats(CCoinsStats &stats) const;
 };
 
@@ -360,7 +395,8 @@ class CCoinsModifier
 private:
     CCoinsViewCache& cache;
     CCoinsMap::iterator it;
-    CCoinsModifier(CCoinsViewCache& cache_, CCoinsMap::iterator it_);
+    size_t cachedCoinUsage; // Cached memory usage of the CCoins object before modification
+    CCoinsModifier(CCoinsViewCache& cache_, CCoinsMap::iterator it_, size_t usage);
 
 public:
     CCoins* operator->() { return &it->second.coins; }
@@ -383,6 +419,18 @@ protected:
     mutable uint256 hashBlock;
     mutable CCoinsMap cacheCoins;
 
+    /* Cached dynamic memory usage for the inner CCoins objects. */
+    mutable size_t cachedCoinsUsage;
+
+    /* Lookups answered from this cache and lookups passed on to the base. */
+    mutable uint64_t nCacheHits;
+    mutable uint64_t nCacheMisses;
+
+    /* Memory budget in bytes for Flush() to trim to, 0 for none. */
+    size_t nMaxUsage;
+    /* Entry limit for Flush() to trim to as well, 0 for none. */
+    size_t nMaxEntries;
+
 public:
     CCoinsViewCache(CCoinsView *baseIn);
     ~CCoinsViewCache();
@@ -392,7 +440,7 @@ public:
     bool HaveCoins(const uint256 &txid) const;
     uint256 GetBestBlock() const;
     void SetBestBlock(const uint256 &hashBlock);
-    bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock);
+    bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock, bool fErase = true);
 
     /**
      * Return a pointer to CCoins in the cache, or NULL if not found. This is
@@ -410,14 +458,49 @@ public:
 
     /**
      * Push the modifications applied to this cache to its base.
+     * Without a memory budget the cache is emptied. With one (see
+     * SetMaxUsage()) it is Sync()ed and then Trim()med to three quarters of
+     * the budget and of the entry limit, so the most used entries stay cached.
      * Failure to call this method before destruction will cause the changes to be forgotten.
      * If false is returned, the state of this cache (and its backing view) will be undefined.
      */
     bool Flush();
 
+    /**
+     * Set the memory budget Flush() trims to, in bytes; 0 (the default) makes
+     * Flush() empty the cache. A flush trigger that counts entries rather than
+     * bytes should pass its limit as nMaxEntriesIn, so that a trimmed cache of
+     * small entries doesn't already exceed it.
+     */
+    void SetMaxUsage(size_t nMaxUsageIn, size_t nMaxEntriesIn = 0) { nMaxUsage = nMaxUsageIn; nMaxEntries = nMaxEntriesIn; }
+    size_t GetMaxUsage() const { return nMaxUsage; }
+
+    /**
+     * Push the modifications applied to this cache to its base, but keep all
+     * entries cached (now clean), so the working set survives the write.
+     * Entries that became fully spent are dropped.
+     * If false is returned, the state of this cache (and its backing view) will be undefined.
+     */
+    bool Sync();
+
+    /**
+     * Drop clean entries until DynamicMemoryUsage() is at most nTargetUsage
+     * and there are at most nTargetEntries, or only dirty entries are left. Entries not accessed since the previous
+     * Trim() go first; the others get a second chance. Pointers returned by
+     * AccessCoins are invalidated.
+     */
+    void Trim(size_t nTargetUsage, size_t nTargetEntries = std::numeric_limits<size_t>::max());
+
     //! Calculate the size of the cache (in number of transactions)
     unsigned int GetCacheSize() const;
 
+    //! Calculate the size of the cache (in bytes)
+    size_t DynamicMemoryUsage() const;
+
+    //! Lookups served from this cache and lookups that went to the base view
+    uint64_t GetCacheHits() const { return nCacheHits; }
+    uint64_t GetCacheMisses() const { return nCacheMisses; }
+
     /** 
      * Amount of bitcoins coming in to a transaction
      * Note that lightweight clients may not know anything besides the hash of previous transactions,
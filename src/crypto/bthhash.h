@@ -54,8 +54,12 @@ GLOBAL sph_simd512_context      z_simd;
 } while (0) 
 
 
-template<typename T1>
-inline uint256 bthhash(const T1 pbegin, const T1 pend)
+/**
+ * Run every stage of bthhash after the first one, starting from the blake512
+ * digest of the header. Split out so that callers hashing many headers that
+ * share a prefix (see CBthHashMidstate) can compute the first stage cheaply.
+ */
+inline uint256 bthhash_from_blake512(const uint512& hashBlake)
 {
     sph_blake512_context      ctx_blake;
     sph_bmw512_context        ctx_bmw;
@@ -67,26 +71,16 @@ inline uint256 bthhash(const T1 pbegin, const T1 pend)
     sph_cubehash512_context   ctx_cubehash;
     sph_shavite512_context    ctx_shavite;
     sph_simd512_context       ctx_simd;
-static unsigned char pblank[1];
 
-#ifndef QT_NO_DEBUG
-    //std::string strhash;
-    //strhash = "";
-#endif
-        
 	uint512 mask = 12; // 0000...0000001100
     uint512 hash_zero = 0;
 	uint512 hash_one = 4;
 	uint512 hash_two = 8;
 	uint512 hash_three = 12;
-    
 
     uint512 hash[13];
+    hash[0] = hashBlake;
 
-    sph_blake512_init(&ctx_blake);
-    sph_blake512 (&ctx_blake, (pbegin == pend ? pblank : static_cast<const void*>(&pbegin[0])), (pend - pbegin) * sizeof(pbegin[0]));
-    sph_blake512_close(&ctx_blake, static_cast<void*>(&hash[0]));
-    
     sph_bmw512_init(&ctx_bmw);
     sph_bmw512 (&ctx_bmw, static_cast<const void*>(&hash[0]), 64);
     sph_bmw512_close(&ctx_bmw, static_cast<void*>(&hash[1]));
@@ -227,6 +221,20 @@ static unsigned char pblank[1];
     return hash[12].trim256();
 }
 
+template<typename T1>
+inline uint256 bthhash(const T1 pbegin, const T1 pend)
+{
+    sph_blake512_context      ctx_blake;
+static unsigned char pblank[1];
+    uint512 hash;
+
+    sph_blake512_init(&ctx_blake);
+    sph_blake512 (&ctx_blake, (pbegin == pend ? pblank : static_cast<const void*>(&pbegin[0])), (pend - pbegin) * sizeof(pbegin[0]));
+    sph_blake512_close(&ctx_blake, static_cast<void*>(&hash));
+
+    return bthhash_from_blake512(hash);
+}
+
 #endif // HASHBLOCK_H
 
 
@@ -0,0 +1,359 @@
+// Copyright (c) 2016 The HealthHeldToken developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// 4-way AVX2 implementations of the 64-bit word bthhash stages (blake512,
+// keccak512 and skein512), each lane hashing an independent single-block
+// message. This file is compiled with -mavx2 and is only called after
+// bthhash_detect_simd() has checked that the CPU supports it.
+
+#ifdef ENABLE_AVX2
+
+#include <stdint.h>
+#include <string.h>
+#include <immintrin.h>
+
+namespace bthhash_avx2 {
+namespace {
+
+#define ROTL64(x, n) _mm256_or_si256(_mm256_slli_epi64((x), (n)), _mm256_srli_epi64((x), 64 - (n)))
+#define ROTR64(x, n) _mm256_or_si256(_mm256_srli_epi64((x), (n)), _mm256_slli_epi64((x), 64 - (n)))
+
+inline __m256i K(uint64_t x) { return _mm256_set1_epi64x((long long)x); }
+inline __m256i Add(__m256i x, __m256i y) { return _mm256_add_epi64(x, y); }
+inline __m256i Xor(__m256i x, __m256i y) { return _mm256_xor_si256(x, y); }
+
+inline uint64_t ReadLE64(const unsigned char* p) { uint64_t x; memcpy(&x, p, 8); return x; }
+inline uint64_t ReadBE64(const unsigned char* p) { return __builtin_bswap64(ReadLE64(p)); }
+inline void WriteLE64(unsigned char* p, uint64_t x) { memcpy(p, &x, 8); }
+inline void WriteBE64(unsigned char* p, uint64_t x) { WriteLE64(p, __builtin_bswap64(x)); }
+
+/** Load word i (of size 8) from four messages of nLen bytes starting at in. */
+inline __m256i LoadLE(const unsigned char* in, size_t nLen, int i)
+{
+    return _mm256_set_epi64x((long long)ReadLE64(in + 3 * nLen + 8 * i), (long long)ReadLE64(in + 2 * nLen + 8 * i),
+                             (long long)ReadLE64(in + nLen + 8 * i), (long long)ReadLE64(in + 8 * i));
+}
+
+inline __m256i LoadBE(const unsigned char* in, size_t nLen, int i)
+{
+    return _mm256_set_epi64x((long long)ReadBE64(in + 3 * nLen + 8 * i), (long long)ReadBE64(in + 2 * nLen + 8 * i),
+                             (long long)ReadBE64(in + nLen + 8 * i), (long long)ReadBE64(in + 8 * i));
+}
+
+inline void StoreLE(unsigned char* out, int i, __m256i v)
+{
+    uint64_t w[4];
+    _mm256_storeu_si256((__m256i*)w, v);
+    for (int l = 0; l < 4; l++)
+        WriteLE64(out + 64 * l + 8 * i, w[l]);
+}
+
+inline void StoreBE(unsigned char* out, int i, __m256i v)
+{
+    uint64_t w[4];
+    _mm256_storeu_si256((__m256i*)w, v);
+    for (int l = 0; l < 4; l++)
+        WriteBE64(out + 64 * l + 8 * i, w[l]);
+}
+
+typedef void (*Kernel4)(const unsigned char* in, unsigned char* out);
+
+/** Run a 4-lane kernel over n messages of nLen bytes, padding the last group. */
+void Run4(Kernel4 kernel, size_t nLen, const unsigned char* in, unsigned char* out, size_t n)
+{
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+        kernel(in + i * nLen, out + i * 64);
+    if (i < n) {
+        unsigned char tmpIn[4 * 80];
+        unsigned char tmpOut[4 * 64];
+        memset(tmpIn, 0, sizeof(tmpIn));
+        memcpy(tmpIn, in + i * nLen, (n - i) * nLen);
+        kernel(tmpIn, tmpOut);
+        memcpy(out + i * 64, tmpOut, (n - i) * 64);
+    }
+}
+
+// blake512
+
+const uint64_t BLAKE_IV[8] = {
+    0x6A09E667F3BCC908ULL, 0xBB67AE8584CAA73BULL, 0x3C6EF372FE94F82BULL, 0xA54FF53A5F1D36F1ULL,
+    0x510E527FADE682D1ULL, 0x9B05688C2B3E6C1FULL, 0x1F83D9ABFB41BD6BULL, 0x5BE0CD19137E2179ULL
+};
+
+const uint64_t BLAKE_CB[16] = {
+    0x243F6A8885A308D3ULL, 0x13198A2E03707344ULL, 0xA4093822299F31D0ULL, 0x082EFA98EC4E6C89ULL,
+    0x452821E638D01377ULL, 0xBE5466CF34E90C6CULL, 0xC0AC29B7C97C50DDULL, 0x3F84D5B5B5470917ULL,
+    0x9216D5D98979FB1BULL, 0xD1310BA698DFB5ACULL, 0x2FFD72DBD01ADFB7ULL, 0xB8E1AFED6A267E96ULL,
+    0xBA7C9045F12C7F99ULL, 0x24A19947B3916CF7ULL, 0x0801F2E2858EFC16ULL, 0x636920D871574E69ULL
+};
+
+const unsigned char BLAKE_SIGMA[10][16] = {
+    { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+    { 14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3 },
+    { 11, 8, 12, 0, 5, 2, 15, 13, 10, 14, 3, 6, 7, 1, 9, 4 },
+    { 7, 9, 3, 1, 13, 12, 11, 14, 2, 6, 5, 10, 4, 0, 15, 8 },
+    { 9, 0, 5, 7, 2, 4, 10, 15, 14, 1, 11, 12, 6, 8, 3, 13 },
+    { 2, 12, 6, 10, 0, 11, 8, 3, 4, 13, 7, 5, 15, 14, 1, 9 },
+    { 12, 5, 1, 15, 14, 13, 4, 10, 0, 7, 6, 3, 9, 2, 8, 11 },
+    { 13, 11, 7, 14, 12, 1, 3, 9, 5, 0, 15, 4, 8, 6, 2, 10 },
+    { 6, 15, 14, 9, 11, 3, 0, 8, 12, 2, 13, 7, 1, 4, 10, 5 },
+    { 10, 2, 8, 4, 7, 6, 1, 5, 15, 11, 9, 14, 3, 12, 13, 0 }
+};
+
+inline void BlakeG(__m256i* v, const __m256i* m, const unsigned char* s, int i, int a, int b, int c, int d)
+{
+    v[a] = Add(Add(v[a], v[b]), Xor(m[s[2 * i]], K(BLAKE_CB[s[2 * i + 1]])));
+    v[d] = ROTR64(Xor(v[d], v[a]), 32);
+    v[c] = Add(v[c], v[d]);
+    v[b] = ROTR64(Xor(v[b], v[c]), 25);
+    v[a] = Add(Add(v[a], v[b]), Xor(m[s[2 * i + 1]], K(BLAKE_CB[s[2 * i]])));
+    v[d] = ROTR64(Xor(v[d], v[a]), 16);
+    v[c] = Add(v[c], v[d]);
+    v[b] = ROTR64(Xor(v[b], v[c]), 11);
+}
+
+/** One padded 128-byte blake512 block holding a message of nLen (64 or 80) bytes. */
+inline void Blake512(const unsigned char* in, unsigned char* out, size_t nLen)
+{
+    __m256i m[16];
+    int nWords = nLen / 8;
+    for (int i = 0; i < nWords; i++)
+        m[i] = LoadBE(in, nLen, i);
+    m[nWords] = K(0x8000000000000000ULL);
+    for (int i = nWords + 1; i < 16; i++)
+        m[i] = _mm256_setzero_si256();
+    m[13] = _mm256_or_si256(m[13], K(1));
+    m[15] = K(nLen * 8);
+
+    __m256i v[16];
+    for (int i = 0; i < 8; i++)
+        v[i] = K(BLAKE_IV[i]);
+    for (int i = 0; i < 4; i++)
+        v[8 + i] = K(BLAKE_CB[i]);
+    v[12] = K(nLen * 8 ^ BLAKE_CB[4]);
+    v[13] = K(nLen * 8 ^ BLAKE_CB[5]);
+    v[14] = K(BLAKE_CB[6]);
+    v[15] = K(BLAKE_CB[7]);
+
+    for (int r = 0; r < 16; r++) {
+        const unsigned char* s = BLAKE_SIGMA[r % 10];
+        BlakeG(v, m, s, 0, 0, 4, 8, 12);
+        BlakeG(v, m, s, 1, 1, 5, 9, 13);
+        BlakeG(v, m, s, 2, 2, 6, 10, 14);
+        BlakeG(v, m, s, 3, 3, 7, 11, 15);
+        BlakeG(v, m, s, 4, 0, 5, 10, 15);
+        BlakeG(v, m, s, 5, 1, 6, 11, 12);
+        BlakeG(v, m, s, 6, 2, 7, 8, 13);
+        BlakeG(v, m, s, 7, 3, 4, 9, 14);
+    }
+
+    for (int i = 0; i < 8; i++)
+        StoreBE(out, i, Xor(K(BLAKE_IV[i]), Xor(v[i], v[i + 8])));
+}
+
+void Blake512_64x4(const unsigned char* in, unsigned char* out) { Blake512(in, out, 64); }
+void Blake512_80x4(const unsigned char* in, unsigned char* out) { Blake512(in, out, 80); }
+
+// keccak512
+
+const uint64_t KECCAK_RC[24] = {
+    0x0000000000000001ULL, 0x0000000000008082ULL, 0x800000000000808AULL, 0x8000000080008000ULL,
+    0x000000000000808BULL, 0x0000000080000001ULL, 0x8000000080008081ULL, 0x8000000000008009ULL,
+    0x000000000000008AULL, 0x0000000000000088ULL, 0x0000000080008009ULL, 0x000000008000000AULL,
+    0x000000008000808BULL, 0x800000000000008BULL, 0x8000000000008089ULL, 0x8000000000008003ULL,
+    0x8000000000008002ULL, 0x8000000000000080ULL, 0x000000000000800AULL, 0x800000008000000AULL,
+    0x8000000080008081ULL, 0x8000000000008080ULL, 0x0000000080000001ULL, 0x8000000080008008ULL
+};
+
+#define KECCAK_THETA_D(x) \
+    d##x = Xor(c[(x + 4) % 5], ROTL64(c[(x + 1) % 5], 1))
+#define KECCAK_THETA_XOR(y) do { \
+    a[y + 0] = Xor(a[y + 0], d0); a[y + 1] = Xor(a[y + 1], d1); a[y + 2] = Xor(a[y + 2], d2); \
+    a[y + 3] = Xor(a[y + 3], d3); a[y + 4] = Xor(a[y + 4], d4); \
+} while (0)
+#define KECCAK_RHO_PI(dst, src, n) b[dst] = ROTL64(a[src], n)
+#define KECCAK_CHI(y) do { \
+    a[y + 0] = Xor(b[y + 0], _mm256_andnot_si256(b[y + 1], b[y + 2])); \
+    a[y + 1] = Xor(b[y + 1], _mm256_andnot_si256(b[y + 2], b[y + 3])); \
+    a[y + 2] = Xor(b[y + 2], _mm256_andnot_si256(b[y + 3], b[y + 4])); \
+    a[y + 3] = Xor(b[y + 3], _mm256_andnot_si256(b[y + 4], b[y + 0])); \
+    a[y + 4] = Xor(b[y + 4], _mm256_andnot_si256(b[y + 0], b[y + 1])); \
+} while (0)
+
+void Keccak512_64x4(const unsigned char* in, unsigned char* out)
+{
+    __m256i a[25];
+    for (int i = 0; i < 8; i++)
+        a[i] = LoadLE(in, 64, i);
+    // Original Keccak padding: 0x01 right after the message, 0x80 at the end of the 72-byte rate.
+    a[8] = K(0x8000000000000001ULL);
+    for (int i = 9; i < 25; i++)
+        a[i] = _mm256_setzero_si256();
+
+    for (int r = 0; r < 24; r++) {
+        __m256i c[5], b[25];
+        __m256i d0, d1, d2, d3, d4;
+        c[0] = Xor(Xor(Xor(a[0], a[5]), Xor(a[10], a[15])), a[20]);
+        c[1] = Xor(Xor(Xor(a[1], a[6]), Xor(a[11], a[16])), a[21]);
+        c[2] = Xor(Xor(Xor(a[2], a[7]), Xor(a[12], a[17])), a[22]);
+        c[3] = Xor(Xor(Xor(a[3], a[8]), Xor(a[13], a[18])), a[23]);
+        c[4] = Xor(Xor(Xor(a[4], a[9]), Xor(a[14], a[19])), a[24]);
+        KECCAK_THETA_D(0);
+        KECCAK_THETA_D(1);
+        KECCAK_THETA_D(2);
+        KECCAK_THETA_D(3);
+        KECCAK_THETA_D(4);
+        KECCAK_THETA_XOR(0);
+        KECCAK_THETA_XOR(5);
+        KECCAK_THETA_XOR(10);
+        KECCAK_THETA_XOR(15);
+        KECCAK_THETA_XOR(20);
+
+        // b[y, 2x + 3y] = rot(a[x, y], r[x, y]), with lane index x + 5y.
+        b[0] = a[0];
+        KECCAK_RHO_PI(10, 1, 1);
+        KECCAK_RHO_PI(20, 2, 62);
+        KECCAK_RHO_PI(5, 3, 28);
+        KECCAK_RHO_PI(15, 4, 27);
+        KECCAK_RHO_PI(16, 5, 36);
+        KECCAK_RHO_PI(1, 6, 44);
+        KECCAK_RHO_PI(11, 7, 6);
+        KECCAK_RHO_PI(21, 8, 55);
+        KECCAK_RHO_PI(6, 9, 20);
+        KECCAK_RHO_PI(7, 10, 3);
+        KECCAK_RHO_PI(17, 11, 10);
+        KECCAK_RHO_PI(2, 12, 43);
+        KECCAK_RHO_PI(12, 13, 25);
+        KECCAK_RHO_PI(22, 14, 39);
+        KECCAK_RHO_PI(23, 15, 41);
+        KECCAK_RHO_PI(8, 16, 45);
+        KECCAK_RHO_PI(18, 17, 15);
+        KECCAK_RHO_PI(3, 18, 21);
+        KECCAK_RHO_PI(13, 19, 8);
+        KECCAK_RHO_PI(14, 20, 18);
+        KECCAK_RHO_PI(24, 21, 2);
+        KECCAK_RHO_PI(9, 22, 61);
+        KECCAK_RHO_PI(19, 23, 56);
+        KECCAK_RHO_PI(4, 24, 14);
+
+        KECCAK_CHI(0);
+        KECCAK_CHI(5);
+        KECCAK_CHI(10);
+        KECCAK_CHI(15);
+        KECCAK_CHI(20);
+        a[0] = Xor(a[0], K(KECCAK_RC[r]));
+    }
+
+    for (int i = 0; i < 8; i++)
+        StoreLE(out, i, a[i]);
+}
+
+#undef KECCAK_THETA_D
+#undef KECCAK_THETA_XOR
+#undef KECCAK_CHI
+#undef KECCAK_RHO_PI
+
+// skein512
+
+const uint64_t SKEIN_IV[8] = {
+    0x4903ADFF749C51CEULL, 0x0D95DE399746DF03ULL, 0x8FD1934127C79BCEULL, 0x9A255629FF352CB1ULL,
+    0x5DB62599DF6CA7B0ULL, 0xEABE394CA9D5C3F4ULL, 0x991112C71A75B523ULL, 0xAE18A40B660FCC33ULL
+};
+
+#define SKEIN_MIX(x0, x1, rc) do { \
+    x0 = Add(x0, x1); \
+    x1 = Xor(ROTL64(x1, rc), x0); \
+} while (0)
+
+#define SKEIN_MIX8(w0, w1, w2, w3, w4, w5, w6, w7, rc0, rc1, rc2, rc3) do { \
+    SKEIN_MIX(p[w0], p[w1], rc0); \
+    SKEIN_MIX(p[w2], p[w3], rc1); \
+    SKEIN_MIX(p[w4], p[w5], rc2); \
+    SKEIN_MIX(p[w6], p[w7], rc3); \
+} while (0)
+
+#define SKEIN_ADDKEY(s) do { \
+    p[0] = Add(p[0], k[((s) + 0) % 9]); \
+    p[1] = Add(p[1], k[((s) + 1) % 9]); \
+    p[2] = Add(p[2], k[((s) + 2) % 9]); \
+    p[3] = Add(p[3], k[((s) + 3) % 9]); \
+    p[4] = Add(p[4], k[((s) + 4) % 9]); \
+    p[5] = Add(p[5], Add(k[((s) + 5) % 9], t[(s) % 3])); \
+    p[6] = Add(p[6], Add(k[((s) + 6) % 9], t[((s) + 1) % 3])); \
+    p[7] = Add(p[7], Add(k[((s) + 7) % 9], K(s))); \
+} while (0)
+
+#define SKEIN_8ROUNDS(s) do { \
+    SKEIN_ADDKEY(s); \
+    SKEIN_MIX8(0, 1, 2, 3, 4, 5, 6, 7, 46, 36, 19, 37); \
+    SKEIN_MIX8(2, 1, 4, 7, 6, 5, 0, 3, 33, 27, 14, 42); \
+    SKEIN_MIX8(4, 1, 6, 3, 0, 5, 2, 7, 17, 49, 36, 39); \
+    SKEIN_MIX8(6, 1, 0, 7, 2, 5, 4, 3, 44, 9, 54, 56); \
+    SKEIN_ADDKEY((s) + 1); \
+    SKEIN_MIX8(0, 1, 2, 3, 4, 5, 6, 7, 39, 30, 34, 24); \
+    SKEIN_MIX8(2, 1, 4, 7, 6, 5, 0, 3, 13, 50, 10, 17); \
+    SKEIN_MIX8(4, 1, 6, 3, 0, 5, 2, 7, 25, 29, 39, 43); \
+    SKEIN_MIX8(6, 1, 0, 7, 2, 5, 4, 3, 8, 35, 56, 22); \
+} while (0)
+
+/** One UBI block: h = E_h,t(m) ^ m. */
+inline void SkeinUBI(__m256i* h, const __m256i* m, uint64_t t0, uint64_t t1)
+{
+    __m256i k[9], p[8];
+    const __m256i t[3] = { K(t0), K(t1), K(t0 ^ t1) };
+    k[8] = K(0x1BD11BDAA9FC1A22ULL);
+    for (int i = 0; i < 8; i++) {
+        k[i] = h[i];
+        k[8] = Xor(k[8], h[i]);
+        p[i] = m[i];
+    }
+
+    SKEIN_8ROUNDS(0);
+    SKEIN_8ROUNDS(2);
+    SKEIN_8ROUNDS(4);
+    SKEIN_8ROUNDS(6);
+    SKEIN_8ROUNDS(8);
+    SKEIN_8ROUNDS(10);
+    SKEIN_8ROUNDS(12);
+    SKEIN_8ROUNDS(14);
+    SKEIN_8ROUNDS(16);
+    SKEIN_ADDKEY(18);
+
+    for (int i = 0; i < 8; i++)
+        h[i] = Xor(m[i], p[i]);
+}
+
+#undef SKEIN_8ROUNDS
+#undef SKEIN_ADDKEY
+#undef SKEIN_MIX8
+#undef SKEIN_MIX
+
+void Skein512_64x4(const unsigned char* in, unsigned char* out)
+{
+    __m256i h[8], m[8];
+    for (int i = 0; i < 8; i++) {
+        h[i] = K(SKEIN_IV[i]);
+        m[i] = LoadLE(in, 64, i);
+    }
+    // Message block: first | final | type msg (48), 64 bytes processed.
+    SkeinUBI(h, m, 64, 0xF000000000000000ULL);
+    // Output block: first | final | type out (63), counter 0.
+    for (int i = 0; i < 8; i++)
+        m[i] = _mm256_setzero_si256();
+    SkeinUBI(h, m, 8, 0xFF00000000000000ULL);
+    for (int i = 0; i < 8; i++)
+        StoreLE(out, i, h[i]);
+}
+
+} // anon namespace
+
+void Blake512_80(const unsigned char* in, unsigned char* out, size_t n) { Run4(Blake512_80x4, 80, in, out, n); }
+void Blake512_64(const unsigned char* in, unsigned char* out, size_t n) { Run4(Blake512_64x4, 64, in, out, n); }
+void Keccak512_64(const unsigned char* in, unsigned char* out, size_t n) { Run4(Keccak512_64x4, 64, in, out, n); }
+void Skein512_64(const unsigned char* in, unsigned char* out, size_t n) { Run4(Skein512_64x4, 64, in, out, n); }
+
+} // namespace bthhash_avx2
+
+#endif // ENABLE_AVX2
@@ -0,0 +1,213 @@
+// Copyright (c) 2016 The HealthHeldToken developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#if defined(HAVE_CONFIG_H)
+#include "config/bitcoin-config.h"
+#endif
+
+#include "crypto/bthhash_batch.h"
+
+#include "crypto/sph_blake.h"
+#include "crypto/sph_bmw.h"
+#include "crypto/sph_cubehash.h"
+#include "crypto/sph_groestl.h"
+#include "crypto/sph_jh.h"
+#include "crypto/sph_keccak.h"
+#include "crypto/sph_luffa.h"
+#include "crypto/sph_shavite.h"
+#include "crypto/sph_simd.h"
+#include "crypto/sph_skein.h"
+
+#include <string.h>
+#include <vector>
+
+#if defined(ENABLE_AVX2) && (defined(__x86_64__) || defined(__i386__))
+#include <cpuid.h>
+#endif
+
+#ifdef ENABLE_AVX2
+namespace bthhash_avx2
+{
+void Blake512_80(const unsigned char* in, unsigned char* out, size_t n);
+void Blake512_64(const unsigned char* in, unsigned char* out, size_t n);
+void Keccak512_64(const unsigned char* in, unsigned char* out, size_t n);
+void Skein512_64(const unsigned char* in, unsigned char* out, size_t n);
+}
+#endif
+
+namespace {
+
+/** Hash n messages of 64 bytes (80 for the first stage) each into n 64-byte digests. */
+typedef void (*MultiHashFn)(const unsigned char* in, unsigned char* out, size_t n);
+
+template <typename Ctx, void (*Init)(void*), void (*Update)(void*, const void*, size_t), void (*Close)(void*, void*), size_t nLen>
+void ScalarMulti(const unsigned char* in, unsigned char* out, size_t n)
+{
+    Ctx ctx;
+    for (size_t i = 0; i < n; i++) {
+        Init(&ctx);
+        Update(&ctx, in + i * nLen, nLen);
+        Close(&ctx, out + i * 64);
+    }
+}
+
+#define SCALAR_MULTI(name, len) ScalarMulti<sph_ ## name ## _context, sph_ ## name ## _init, sph_ ## name, sph_ ## name ## _close, len>
+
+/** The primitives used by the bthhash chain, each in its fastest available form. */
+struct MultiHashTable
+{
+    MultiHashFn blake512_80;
+    MultiHashFn blake512;
+    MultiHashFn bmw512;
+    MultiHashFn groestl512;
+    MultiHashFn skein512;
+    MultiHashFn jh512;
+    MultiHashFn keccak512;
+    MultiHashFn luffa512;
+    MultiHashFn cubehash512;
+    MultiHashFn shavite512;
+    MultiHashFn simd512;
+};
+
+const MultiHashTable tableScalar = {
+    SCALAR_MULTI(blake512, 80),
+    SCALAR_MULTI(blake512, 64),
+    SCALAR_MULTI(bmw512, 64),
+    SCALAR_MULTI(groestl512, 64),
+    SCALAR_MULTI(skein512, 64),
+    SCALAR_MULTI(jh512, 64),
+    SCALAR_MULTI(keccak512, 64),
+    SCALAR_MULTI(luffa512, 64),
+    SCALAR_MULTI(cubehash512, 64),
+    SCALAR_MULTI(shavite512, 64),
+    SCALAR_MULTI(simd512, 64),
+};
+
+#ifdef ENABLE_AVX2
+const MultiHashTable tableAVX2 = {
+    bthhash_avx2::Blake512_80,
+    bthhash_avx2::Blake512_64,
+    SCALAR_MULTI(bmw512, 64),
+    SCALAR_MULTI(groestl512, 64),
+    bthhash_avx2::Skein512_64,
+    SCALAR_MULTI(jh512, 64),
+    bthhash_avx2::Keccak512_64,
+    SCALAR_MULTI(luffa512, 64),
+    SCALAR_MULTI(cubehash512, 64),
+    SCALAR_MULTI(shavite512, 64),
+    SCALAR_MULTI(simd512, 64),
+};
+#endif
+
+#undef SCALAR_MULTI
+
+const MultiHashTable* pTable = &tableScalar;
+
+/**
+ * A data-dependent stage: each lane picks one of four primitives from bits
+ * 2-3 of the first byte of its previous digest (the "hash & 12" test in
+ * bthhash). Lanes are gathered into one contiguous bucket per primitive,
+ * hashed together, and scattered back to their original positions.
+ */
+void BranchStage(const unsigned char* in, unsigned char* out, size_t n, const MultiHashFn fn[4],
+                 std::vector<size_t>& vIndex, std::vector<unsigned char>& vIn, std::vector<unsigned char>& vOut)
+{
+    size_t nBucketStart[5] = { 0, 0, 0, 0, 0 };
+    for (size_t i = 0; i < n; i++)
+        nBucketStart[((in[i * 64] >> 2) & 3) + 1]++;
+    for (int b = 1; b < 5; b++)
+        nBucketStart[b] += nBucketStart[b - 1];
+
+    size_t nPos[4] = { nBucketStart[0], nBucketStart[1], nBucketStart[2], nBucketStart[3] };
+    for (size_t i = 0; i < n; i++) {
+        size_t j = nPos[(in[i * 64] >> 2) & 3]++;
+        vIndex[j] = i;
+        memcpy(&vIn[j * 64], in + i * 64, 64);
+    }
+
+    for (int b = 0; b < 4; b++) {
+        size_t nLanes = nBucketStart[b + 1] - nBucketStart[b];
+        if (nLanes)
+            fn[b](&vIn[nBucketStart[b] * 64], &vOut[nBucketStart[b] * 64], nLanes);
+    }
+
+    for (size_t j = 0; j < n; j++)
+        memcpy(out + vIndex[j] * 64, &vOut[j * 64], 64);
+}
+
+} // anon namespace
+
+void bthhash_batch(const unsigned char* pheaders, size_t nCount, unsigned char* pout)
+{
+    if (nCount == 0)
+        return;
+
+    const MultiHashTable& t = *pTable;
+    std::vector<unsigned char> a(nCount * 64), b(nCount * 64), vIn(nCount * 64), vOut(nCount * 64);
+    std::vector<size_t> vIndex(nCount);
+
+    const MultiHashFn branch1[4] = { t.blake512, t.groestl512, t.skein512, t.jh512 };
+    const MultiHashFn branch2[4] = { t.luffa512, t.groestl512, t.skein512, t.keccak512 };
+    const MultiHashFn branch3[4] = { t.shavite512, t.groestl512, t.simd512, t.keccak512 };
+    const MultiHashFn branch4[4] = { t.shavite512, t.jh512, t.luffa512, t.keccak512 };
+
+    t.blake512_80(pheaders, &a[0], nCount);
+    t.bmw512(&a[0], &b[0], nCount);
+    BranchStage(&b[0], &a[0], nCount, branch1, vIndex, vIn, vOut);
+    t.groestl512(&a[0], &b[0], nCount);
+    t.skein512(&b[0], &a[0], nCount);
+    BranchStage(&a[0], &b[0], nCount, branch2, vIndex, vIn, vOut);
+    t.jh512(&b[0], &a[0], nCount);
+    t.keccak512(&a[0], &b[0], nCount);
+    BranchStage(&b[0], &a[0], nCount, branch3, vIndex, vIn, vOut);
+    t.luffa512(&a[0], &b[0], nCount);
+    t.cubehash512(&b[0], &a[0], nCount);
+    BranchStage(&a[0], &b[0], nCount, branch4, vIndex, vIn, vOut);
+    t.simd512(&b[0], &a[0], nCount);
+
+    for (size_t i = 0; i < nCount; i++)
+        memcpy(pout + i * BTHHASH_OUTPUT_SIZE, &a[i * 64], BTHHASH_OUTPUT_SIZE);
+}
+
+void bthhash_batch_nonces(const unsigned char* pheader, uint32_t nNonceStart, size_t nCount, unsigned char* pout)
+{
+    std::vector<unsigned char> vHeaders(nCount * BTHHASH_HEADER_SIZE);
+    for (size_t i = 0; i < nCount; i++) {
+        unsigned char* p = &vHeaders[i * BTHHASH_HEADER_SIZE];
+        uint32_t nNonce = nNonceStart + (uint32_t)i;
+        memcpy(p, pheader, BTHHASH_HEADER_SIZE - 4);
+        p[76] = nNonce & 0xff;
+        p[77] = (nNonce >> 8) & 0xff;
+        p[78] = (nNonce >> 16) & 0xff;
+        p[79] = (nNonce >> 24) & 0xff;
+    }
+    bthhash_batch(nCount ? &vHeaders[0] : NULL, nCount, pout);
+}
+
+const char* bthhash_detect_simd()
+{
+#if defined(ENABLE_AVX2) && (defined(__x86_64__) || defined(__i386__))
+    unsigned int eax, ebx, ecx, edx;
+    bool fOSXSAVE = false;
+    if (__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+        fOSXSAVE = (ecx >> 27) & 1;
+    if (fOSXSAVE && __get_cpuid_max(0, NULL) >= 7) {
+        // Check that the OS saves the YMM registers before using them.
+        uint32_t nXCR0Low, nXCR0High;
+        __asm__ ("xgetbv" : "=a"(nXCR0Low), "=d"(nXCR0High) : "c"(0));
+        __cpuid_count(7, 0, eax, ebx, ecx, edx);
+        if ((ebx >> 5) & 1 && (nXCR0Low & 6) == 6) {
+            pTable = &tableAVX2;
+            return "avx2 (blake512, keccak512, skein512 4-way)";
+        }
+    }
+#endif
+    pTable = &tableScalar;
+    return "scalar";
+}
+
+void bthhash_use_scalar()
+{
+    pTable = &tableScalar;
+}
@@ -0,0 +1,41 @@
+// Copyright (c) 2016 The HealthHeldToken developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_CRYPTO_BTHHASH_BATCH_H
+#define BITCOIN_CRYPTO_BTHHASH_BATCH_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/** Size of a serialized block header, the input of bthhash. */
+static const size_t BTHHASH_HEADER_SIZE = 80;
+/** Size of a bthhash result as returned by the batch functions (trimmed to 256 bits). */
+static const size_t BTHHASH_OUTPUT_SIZE = 32;
+
+/**
+ * Hash nCount independent 80-byte headers laid out back to back in pheaders,
+ * writing nCount 32-byte results to pout. The results are bit-exact with
+ * bthhash(): lanes are bucketed at each data-dependent stage so that every
+ * bucket runs through the same primitive, and the primitives that vectorize
+ * well are processed several lanes at a time when the CPU supports it.
+ */
+void bthhash_batch(const unsigned char* pheaders, size_t nCount, unsigned char* pout);
+
+/**
+ * Hash nCount copies of the 80-byte header pheader, the i-th one with its
+ * nonce (the last four bytes, little endian) set to nNonceStart + i.
+ */
+void bthhash_batch_nonces(const unsigned char* pheader, uint32_t nNonceStart, size_t nCount, unsigned char* pout);
+
+/**
+ * Select the fastest available implementation for this CPU. Until this is
+ * called the portable scalar code is used. Returns a short description of
+ * the implementation picked.
+ */
+const char* bthhash_detect_simd();
+
+/** Force the portable scalar implementation (used by tests to compare). */
+void bthhash_use_scalar();
+
+#endif // BITCOIN_CRYPTO_BTHHASH_BATCH_H
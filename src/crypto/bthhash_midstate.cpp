@@ -0,0 +1,141 @@
+// Copyright (c) 2016 The HealthHeldToken developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "crypto/bthhash_midstate.h"
+
+#include "crypto/common.h"
+
+namespace
+{
+/// Internal blake512 implementation for a single padded 80-byte block.
+namespace blake512
+{
+const uint64_t IV[8] = {
+    0x6A09E667F3BCC908ULL, 0xBB67AE8584CAA73BULL, 0x3C6EF372FE94F82BULL, 0xA54FF53A5F1D36F1ULL,
+    0x510E527FADE682D1ULL, 0x9B05688C2B3E6C1FULL, 0x1F83D9ABFB41BD6BULL, 0x5BE0CD19137E2179ULL
+};
+
+const uint64_t CB[16] = {
+    0x243F6A8885A308D3ULL, 0x13198A2E03707344ULL, 0xA4093822299F31D0ULL, 0x082EFA98EC4E6C89ULL,
+    0x452821E638D01377ULL, 0xBE5466CF34E90C6CULL, 0xC0AC29B7C97C50DDULL, 0x3F84D5B5B5470917ULL,
+    0x9216D5D98979FB1BULL, 0xD1310BA698DFB5ACULL, 0x2FFD72DBD01ADFB7ULL, 0xB8E1AFED6A267E96ULL,
+    0xBA7C9045F12C7F99ULL, 0x24A19947B3916CF7ULL, 0x0801F2E2858EFC16ULL, 0x636920D871574E69ULL
+};
+
+/** Message length in bits, which is also the block counter T0. */
+const uint64_t BITS = CBthHashMidstate::HEADER_SIZE * 8;
+
+uint64_t inline Rotr(uint64_t x, int n) { return (x >> n) | (x << (64 - n)); }
+
+/**
+ * The blake512 G function on the state words va, vb, vc, vd with message words
+ * m0 and m1 (and the matching constants), written out on named locals like
+ * sph_blake so that the state stays in registers.
+ */
+#define BLAKE_G(a, b, c, d, m0, m1) do { \
+        V##a += V##b + (M##m0 ^ CB[0x##m1]); \
+        V##d = Rotr(V##d ^ V##a, 32); \
+        V##c += V##d; \
+        V##b = Rotr(V##b ^ V##c, 25); \
+        V##a += V##b + (M##m1 ^ CB[0x##m0]); \
+        V##d = Rotr(V##d ^ V##a, 16); \
+        V##c += V##d; \
+        V##b = Rotr(V##b ^ V##c, 11); \
+    } while (0)
+
+#define BLAKE_COLUMNS(s0, s1, s2, s3, s4, s5, s6, s7) do { \
+        BLAKE_G(0, 4, 8, C, s0, s1); \
+        BLAKE_G(1, 5, 9, D, s2, s3); \
+        BLAKE_G(2, 6, A, E, s4, s5); \
+        BLAKE_G(3, 7, B, F, s6, s7); \
+    } while (0)
+
+#define BLAKE_DIAGONALS(s8, s9, sA, sB, sC, sD, sE, sF) do { \
+        BLAKE_G(0, 5, A, F, s8, s9); \
+        BLAKE_G(1, 6, B, C, sA, sB); \
+        BLAKE_G(2, 7, 8, D, sC, sD); \
+        BLAKE_G(3, 4, 9, E, sE, sF); \
+    } while (0)
+
+#define BLAKE_ROUND(s0, s1, s2, s3, s4, s5, s6, s7, s8, s9, sA, sB, sC, sD, sE, sF) do { \
+        BLAKE_COLUMNS(s0, s1, s2, s3, s4, s5, s6, s7); \
+        BLAKE_DIAGONALS(s8, s9, sA, sB, sC, sD, sE, sF); \
+    } while (0)
+
+} // namespace blake512
+} // namespace
+
+#define BLAKE_LOAD_STATE(v) \
+    uint64_t V0 = v[0], V1 = v[1], V2 = v[2], V3 = v[3], V4 = v[4], V5 = v[5], V6 = v[6], V7 = v[7]; \
+    uint64_t V8 = v[8], V9 = v[9], VA = v[10], VB = v[11], VC = v[12], VD = v[13], VE = v[14], VF = v[15]
+#define BLAKE_LOAD_MESSAGE_PREFIX(m) \
+    uint64_t M0 = m[0], M1 = m[1], M2 = m[2], M3 = m[3], M4 = m[4], M5 = m[5], M6 = m[6], M7 = m[7]
+/** The last two header words followed by the padding of an 80-byte message. */
+#define BLAKE_LOAD_MESSAGE_TAIL(m) \
+    uint64_t M8 = m[8], M9 = m[9], MA = 0x8000000000000000ULL, MB = 0, MC = 0, MD = 1, ME = 0, MF = BITS
+
+CBthHashMidstate::CBthHashMidstate(const unsigned char* pheader)
+{
+    using namespace blake512;
+
+    for (int i = 0; i < 10; i++)
+        m[i] = ReadBE64(pheader + 8 * i);
+    m[9] &= 0xFFFFFFFF00000000ULL;
+
+    for (int i = 0; i < 8; i++)
+        v[i] = IV[i];
+    for (int i = 0; i < 4; i++)
+        v[8 + i] = CB[i];
+    v[12] = BITS ^ CB[4];
+    v[13] = BITS ^ CB[5];
+    v[14] = CB[6];
+    v[15] = CB[7];
+
+    // The column step of round 0 only reads message words 0-7, so it does
+    // not depend on the nonce.
+    BLAKE_LOAD_STATE(v);
+    BLAKE_LOAD_MESSAGE_PREFIX(m);
+    BLAKE_COLUMNS(0, 1, 2, 3, 4, 5, 6, 7);
+    v[0] = V0; v[1] = V1; v[2] = V2; v[3] = V3; v[4] = V4; v[5] = V5; v[6] = V6; v[7] = V7;
+    v[8] = V8; v[9] = V9; v[10] = VA; v[11] = VB; v[12] = VC; v[13] = VD; v[14] = VE; v[15] = VF;
+}
+
+void CBthHashMidstate::Blake512(uint32_t nNonce, unsigned char hash[64]) const
+{
+    using namespace blake512;
+
+    BLAKE_LOAD_STATE(v);
+    BLAKE_LOAD_MESSAGE_PREFIX(m);
+    BLAKE_LOAD_MESSAGE_TAIL(m);
+    // The nonce is stored little endian, but blake512 reads its words big endian.
+    unsigned char nonce[4];
+    WriteLE32(nonce, nNonce);
+    M9 |= ReadBE32(nonce);
+
+    BLAKE_DIAGONALS(8, 9, A, B, C, D, E, F);
+    BLAKE_ROUND(E, A, 4, 8, 9, F, D, 6, 1, C, 0, 2, B, 7, 5, 3);
+    BLAKE_ROUND(B, 8, C, 0, 5, 2, F, D, A, E, 3, 6, 7, 1, 9, 4);
+    BLAKE_ROUND(7, 9, 3, 1, D, C, B, E, 2, 6, 5, A, 4, 0, F, 8);
+    BLAKE_ROUND(9, 0, 5, 7, 2, 4, A, F, E, 1, B, C, 6, 8, 3, D);
+    BLAKE_ROUND(2, C, 6, A, 0, B, 8, 3, 4, D, 7, 5, F, E, 1, 9);
+    BLAKE_ROUND(C, 5, 1, F, E, D, 4, A, 0, 7, 6, 3, 9, 2, 8, B);
+    BLAKE_ROUND(D, B, 7, E, C, 1, 3, 9, 5, 0, F, 4, 8, 6, 2, A);
+    BLAKE_ROUND(6, F, E, 9, B, 3, 0, 8, C, 2, D, 7, 1, 4, A, 5);
+    BLAKE_ROUND(A, 2, 8, 4, 7, 6, 1, 5, F, B, 9, E, 3, C, D, 0);
+    BLAKE_ROUND(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, A, B, C, D, E, F);
+    BLAKE_ROUND(E, A, 4, 8, 9, F, D, 6, 1, C, 0, 2, B, 7, 5, 3);
+    BLAKE_ROUND(B, 8, C, 0, 5, 2, F, D, A, E, 3, 6, 7, 1, 9, 4);
+    BLAKE_ROUND(7, 9, 3, 1, D, C, B, E, 2, 6, 5, A, 4, 0, F, 8);
+    BLAKE_ROUND(9, 0, 5, 7, 2, 4, A, F, E, 1, B, C, 6, 8, 3, D);
+    BLAKE_ROUND(2, C, 6, A, 0, B, 8, 3, 4, D, 7, 5, F, E, 1, 9);
+
+    WriteBE64(hash, IV[0] ^ V0 ^ V8);
+    WriteBE64(hash + 8, IV[1] ^ V1 ^ V9);
+    WriteBE64(hash + 16, IV[2] ^ V2 ^ VA);
+    WriteBE64(hash + 24, IV[3] ^ V3 ^ VB);
+    WriteBE64(hash + 32, IV[4] ^ V4 ^ VC);
+    WriteBE64(hash + 40, IV[5] ^ V5 ^ VD);
+    WriteBE64(hash + 48, IV[6] ^ V6 ^ VE);
+    WriteBE64(hash + 56, IV[7] ^ V7 ^ VF);
+}
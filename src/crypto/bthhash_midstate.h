@@ -0,0 +1,45 @@
+// Copyright (c) 2016 The HealthHeldToken developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_CRYPTO_BTHHASH_MIDSTATE_H
+#define BITCOIN_CRYPTO_BTHHASH_MIDSTATE_H
+
+#include "crypto/bthhash.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/**
+ * Hashes 80-byte block headers that only differ in their nonce (the last
+ * four bytes, little endian). The whole header fits in one blake512 block,
+ * so there is no absorbed prefix to cache; instead the padded message block
+ * is built once, and the column step of the first blake512 round, which
+ * only reads message words 0-7, is run once. Each attempt then inserts the
+ * nonce into message word 9 and finishes the remaining 124 of 128 G
+ * evaluations before running the rest of the chain.
+ */
+class CBthHashMidstate
+{
+private:
+    uint64_t v[16]; //!< blake512 working state after the column step of round 0
+    uint64_t m[10]; //!< message words, with the nonce half of m[9] cleared (the rest is padding)
+
+public:
+    static const size_t HEADER_SIZE = 80;
+
+    explicit CBthHashMidstate(const unsigned char* pheader);
+
+    /** Compute the first stage (blake512) of the header with the given nonce. */
+    void Blake512(uint32_t nNonce, unsigned char hash[64]) const;
+
+    /** Compute the full bthhash of the header with the given nonce. */
+    uint256 GetHash(uint32_t nNonce) const
+    {
+        uint512 hash;
+        Blake512(nNonce, hash.begin());
+        return bthhash_from_blake512(hash);
+    }
+};
+
+#endif // BITCOIN_CRYPTO_BTHHASH_MIDSTATE_H
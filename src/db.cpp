@@ -11,6 +11,7 @@
 #include "util.h"
 #include "utilstrencodings.h"
 
+#include <errno.h>
 #include <stdint.h>
 
 #ifndef WIN32
@@ -38,6 +39,10 @@ CDBEnv bitdb;
 
 void CDBEnv::EnvShutdown()
 {
+    for (map<string, CWalletLog*>::iterator it = mapLog.begin(); it != mapLog.end(); ++it)
+        delete it->second;
+    mapLog.clear();
+
     if (!fDbEnvInit)
         return;
 
@@ -53,6 +58,7 @@ CDBEnv::CDBEnv() : dbenv(DB_CXX_NO_EXCEPTIONS)
 {
     fDbEnvInit = false;
     fMockDb = false;
+    fLogStore = false;
 }
 
 CDBEnv::~CDBEnv()
@@ -211,6 +217,8 @@ bool CDBEnv::Salvage(std::string strFile, bool fAggressive, std::vector<CDBEnv::
 
 void CDBEnv::CheckpointLSN(const std::string& strFile)
 {
+    if (fLogStore)
+        return;
     dbenv.txn_checkpoint(0, 0, 0);
     if (fMockDb)
         return;
@@ -218,7 +226,7 @@ void CDBEnv::CheckpointLSN(const std::string& strFile)
 }
 
 
-CDB::CDB(const std::string& strFilename, const char* pszMode) : pdb(NULL), activeTxn(NULL)
+CDB::CDB(const std::string& strFilename, const char* pszMode) : pdb(NULL), plog(NULL), activeTxn(NULL), fBatch(false)
 {
     int ret;
     fReadOnly = (!strchr(pszMode, '+') && !strchr(pszMode, 'w'));
@@ -237,6 +245,28 @@ CDB::CDB(const std::string& strFilename, const char* pszMode) : pdb(NULL), activ
 
         strFile = strFilename;
         ++bitdb.mapFileUseCount[strFile];
+
+        if (bitdb.fLogStore) {
+            plog = bitdb.mapLog[strFile];
+            if (plog == NULL) {
+                plog = new CWalletLog();
+                if (!plog->Open(GetDataDir() / strFile, fCreate)) {
+                    delete plog;
+                    plog = NULL;
+                    --bitdb.mapFileUseCount[strFile];
+                    throw runtime_error(strprintf("CDB : Can't open wallet log %s", strFilename));
+                }
+                bitdb.mapLog[strFile] = plog;
+            }
+            if (fCreate && !Exists(string("version"))) {
+                bool fTmp = fReadOnly;
+                fReadOnly = false;
+                WriteVersion(CLIENT_VERSION);
+                fReadOnly = fTmp;
+            }
+            return;
+        }
+
         pdb = bitdb.mapDb[strFile];
         if (pdb == NULL) {
             pdb = new Db(&bitdb.dbenv, 0);
@@ -278,7 +308,7 @@ CDB::CDB(const std::string& strFilename, const char* pszMode) : pdb(NULL), activ
 
 void CDB::Flush()
 {
-    if (activeTxn)
+    if (activeTxn || plog)
         return;
 
     // Flush database activity from memory pool to disk log
@@ -291,14 +321,18 @@ void CDB::Flush()
 
 void CDB::Close()
 {
-    if (!pdb)
+    if (!pdb && !plog)
         return;
     if (activeTxn)
         activeTxn->abort();
     activeTxn = NULL;
-    pdb = NULL;
-
+    // Before plog is cleared, so that log store handles skip the checkpoint
     Flush();
+    pdb = NULL;
+    // An unfinished batch is dropped, like an aborted transaction
+    fBatch = false;
+    vBatch.clear();
+    plog = NULL;
 
     {
         LOCK(bitdb.cs_db);
@@ -306,10 +340,259 @@ void CDB::Close()
     }
 }
 
+CSerializeData static StreamData(const CDataStream& ss)
+{
+    return CSerializeData(ss.begin(), ss.end());
+}
+
+bool CDB::ReadRaw(CDataStream& ssKey, CDataStream& ssValue)
+{
+    if (plog) {
+        CSerializeData key = StreamData(ssKey);
+        CSerializeData value;
+        bool fFound = false;
+        // Within a batch the latest pending write of the key decides
+        for (CWalletLog::Batch::const_reverse_iterator it = vBatch.rbegin(); it != vBatch.rend(); ++it) {
+            if (it->key == key) {
+                if (it->fErase)
+                    return false;
+                value = it->value;
+                fFound = true;
+                break;
+            }
+        }
+        if (!fFound && !plog->Read(key, value))
+            return false;
+        if (!value.empty())
+            ssValue.write(&value[0], value.size());
+        return true;
+    }
+
+    Dbt datKey(&ssKey[0], ssKey.size());
+    Dbt datValue;
+    datValue.set_flags(DB_DBT_MALLOC);
+    int ret = pdb->get(activeTxn, &datKey, &datValue, 0);
+    memset(datKey.get_data(), 0, datKey.get_size());
+    if (datValue.get_data() == NULL)
+        return false;
+    ssValue.write((char*)datValue.get_data(), datValue.get_size());
+
+    // Clear and free memory
+    memset(datValue.get_data(), 0, datValue.get_size());
+    free(datValue.get_data());
+    return (ret == 0);
+}
+
+bool CDB::WriteRaw(CDataStream& ssKey, CDataStream& ssValue, bool fOverwrite)
+{
+    if (plog) {
+        if (!fOverwrite && ExistsRaw(ssKey))
+            return false;
+        CWalletLog::Op op;
+        op.fErase = false;
+        op.key = StreamData(ssKey);
+        op.value = StreamData(ssValue);
+        if (fBatch) {
+            vBatch.push_back(op);
+            return true;
+        }
+        return plog->Write(CWalletLog::Batch(1, op), false);
+    }
+
+    Dbt datKey(&ssKey[0], ssKey.size());
+    Dbt datValue(&ssValue[0], ssValue.size());
+    int ret = pdb->put(activeTxn, &datKey, &datValue, (fOverwrite ? 0 : DB_NOOVERWRITE));
+
+    // Clear memory in case it was a private key
+    memset(datKey.get_data(), 0, datKey.get_size());
+    memset(datValue.get_data(), 0, datValue.get_size());
+    return (ret == 0);
+}
+
+bool CDB::EraseRaw(CDataStream& ssKey)
+{
+    if (plog) {
+        CWalletLog::Op op;
+        op.fErase = true;
+        op.key = StreamData(ssKey);
+        if (fBatch) {
+            vBatch.push_back(op);
+            return true;
+        }
+        return plog->Write(CWalletLog::Batch(1, op), false);
+    }
+
+    Dbt datKey(&ssKey[0], ssKey.size());
+    int ret = pdb->del(activeTxn, &datKey, 0);
+
+    // Clear memory
+    memset(datKey.get_data(), 0, datKey.get_size());
+    return (ret == 0 || ret == DB_NOTFOUND);
+}
+
+bool CDB::ExistsRaw(CDataStream& ssKey)
+{
+    if (plog) {
+        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+        return ReadRaw(ssKey, ssValue);
+    }
+
+    Dbt datKey(&ssKey[0], ssKey.size());
+    int ret = pdb->exists(activeTxn, &datKey, 0);
+
+    // Clear memory
+    memset(datKey.get_data(), 0, datKey.get_size());
+    return (ret == 0);
+}
+
+CDBCursor* CDB::GetCursor()
+{
+    if (plog)
+        return new CDBCursor();
+    if (!pdb)
+        return NULL;
+    Dbc* pdbc = NULL;
+    int ret = pdb->cursor(NULL, &pdbc, 0);
+    if (ret != 0)
+        return NULL;
+    CDBCursor* pcursor = new CDBCursor();
+    pcursor->pdbc = pdbc;
+    return pcursor;
+}
+
+int CDB::ReadAtCursor(CDBCursor* pcursor, CDataStream& ssKey, CDataStream& ssValue, unsigned int fFlags)
+{
+    if (plog) {
+        // Cursors walk the committed records; writes pending in a batch are not seen
+        CSerializeData key, value;
+        bool fFound;
+        if (fFlags == DB_SET || fFlags == DB_SET_RANGE)
+            fFound = plog->Seek(StreamData(ssKey), false, key, value) && (fFlags == DB_SET_RANGE || key == StreamData(ssKey));
+        else if (fFlags == DB_NEXT)
+            fFound = plog->Seek(pcursor->vchKey, pcursor->fStarted, key, value);
+        else
+            return EINVAL;
+        if (!fFound)
+            return DB_NOTFOUND;
+        pcursor->vchKey = key;
+        pcursor->fStarted = true;
+
+        ssKey.SetType(SER_DISK);
+        ssKey.clear();
+        ssKey.write(&key[0], key.size());
+        ssValue.SetType(SER_DISK);
+        ssValue.clear();
+        if (!value.empty())
+            ssValue.write(&value[0], value.size());
+        return 0;
+    }
+
+    // Read at cursor
+    Dbt datKey;
+    if (fFlags == DB_SET || fFlags == DB_SET_RANGE || fFlags == DB_GET_BOTH || fFlags == DB_GET_BOTH_RANGE) {
+        datKey.set_data(&ssKey[0]);
+        datKey.set_size(ssKey.size());
+    }
+    Dbt datValue;
+    if (fFlags == DB_GET_BOTH || fFlags == DB_GET_BOTH_RANGE) {
+        datValue.set_data(&ssValue[0]);
+        datValue.set_size(ssValue.size());
+    }
+    datKey.set_flags(DB_DBT_MALLOC);
+    datValue.set_flags(DB_DBT_MALLOC);
+    int ret = pcursor->pdbc->get(&datKey, &datValue, fFlags);
+    if (ret != 0)
+        return ret;
+    else if (datKey.get_data() == NULL || datValue.get_data() == NULL)
+        return 99999;
+
+    // Convert to streams
+    ssKey.SetType(SER_DISK);
+    ssKey.clear();
+    ssKey.write((char*)datKey.get_data(), datKey.get_size());
+    ssValue.SetType(SER_DISK);
+    ssValue.clear();
+    ssValue.write((char*)datValue.get_data(), datValue.get_size());
+
+    // Clear and free memory
+    memset(datKey.get_data(), 0, datKey.get_size());
+    memset(datValue.get_data(), 0, datValue.get_size());
+    free(datKey.get_data());
+    free(datValue.get_data());
+    return 0;
+}
+
+void CDB::CloseCursor(CDBCursor* pcursor)
+{
+    if (pcursor->pdbc)
+        pcursor->pdbc->close();
+    delete pcursor;
+}
+
+bool CDB::TxnBegin()
+{
+    if (plog) {
+        // A log store transaction is a batch written as one frame on commit
+        if (fBatch)
+            return false;
+        fBatch = true;
+        vBatch.clear();
+        return true;
+    }
+    if (!pdb || activeTxn)
+        return false;
+    DbTxn* ptxn = bitdb.TxnBegin();
+    if (!ptxn)
+        return false;
+    activeTxn = ptxn;
+    return true;
+}
+
+bool CDB::TxnCommit()
+{
+    if (plog) {
+        if (!fBatch)
+            return false;
+        fBatch = false;
+        bool fSuccess = plog->Write(vBatch, true);
+        vBatch.clear();
+        return fSuccess;
+    }
+    if (!pdb || !activeTxn)
+        return false;
+    int ret = activeTxn->commit(0);
+    activeTxn = NULL;
+    return (ret == 0);
+}
+
+bool CDB::TxnAbort()
+{
+    if (plog) {
+        if (!fBatch)
+            return false;
+        fBatch = false;
+        vBatch.clear();
+        return true;
+    }
+    if (!pdb || !activeTxn)
+        return false;
+    int ret = activeTxn->abort();
+    activeTxn = NULL;
+    return (ret == 0);
+}
+
 void CDBEnv::CloseDb(const string& strFile)
 {
     {
         LOCK(cs_db);
+        if (mapLog[strFile] != NULL) {
+            // Log stores stay open, so this is the point to make them durable
+            // and to drop their dead records: no handle is using them
+            CWalletLog* plog = mapLog[strFile];
+            plog->Flush();
+            if (plog->NeedsCompaction())
+                plog->Compact();
+        }
         if (mapDb[strFile] != NULL) {
             // Close the database handle
             Db* pdb = mapDb[strFile];
@@ -325,6 +608,11 @@ bool CDBEnv::RemoveDb(const string& strFile)
     this->CloseDb(strFile);
 
     LOCK(cs_db);
+    if (fLogStore) {
+        delete mapLog[strFile];
+        mapLog.erase(strFile);
+        return boost::filesystem::remove(GetDataDir() / strFile);
+    }
     int rc = dbenv.dbremove(NULL, strFile.c_str(), NULL, DB_AUTO_COMMIT);
     return (rc == 0);
 }
@@ -342,6 +630,13 @@ bool CDB::Rewrite(const string& strFile, const char* pszSkip)
 
                 bool fSuccess = true;
                 LogPrintf("CDB::Rewrite : Rewriting %s...\n", strFile);
+                if (bitdb.fLogStore) {
+                    CDB db(strFile.c_str(), "r+");
+                    fSuccess = db.WriteVersion(CLIENT_VERSION) && db.plog->Compact(pszSkip);
+                    if (!fSuccess)
+                        LogPrintf("CDB::Rewrite : Failed to rewrite wallet log %s\n", strFile);
+                    return fSuccess;
+                }
                 string strFileRes = strFile + ".rewrite";
                 { // surround usage of db with extra {}
                     CDB db(strFile.c_str(), "r");
@@ -358,17 +653,17 @@ bool CDB::Rewrite(const string& strFile, const char* pszSkip)
                         fSuccess = false;
                     }
 
-                    Dbc* pcursor = db.GetCursor();
+                    CDBCursor* pcursor = db.GetCursor();
                     if (pcursor)
                         while (fSuccess) {
                             CDataStream ssKey(SER_DISK, CLIENT_VERSION);
                             CDataStream ssValue(SER_DISK, CLIENT_VERSION);
                             int ret = db.ReadAtCursor(pcursor, ssKey, ssValue, DB_NEXT);
                             if (ret == DB_NOTFOUND) {
-                                pcursor->close();
+                                db.CloseCursor(pcursor);
                                 break;
                             } else if (ret != 0) {
-                                pcursor->close();
+                                db.CloseCursor(pcursor);
                                 fSuccess = false;
                                 break;
                             }
@@ -413,6 +708,89 @@ bool CDB::Rewrite(const string& strFile, const char* pszSkip)
 }
 
 
+bool CDB::ConvertToLog(const string& strFile)
+{
+    assert(!bitdb.fLogStore);
+    LogPrintf("CDB::ConvertToLog : Converting %s...\n", strFile);
+    boost::filesystem::path pathFile = GetDataDir() / strFile;
+    boost::filesystem::path pathLog = GetDataDir() / (strFile + ".log");
+    boost::filesystem::remove(pathLog);
+
+    bool fSuccess = true;
+    unsigned int nRecords = 0;
+    {
+        CWalletLog log;
+        if (!log.Open(pathLog, true))
+            return false;
+        CDB db(strFile.c_str(), "r");
+        CDBCursor* pcursor = db.GetCursor();
+        if (!pcursor)
+            fSuccess = false;
+        CWalletLog::Batch batch;
+        size_t nBatchBytes = 0;
+        while (fSuccess) {
+            CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+            CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+            int ret = db.ReadAtCursor(pcursor, ssKey, ssValue, DB_NEXT);
+            if (ret == DB_NOTFOUND)
+                break;
+            else if (ret != 0) {
+                fSuccess = false;
+                break;
+            }
+            CWalletLog::Op op;
+            op.fErase = false;
+            op.key = StreamData(ssKey);
+            op.value = StreamData(ssValue);
+            batch.push_back(op);
+            nBatchBytes += op.key.size() + op.value.size();
+            nRecords++;
+            if (nBatchBytes >= WALLETLOG_COMPACT_FRAME_SIZE) {
+                fSuccess = log.Write(batch, false);
+                batch.clear();
+                nBatchBytes = 0;
+            }
+        }
+        if (pcursor)
+            db.CloseCursor(pcursor);
+        if (fSuccess)
+            fSuccess = log.Write(batch, false) && log.Flush();
+        log.Close();
+    }
+
+    {
+        // Flush log data to the dat file before it is moved away
+        LOCK(bitdb.cs_db);
+        bitdb.CloseDb(strFile);
+        bitdb.CheckpointLSN(strFile);
+        bitdb.mapFileUseCount.erase(strFile);
+    }
+
+    if (fSuccess) {
+        // Copy rather than move the dat file to the backup, so that it stays
+        // in place until the log atomically replaces it
+        boost::filesystem::path pathBackup = GetDataDir() / strprintf("%s.bdb.%d.bak", strFile, GetTime());
+        try {
+            boost::filesystem::copy_file(pathFile, pathBackup);
+            if (!RenameOver(pathLog, pathFile)) {
+                boost::filesystem::remove(pathBackup);
+                fSuccess = false;
+            }
+        } catch (const boost::filesystem::filesystem_error& e) {
+            LogPrintf("CDB::ConvertToLog : %s\n", e.what());
+            fSuccess = false;
+        }
+        if (fSuccess)
+            LogPrintf("CDB::ConvertToLog : Converted %u records, Berkeley DB file kept as %s\n", nRecords, pathBackup.string());
+    }
+    if (!fSuccess) {
+        boost::filesystem::remove(pathLog);
+        LogPrintf("CDB::ConvertToLog : Failed to convert %s\n", strFile);
+    }
+    return fSuccess;
+}
+
+
 void CDBEnv::Flush(bool fShutdown)
 {
     int64_t nStart = GetTimeMillis();
@@ -430,11 +808,13 @@ void CDBEnv::Flush(bool fShutdown)
             if (nRefCount == 0) {
                 // Move log data to the dat file
                 CloseDb(strFile);
-                LogPrint("db", "CDBEnv::Flush : %s checkpoint\n", strFile);
-                dbenv.txn_checkpoint(0, 0, 0);
-                LogPrint("db", "CDBEnv::Flush : %s detach\n", strFile);
-                if (!fMockDb)
-                    dbenv.lsn_reset(strFile.c_str(), 0);
+                if (!fLogStore) {
+                    LogPrint("db", "CDBEnv::Flush : %s checkpoint\n", strFile);
+                    dbenv.txn_checkpoint(0, 0, 0);
+                    LogPrint("db", "CDBEnv::Flush : %s detach\n", strFile);
+                    if (!fMockDb)
+                        dbenv.lsn_reset(strFile.c_str(), 0);
+                }
                 LogPrint("db", "CDBEnv::Flush : %s closed\n", strFile);
                 mapFileUseCount.erase(mi++);
             } else
@@ -0,0 +1,120 @@
+// Copyright (c) 2016 The HealthHeldToken developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "headerverify.h"
+
+#include "crypto/bthhash_batch.h"
+#include "pow.h"
+#include "util.h"
+#include "utilstrencodings.h"
+
+#include <algorithm>
+#include <string.h>
+
+#include <boost/thread/locks.hpp>
+
+CHeaderVerifyQueue headerverifyqueue(MAX_HEADER_VERIFY_BATCHES);
+
+void CHeaderVerifyQueue::VerifyChunk(Chunk& chunk)
+{
+    std::vector<CBlockHeader>& vHeaders = chunk.state->batch.vHeaders;
+    size_t nCount = chunk.nEnd - chunk.nBegin;
+
+    std::vector<unsigned char> vData(nCount * BTHHASH_HEADER_SIZE);
+    std::vector<unsigned char> vHash(nCount * BTHHASH_OUTPUT_SIZE);
+    for (size_t i = 0; i < nCount; i++)
+        memcpy(&vData[i * BTHHASH_HEADER_SIZE], BEGIN(vHeaders[chunk.nBegin + i].nVersion), BTHHASH_HEADER_SIZE);
+    bthhash_batch(&vData[0], nCount, &vHash[0]);
+
+    for (size_t i = 0; i < nCount; i++) {
+        const CBlockHeader& header = vHeaders[chunk.nBegin + i];
+        uint256 hash;
+        memcpy(hash.begin(), &vHash[i * BTHHASH_OUTPUT_SIZE], BTHHASH_OUTPUT_SIZE);
+        header.SetCachedHash(hash);
+        if (!CheckProofOfWork(hash, header.nBits)) {
+            // Other chunks of the batch update nValid under the lock
+            boost::unique_lock<boost::mutex> lock(mutex);
+            chunk.state->batch.nValid = std::min(chunk.state->batch.nValid, chunk.nBegin + i);
+            break;
+        }
+    }
+}
+
+void CHeaderVerifyQueue::Push(int nPeer, std::vector<CBlockHeader>& vHeaders)
+{
+    boost::shared_ptr<BatchState> state(new BatchState());
+    state->batch.nPeer = nPeer;
+    state->batch.vHeaders.swap(vHeaders);
+    state->batch.nValid = state->batch.vHeaders.size();
+    state->nChunks = (state->batch.vHeaders.size() + HEADER_VERIFY_CHUNK_SIZE - 1) / HEADER_VERIFY_CHUNK_SIZE;
+    state->nChunksDone = 0;
+
+    boost::unique_lock<boost::mutex> lock(mutex);
+    while (queueBatches.size() >= nMaxBatches)
+        condBatches.wait(lock);
+    queueBatches.push_back(state);
+    for (size_t nBegin = 0; nBegin < state->batch.vHeaders.size(); nBegin += HEADER_VERIFY_CHUNK_SIZE) {
+        Chunk chunk;
+        chunk.state = state;
+        chunk.nBegin = nBegin;
+        chunk.nEnd = std::min(nBegin + HEADER_VERIFY_CHUNK_SIZE, state->batch.vHeaders.size());
+        queueChunks.push_back(chunk);
+    }
+    if (state->nChunks == 0)
+        condBatches.notify_all();
+    else if (state->nChunks == 1)
+        condWorker.notify_one();
+    else
+        condWorker.notify_all();
+}
+
+bool CHeaderVerifyQueue::Pop(Batch& batch, bool fWait)
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    while (queueBatches.empty() || queueBatches.front()->nChunksDone < queueBatches.front()->nChunks) {
+        if (!fWait)
+            return false;
+        condBatches.wait(lock);
+    }
+    Batch& front = queueBatches.front()->batch;
+    batch.nPeer = front.nPeer;
+    batch.vHeaders.swap(front.vHeaders);
+    batch.nValid = front.nValid;
+    queueBatches.pop_front();
+    // Wake Push() waiting for room as well as other poppers
+    condBatches.notify_all();
+    return true;
+}
+
+size_t CHeaderVerifyQueue::Size()
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    return queueBatches.size();
+}
+
+void CHeaderVerifyQueue::Thread()
+{
+    while (true) {
+        Chunk chunk;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            while (queueChunks.empty())
+                condWorker.wait(lock); // interruption point
+            chunk = queueChunks.front();
+            queueChunks.pop_front();
+        }
+
+        VerifyChunk(chunk);
+
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (++chunk.state->nChunksDone == chunk.state->nChunks)
+            condBatches.notify_all();
+    }
+}
+
+void ThreadHeaderVerify()
+{
+    RenameThread("healthheldtoken-hdrverify");
+    headerverifyqueue.Thread();
+}
@@ -0,0 +1,98 @@
+// Copyright (c) 2016 The HealthHeldToken developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_HEADERVERIFY_H
+#define BITCOIN_HEADERVERIFY_H
+
+#include "primitives/block.h"
+
+#include <deque>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+
+/** Number of headers a worker hashes with one bthhash_batch call */
+static const unsigned int HEADER_VERIFY_CHUNK_SIZE = 64;
+/** Header batches that may be verifying or waiting to be connected at once */
+static const unsigned int MAX_HEADER_VERIFY_BATCHES = 8;
+
+/**
+ * Pipeline that checks the proof-of-work of received headers off the
+ * message thread.
+ *
+ * A "headers" message is pushed as one batch. Workers split it into chunks,
+ * hash each chunk with bthhash_batch, check it against nBits and seed the
+ * headers' hash cache, so the connect stage's GetHash() calls are free.
+ * Batches come out of Pop() in the order they were pushed. At most
+ * nMaxBatches are outstanding: Push() blocks until the connect stage has
+ * popped one, so it must not run on the thread that pops.
+ *
+ * No worker threads are started yet: the "headers" handler in main.cpp does
+ * not push to the queue. Whoever wires it in starts ThreadHeaderVerify()
+ * workers from AppInit2, on a pool separate from the script checks.
+ */
+class CHeaderVerifyQueue
+{
+public:
+    struct Batch
+    {
+        //! Peer the headers came from
+        int nPeer;
+        std::vector<CBlockHeader> vHeaders;
+        //! Headers before the first one with invalid proof-of-work
+        size_t nValid;
+
+        Batch() : nPeer(-1), nValid(0) {}
+    };
+
+private:
+    struct BatchState
+    {
+        Batch batch;
+        size_t nChunks;
+        size_t nChunksDone;
+    };
+
+    struct Chunk
+    {
+        boost::shared_ptr<BatchState> state;
+        size_t nBegin;
+        size_t nEnd;
+    };
+
+    boost::mutex mutex;
+    //! Workers wait for chunks on this
+    boost::condition_variable condWorker;
+    //! Push() waits for room, Pop() for the oldest batch to complete
+    boost::condition_variable condBatches;
+
+    std::deque<boost::shared_ptr<BatchState> > queueBatches;
+    std::deque<Chunk> queueChunks;
+    size_t nMaxBatches;
+
+    void VerifyChunk(Chunk& chunk);
+
+public:
+    CHeaderVerifyQueue(size_t nMaxBatchesIn) : nMaxBatches(nMaxBatchesIn) {}
+
+    //! Queue headers received from nPeer for verification (vHeaders is emptied)
+    void Push(int nPeer, std::vector<CBlockHeader>& vHeaders);
+
+    //! Take the oldest batch if it is fully verified, waiting for it if fWait
+    bool Pop(Batch& batch, bool fWait = true);
+
+    //! Batches pushed but not popped yet
+    size_t Size();
+
+    //! Worker thread; returns only when interrupted
+    void Thread();
+};
+
+extern CHeaderVerifyQueue headerverifyqueue;
+
+void ThreadHeaderVerify();
+
+#endif // BITCOIN_HEADERVERIFY_H
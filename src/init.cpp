@@ -13,12 +13,15 @@
 #include "amount.h"
 #include "checkpoints.h"
 #include "compat/sanity.h"
+#include "crypto/bthhash_batch.h"
 #include "key.h"
 #include "main.h"
 #include "miner.h"
 #include "net.h"
 #include "rpcserver.h"
+#include "script/sigcache.h"
 #include "script/standard.h"
+#include "stratum.h"
 #include "txdb.h"
 #include "ui_interface.h"
 #include "util.h"
@@ -132,7 +135,7 @@ public:
     // Writes do not need similar protection, as failure to write is handled by the caller.
 };
 
-static CCoinsViewDB *pcoinsdbview = NULL;
+CCoinsViewDB *pcoinsdbview = NULL;
 static CCoinsViewErrorCatcher *pcoinscatcher = NULL;
 
 void Shutdown()
@@ -150,6 +153,7 @@ void Shutdown()
     RenameThread("healthheldtoken-shutoff");
     mempool.AddTransactionsUpdated(1);
     StopRPCThreads();
+    StopStratumServer();
 #ifdef ENABLE_WALLET
     if (pwalletMain)
         bitdb.Flush(false);
@@ -242,7 +246,9 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += "  -?                     " + _("This help message") + "\n";
     strUsage += "  -alertnotify=<cmd>     " + _("Execute command when a relevant alert is received or we see a really long fork (%s in cmd is replaced by message)") + "\n";
     strUsage += "  -alerts                " + strprintf(_("Receive and display P2P network alerts (default: %u)"), DEFAULT_ALERTS);
+    strUsage += "  -assumevalid=<hex>     " + _("Block whose ancestors may later skip script verification; block validation does not use it yet, so all scripts are still verified (default: 0)") + "\n";
     strUsage += "  -blocknotify=<cmd>     " + _("Execute command when the best block changes (%s in cmd is replaced by block hash)") + "\n";
+    strUsage += "  -checkblockindexhashes " + strprintf(_("Recompute and verify the hash of every block index entry at startup (default: %u)"), 0) + "\n";
     strUsage += "  -checkblocks=<n>       " + strprintf(_("How many blocks to check at startup (default: %u, 0 = all)"), 288) + "\n";
     strUsage += "  -checklevel=<n>        " + strprintf(_("How thorough the block verification of -checkblocks is (0-4, default: %u)"), 3) + "\n";
     strUsage += "  -conf=<file>           " + strprintf(_("Specify configuration file (default: %s)"), "healthheldtoken.conf") + "\n";
@@ -255,7 +261,9 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += "  -datadir=<dir>         " + _("Specify data directory") + "\n";
     strUsage += "  -dbcache=<n>           " + strprintf(_("Set database cache size in megabytes (%d to %d, default: %d)"), nMinDbCache, nMaxDbCache, nDefaultDbCache) + "\n";
     strUsage += "  -loadblock=<file>      " + _("Imports blocks from external blk000??.dat file") + " " + _("on startup") + "\n";
+    strUsage += "  -maxmempool=<n>        " + strprintf(_("Keep the transaction memory pool below <n> megabytes (default: %u, 0 = no limit)"), DEFAULT_MAX_MEMPOOL_SIZE) + "\n";
     strUsage += "  -maxorphantx=<n>       " + strprintf(_("Keep at most <n> unconnectable transactions in memory (default: %u)"), DEFAULT_MAX_ORPHAN_TRANSACTIONS) + "\n";
+    strUsage += "  -mempoolexpiry=<n>     " + strprintf(_("Do not keep transactions in the mempool longer than <n> hours (default: %u, 0 = no limit)"), DEFAULT_MEMPOOL_EXPIRY) + "\n";
     strUsage += "  -par=<n>               " + strprintf(_("Set the number of script verification threads (%u to %d, 0 = auto, <0 = leave that many cores free, default: %d)"), -(int)boost::thread::hardware_concurrency(), MAX_SCRIPTCHECK_THREADS, DEFAULT_SCRIPTCHECK_THREADS) + "\n";
 #ifndef WIN32
     strUsage += "  -pid=<file>            " + strprintf(_("Specify pid file (default: %s)"), "healthheldtokend.pid") + "\n";
@@ -281,12 +289,14 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += "  -maxconnections=<n>    " + strprintf(_("Maintain at most <n> connections to peers (default: %u)"), 125) + "\n";
     strUsage += "  -maxreceivebuffer=<n>  " + strprintf(_("Maximum per-connection receive buffer, <n>*1000 bytes (default: %u)"), 5000) + "\n";
     strUsage += "  -maxsendbuffer=<n>     " + strprintf(_("Maximum per-connection send buffer, <n>*1000 bytes (default: %u)"), 1000) + "\n";
+    strUsage += "  -msghandthreads=<n>    " + strprintf(_("Set the number of threads processing peer messages (1 to %d, default: %d)"), MAX_MSGHAND_THREADS, DEFAULT_MSGHAND_THREADS) + "\n";
     strUsage += "  -onion=<ip:port>       " + strprintf(_("Use separate SOCKS5 proxy to reach peers via Tor hidden services (default: %s)"), "-proxy") + "\n";
     strUsage += "  -onlynet=<net>         " + _("Only connect to nodes in network <net> (ipv4, ipv6 or onion)") + "\n";
     strUsage += "  -permitbaremultisig    " + strprintf(_("Relay non-P2SH multisig (default: %u)"), 1) + "\n";
     strUsage += "  -port=<port>           " + strprintf(_("Listen for connections on <port> (default: %u or testnet: %u)"), 9333, 19333) + "\n";
     strUsage += "  -proxy=<ip:port>       " + _("Connect through SOCKS5 proxy") + "\n";
     strUsage += "  -seednode=<ip>         " + _("Connect to a node to retrieve peer addresses, and disconnect") + "\n";
+    strUsage += "  -socketevents=<mode>   " + strprintf(_("Wait for socket events with <mode> (epoll or select, default: %s)"), HaveSocketEventsEpoll() ? "epoll" : "select") + "\n";
     strUsage += "  -timeout=<n>           " + strprintf(_("Specify connection timeout in milliseconds (minimum: 1, default: %d)"), DEFAULT_CONNECT_TIMEOUT) + "\n";
 #ifdef USE_UPNP
 #if USE_UPNP
@@ -315,6 +325,7 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += "  -maxtxfee=<amt>        " + strprintf(_("Maximum total fees to use in a single wallet transaction, setting too low may abort large transactions (default: %s)"), FormatMoney(maxTxFee)) + "\n";
     strUsage += "  -upgradewallet         " + _("Upgrade wallet to latest format") + " " + _("on startup") + "\n";
     strUsage += "  -wallet=<file>         " + _("Specify wallet file (within data directory)") + " " + strprintf(_("(default: %s)"), "wallet.dat") + "\n";
+    strUsage += "  -walletbackend=<type>  " + strprintf(_("Store the wallet in Berkeley DB (bdb) or in an append-only log (log); a bdb wallet is converted to log on startup (default: %s)"), "bdb") + "\n";
     strUsage += "  -walletnotify=<cmd>    " + _("Execute command when a wallet transaction changes (%s in cmd is replaced by TxID)") + "\n";
     strUsage += "  -zapwallettxes=<mode>  " + _("Delete all wallet transactions and only recover those parts of the blockchain through -rescan on startup") + "\n";
     strUsage += "                         " + _("(1 = keep tx meta data e.g. account owner and payment request information, 2 = drop tx meta data)") + "\n";
@@ -335,12 +346,13 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += "  -debug=<category>      " + strprintf(_("Output debugging information (default: %u, supplying <category> is optional)"), 0) + "\n";
     strUsage += "                         " + _("If <category> is not supplied, output all debugging information.") + "\n";
     strUsage += "                         " + _("<category> can be:");
-    strUsage +=                                 " addrman, alert, bench, coindb, db, lock, rand, rpc, selectcoins, mempool, net"; // Don't translate these and qt below
+    strUsage +=                                 " addrman, alert, bench, coindb, db, lock, rand, rpc, selectcoins, mempool, net, stratum"; // Don't translate these and qt below
     if (mode == HMM_BITCOIN_QT)
         strUsage += ", qt";
     strUsage += ".\n";
 #ifdef ENABLE_WALLET
     strUsage += "  -gen                   " + strprintf(_("Generate coins (default: %u)"), 0) + "\n";
+    strUsage += "  -genpinthreads         " + strprintf(_("Pin each coin generation thread to its own CPU core (default: %u)"), 1) + "\n";
     strUsage += "  -genproclimit=<n>      " + strprintf(_("Set the number of threads for coin generation if enabled (-1 = all cores, default: %d)"), 1) + "\n";
 #endif
     strUsage += "  -help-debug            " + _("Show all debugging options (usage: --help -help-debug)") + "\n";
@@ -350,7 +362,7 @@ std::string HelpMessage(HelpMessageMode mode)
     {
         strUsage += "  -limitfreerelay=<n>    " + strprintf(_("Continuously rate-limit free transactions to <n>*1000 bytes per minute (default:%u)"), 15) + "\n";
         strUsage += "  -relaypriority         " + strprintf(_("Require high priority for relaying free or low-fee transactions (default:%u)"), 1) + "\n";
-        strUsage += "  -maxsigcachesize=<n>   " + strprintf(_("Limit size of signature cache to <n> entries (default: %u)"), 50000) + "\n";
+        strUsage += "  -maxsigcachemb=<n>     " + strprintf(_("Limit size of signature cache to <n> megabytes (default: %u)"), DEFAULT_MAX_SIG_CACHE_SIZE) + "\n";
     }
     strUsage += "  -minrelaytxfee=<amt>   " + strprintf(_("Fees (in LTC/Kb) smaller than this are considered zero fee for relaying (default: %s)"), FormatMoney(::minRelayTxFee.GetFeePerK())) + "\n";
     strUsage += "  -printtoconsole        " + _("Send trace/debug info to console instead of debug.log file") + "\n";
@@ -374,6 +386,15 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += "  -blockmaxsize=<n>      " + strprintf(_("Set maximum block size in bytes (default: %d)"), DEFAULT_BLOCK_MAX_SIZE) + "\n";
     strUsage += "  -blockprioritysize=<n> " + strprintf(_("Set maximum size of high-priority/low-fee transactions in bytes (default: %d)"), DEFAULT_BLOCK_PRIORITY_SIZE) + "\n";
 
+    strUsage += "\n" + _("Stratum server options:") + "\n";
+    strUsage += "  -stratum               " + strprintf(_("Run a Stratum mining server for external miners (default: %u)"), 0) + "\n";
+    strUsage += "  -stratumaddress=<addr> " + _("Address to pay block rewards of Stratum-mined blocks to (required with -stratum)") + "\n";
+    strUsage += "  -stratumbind=<addr>    " + _("Bind the Stratum server to given address. Miners are not authenticated; use 0.0.0.0 only on a trusted network (default: 127.0.0.1)") + "\n";
+    strUsage += "  -stratumdifficulty=<n> " + strprintf(_("Share difficulty sent to Stratum miners (default: %s)"), "1") + "\n";
+    strUsage += "  -stratummaxconnections=<n> " + strprintf(_("Maximum number of connected Stratum miners (default: %u)"), DEFAULT_STRATUM_MAX_CONNECTIONS) + "\n";
+    strUsage += "  -stratummaxsubmits=<n> " + strprintf(_("Maximum shares per second accepted from one Stratum miner (default: %u)"), DEFAULT_STRATUM_MAX_SUBMITS) + "\n";
+    strUsage += "  -stratumport=<port>    " + strprintf(_("Listen for Stratum connections on <port> (default: %u)"), DEFAULT_STRATUM_PORT) + "\n";
+
     strUsage += "\n" + _("RPC server options:") + "\n";
     strUsage += "  -server                " + _("Accept command line and JSON-RPC commands") + "\n";
     strUsage += "  -rest                  " + strprintf(_("Accept public REST requests (default: %u)"), 0) + "\n";
@@ -636,7 +657,16 @@ bool AppInit2(boost::thread_group& threadGroup)
     // Make sure enough file descriptors are available
     int nBind = std::max((int)mapArgs.count("-bind") + (int)mapArgs.count("-whitebind"), 1);
     nMaxConnections = GetArg("-maxconnections", 510);
-    nMaxConnections = std::max(std::min(nMaxConnections, (int)(FD_SETSIZE - nBind - MIN_CORE_FILEDESCRIPTORS)), 0);
+    std::string strSocketEvents = GetArg("-socketevents", HaveSocketEventsEpoll() ? "epoll" : "select");
+    if (strSocketEvents == "epoll" && HaveSocketEventsEpoll())
+        fSocketEventsEpoll = true;
+    else if (strSocketEvents != "select")
+        return InitError(strprintf(_("Unsupported -socketevents mode: '%s'"), strSocketEvents));
+    InitSocketEvents();
+    // select() can't watch sockets beyond FD_SETSIZE; epoll has no such limit
+    if (!fSocketEventsEpoll)
+        nMaxConnections = std::min(nMaxConnections, (int)(FD_SETSIZE - nBind - MIN_CORE_FILEDESCRIPTORS));
+    nMaxConnections = std::max(nMaxConnections, 0);
     int nFD = RaiseFileDescriptorLimit(nMaxConnections + MIN_CORE_FILEDESCRIPTORS);
     if (nFD < MIN_CORE_FILEDESCRIPTORS)
         return InitError(_("Not enough file descriptors available."));
@@ -666,8 +696,17 @@ bool AppInit2(boost::thread_group& threadGroup)
 
     // Checkmempool and checkblockindex default to true in regtest mode
     mempool.setSanityCheck(GetBoolArg("-checkmempool", Params().DefaultConsistencyChecks()));
+    int64_t nMempoolSizeMax = GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE);
+    int64_t nMempoolExpiry = GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY);
+    if (nMempoolSizeMax < 0)
+        return InitError(strprintf(_("Invalid value for -maxmempool=<n>: '%d'"), nMempoolSizeMax));
+    if (nMempoolExpiry < 0)
+        return InitError(strprintf(_("Invalid value for -mempoolexpiry=<n>: '%d'"), nMempoolExpiry));
+    mempool.SetLimits(nMempoolSizeMax * 1000000, nMempoolExpiry * 60 * 60);
+    InitSignatureCache();
     fCheckBlockIndex = GetBoolArg("-checkblockindex", Params().DefaultConsistencyChecks());
     Checkpoints::fEnabled = GetBoolArg("-checkpoints", true);
+    Checkpoints::hashAssumeValid = uint256(GetArg("-assumevalid", Params().DefaultAssumeValid().GetHex()));
 
     // -par=0 means autodetect, but nScriptCheckThreads==0 means no concurrency
     nScriptCheckThreads = GetArg("-par", DEFAULT_SCRIPTCHECK_THREADS);
@@ -818,6 +857,7 @@ bool AppInit2(boost::thread_group& threadGroup)
 #if defined(USE_SSE2)
     scrypt_detect_sse2();
 #endif
+    LogPrintf("Using bthhash batch implementation: %s\n", bthhash_detect_simd());
 
     // ********************************************************* Step 5: verify wallet database integrity
 #ifdef ENABLE_WALLET
@@ -845,14 +885,24 @@ bool AppInit2(boost::thread_group& threadGroup)
             }
         }
 
+        string strWalletBackend = GetArg("-walletbackend", "bdb");
+        if (strWalletBackend != "bdb" && strWalletBackend != "log")
+            return InitError(strprintf(_("Unknown -walletbackend: '%s'"), strWalletBackend));
+        bool fWalletExists = filesystem::exists(GetDataDir() / strWalletFile);
+        bool fWalletIsLog = fWalletExists && CWalletLog::IsLogFile(GetDataDir() / strWalletFile);
+        if (fWalletIsLog && strWalletBackend != "log")
+            return InitError(strprintf(_("%s is stored as a log, start with -walletbackend=log"), strWalletFile));
+
         if (GetBoolArg("-salvagewallet", false))
         {
             // Recover readable keypairs:
-            if (!CWalletDB::Recover(bitdb, strWalletFile, true))
+            if (fWalletIsLog)
+                LogPrintf("-salvagewallet only applies to Berkeley DB wallets, skipping it for %s\n", strWalletFile);
+            else if (!CWalletDB::Recover(bitdb, strWalletFile, true))
                 return false;
         }
 
-        if (filesystem::exists(GetDataDir() / strWalletFile))
+        if (filesystem::exists(GetDataDir() / strWalletFile) && !fWalletIsLog)
         {
             CDBEnv::VerifyResult r = bitdb.Verify(strWalletFile, CWalletDB::Recover);
             if (r == CDBEnv::RECOVER_OK)
@@ -866,6 +916,17 @@ bool AppInit2(boost::thread_group& threadGroup)
             if (r == CDBEnv::RECOVER_FAIL)
                 return InitError(_("wallet.dat corrupt, salvage failed"));
         }
+
+        if (strWalletBackend == "log")
+        {
+            if (filesystem::exists(GetDataDir() / strWalletFile) && !fWalletIsLog)
+            {
+                uiInterface.InitMessage(_("Converting wallet..."));
+                if (!CDB::ConvertToLog(strWalletFile))
+                    return InitError(strprintf(_("Error converting %s to a log"), strWalletFile));
+            }
+            bitdb.fLogStore = true;
+        }
     } // (!fDisableWallet)
 #endif // ENABLE_WALLET
     // ********************************************************* Step 6: network initialization
@@ -1011,7 +1072,8 @@ bool AppInit2(boost::thread_group& threadGroup)
     nTotalCache -= nBlockTreeDBCache;
     size_t nCoinDBCache = nTotalCache / 2; // use half of the remaining cache for coindb cache
     nTotalCache -= nCoinDBCache;
-    nCoinCacheSize = nTotalCache / 300; // coins in memory require around 300 bytes
+    size_t nCoinCacheUsage = nTotalCache; // the rest goes to the in-memory coins cache, measured in bytes
+    nCoinCacheSize = nTotalCache / 300; // FlushStateToDisk still triggers on entries, so Flush() trims under both; coins in memory require around 300 bytes
 
     bool fLoaded = false;
     while (!fLoaded) {
@@ -1033,6 +1095,7 @@ bool AppInit2(boost::thread_group& threadGroup)
                 pcoinsdbview = new CCoinsViewDB(nCoinDBCache, false, fReindex);
                 pcoinscatcher = new CCoinsViewErrorCatcher(pcoinsdbview);
                 pcoinsTip = new CCoinsViewCache(pcoinscatcher);
+                pcoinsTip->SetMaxUsage(nCoinCacheUsage, nCoinCacheSize);
 
                 if (fReindex)
                     pblocktree->WriteReindexing(true);
@@ -1290,6 +1353,12 @@ bool AppInit2(boost::thread_group& threadGroup)
 
     StartNode(threadGroup);
 
+    if (GetBoolArg("-stratum", false)) {
+        std::string strError;
+        if (!StartStratumServer(strError))
+            return InitError(strError);
+    }
+
 #ifdef ENABLE_WALLET
     // Generate coins in the background
     if (pwalletMain)
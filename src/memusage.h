@@ -0,0 +1,100 @@
+// Copyright (c) 2016 The HealthHeldToken developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_MEMUSAGE_H
+#define BITCOIN_MEMUSAGE_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <map>
+#include <set>
+#include <vector>
+
+#include <boost/unordered_map.hpp>
+
+template <typename T>
+struct node_pool_allocator;
+
+/**
+ * Estimates of the heap memory held by common containers. The numbers model
+ * the glibc malloc overhead and the node layout of the usual standard library
+ * implementations; they are meant for accounting and limits, not to be exact.
+ */
+namespace memusage
+{
+
+/** Compute the memory used by a malloc'ed block of the given size, including overhead. */
+static inline size_t MallocUsage(size_t alloc)
+{
+    // Measured on libc6 2.19 on Linux.
+    if (alloc == 0)
+        return 0;
+    if (sizeof(void*) == 8)
+        return ((alloc + 31) >> 4) << 4;
+    return ((alloc + 15) >> 3) << 3;
+}
+
+/** Compute the memory used by an object of the given size taken from a node_pool_allocator pool. */
+static inline size_t PoolUsage(size_t alloc)
+{
+    // Pool blocks are padded to pointer alignment, with no per-block header.
+    return ((alloc + sizeof(void*) - 1) / sizeof(void*)) * sizeof(void*);
+}
+
+// STL data structures
+
+template<typename X>
+struct stl_tree_node
+{
+private:
+    int color;
+    void* parent;
+    void* left;
+    void* right;
+    X x;
+};
+
+template<typename X>
+struct unordered_node : private X
+{
+private:
+    void* next;
+    size_t bucket_info;
+};
+
+template<typename X>
+static inline size_t DynamicUsage(const std::vector<X>& v)
+{
+    return MallocUsage(v.capacity() * sizeof(X));
+}
+
+template<typename X, typename Y>
+static inline size_t DynamicUsage(const std::set<X, Y>& s)
+{
+    return MallocUsage(sizeof(stl_tree_node<X>)) * s.size();
+}
+
+template<typename X, typename Y, typename Z>
+static inline size_t DynamicUsage(const std::map<X, Y, Z>& m)
+{
+    return MallocUsage(sizeof(stl_tree_node<std::pair<const X, Y> >)) * m.size();
+}
+
+// Boost data structures
+
+template<typename X, typename Y, typename Z>
+static inline size_t DynamicUsage(const boost::unordered_map<X, Y, Z>& m)
+{
+    return MallocUsage(sizeof(unordered_node<std::pair<const X, Y> >)) * m.size() + MallocUsage(sizeof(void*) * m.bucket_count());
+}
+
+template<typename X, typename Y, typename Z, typename E>
+static inline size_t DynamicUsage(const boost::unordered_map<X, Y, Z, E, node_pool_allocator<std::pair<const X, Y> > >& m)
+{
+    return PoolUsage(sizeof(unordered_node<std::pair<const X, Y> >)) * m.size() + MallocUsage(sizeof(void*) * m.bucket_count());
+}
+
+} // namespace memusage
+
+#endif // BITCOIN_MEMUSAGE_H
@@ -9,6 +9,7 @@
 #include "primitives/block.h"
 #include "primitives/transaction.h"
 #include "hash.h"
+#include "crypto/bthhash_midstate.h"
 #include "crypto/scrypt.h"
 #include "main.h"
 #include "net.h"
@@ -20,6 +21,9 @@
 #include "wallet.h"
 #endif
 
+#include <algorithm>
+
+#include <boost/shared_ptr.hpp>
 #include <boost/thread.hpp>
 #include <boost/tuple/tuple.hpp>
 
@@ -54,6 +58,9 @@ public:
 uint64_t nLastBlockTx = 0;
 uint64_t nLastBlockSize = 0;
 
+/** Transactions in a row that may be too large for a nearly full block before CreateNewBlock stops looking. */
+static const int MAX_CONSECUTIVE_FAILURES = 50;
+
 // We want to sort transactions by priority and fee rate, so:
 typedef boost::tuple<double, CFeeRate, const CTransaction*> TxPriority;
 class TxPriorityCompare
@@ -138,108 +145,138 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
         const int nHeight = pindexPrev->nHeight + 1;
         CCoinsViewCache view(pcoinsTip);
 
-        // Priority order to process transactions
+        // Transactions are taken best-first from the mempool's priority and
+        // fee rate indexes, so only as much of the pool is visited as it takes
+        // to fill the block. A transaction with mempool parents that are not in
+        // the block yet waits as an orphan until the last of them is added, and
+        // then competes from the vecReady heap.
         list<COrphan> vOrphan; // list memory doesn't move
         map<uint256, vector<COrphan*> > mapDependers;
+        set<uint256> setSeen; // in the block, rejected as an orphan or waiting as one
+        set<uint256> setInBlock;
+        vector<TxPriority> vecReady;
         bool fPrintPriority = GetBoolArg("-printpriority", false);
 
-        // This vector will be sorted into a priority queue:
-        vector<TxPriority> vecPriority;
-        vecPriority.reserve(mempool.mapTx.size());
-        for (map<uint256, CTxMemPoolEntry>::iterator mi = mempool.mapTx.begin();
-             mi != mempool.mapTx.end(); ++mi)
+        typedef CTxMemPool::indexed_transaction_set::index<priority_score>::type priority_index;
+        typedef CTxMemPool::indexed_transaction_set::index<fee_rate_score>::type fee_rate_index;
+        const priority_index& byPriority = mempool.mapTx.get<priority_score>();
+        const fee_rate_index& byFeeRate = mempool.mapTx.get<fee_rate_score>();
+        priority_index::reverse_iterator itPriority = byPriority.rbegin();
+        fee_rate_index::reverse_iterator itFeeRate = byFeeRate.rbegin();
+        // Prioritised transactions left in the fee index once walking it stops
+        vector<const CTxMemPoolEntry*> vPrioritised;
+        size_t nPrioritised = 0;
+
+        // Collect transactions into block
+        uint64_t nBlockSize = 1000;
+        uint64_t nBlockTx = 0;
+        int nBlockSigOps = 100;
+        int nConsecutiveFailed = 0;
+        bool fSortedByFee = (nBlockPrioritySize <= 0);
+
+        TxPriorityCompare comparer(fSortedByFee);
+
+        while (true)
         {
-            const CTransaction& tx = mi->second.GetTx();
-            if (tx.IsCoinBase() || !IsFinalTx(tx, nHeight))
-                continue;
+            // Past the minimum block size, the rest of the fee index pays less
+            // than the relay fee and is not worth walking. Only transactions
+            // prioritised with prioritisetransaction can still go in, and there
+            // are few enough of them to take from mapDeltas instead.
+            if (fSortedByFee && itFeeRate != byFeeRate.rend() && nBlockSize >= nBlockMinSize &&
+                CFeeRate(itFeeRate->GetModifiedFee(), itFeeRate->GetTxSize()) < ::minRelayTxFee)
+            {
+                itFeeRate = byFeeRate.rend();
+                for (map<uint256, pair<double, CAmount> >::const_iterator it = mempool.mapDeltas.begin(); it != mempool.mapDeltas.end(); it++)
+                {
+                    if ((it->second.first <= 0 && it->second.second <= 0) || setSeen.count(it->first))
+                        continue;
+                    CTxMemPool::txiter mi = mempool.mapTx.find(it->first);
+                    if (mi != mempool.mapTx.end())
+                        vPrioritised.push_back(&(*mi));
+                }
+            }
+
+            // Next candidate from the index in use, unless a ready orphan beats it
+            const CTxMemPoolEntry* pentry = NULL;
+            if (fSortedByFee && itFeeRate != byFeeRate.rend())
+                pentry = &(*itFeeRate);
+            else if (fSortedByFee && nPrioritised < vPrioritised.size())
+                pentry = vPrioritised[nPrioritised];
+            else if (!fSortedByFee && itPriority != byPriority.rend())
+                pentry = &(*itPriority);
+            if (pentry == NULL && vecReady.empty())
+                break;
 
-            COrphan* porphan = NULL;
             double dPriority = 0;
-            CAmount nTotalIn = 0;
-            bool fMissingInputs = false;
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            CFeeRate feeRate;
+            const CTransaction* ptx = NULL;
+            bool fFromIndex = false;
+            if (pentry != NULL)
             {
-                // Read prev transaction
-                if (!view.HaveCoins(txin.prevout.hash))
-                {
-                    // This should never happen; all transactions in the memory
-                    // pool should connect to either transactions in the chain
-                    // or other transactions in the memory pool.
-                    if (!mempool.mapTx.count(txin.prevout.hash))
-                    {
-                        LogPrintf("ERROR: mempool transaction missing input\n");
-                        if (fDebug) assert("mempool transaction missing input" == 0);
-                        fMissingInputs = true;
-                        if (porphan)
-                            vOrphan.pop_back();
-                        break;
-                    }
+                dPriority = pentry->GetPriority(nHeight) + pentry->GetPriorityDelta();
+                feeRate = CFeeRate(pentry->GetModifiedFee(), pentry->GetTxSize());
+                ptx = &pentry->GetTx();
+                fFromIndex = vecReady.empty() || !comparer(TxPriority(dPriority, feeRate, ptx), vecReady.front());
+            }
+            if (fFromIndex)
+            {
+                if (!fSortedByFee)
+                    ++itPriority;
+                else if (itFeeRate != byFeeRate.rend())
+                    ++itFeeRate;
+                else
+                    ++nPrioritised;
+            }
+            else
+            {
+                // Take highest priority ready orphan off the priority queue:
+                dPriority = vecReady.front().get<0>();
+                feeRate = vecReady.front().get<1>();
+                ptx = vecReady.front().get<2>();
+                std::pop_heap(vecReady.begin(), vecReady.end(), comparer);
+                vecReady.pop_back();
+            }
+            const CTransaction& tx = *ptx;
+            const uint256& hash = tx.GetHash();
+
+            if (fFromIndex)
+            {
+                // Already handled while walking the other index
+                if (!setSeen.insert(hash).second)
+                    continue;
+                if (tx.IsCoinBase() || !IsFinalTx(tx, nHeight))
+                    continue;
 
-                    // Has to wait for dependencies
+                // Has to wait for dependencies
+                COrphan* porphan = NULL;
+                BOOST_FOREACH(const CTxIn& txin, tx.vin)
+                {
+                    if (setInBlock.count(txin.prevout.hash) || !mempool.mapTx.count(txin.prevout.hash))
+                        continue;
                     if (!porphan)
                     {
                         // Use list for automatic deletion
                         vOrphan.push_back(COrphan(&tx));
                         porphan = &vOrphan.back();
+                        porphan->dPriority = dPriority;
+                        porphan->feeRate = feeRate;
                     }
                     mapDependers[txin.prevout.hash].push_back(porphan);
                     porphan->setDependsOn.insert(txin.prevout.hash);
-                    nTotalIn += mempool.mapTx[txin.prevout.hash].GetTx().vout[txin.prevout.n].nValue;
-                    continue;
                 }
-                const CCoins* coins = view.AccessCoins(txin.prevout.hash);
-                assert(coins);
-
-                CAmount nValueIn = coins->vout[txin.prevout.n].nValue;
-                nTotalIn += nValueIn;
-
-                int nConf = nHeight - coins->nHeight;
-
-                dPriority += (double)nValueIn * nConf;
-            }
-            if (fMissingInputs) continue;
-
-            // Priority is sum(valuein * age) / modified_txsize
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            dPriority = tx.ComputePriority(dPriority, nTxSize);
-
-            uint256 hash = tx.GetHash();
-            mempool.ApplyDeltas(hash, dPriority, nTotalIn);
-
-            CFeeRate feeRate(nTotalIn-tx.GetValueOut(), nTxSize);
-
-            if (porphan)
-            {
-                porphan->dPriority = dPriority;
-                porphan->feeRate = feeRate;
+                if (porphan)
+                    continue;
             }
-            else
-                vecPriority.push_back(TxPriority(dPriority, feeRate, &mi->second.GetTx()));
-        }
-
-        // Collect transactions into block
-        uint64_t nBlockSize = 1000;
-        uint64_t nBlockTx = 0;
-        int nBlockSigOps = 100;
-        bool fSortedByFee = (nBlockPrioritySize <= 0);
-
-        TxPriorityCompare comparer(fSortedByFee);
-        std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-
-        while (!vecPriority.empty())
-        {
-            // Take highest priority transaction off the priority queue:
-            double dPriority = vecPriority.front().get<0>();
-            CFeeRate feeRate = vecPriority.front().get<1>();
-            const CTransaction& tx = *(vecPriority.front().get<2>());
-
-            std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            vecPriority.pop_back();
 
             // Size limits
             unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
             if (nBlockSize + nTxSize >= nBlockMaxSize)
+            {
+                // Stop once the block is nearly full and nothing else fits
+                if (++nConsecutiveFailed > MAX_CONSECUTIVE_FAILURES && nBlockSize + 1000 > nBlockMaxSize)
+                    break;
                 continue;
+            }
 
             // Legacy limits on sigOps:
             unsigned int nTxSigOps = GetLegacySigOpCount(tx);
@@ -247,12 +284,15 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
                 continue;
 
             // Skip free transactions if we're past the minimum block size:
-            const uint256& hash = tx.GetHash();
             double dPriorityDelta = 0;
             CAmount nFeeDelta = 0;
             mempool.ApplyDeltas(hash, dPriorityDelta, nFeeDelta);
             if (fSortedByFee && (dPriorityDelta <= 0) && (nFeeDelta <= 0) && (feeRate < ::minRelayTxFee) && (nBlockSize + nTxSize >= nBlockMinSize))
+            {
+                // Still under the minimum block size: a smaller transaction
+                // further on may fit, so keep walking
                 continue;
+            }
 
             // Prioritise by fee once past the priority size or we run out of high-priority
             // transactions:
@@ -261,7 +301,7 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
             {
                 fSortedByFee = true;
                 comparer = TxPriorityCompare(fSortedByFee);
-                std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
+                std::make_heap(vecReady.begin(), vecReady.end(), comparer);
             }
 
             if (!view.HaveInputs(tx))
@@ -291,6 +331,8 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
             ++nBlockTx;
             nBlockSigOps += nTxSigOps;
             nFees += nTxFees;
+            nConsecutiveFailed = 0;
+            setInBlock.insert(hash);
 
             if (fPrintPriority)
             {
@@ -308,8 +350,8 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
                         porphan->setDependsOn.erase(hash);
                         if (porphan->setDependsOn.empty())
                         {
-                            vecPriority.push_back(TxPriority(porphan->dPriority, porphan->feeRate, porphan->ptx));
-                            std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
+                            vecReady.push_back(TxPriority(porphan->dPriority, porphan->feeRate, porphan->ptx));
+                            std::push_heap(vecReady.begin(), vecReady.end(), comparer);
                         }
                     }
                 }
@@ -341,6 +383,18 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
     return pblocktemplate.release();
 }
 
+/** Rebuild the coinbase of pblock around nExtraNonce and update the merkle root. */
+static void SetExtraNonce(CBlock* pblock, const CBlockIndex* pindexPrev, unsigned int nExtraNonce)
+{
+    unsigned int nHeight = pindexPrev->nHeight+1; // Height first in coinbase required for block.version=2
+    CMutableTransaction txCoinbase(pblock->vtx[0]);
+    txCoinbase.vin[0].scriptSig = (CScript() << nHeight << CScriptNum(nExtraNonce)) + COINBASE_FLAGS;
+    assert(txCoinbase.vin[0].scriptSig.size() <= 100);
+
+    pblock->vtx[0] = txCoinbase;
+    pblock->hashMerkleRoot = pblock->BuildMerkleTree();
+}
+
 void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int& nExtraNonce)
 {
     // Update nExtraNonce
@@ -351,13 +405,7 @@ void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int&
         hashPrevBlock = pblock->hashPrevBlock;
     }
     ++nExtraNonce;
-    unsigned int nHeight = pindexPrev->nHeight+1; // Height first in coinbase required for block.version=2
-    CMutableTransaction txCoinbase(pblock->vtx[0]);
-    txCoinbase.vin[0].scriptSig = (CScript() << nHeight << CScriptNum(nExtraNonce)) + COINBASE_FLAGS;
-    assert(txCoinbase.vin[0].scriptSig.size() <= 100);
-
-    pblock->vtx[0] = txCoinbase;
-    pblock->hashMerkleRoot = pblock->BuildMerkleTree();
+    SetExtraNonce(pblock, pindexPrev, nExtraNonce);
 }
 
 #ifdef ENABLE_WALLET
@@ -408,20 +456,192 @@ bool ProcessBlockFound(CBlock* pblock, CWallet& wallet, CReserveKey& reservekey)
 }
 
 volatile bool fStopPow = true;
-void static BitcoinMiner(CWallet *pwallet)
+
+namespace {
+
+/** Minimum age of a template before a mempool change alone causes it to be rebuilt. */
+static const int64_t MINER_TEMPLATE_REFRESH_SECONDS = 5;
+/** Number of nonces hashed between checks for interruption and nTime updates. */
+static const uint32_t MINER_NONCE_BATCH = 0x100;
+
+/** A block template shared by all miner threads, with its coinbase extranonce already set. */
+struct CMinerJob
 {
-    LogPrintf("healthheldtokenMiner started\n");
+    boost::shared_ptr<CBlockTemplate> pblocktemplate;
+    CBlockIndex* pindexPrev;
+    unsigned int nId;
+};
 
-    SetThreadPriority(THREAD_PRIORITY_LOWEST);
-    RenameThread("healthheldtoken-miner");
+/**
+ * Hash counter owned by one miner thread. Only the owning thread writes it, so
+ * no lock is needed. Vector storage is only aligned for uint64_t, not to a
+ * cache line, so a full line of padding on both sides keeps the counters of
+ * different threads (and anything else on the heap) off each other's lines.
+ */
+struct CMinerCounter
+{
+    char paddingBefore[64];
+    volatile uint64_t nHashes;
+    char paddingAfter[64];
+
+    CMinerCounter() : nHashes(0) {}
+};
+
+/**
+ * The internal miner. One coordinator thread builds a block template for each
+ * new tip (or mempool change) and publishes it; nThreads worker threads hash
+ * it, worker i scanning the i-th of nThreads equal slices of the nonce space.
+ * A worker that exhausts its slice takes a fresh extranonce and continues on
+ * the full nonce range. When the tip changes, the current job is withdrawn at
+ * once and workers stop hashing it within one nonce.
+ */
+class CMinerEngine
+{
+private:
+    CWallet* pwallet;
+    int nThreads;
+    boost::thread_group threadGroup;
+
+    //! Protects pjob, the extranonce counter, fStopped, nWorkersRunning and condNewJob waits
+    boost::mutex mutexJob;
+    boost::condition_variable condNewJob;
+    boost::shared_ptr<CMinerJob> pjob;
+    //! Id of the current job, 0 while there is none; polled by workers without locking
+    volatile unsigned int nJobId;
+    unsigned int nLastJobId;
+    uint256 hashExtraNoncePrev;
+    unsigned int nExtraNonceLast;
+    //! Set once mining has ended for good; no further jobs are published
+    bool fStopped;
+    int nWorkersRunning;
+
+    //! Serializes use of the reserved key between the coordinator and workers that found a block
+    boost::mutex mutexKey;
+    CReserveKey reservekey;
+
+    std::vector<CMinerCounter> vCounters;
+    //! Sum of the counters when the hash meter interval started (coordinator only)
+    uint64_t nHashesMeterStart;
+
+    unsigned int TakeExtraNonce(const uint256& hashPrevBlock)
+    {
+        boost::unique_lock<boost::mutex> lock(mutexJob);
+        if (hashExtraNoncePrev != hashPrevBlock) {
+            hashExtraNoncePrev = hashPrevBlock;
+            nExtraNonceLast = 0;
+        }
+        return ++nExtraNonceLast;
+    }
+
+    void Publish(const boost::shared_ptr<CMinerJob>& pjobNew)
+    {
+        boost::unique_lock<boost::mutex> lock(mutexJob);
+        if (fStopped)
+            return;
+        pjob = pjobNew;
+        if (pjob) {
+            pjob->nId = ++nLastJobId;
+            nJobId = pjob->nId;
+        } else {
+            nJobId = 0;
+        }
+        condNewJob.notify_all();
+    }
+
+    /** Wait for a job other than nPrevJobId. Returns NULL once mining has stopped. */
+    boost::shared_ptr<CMinerJob> WaitForJob(unsigned int nPrevJobId)
+    {
+        boost::unique_lock<boost::mutex> lock(mutexJob);
+        while (!fStopped && (!pjob || pjob->nId == nPrevJobId))
+            condNewJob.wait(lock);
+        return pjob;
+    }
+
+    /** End mining: withdraw the current job and let the coordinator and all workers exit. */
+    void Stop()
+    {
+        boost::unique_lock<boost::mutex> lock(mutexJob);
+        fStopped = true;
+        pjob.reset();
+        nJobId = 0;
+        condNewJob.notify_all();
+    }
+
+    bool IsStopped()
+    {
+        boost::unique_lock<boost::mutex> lock(mutexJob);
+        return fStopped;
+    }
+
+    /** Called by each worker on its way out; the coordinator has nothing to do once all are gone. */
+    void WorkerExited()
+    {
+        boost::unique_lock<boost::mutex> lock(mutexJob);
+        if (--nWorkersRunning > 0)
+            return;
+        fStopped = true;
+        pjob.reset();
+        nJobId = 0;
+        condNewJob.notify_all();
+    }
+
+    void UpdateHashMeter()
+    {
+        int64_t nNow = GetTimeMillis();
+        if (nHPSTimerStart == 0) {
+            nHPSTimerStart = nNow;
+            nHashesMeterStart = GetTotalHashes();
+        } else if (nNow - nHPSTimerStart > 4000) {
+            uint64_t nHashes = GetTotalHashes();
+            dHashesPerSec = 1000.0 * (nHashes - nHashesMeterStart) / (nNow - nHPSTimerStart);
+            nHPSTimerStart = nNow;
+            nHashesMeterStart = nHashes;
+            static int64_t nLogTime;
+            if (GetTime() - nLogTime > 30 * 60)
+            {
+                nLogTime = GetTime();
+                LogPrintf("hashmeter %6.0f khash/s\n", dHashesPerSec/1000.0);
+            }
+        }
+    }
+
+    void Coordinator();
+    void Worker(int nThread);
 
+public:
+    CMinerEngine(CWallet* pwalletIn, int nThreadsIn) : pwallet(pwalletIn), nThreads(nThreadsIn), nJobId(0), nLastJobId(0),
+        nExtraNonceLast(0), fStopped(false), nWorkersRunning(nThreadsIn), reservekey(pwalletIn), vCounters(nThreadsIn),
+        nHashesMeterStart(0)
+    {
+        nHPSTimerStart = 0;
+        threadGroup.create_thread(boost::bind(&CMinerEngine::Coordinator, this));
+        for (int i = 0; i < nThreads; i++)
+            threadGroup.create_thread(boost::bind(&CMinerEngine::Worker, this, i));
+    }
+
+    ~CMinerEngine()
+    {
+        threadGroup.interrupt_all();
+        threadGroup.join_all();
+        dHashesPerSec = 0;
+    }
 
-    // Each thread has its own key and counter
-    CReserveKey reservekey(pwallet);
-    unsigned int nExtraNonce = 0;
+    uint64_t GetTotalHashes() const
+    {
+        uint64_t nTotal = 0;
+        for (unsigned int i = 0; i < vCounters.size(); i++)
+            nTotal += vCounters[i].nHashes;
+        return nTotal;
+    }
+};
+
+void CMinerEngine::Coordinator()
+{
+    LogPrintf("healthheldtokenMiner started with %d threads\n", nThreads);
+    RenameThread("healthheldtoken-miner");
 
     try {
-        while (true) {
+        while (!IsStopped()) {
             if (Params().MiningRequiresPeers()) {
                 // Busy-wait for the network to come online so we don't waste time mining
                 // on an obsolete chain. In regtest mode we expect to fly solo.
@@ -433,6 +653,8 @@ void static BitcoinMiner(CWallet *pwallet)
                     }
                     if (!fvNodesEmpty && !IsInitialBlockDownload())
                         break;
+                    if (IsStopped())
+                        return;
                     MilliSleep(1000);
                 } while (true);
             }
@@ -443,117 +665,160 @@ void static BitcoinMiner(CWallet *pwallet)
             unsigned int nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
             CBlockIndex* pindexPrev = chainActive.Tip();
 
-            auto_ptr<CBlockTemplate> pblocktemplate(CreateNewBlockWithKey(reservekey));
-            if (!pblocktemplate.get())
+            boost::shared_ptr<CMinerJob> pjobNew(new CMinerJob());
+            {
+                boost::unique_lock<boost::mutex> lock(mutexKey);
+                pjobNew->pblocktemplate.reset(CreateNewBlockWithKey(reservekey));
+            }
+            if (!pjobNew->pblocktemplate)
             {
                 LogPrintf("Error in healthheldtokenMiner: Keypool ran out, please call keypoolrefill before restarting the mining thread\n");
+                Stop();
                 return;
             }
-            CBlock *pblock = &pblocktemplate->block;
-            IncrementExtraNonce(pblock, pindexPrev, nExtraNonce);
+            pjobNew->pindexPrev = pindexPrev;
+            CBlock *pblock = &pjobNew->pblocktemplate->block;
+            SetExtraNonce(pblock, pindexPrev, TakeExtraNonce(pblock->hashPrevBlock));
 
             LogPrintf("Running healthheldtokenMiner with %u transactions in block (%u bytes)\n", pblock->vtx.size(),
                 ::GetSerializeSize(*pblock, SER_NETWORK, PROTOCOL_VERSION));
+            Publish(pjobNew);
 
             //
-            // Search
+            // Wait for a new tip or enough mempool changes to rebuild the template
             //
             int64_t nStart = GetTime();
-            uint256 hashTarget = uint256().SetCompact(pblock->nBits);
-            uint256 thash;
             while (true) {
-                unsigned int nHashesDone = 0;
-                //char scratchpad[SCRYPT_SCRATCHPAD_SIZE];
-                while(true)
+                UpdateHashMeter();
+                if (IsStopped())
+                    break;
                 {
-                    thash = pblock->GetHash();
-                    if (thash <= hashTarget)
-                    {
-                        // Found a solution
-                        SetThreadPriority(THREAD_PRIORITY_NORMAL);
-                        LogPrintf("healthheldtokenMiner:\n");
-                        LogPrintf("proof-of-work found  \n  powhash: %s  \ntarget: %s\n", thash.GetHex(), hashTarget.GetHex());
-                        ProcessBlockFound(pblock, *pwallet, reservekey);
-                        SetThreadPriority(THREAD_PRIORITY_LOWEST);
+                    boost::unique_lock<boost::mutex> lock(csBestBlock);
+                    if (chainActive.Tip() == pindexPrev)
+                        cvBlockChange.timed_wait(lock, boost::posix_time::seconds(1));
+                }
+                if (chainActive.Tip() != pindexPrev) {
+                    // Stop the workers right away rather than after the next template is built.
+                    Publish(boost::shared_ptr<CMinerJob>());
+                    break;
+                }
+                // Regtest mode doesn't require peers
+                if (vNodes.empty() && Params().MiningRequiresPeers())
+                    break;
+                if (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLast && GetTime() - nStart >= MINER_TEMPLATE_REFRESH_SECONDS)
+                    break;
+            }
+        }
+    }
+    catch (boost::thread_interrupted)
+    {
+        LogPrintf("healthheldtokenMiner terminated\n");
+        throw;
+    }
+    catch (const std::runtime_error &e)
+    {
+        LogPrintf("healthheldtokenMiner runtime error: %s\n", e.what());
+        Stop();
+        return;
+    }
+    LogPrintf("healthheldtokenMiner stopped\n");
+}
+
+void CMinerEngine::Worker(int nThread)
+{
+    SetThreadPriority(THREAD_PRIORITY_LOWEST);
+    RenameThread("healthheldtoken-miner-worker");
+    if (GetBoolArg("-genpinthreads", true)) {
+        int nCores = boost::thread::hardware_concurrency();
+        if (nCores > 0 && !SetThreadAffinity(nThread % nCores))
+            LogPrintf("healthheldtokenMiner: could not pin thread %d to core %d\n", nThread, nThread % nCores);
+    }
 
-                        // In regression test mode, stop mining after a block is found.
-                        if (Params().MineBlocksOnDemand())
-                            throw boost::thread_interrupted();
+    volatile uint64_t& nHashes = vCounters[nThread].nHashes;
+    // This worker's slice of the nonce space, as a half-open range.
+    const uint64_t nNonceBegin = (uint64_t)nThread * 0x100000000ULL / nThreads;
+    const uint64_t nNonceEnd = (uint64_t)(nThread + 1) * 0x100000000ULL / nThreads;
+    unsigned int nJob = 0;
 
+    try {
+        while (true) {
+            boost::shared_ptr<CMinerJob> pjobCur = WaitForJob(nJob);
+            if (!pjobCur)
+                break;
+            nJob = pjobCur->nId;
+            CBlock block(pjobCur->pblocktemplate->block);
+            CBlockIndex* pindexPrev = pjobCur->pindexPrev;
+            uint256 hashTarget = uint256().SetCompact(block.nBits);
+
+            uint64_t nNonce = nNonceBegin;
+            uint64_t nEnd = nNonceEnd;
+            bool fFound = false;
+            while (nJobId == nJob && !fFound) {
+                if (nNonce >= nEnd) {
+                    // Slice exhausted: move to a fresh extranonce and the full nonce range.
+                    SetExtraNonce(&block, pindexPrev, TakeExtraNonce(block.hashPrevBlock));
+                    nNonce = 0;
+                    nEnd = 0x100000000ULL;
+                }
+
+                // Only the nonce changes within a batch, so the header is prepared once.
+                CBthHashMidstate midstate((const unsigned char*)BEGIN(block.nVersion));
+                uint64_t nBatchEnd = std::min(nNonce + MINER_NONCE_BATCH, nEnd);
+                for (; nNonce < nBatchEnd && nJobId == nJob; nNonce++) {
+                    nHashes = nHashes + 1;
+                    if (midstate.GetHash((uint32_t)nNonce) <= hashTarget) {
+                        block.nNonce = (uint32_t)nNonce;
+                        fFound = true;
                         break;
                     }
-                    pblock->nNonce += 1;
-                    nHashesDone += 1;
-                    if ((pblock->nNonce & 0xFF) == 0)
-                        break;
                 }
 
-                // Meter hashes/sec
-                static int64_t nHashCounter;
-                if (nHPSTimerStart == 0)
-                {
-                    nHPSTimerStart = GetTimeMillis();
-                    nHashCounter = 0;
-                }
-                else
-                    nHashCounter += nHashesDone;
-                if (GetTimeMillis() - nHPSTimerStart > 4000)
-                {
-                    static CCriticalSection cs;
+                boost::this_thread::interruption_point();
+                if (!fFound) {
+                    // Update nTime every few seconds
+                    UpdateTime(&block, pindexPrev);
+                    if (Params().AllowMinDifficultyBlocks())
                     {
-                        LOCK(cs);
-                        if (GetTimeMillis() - nHPSTimerStart > 4000)
-                        {
-                            dHashesPerSec = 1000.0 * nHashCounter / (GetTimeMillis() - nHPSTimerStart);
-                            nHPSTimerStart = GetTimeMillis();
-                            nHashCounter = 0;
-                            static int64_t nLogTime;
-                            if (GetTime() - nLogTime > 30 * 60)
-                            {
-                                nLogTime = GetTime();
-                                LogPrintf("hashmeter %6.0f khash/s\n", dHashesPerSec/1000.0);
-                            }
-                        }
+                        // Changing block.nTime can change work required on testnet:
+                        hashTarget.SetCompact(block.nBits);
                     }
                 }
+            }
+            if (!fFound)
+                continue;
 
-                // Check for stop or if block needs to be rebuilt
-                boost::this_thread::interruption_point();
-                // Regtest mode doesn't require peers
-                if (vNodes.empty() && Params().MiningRequiresPeers())
-                    break;
-                if (pblock->nNonce >= 0xffff0000)
-                    break;
-                if (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLast && GetTime() - nStart > 60)
-                    break;
-                if (pindexPrev != chainActive.Tip())
-                    break;
-
-                // Update nTime every few seconds
-                UpdateTime(pblock, pindexPrev);
-                if (Params().AllowMinDifficultyBlocks())
-                {
-                    // Changing pblock->nTime can change work required on testnet:
-                    hashTarget.SetCompact(pblock->nBits);
-                }
+            // Found a solution
+            SetThreadPriority(THREAD_PRIORITY_NORMAL);
+            LogPrintf("healthheldtokenMiner:\n");
+            LogPrintf("proof-of-work found  \n  powhash: %s  \ntarget: %s\n", block.GetHash().GetHex(), hashTarget.GetHex());
+            {
+                boost::unique_lock<boost::mutex> lock(mutexKey);
+                ProcessBlockFound(&block, *pwallet, reservekey);
             }
+            SetThreadPriority(THREAD_PRIORITY_LOWEST);
+
+            // In regression test mode, stop mining after a block is found.
+            if (Params().MineBlocksOnDemand())
+                Stop();
         }
     }
     catch (boost::thread_interrupted)
     {
-        LogPrintf("healthheldtokenMiner terminated\n");
+        WorkerExited();
         throw;
     }
     catch (const std::runtime_error &e)
     {
         LogPrintf("healthheldtokenMiner runtime error: %s\n", e.what());
-        return;
     }
+    WorkerExited();
 }
 
+} // anon namespace
+
 void GenerateBitcoins(bool fGenerate, CWallet* pwallet, int nThreads)
 {
-    static boost::thread_group* minerThreads = NULL;
+    static CMinerEngine* pminer = NULL;
 
     if (nThreads < 0) {
         // In regtest threads defaults to 1
@@ -563,19 +828,16 @@ void GenerateBitcoins(bool fGenerate, CWallet* pwallet, int nThreads)
             nThreads = boost::thread::hardware_concurrency();
     }
 
-    if (minerThreads != NULL)
+    if (pminer != NULL)
     {
-        minerThreads->interrupt_all();
-        delete minerThreads;
-        minerThreads = NULL;
+        delete pminer;
+        pminer = NULL;
     }
 
     if (nThreads == 0 || !fGenerate)
         return;
 
-    minerThreads = new boost::thread_group();
-    for (int i = 0; i < nThreads; i++)
-        minerThreads->create_thread(boost::bind(&BitcoinMiner, pwallet));
+    pminer = new CMinerEngine(pwallet, nThreads);
 }
 
 #endif // ENABLE_WALLET
@@ -12,6 +12,7 @@
 #include "addrman.h"
 #include "chainparams.h"
 #include "clientversion.h"
+#include "crypto/common.h"
 #include "primitives/transaction.h"
 #include "ui_interface.h"
 
@@ -21,6 +22,10 @@
 #include <fcntl.h>
 #endif
 
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+
 #ifdef USE_UPNP
 #include <miniupnpc/miniupnpc.h>
 #include <miniupnpc/miniwget.h>
@@ -377,6 +382,8 @@ CNode* FindNode(const CService& addr)
     return NULL;
 }
 
+static void AddNode(CNode* pnode);
+
 CNode* ConnectNode(CAddress addrConnect, const char *pszDest)
 {
     if (pszDest == NULL) {
@@ -408,11 +415,7 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest)
         // Add node
         CNode* pnode = new CNode(hSocket, addrConnect, pszDest ? pszDest : "", false);
         pnode->AddRef();
-
-        {
-            LOCK(cs_vNodes);
-            vNodes.push_back(pnode);
-        }
+        AddNode(pnode);
 
         pnode->nTimeConnected = GetTime();
 
@@ -552,6 +555,91 @@ void CNode::copyStats(CNodeStats &stats)
 }
 #undef X
 
+namespace {
+
+/**
+ * Payload buffers of processed messages, kept for the messages that follow.
+ * A recycled buffer keeps its capacity, so most payloads are received into
+ * memory that is already allocated, and network data, which is not secret,
+ * isn't cleansed byte by byte as zero_after_free_allocator does on free.
+ * Buffers are binned by the power of two below their capacity.
+ */
+class CRecvBufferPool
+{
+private:
+    static const int MIN_BIN = 8;       // 256 bytes; smaller buffers aren't worth keeping
+    static const int MAX_BIN = 21;      // 2 MiB, enough for MAX_PROTOCOL_MESSAGE_LENGTH
+    static const size_t MAX_BUFFERS_PER_BIN = 64;
+    static const size_t MAX_POOLED_BYTES = 32 * 1024 * 1024;
+
+    CCriticalSection cs;
+    std::vector<CSerializeData> vBins[MAX_BIN + 1];
+    size_t nPooledBytes;
+
+    static int Log2(size_t n)
+    {
+        int nBits = 0;
+        while (n >>= 1)
+            nBits++;
+        return nBits;
+    }
+
+public:
+    CRecvBufferPool() : nPooledBytes(0)
+    {
+        // Reserve up front, as reallocating a vector of vectors would copy the buffers
+        for (int i = MIN_BIN; i <= MAX_BIN; i++)
+            vBins[i].reserve(MAX_BUFFERS_PER_BIN);
+    }
+
+    /** Swap a free buffer of at least nMinCapacity bytes into data. Returns false if there is none. */
+    bool Get(CSerializeData& data, size_t nMinCapacity)
+    {
+        int nBin = Log2(nMinCapacity - 1) + 1;
+        if (nBin < MIN_BIN)
+            nBin = MIN_BIN;
+        LOCK(cs);
+        for (; nBin <= MAX_BIN; nBin++) {
+            std::vector<CSerializeData>& vBin = vBins[nBin];
+            if (!vBin.empty()) {
+                data.swap(vBin.back());
+                vBin.pop_back();
+                nPooledBytes -= data.capacity();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /** Keep data's buffer for reuse, leaving data empty, unless the pool is full. */
+    void Put(CSerializeData& data)
+    {
+        size_t nCapacity = data.capacity();
+        int nBin = Log2(nCapacity);
+        if (nBin < MIN_BIN || nBin > MAX_BIN)
+            return;
+        data.clear();
+        LOCK(cs);
+        std::vector<CSerializeData>& vBin = vBins[nBin];
+        if (vBin.size() >= MAX_BUFFERS_PER_BIN || nPooledBytes + nCapacity > MAX_POOLED_BYTES)
+            return;
+        vBin.push_back(CSerializeData());
+        vBin.back().swap(data);
+        nPooledBytes += nCapacity;
+    }
+};
+
+CRecvBufferPool recvBufferPool;
+
+} // anon namespace
+
+CNetMessage::~CNetMessage()
+{
+    CSerializeData data;
+    vRecv.SwapBuffer(data);
+    recvBufferPool.Put(data);
+}
+
 // requires LOCK(cs_vRecvMsg)
 bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
 {
@@ -589,26 +677,40 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
     return true;
 }
 
+char* CNode::GetRecvDataBuffer(unsigned int& nSpace)
+{
+    if (vRecvMsg.empty() || !vRecvMsg.back().in_data || vRecvMsg.back().complete())
+        return NULL;
+    return vRecvMsg.back().GetDataBuffer(nSpace);
+}
+
+void CNode::ReceivedMsgData(unsigned int nBytes)
+{
+    CNetMessage& msg = vRecvMsg.back();
+    msg.DataReceived(nBytes);
+    if (msg.complete())
+        msg.nTime = GetTimeMicros();
+}
+
 int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
 {
     // copy data to temporary parsing buffer
-    unsigned int nRemaining = 24 - nHdrPos;
+    unsigned int nRemaining = CMessageHeader::HEADER_SIZE - nHdrPos;
     unsigned int nCopy = std::min(nRemaining, nBytes);
 
     memcpy(&hdrbuf[nHdrPos], pch, nCopy);
     nHdrPos += nCopy;
 
     // if header incomplete, exit
-    if (nHdrPos < 24)
+    if (nHdrPos < CMessageHeader::HEADER_SIZE)
         return nCopy;
 
     // deserialize to CMessageHeader
-    try {
-        hdrbuf >> hdr;
-    }
-    catch (const std::exception &) {
-        return -1;
-    }
+    const unsigned char* pchHdr = (const unsigned char*)hdrbuf;
+    memcpy(hdr.pchMessageStart, pchHdr, MESSAGE_START_SIZE);
+    memcpy(hdr.pchCommand, pchHdr + MESSAGE_START_SIZE, CMessageHeader::COMMAND_SIZE);
+    hdr.nMessageSize = ReadLE32(pchHdr + CMessageHeader::MESSAGE_SIZE_OFFSET);
+    hdr.nChecksum = ReadLE32(pchHdr + CMessageHeader::CHECKSUM_OFFSET);
 
     // reject messages larger than MAX_SIZE
     if (hdr.nMessageSize > MAX_SIZE)
@@ -617,25 +719,48 @@ int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
     // switch state to reading message data
     in_data = true;
 
+    // Take a recycled buffer that can hold the whole payload, so it never
+    // reallocates. Its size stays zero: the payload is appended as it arrives
+    // rather than zero-filled up front.
+    CSerializeData data;
+    if (hdr.nMessageSize > 0 && recvBufferPool.Get(data, hdr.nMessageSize))
+        vRecv.SwapBuffer(data);
+
     return nCopy;
 }
 
 int CNetMessage::readData(const char *pch, unsigned int nBytes)
 {
-    unsigned int nRemaining = hdr.nMessageSize - nDataPos;
-    unsigned int nCopy = std::min(nRemaining, nBytes);
-
-    if (vRecv.size() < nDataPos + nCopy) {
-        // Allocate up to 256 KiB ahead, but never more than the total message size.
-        vRecv.resize(std::min(hdr.nMessageSize, nDataPos + nCopy + 256 * 1024));
-    }
+    unsigned int nCopy = std::min(hdr.nMessageSize - nDataPos, nBytes);
 
-    memcpy(&vRecv[nDataPos], pch, nCopy);
+    // Fill any room GetDataBuffer() made first, then append the rest.
+    unsigned int nFill = std::min(nCopy, (unsigned int)vRecv.size() - nDataPos);
+    if (nFill > 0)
+        memcpy(&vRecv[nDataPos], pch, nFill);
+    vRecv.write(pch + nFill, nCopy - nFill);
     nDataPos += nCopy;
 
     return nCopy;
 }
 
+char* CNetMessage::GetDataBuffer(unsigned int& nSpace)
+{
+    assert(in_data && nDataPos < hdr.nMessageSize);
+    if (vRecv.size() == nDataPos) {
+        // recv() needs initialized space to write to. Make it one socket read's
+        // worth at a time, so the zero-fill is still in cache when overwritten.
+        vRecv.resize(std::min(hdr.nMessageSize, nDataPos + 64 * 1024));
+    }
+    nSpace = vRecv.size() - nDataPos;
+    return &vRecv[nDataPos];
+}
+
+void CNetMessage::DataReceived(unsigned int nBytes)
+{
+    assert(nDataPos + nBytes <= vRecv.size());
+    nDataPos += nBytes;
+}
+
 
 
 
@@ -647,10 +772,10 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
 // requires LOCK(cs_vSend)
 void SocketSendData(CNode *pnode)
 {
-    std::deque<CSerializeData>::iterator it = pnode->vSendMsg.begin();
+    std::deque<CSerializedNetMsg>::iterator it = pnode->vSendMsg.begin();
 
     while (it != pnode->vSendMsg.end()) {
-        const CSerializeData &data = *it;
+        const CSerializeData &data = **it;
         assert(data.size() > pnode->nSendOffset);
         int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], data.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
         if (nBytes > 0) {
@@ -690,80 +815,317 @@ void SocketSendData(CNode *pnode)
 
 static list<CNode*> vNodesDisconnected;
 
-void ThreadSocketHandler()
+/** Milliseconds between passes that clean up disconnected nodes and check the others for inactivity */
+static const int64_t SOCKET_MAINTENANCE_INTERVAL = 200;
+/** Milliseconds to wait before retrying sockets that could not be serviced completely */
+static const int SOCKET_RETRY_INTERVAL = 50;
+
+#ifdef HAVE_SYS_EPOLL_H
+/** epoll instance watching the listening and node sockets, or -1 when select() is used */
+static int epollSocketEvents = -1;
+/** Maximum number of readiness events taken from the kernel per epoll_wait() */
+static const int EPOLL_MAX_EVENTS = 256;
+/** Maximum number of recv() calls per node and event loop iteration, so one fast peer can't starve the others */
+static const int MAX_RECV_PER_NODE = 4;
+#endif
+
+#ifndef WIN32
+/** Pipe that select() waits on along with the sockets; a byte written to it wakes the socket thread */
+static int pipeSocketWakeup[2] = { -1, -1 };
+#endif
+
+bool fSocketEventsEpoll = false;
+
+bool HaveSocketEventsEpoll()
+{
+#ifdef HAVE_SYS_EPOLL_H
+    return true;
+#else
+    return false;
+#endif
+}
+
+void InitSocketEvents()
+{
+#ifdef HAVE_SYS_EPOLL_H
+    if (fSocketEventsEpoll) {
+        epollSocketEvents = epoll_create1(EPOLL_CLOEXEC);
+        if (epollSocketEvents == -1) {
+            LogPrintf("epoll_create1 failed: %s, falling back to select()\n", NetworkErrorString(errno));
+            fSocketEventsEpoll = false;
+        }
+    }
+#endif
+#ifndef WIN32
+    if (!fSocketEventsEpoll) {
+        if (pipe(pipeSocketWakeup) != 0) {
+            LogPrintf("InitSocketEvents: could not create wakeup pipe: %s\n", NetworkErrorString(errno));
+            pipeSocketWakeup[0] = pipeSocketWakeup[1] = -1;
+        } else {
+            fcntl(pipeSocketWakeup[0], F_SETFL, fcntl(pipeSocketWakeup[0], F_GETFL, 0) | O_NONBLOCK);
+            fcntl(pipeSocketWakeup[1], F_SETFL, fcntl(pipeSocketWakeup[1], F_GETFL, 0) | O_NONBLOCK);
+        }
+    }
+#endif
+    LogPrintf("Using %s to wait for socket events\n", fSocketEventsEpoll ? "epoll" : "select");
+}
+
+/** Wake the select() loop early, e.g. because a send queue became non-empty. */
+static void WakeSocketHandler()
+{
+#ifndef WIN32
+    if (pipeSocketWakeup[1] != -1) {
+        char c = 0;
+        // Ignore failure: a full pipe means a wakeup is already pending
+        if (write(pipeSocketWakeup[1], &c, 1) != 1)
+            return;
+    }
+#endif
+}
+
+#ifndef WIN32
+static void DrainSocketWakeup()
+{
+    char buf[128];
+    while (read(pipeSocketWakeup[0], buf, sizeof(buf)) > 0) {}
+}
+#endif
+
+/**
+ * Start watching a new node's socket. With epoll the socket is registered once,
+ * edge-triggered for both directions; select() picks it up from vNodes instead.
+ */
+static bool RegisterNodeSocket(CNode* pnode)
+{
+#ifdef HAVE_SYS_EPOLL_H
+    if (epollSocketEvents != -1 && pnode->hSocket != INVALID_SOCKET) {
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+        event.data.ptr = pnode;
+        if (epoll_ctl(epollSocketEvents, EPOLL_CTL_ADD, pnode->hSocket, &event) != 0) {
+            LogPrintf("epoll_ctl failed for peer=%d: %s\n", pnode->id, NetworkErrorString(errno));
+            return false;
+        }
+    }
+#endif
+    return true;
+}
+
+/** Add a new node to vNodes, disconnecting it right away if its socket can't be watched. */
+static void AddNode(CNode* pnode)
 {
-    unsigned int nPrevNodeCount = 0;
-    while (true)
     {
-        //
-        // Disconnect nodes
-        //
+        LOCK(cs_vNodes);
+        vNodes.push_back(pnode);
+    }
+    if (!RegisterNodeSocket(pnode))
+        pnode->CloseSocketDisconnect();
+}
+
+/**
+ * Take nodes that are disconnected or no longer used out of vNodes, and delete
+ * the ones no other thread holds a reference to any more.
+ */
+static void DisconnectNodes(unsigned int& nPrevNodeCount)
+{
+    {
+        LOCK(cs_vNodes);
+        // Disconnect unused nodes
+        vector<CNode*> vNodesCopy = vNodes;
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
         {
-            LOCK(cs_vNodes);
-            // Disconnect unused nodes
-            vector<CNode*> vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            if (pnode->fDisconnect ||
+                (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty()))
             {
-                if (pnode->fDisconnect ||
-                    (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty()))
-                {
-                    // remove from vNodes
-                    vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
+                // remove from vNodes
+                vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
 
-                    // release outbound grant (if any)
-                    pnode->grantOutbound.Release();
+                // release outbound grant (if any)
+                pnode->grantOutbound.Release();
 
-                    // close socket and cleanup
-                    pnode->CloseSocketDisconnect();
+                // close socket and cleanup
+                pnode->CloseSocketDisconnect();
 
-                    // hold in disconnected pool until all refs are released
-                    if (pnode->fNetworkNode || pnode->fInbound)
-                        pnode->Release();
-                    vNodesDisconnected.push_back(pnode);
-                }
+                // hold in disconnected pool until all refs are released
+                if (pnode->fNetworkNode || pnode->fInbound)
+                    pnode->Release();
+                vNodesDisconnected.push_back(pnode);
             }
         }
+    }
+    {
+        // Delete disconnected nodes
+        list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
+        BOOST_FOREACH(CNode* pnode, vNodesDisconnectedCopy)
         {
-            // Delete disconnected nodes
-            list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
-            BOOST_FOREACH(CNode* pnode, vNodesDisconnectedCopy)
+            // wait until threads are done using it
+            if (pnode->GetRefCount() <= 0)
             {
-                // wait until threads are done using it
-                if (pnode->GetRefCount() <= 0)
+                bool fDelete = false;
                 {
-                    bool fDelete = false;
+                    TRY_LOCK(pnode->cs_vSend, lockSend);
+                    if (lockSend)
                     {
-                        TRY_LOCK(pnode->cs_vSend, lockSend);
-                        if (lockSend)
+                        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                        if (lockRecv)
                         {
-                            TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                            if (lockRecv)
-                            {
-                                TRY_LOCK(pnode->cs_inventory, lockInv);
-                                if (lockInv)
-                                    fDelete = true;
-                            }
+                            TRY_LOCK(pnode->cs_inventory, lockInv);
+                            if (lockInv)
+                                fDelete = true;
                         }
                     }
-                    if (fDelete)
-                    {
-                        vNodesDisconnected.remove(pnode);
-                        delete pnode;
-                    }
+                }
+                if (fDelete)
+                {
+                    vNodesDisconnected.remove(pnode);
+                    delete pnode;
                 }
             }
         }
-        if(vNodes.size() != nPrevNodeCount) {
-            nPrevNodeCount = vNodes.size();
-            uiInterface.NotifyNumConnectionsChanged(nPrevNodeCount);
+    }
+    if(vNodes.size() != nPrevNodeCount) {
+        nPrevNodeCount = vNodes.size();
+        uiInterface.NotifyNumConnectionsChanged(nPrevNodeCount);
+    }
+}
+
+/** Accept one connection on a listening socket. Returns false if none could be accepted. */
+static bool AcceptConnection(const ListenSocket& hListenSocket)
+{
+    struct sockaddr_storage sockaddr;
+    socklen_t len = sizeof(sockaddr);
+    SOCKET hSocket = accept(hListenSocket.socket, (struct sockaddr*)&sockaddr, &len);
+    CAddress addr;
+    int nInbound = 0;
+
+    if (hSocket == INVALID_SOCKET)
+    {
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK)
+            LogPrintf("socket error accept failed: %s\n", NetworkErrorString(nErr));
+        return false;
+    }
+
+    if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
+        LogPrintf("Warning: Unknown socket family\n");
+
+    bool whitelisted = hListenSocket.whitelisted || CNode::IsWhitelistedRange(addr);
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes)
+            if (pnode->fInbound)
+                nInbound++;
+    }
+
+    if (nInbound >= nMaxConnections - MAX_OUTBOUND_CONNECTIONS)
+    {
+        CloseSocket(hSocket);
+    }
+    else if (CNode::IsBanned(addr) && !whitelisted)
+    {
+        LogPrintf("connection from %s dropped (banned)\n", addr.ToString());
+        CloseSocket(hSocket);
+    }
+    else
+    {
+        CNode* pnode = new CNode(hSocket, addr, "", true);
+        pnode->AddRef();
+        pnode->fWhitelisted = whitelisted;
+        AddNode(pnode);
+    }
+    return true;
+}
+
+/**
+ * Read once from a node's socket into its receive buffer.
+ * Returns true if data was received and the socket is still open.
+ */
+// requires LOCK(cs_vRecvMsg)
+static bool SocketRecvData(CNode* pnode)
+{
+    // typical socket buffer is 8K-64K
+    char pchBuf[0x10000];
+    // The rest of a large payload is received straight into the message.
+    // Headers and small messages go through pchBuf, which can hold several at once.
+    unsigned int nSpace = 0;
+    char* pchData = pnode->GetRecvDataBuffer(nSpace);
+    if (nSpace < sizeof(pchBuf))
+        pchData = NULL;
+    int nBytes = pchData ? recv(pnode->hSocket, pchData, nSpace, MSG_DONTWAIT)
+                         : recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+    if (nBytes > 0)
+    {
+        if (pchData)
+            pnode->ReceivedMsgData(nBytes);
+        else if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
+            pnode->CloseSocketDisconnect();
+        pnode->nLastRecv = GetTime();
+        pnode->nRecvBytes += nBytes;
+        pnode->RecordBytesRecv(nBytes);
+        return pnode->hSocket != INVALID_SOCKET;
+    }
+    else if (nBytes == 0)
+    {
+        // socket closed gracefully
+        if (!pnode->fDisconnect)
+            LogPrint("net", "socket closed\n");
+        pnode->CloseSocketDisconnect();
+    }
+    else if (nBytes < 0)
+    {
+        // error
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+        {
+            if (!pnode->fDisconnect)
+                LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
+            pnode->CloseSocketDisconnect();
+        }
+    }
+    return false;
+}
+
+static void InactivityCheck(CNode* pnode)
+{
+    int64_t nTime = GetTime();
+    if (nTime - pnode->nTimeConnected > 60)
+    {
+        if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
+        {
+            LogPrint("net", "socket no message in first 60 seconds, %d %d from %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0, pnode->id);
+            pnode->fDisconnect = true;
+        }
+        else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL)
+        {
+            LogPrintf("socket sending timeout: %is\n", nTime - pnode->nLastSend);
+            pnode->fDisconnect = true;
+        }
+        else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90*60))
+        {
+            LogPrintf("socket receive timeout: %is\n", nTime - pnode->nLastRecv);
+            pnode->fDisconnect = true;
+        }
+        else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros())
+        {
+            LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
+            pnode->fDisconnect = true;
         }
+    }
+}
+
+static void ThreadSocketHandlerSelect()
+{
+    unsigned int nPrevNodeCount = 0;
+    while (true)
+    {
+        DisconnectNodes(nPrevNodeCount);
 
         //
         // Find which sockets have data to receive
         //
         struct timeval timeout;
         timeout.tv_sec  = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
+        timeout.tv_usec = SOCKET_RETRY_INTERVAL * 1000; // frequency to poll full receive buffers
 
         fd_set fdsetRecv;
         fd_set fdsetSend;
@@ -780,6 +1142,14 @@ void ThreadSocketHandler()
             have_fds = true;
         }
 
+#ifndef WIN32
+        if (pipeSocketWakeup[0] != -1) {
+            FD_SET(pipeSocketWakeup[0], &fdsetRecv);
+            hSocketMax = max(hSocketMax, (SOCKET)pipeSocketWakeup[0]);
+            have_fds = true;
+        }
+#endif
+
         {
             LOCK(cs_vNodes);
             BOOST_FOREACH(CNode* pnode, vNodes)
@@ -840,58 +1210,18 @@ void ThreadSocketHandler()
             MilliSleep(timeout.tv_usec/1000);
         }
 
+#ifndef WIN32
+        if (pipeSocketWakeup[0] != -1 && FD_ISSET(pipeSocketWakeup[0], &fdsetRecv))
+            DrainSocketWakeup();
+#endif
+
         //
         // Accept new connections
         //
         BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket)
         {
             if (hListenSocket.socket != INVALID_SOCKET && FD_ISSET(hListenSocket.socket, &fdsetRecv))
-            {
-                struct sockaddr_storage sockaddr;
-                socklen_t len = sizeof(sockaddr);
-                SOCKET hSocket = accept(hListenSocket.socket, (struct sockaddr*)&sockaddr, &len);
-                CAddress addr;
-                int nInbound = 0;
-
-                if (hSocket != INVALID_SOCKET)
-                    if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
-                        LogPrintf("Warning: Unknown socket family\n");
-
-                bool whitelisted = hListenSocket.whitelisted || CNode::IsWhitelistedRange(addr);
-                {
-                    LOCK(cs_vNodes);
-                    BOOST_FOREACH(CNode* pnode, vNodes)
-                        if (pnode->fInbound)
-                            nInbound++;
-                }
-
-                if (hSocket == INVALID_SOCKET)
-                {
-                    int nErr = WSAGetLastError();
-                    if (nErr != WSAEWOULDBLOCK)
-                        LogPrintf("socket error accept failed: %s\n", NetworkErrorString(nErr));
-                }
-                else if (nInbound >= nMaxConnections - MAX_OUTBOUND_CONNECTIONS)
-                {
-                    CloseSocket(hSocket);
-                }
-                else if (CNode::IsBanned(addr) && !whitelisted)
-                {
-                    LogPrintf("connection from %s dropped (banned)\n", addr.ToString());
-                    CloseSocket(hSocket);
-                }
-                else
-                {
-                    CNode* pnode = new CNode(hSocket, addr, "", true);
-                    pnode->AddRef();
-                    pnode->fWhitelisted = whitelisted;
-
-                    {
-                        LOCK(cs_vNodes);
-                        vNodes.push_back(pnode);
-                    }
-                }
-            }
+                AcceptConnection(hListenSocket);
         }
 
         //
@@ -915,41 +1245,17 @@ void ThreadSocketHandler()
                 continue;
             if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
             {
-                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                if (lockRecv)
+                bool fComplete = false;
                 {
+                    TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                    if (lockRecv)
                     {
-                        // typical socket buffer is 8K-64K
-                        char pchBuf[0x10000];
-                        int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
-                        if (nBytes > 0)
-                        {
-                            if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
-                                pnode->CloseSocketDisconnect();
-                            pnode->nLastRecv = GetTime();
-                            pnode->nRecvBytes += nBytes;
-                            pnode->RecordBytesRecv(nBytes);
-                        }
-                        else if (nBytes == 0)
-                        {
-                            // socket closed gracefully
-                            if (!pnode->fDisconnect)
-                                LogPrint("net", "socket closed\n");
-                            pnode->CloseSocketDisconnect();
-                        }
-                        else if (nBytes < 0)
-                        {
-                            // error
-                            int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
-                            {
-                                if (!pnode->fDisconnect)
-                                    LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
-                                pnode->CloseSocketDisconnect();
-                            }
-                        }
+                        SocketRecvData(pnode);
+                        fComplete = !pnode->vRecvMsg.empty() && pnode->vRecvMsg.front().complete();
                     }
                 }
+                if (fComplete)
+                    ScheduleMessageHandler(pnode);
             }
 
             //
@@ -964,41 +1270,229 @@ void ThreadSocketHandler()
                     SocketSendData(pnode);
             }
 
-            //
-            // Inactivity checking
-            //
-            int64_t nTime = GetTime();
-            if (nTime - pnode->nTimeConnected > 60)
+            InactivityCheck(pnode);
+        }
+        {
+            LOCK(cs_vNodes);
+            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+                pnode->Release();
+        }
+    }
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+/**
+ * Readiness reported for a node's socket that could not be acted on yet:
+ * its lock was busy, its receive buffer was full, or it had more data than
+ * one iteration reads. Edge-triggered epoll reports each change only once,
+ * so this is remembered until the socket has been serviced.
+ */
+enum
+{
+    SOCKET_PENDING_RECV = (1U << 0),
+    SOCKET_PENDING_SEND = (1U << 1)
+};
+
+/** Act on a node's pending readiness. Returns the part of it that is still pending. */
+static int ServiceNodeSocket(CNode* pnode, int nPending)
+{
+    if (pnode->hSocket == INVALID_SOCKET)
+        return 0;
+
+    if (nPending & SOCKET_PENDING_SEND)
+    {
+        TRY_LOCK(pnode->cs_vSend, lockSend);
+        if (lockSend)
+        {
+            if (!pnode->vSendMsg.empty())
+                SocketSendData(pnode);
+            nPending &= ~SOCKET_PENDING_SEND;
+        }
+    }
+
+    if (nPending & SOCKET_PENDING_RECV)
+    {
+        // As with select(), drain the write buffer before receiving more; the
+        // socket reports writable again once the peer has read some of it.
+        {
+            TRY_LOCK(pnode->cs_vSend, lockSend);
+            if (lockSend && !pnode->vSendMsg.empty())
+                return nPending;
+        }
+        bool fDrained = false;
+        bool fComplete = false;
+        {
+            TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+            if (!lockRecv)
+                return nPending;
+            for (int i = 0; i < MAX_RECV_PER_NODE; i++)
             {
-                if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
+                if (!pnode->vRecvMsg.empty() && pnode->vRecvMsg.front().complete() &&
+                    pnode->GetTotalRecvSize() > ReceiveFloodSize())
+                    break;
+                if (!SocketRecvData(pnode))
                 {
-                    LogPrint("net", "socket no message in first 60 seconds, %d %d from %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0, pnode->id);
-                    pnode->fDisconnect = true;
+                    fDrained = true;
+                    break;
                 }
-                else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL)
-                {
-                    LogPrintf("socket sending timeout: %is\n", nTime - pnode->nLastSend);
-                    pnode->fDisconnect = true;
-                }
-                else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90*60))
+            }
+            fComplete = !pnode->vRecvMsg.empty() && pnode->vRecvMsg.front().complete();
+        }
+        if (fComplete)
+            ScheduleMessageHandler(pnode);
+        if (fDrained)
+            nPending &= ~SOCKET_PENDING_RECV;
+    }
+    return nPending;
+}
+
+static void ThreadSocketHandlerEpoll()
+{
+    unsigned int nPrevNodeCount = 0;
+    int64_t nNextMaintenance = 0;
+    // Nodes with readiness not acted on yet, each holding a reference so it isn't deleted meanwhile
+    map<CNode*, int> mapPending;
+    struct epoll_event events[EPOLL_MAX_EVENTS];
+
+    while (true)
+    {
+        //
+        // Periodically disconnect and delete nodes, and check for inactivity.
+        // None of this depends on socket readiness, so it stays out of the event path.
+        //
+        int64_t nNow = GetTimeMillis();
+        if (nNow >= nNextMaintenance)
+        {
+            DisconnectNodes(nPrevNodeCount);
+
+            vector<CNode*> vNodesCopy;
+            {
+                LOCK(cs_vNodes);
+                vNodesCopy = vNodes;
+                BOOST_FOREACH(CNode* pnode, vNodesCopy)
+                    pnode->AddRef();
+            }
+            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            {
+                // An optimistic write that was interrupted leaves data queued
+                // without the socket ever becoming unwritable; pick it up here.
+                if (pnode->hSocket != INVALID_SOCKET && pnode->nSendSize > 0)
                 {
-                    LogPrintf("socket receive timeout: %is\n", nTime - pnode->nLastRecv);
-                    pnode->fDisconnect = true;
+                    TRY_LOCK(pnode->cs_vSend, lockSend);
+                    if (lockSend && !pnode->vSendMsg.empty())
+                        SocketSendData(pnode);
                 }
-                else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros())
+                InactivityCheck(pnode);
+            }
+            {
+                LOCK(cs_vNodes);
+                BOOST_FOREACH(CNode* pnode, vNodesCopy)
+                    pnode->Release();
+            }
+            nNextMaintenance = nNow + SOCKET_MAINTENANCE_INTERVAL;
+        }
+
+        //
+        // Wait for readiness changes
+        //
+        int nTimeout = mapPending.empty() ? (int)(nNextMaintenance - nNow) : SOCKET_RETRY_INTERVAL;
+        int nEvents = epoll_wait(epollSocketEvents, events, EPOLL_MAX_EVENTS, nTimeout);
+        boost::this_thread::interruption_point();
+
+        if (nEvents < 0)
+        {
+            if (errno != EINTR)
+            {
+                LogPrintf("socket epoll_wait error %s\n", NetworkErrorString(errno));
+                MilliSleep(SOCKET_RETRY_INTERVAL);
+            }
+            nEvents = 0;
+        }
+
+        vector<CNode*> vNodesReady;
+        for (int i = 0; i < nEvents; i++)
+        {
+            const struct epoll_event& event = events[i];
+
+            // Listening sockets are level-triggered: accept until there is nothing left
+            bool fListen = false;
+            BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket)
+            {
+                if (event.data.ptr == &hListenSocket)
                 {
-                    LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
-                    pnode->fDisconnect = true;
+                    while (AcceptConnection(hListenSocket)) {}
+                    fListen = true;
+                    break;
                 }
             }
+            if (fListen)
+                continue;
+
+            CNode* pnode = (CNode*)event.data.ptr;
+            int nFlags = 0;
+            if (event.events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+                nFlags |= SOCKET_PENDING_RECV;
+            if (event.events & EPOLLOUT)
+                nFlags |= SOCKET_PENDING_SEND;
+            map<CNode*, int>::iterator it = mapPending.find(pnode);
+            if (it == mapPending.end()) {
+                mapPending.insert(make_pair(pnode, nFlags));
+                vNodesReady.push_back(pnode);
+            } else {
+                it->second |= nFlags;
+            }
         }
+        if (!vNodesReady.empty())
         {
             LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            BOOST_FOREACH(CNode* pnode, vNodesReady)
+                pnode->AddRef();
+        }
+
+        //
+        // Service the sockets that reported readiness
+        //
+        vector<CNode*> vNodesDone;
+        for (map<CNode*, int>::iterator it = mapPending.begin(); it != mapPending.end(); )
+        {
+            it->second = ServiceNodeSocket(it->first, it->second);
+            if (it->second == 0) {
+                vNodesDone.push_back(it->first);
+                mapPending.erase(it++);
+            } else {
+                it++;
+            }
+        }
+        if (!vNodesDone.empty())
+        {
+            LOCK(cs_vNodes);
+            BOOST_FOREACH(CNode* pnode, vNodesDone)
                 pnode->Release();
         }
     }
 }
+#endif
+
+void ThreadSocketHandler()
+{
+#ifdef HAVE_SYS_EPOLL_H
+    if (epollSocketEvents != -1)
+    {
+        // Listening sockets are bound before the thread starts, and are level-triggered
+        BOOST_FOREACH(ListenSocket& hListenSocket, vhListenSocket)
+        {
+            struct epoll_event event;
+            event.events = EPOLLIN;
+            event.data.ptr = &hListenSocket;
+            if (epoll_ctl(epollSocketEvents, EPOLL_CTL_ADD, hListenSocket.socket, &event) != 0)
+                LogPrintf("epoll_ctl failed for listening socket: %s\n", NetworkErrorString(errno));
+        }
+        ThreadSocketHandlerEpoll();
+        return;
+    }
+#endif
+    ThreadSocketHandlerSelect();
+}
 
 
 
@@ -1409,46 +1903,141 @@ bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant *grantOu
 }
 
 
-void ThreadMessageHandler()
+/** Milliseconds between passes that let every peer send pings, trickled inventory and addresses */
+static const int MESSAGE_HANDLER_SEND_INTERVAL = 100;
+
+namespace {
+
+/**
+ * Hands peers with work to the message handler threads. A peer is queued at
+ * most once and handled by at most one thread at a time, so its messages are
+ * still processed in the order they arrived. A peer that is scheduled while a
+ * thread is handling it is queued again once that thread is done with it.
+ */
+class CMessageScheduler
 {
-    SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
-    while (true)
+public:
+    enum
     {
-        vector<CNode*> vNodesCopy;
+        STATE_IDLE = 0,
+        STATE_QUEUED,
+        STATE_RUNNING,
+        STATE_RUNNING_AGAIN
+    };
+
+private:
+    boost::mutex mutex;
+    boost::condition_variable condReady;
+    std::deque<CNode*> queueReady;
+
+public:
+    void Schedule(CNode* pnode, bool fTrickle)
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            if (fTrickle)
+                pnode->fMessageHandlerTrickle = true;
+            if (pnode->nMessageHandlerState == STATE_RUNNING)
+                pnode->nMessageHandlerState = STATE_RUNNING_AGAIN;
+            if (pnode->nMessageHandlerState != STATE_IDLE)
+                return;
+            pnode->nMessageHandlerState = STATE_QUEUED;
+        }
+        // The queue holds a reference until the peer has been handled
         {
             LOCK(cs_vNodes);
-            vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy) {
-                pnode->AddRef();
+            pnode->AddRef();
+        }
+        boost::unique_lock<boost::mutex> lock(mutex);
+        queueReady.push_back(pnode);
+        condReady.notify_one();
+    }
+
+    CNode* Pop(bool& fTrickle)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (queueReady.empty())
+            condReady.wait(lock);
+        CNode* pnode = queueReady.front();
+        queueReady.pop_front();
+        pnode->nMessageHandlerState = STATE_RUNNING;
+        fTrickle = pnode->fMessageHandlerTrickle;
+        pnode->fMessageHandlerTrickle = false;
+        return pnode;
+    }
+
+    void Done(CNode* pnode, bool fMore)
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            if (fMore || pnode->nMessageHandlerState == STATE_RUNNING_AGAIN) {
+                pnode->nMessageHandlerState = STATE_QUEUED;
+                queueReady.push_back(pnode);
+                condReady.notify_one();
+                return;
             }
+            pnode->nMessageHandlerState = STATE_IDLE;
         }
+        LOCK(cs_vNodes);
+        pnode->Release();
+    }
+};
 
-        // Poll the connected nodes for messages
-        CNode* pnodeTrickle = NULL;
-        if (!vNodesCopy.empty())
-            pnodeTrickle = vNodesCopy[GetRand(vNodesCopy.size())];
+CMessageScheduler messageScheduler;
 
-        bool fSleep = true;
+} // anon namespace
 
-        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+void ScheduleMessageHandler(CNode* pnode, bool fTrickle)
+{
+    if (!pnode->fDisconnect)
+        messageScheduler.Schedule(pnode, fTrickle);
+}
+
+/**
+ * Schedule every peer for a send pass at a fixed interval. Sending pings,
+ * trickled inventory and addresses depends on time rather than on incoming
+ * data; received messages and block announcements are scheduled as they occur.
+ */
+void ThreadMessageHandler()
+{
+    while (true)
+    {
         {
-            if (pnode->fDisconnect)
-                continue;
+            LOCK(cs_vNodes);
+            CNode* pnodeTrickle = NULL;
+            if (!vNodes.empty())
+                pnodeTrickle = vNodes[GetRand(vNodes.size())];
+            BOOST_FOREACH(CNode* pnode, vNodes)
+                ScheduleMessageHandler(pnode, pnode == pnodeTrickle);
+        }
+        MilliSleep(MESSAGE_HANDLER_SEND_INTERVAL);
+    }
+}
 
+void ThreadMessageWorker()
+{
+    SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
+    while (true)
+    {
+        bool fTrickle;
+        CNode* pnode = messageScheduler.Pop(fTrickle);
+        bool fMore = false;
+
+        if (!pnode->fDisconnect)
+        {
             // Receive messages
             {
-                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                if (lockRecv)
-                {
-                    if (!g_signals.ProcessMessages(pnode))
-                        pnode->CloseSocketDisconnect();
+                // No other handler thread holds this while the peer is ours;
+                // the socket thread only holds it briefly to append data.
+                LOCK(pnode->cs_vRecvMsg);
+                if (!g_signals.ProcessMessages(pnode))
+                    pnode->CloseSocketDisconnect();
 
-                    if (pnode->nSendSize < SendBufferSize())
+                if (pnode->nSendSize < SendBufferSize())
+                {
+                    if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete()))
                     {
-                        if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete()))
-                        {
-                            fSleep = false;
-                        }
+                        fMore = true;
                     }
                 }
             }
@@ -1458,19 +2047,12 @@ void ThreadMessageHandler()
             {
                 TRY_LOCK(pnode->cs_vSend, lockSend);
                 if (lockSend)
-                    g_signals.SendMessages(pnode, pnode == pnodeTrickle || pnode->fWhitelisted);
+                    g_signals.SendMessages(pnode, fTrickle || pnode->fWhitelisted);
             }
             boost::this_thread::interruption_point();
         }
 
-        {
-            LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
-                pnode->Release();
-        }
-
-        if (fSleep)
-            MilliSleep(100);
+        messageScheduler.Done(pnode, fMore && !pnode->fDisconnect);
     }
 }
 
@@ -1663,7 +2245,12 @@ void StartNode(boost::thread_group& threadGroup)
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "opencon", &ThreadOpenConnections));
 
     // Process messages
+    int nMessageHandlers = GetArg("-msghandthreads", DEFAULT_MSGHAND_THREADS);
+    nMessageHandlers = std::max(std::min(nMessageHandlers, MAX_MSGHAND_THREADS), 1);
+    LogPrintf("Using %d message handler threads\n", nMessageHandlers);
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msghand", &ThreadMessageHandler));
+    for (int i = 0; i < nMessageHandlers; i++)
+        threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msgworker", &ThreadMessageWorker));
 
     // Dump network addresses
     threadGroup.create_thread(boost::bind(&LoopForever<void (*)()>, "dumpaddr", &DumpAddresses, DUMP_ADDRESSES_INTERVAL * 1000));
@@ -1710,6 +2297,17 @@ public:
         vNodes.clear();
         vNodesDisconnected.clear();
         vhListenSocket.clear();
+#ifdef HAVE_SYS_EPOLL_H
+        if (epollSocketEvents != -1)
+            close(epollSocketEvents);
+        epollSocketEvents = -1;
+#endif
+#ifndef WIN32
+        for (int i = 0; i < 2; i++)
+            if (pipeSocketWakeup[i] != -1)
+                close(pipeSocketWakeup[i]);
+        pipeSocketWakeup[0] = pipeSocketWakeup[1] = -1;
+#endif
         delete semOutbound;
         semOutbound = NULL;
         delete pnodeLocalHost;
@@ -1729,6 +2327,79 @@ instance_of_cnetcleanup;
 
 
 
+CRelayCache relayCache;
+
+CRelayCache::CRelayCache() : nBytes(0), nMaxBytes(DEFAULT_RELAY_CACHE_SIZE * 1000000), nHits(0), nMisses(0)
+{
+}
+
+// Approximate memory used by an entry, including the list and map nodes
+static size_t RelayCacheEntryUsage(const CSerializedNetMsg& msg)
+{
+    return msg->capacity() + 128;
+}
+
+// requires LOCK(cs)
+void CRelayCache::Trim()
+{
+    while (nBytes > nMaxBytes && !listEntries.empty()) {
+        nBytes -= RelayCacheEntryUsage(listEntries.back().second);
+        mapEntries.erase(listEntries.back().first);
+        listEntries.pop_back();
+    }
+}
+
+void CRelayCache::SetMaxSize(size_t nMaxBytesIn)
+{
+    LOCK(cs);
+    nMaxBytes = nMaxBytesIn;
+    Trim();
+}
+
+CSerializedNetMsg CRelayCache::Get(const CInv& inv)
+{
+    LOCK(cs);
+    std::map<CInv, entry_list::iterator>::iterator it = mapEntries.find(inv);
+    if (it == mapEntries.end()) {
+        nMisses++;
+        return CSerializedNetMsg();
+    }
+    nHits++;
+    listEntries.splice(listEntries.begin(), listEntries, it->second);
+    return it->second->second;
+}
+
+void CRelayCache::Insert(const CInv& inv, const CSerializedNetMsg& msg)
+{
+    size_t nUsage = RelayCacheEntryUsage(msg);
+    LOCK(cs);
+    // Don't let one oversized entry flush everything else
+    if (nUsage > nMaxBytes / 2)
+        return;
+    std::map<CInv, entry_list::iterator>::iterator it = mapEntries.find(inv);
+    if (it != mapEntries.end()) {
+        // Keep the original serialization, as mapRelay does
+        listEntries.splice(listEntries.begin(), listEntries, it->second);
+        return;
+    }
+    listEntries.push_front(std::make_pair(inv, msg));
+    mapEntries.insert(std::make_pair(inv, listEntries.begin()));
+    nBytes += nUsage;
+    Trim();
+}
+
+CRelayCacheStats CRelayCache::GetStats() const
+{
+    LOCK(cs);
+    CRelayCacheStats stats;
+    stats.nEntries = mapEntries.size();
+    stats.nBytes = nBytes;
+    stats.nMaxBytes = nMaxBytes;
+    stats.nHits = nHits;
+    stats.nMisses = nMisses;
+    return stats;
+}
+
 void RelayTransaction(const CTransaction& tx)
 {
     CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
@@ -1953,6 +2624,8 @@ CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fIn
     fSuccessfullyConnected = false;
     fDisconnect = false;
     nRefCount = 0;
+    nMessageHandlerState = 0;
+    fMessageHandlerTrickle = false;
     nSendSize = 0;
     nSendOffset = 0;
     hashContinue = 0;
@@ -2040,6 +2713,71 @@ void CNode::AbortMessage() UNLOCK_FUNCTION(cs_vSend)
     LogPrint("net", "(aborted)\n");
 }
 
+CSerializedNetMsg FinalizeNetMessage(CDataStream& ss)
+{
+    // Set the size
+    unsigned int nSize = ss.size() - CMessageHeader::HEADER_SIZE;
+    memcpy((char*)&ss[CMessageHeader::MESSAGE_SIZE_OFFSET], &nSize, sizeof(nSize));
+
+    // Set the checksum
+    uint256 hash = Hash(ss.begin() + CMessageHeader::HEADER_SIZE, ss.end());
+    unsigned int nChecksum = 0;
+    memcpy(&nChecksum, &hash, sizeof(nChecksum));
+    assert(ss.size () >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
+    memcpy((char*)&ss[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
+
+    boost::shared_ptr<CSerializeData> msg(new CSerializeData());
+    ss.GetAndClear(*msg);
+    return msg;
+}
+
+// requires LOCK(cs_vSend)
+void CNode::QueueSendMsg(const CSerializedNetMsg& msg)
+{
+    vSendMsg.push_back(msg);
+    nSendSize += msg->size();
+
+    // If write queue empty, attempt "optimistic write"
+    if (vSendMsg.size() == 1) {
+        SocketSendData(this);
+        // With epoll the socket reports writable again once it has room; select()
+        // has to be woken to start watching it.
+        if (!vSendMsg.empty() && !fSocketEventsEpoll)
+            WakeSocketHandler();
+    }
+}
+
+void CNode::PushSerializedMessage(const CSerializedNetMsg& msg)
+{
+    assert(msg->size() >= CMessageHeader::HEADER_SIZE);
+    LOCK(cs_vSend);
+    LogPrint("net", "sending: %s (%d bytes, shared) peer=%d\n",
+        SanitizeString(std::string(&(*msg)[MESSAGE_START_SIZE], CMessageHeader::COMMAND_SIZE)),
+        msg->size() - CMessageHeader::HEADER_SIZE, id);
+    QueueSendMsg(msg);
+}
+
+bool CNode::PushCachedMessage(const CInv& inv)
+{
+    CSerializedNetMsg msg = relayCache.Get(inv);
+    if (!msg) {
+        if (inv.type != MSG_TX)
+            return false;
+        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+        {
+            LOCK(cs_mapRelay);
+            map<CInv, CDataStream>::iterator mi = mapRelay.find(inv);
+            if (mi == mapRelay.end())
+                return false;
+            ss = mi->second;
+        }
+        msg = SerializeNetMessage("tx", ss);
+        relayCache.Insert(inv, msg);
+    }
+    PushSerializedMessage(msg);
+    return true;
+}
+
 void CNode::EndMessage() UNLOCK_FUNCTION(cs_vSend)
 {
     // The -*messagestest options are intentionally not documented in the help message,
@@ -2057,26 +2795,12 @@ void CNode::EndMessage() UNLOCK_FUNCTION(cs_vSend)
     if (ssSend.size() == 0)
         return;
 
-    // Set the size
     unsigned int nSize = ssSend.size() - CMessageHeader::HEADER_SIZE;
-    memcpy((char*)&ssSend[CMessageHeader::MESSAGE_SIZE_OFFSET], &nSize, sizeof(nSize));
-
-    // Set the checksum
-    uint256 hash = Hash(ssSend.begin() + CMessageHeader::HEADER_SIZE, ssSend.end());
-    unsigned int nChecksum = 0;
-    memcpy(&nChecksum, &hash, sizeof(nChecksum));
-    assert(ssSend.size () >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
-    memcpy((char*)&ssSend[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
+    CSerializedNetMsg msg = FinalizeNetMessage(ssSend);
 
     LogPrint("net", "(%d bytes) peer=%d\n", nSize, id);
 
-    std::deque<CSerializeData>::iterator it = vSendMsg.insert(vSendMsg.end(), CSerializeData());
-    ssSend.GetAndClear(*it);
-    nSendSize += (*it).size();
-
-    // If write queue empty, attempt "optimistic write"
-    if (it == vSendMsg.begin())
-        SocketSendData(this);
+    QueueSendMsg(msg);
 
     LEAVE_CRITICAL_SECTION(cs_vSend);
 }
@@ -20,6 +20,7 @@
 #include "utilstrencodings.h"
 
 #include <deque>
+#include <list>
 #include <stdint.h>
 
 #ifndef WIN32
@@ -28,6 +29,7 @@
 
 #include <boost/filesystem/path.hpp>
 #include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/signals2/signal.hpp>
 
 class CAddrMan;
@@ -58,9 +60,17 @@ static const bool DEFAULT_UPNP = false;
 #endif
 /** The maximum number of entries in mapAskFor */
 static const size_t MAPASKFOR_MAX_SZ = MAX_INV_SZ;
+/** Memory for serialized blocks and transactions shared between peers, in MB */
+static const unsigned int DEFAULT_RELAY_CACHE_SIZE = 64;
+/** -msghandthreads default: number of threads processing peer messages */
+static const int DEFAULT_MSGHAND_THREADS = 4;
+/** Maximum number of message handler threads */
+static const int MAX_MSGHAND_THREADS = 16;
 
 unsigned int ReceiveFloodSize();
 unsigned int SendBufferSize();
+/** Queue a peer for the message handler threads, e.g. because a complete message arrived for it */
+void ScheduleMessageHandler(CNode* pnode, bool fTrickle = false);
 
 void AddOneShot(std::string strDest);
 bool RecvLine(SOCKET hSocket, std::string& strLine);
@@ -76,9 +86,16 @@ bool BindListenPort(const CService &bindAddr, std::string& strError, bool fWhite
 void StartNode(boost::thread_group& threadGroup);
 bool StopNode();
 void SocketSendData(CNode *pnode);
+/** Whether this build can wait for socket readiness with epoll (-socketevents=epoll) */
+bool HaveSocketEventsEpoll();
+/** Set up the socket readiness backend selected by fSocketEventsEpoll, falling back to select() if epoll fails */
+void InitSocketEvents();
 
 typedef int NodeId;
 
+/** A complete serialized network message, shared by the send queues of every peer it is pushed to */
+typedef boost::shared_ptr<const CSerializeData> CSerializedNetMsg;
+
 // Signals for message handling
 struct CNodeSignals
 {
@@ -126,6 +143,8 @@ extern uint64_t nLocalServices;
 extern uint64_t nLocalHostNonce;
 extern CAddrMan addrman;
 extern int nMaxConnections;
+/** Whether the socket thread uses epoll rather than select(), set from -socketevents */
+extern bool fSocketEventsEpoll;
 
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
@@ -176,23 +195,24 @@ class CNetMessage {
 public:
     bool in_data;                   // parsing header (false) or data (true)
 
-    CDataStream hdrbuf;             // partially received header
+    char hdrbuf[CMessageHeader::HEADER_SIZE]; // partially received header
     CMessageHeader hdr;             // complete header
     unsigned int nHdrPos;
 
-    CDataStream vRecv;              // received message data
+    CDataStream vRecv;              // received message data, in a buffer recycled between messages
     unsigned int nDataPos;
 
     int64_t nTime;                  // time (in microseconds) of message receipt.
 
-    CNetMessage(int nTypeIn, int nVersionIn) : hdrbuf(nTypeIn, nVersionIn), vRecv(nTypeIn, nVersionIn) {
-        hdrbuf.resize(24);
+    CNetMessage(int nTypeIn, int nVersionIn) : vRecv(nTypeIn, nVersionIn) {
         in_data = false;
         nHdrPos = 0;
         nDataPos = 0;
         nTime = 0;
     }
 
+    ~CNetMessage();
+
     bool complete() const
     {
         if (!in_data)
@@ -202,12 +222,16 @@ public:
 
     void SetVersion(int nVersionIn)
     {
-        hdrbuf.SetVersion(nVersionIn);
         vRecv.SetVersion(nVersionIn);
     }
 
     int readHeader(const char *pch, unsigned int nBytes);
     int readData(const char *pch, unsigned int nBytes);
+
+    /** Room in vRecv for the next payload bytes, so they can be received without an intermediate copy */
+    char* GetDataBuffer(unsigned int& nSpace);
+    /** Account for nBytes of payload written to the space returned by GetDataBuffer() */
+    void DataReceived(unsigned int nBytes);
 };
 
 
@@ -225,7 +249,7 @@ public:
     size_t nSendSize; // total size of all vSendMsg entries
     size_t nSendOffset; // offset inside the first vSendMsg already sent
     uint64_t nSendBytes;
-    std::deque<CSerializeData> vSendMsg;
+    std::deque<CSerializedNetMsg> vSendMsg;
     CCriticalSection cs_vSend;
 
     std::deque<CInv> vRecvGetData;
@@ -263,6 +287,9 @@ public:
     CBloomFilter* pfilter;
     int nRefCount;
     NodeId id;
+    // Scheduling state for the message handler threads; protected by the scheduler's lock
+    int nMessageHandlerState;
+    bool fMessageHandlerTrickle;
 protected:
 
     // Denial-of-service detection/prevention
@@ -278,6 +305,9 @@ protected:
     // Basic fuzz-testing
     void Fuzz(int nChance); // modifies ssSend
 
+    // requires LOCK(cs_vSend)
+    void QueueSendMsg(const CSerializedNetMsg& msg);
+
 public:
     uint256 hashContinue;
     int nStartingHeight;
@@ -341,6 +371,14 @@ public:
     // requires LOCK(cs_vRecvMsg)
     bool ReceiveMsgBytes(const char *pch, unsigned int nBytes);
 
+    // requires LOCK(cs_vRecvMsg)
+    /** Space in the payload of the message being received, or NULL if the next bytes start a header */
+    char* GetRecvDataBuffer(unsigned int& nSpace);
+
+    // requires LOCK(cs_vRecvMsg)
+    /** Account for nBytes received into the space returned by GetRecvDataBuffer() */
+    void ReceivedMsgData(unsigned int nBytes);
+
     // requires LOCK(cs_vRecvMsg)
     void SetRecvVersion(int nVersionIn)
     {
@@ -397,6 +435,9 @@ public:
             if (!setInventoryKnown.count(inv))
                 vInventoryToSend.push_back(inv);
         }
+        // Blocks are announced without trickling, so don't wait for the next pass over all peers
+        if (inv.type == MSG_BLOCK)
+            ScheduleMessageHandler(this);
     }
 
     void AskFor(const CInv& inv);
@@ -410,6 +451,16 @@ public:
     // TODO: Document the precondition of this function.  Is cs_vSend locked?
     void EndMessage() UNLOCK_FUNCTION(cs_vSend);
 
+    /** Queue a message that was serialized once for any number of peers; see SerializeNetMessage() */
+    void PushSerializedMessage(const CSerializedNetMsg& msg);
+
+    /**
+     * Answer a getdata for inv from the relay cache, serializing a relayed
+     * transaction from mapRelay into the cache on first request. Returns false
+     * if inv is neither cached nor in mapRelay.
+     */
+    bool PushCachedMessage(const CInv& inv);
+
     void PushVersion();
 
 
@@ -608,6 +659,67 @@ public:
 
 
 
+/** Fill in the size and checksum of a message header at the start of ss, followed by the payload, and take the result */
+CSerializedNetMsg FinalizeNetMessage(CDataStream& ss);
+
+/** Serialize a complete message once, to push it to any number of peers with CNode::PushSerializedMessage() */
+template<typename T>
+CSerializedNetMsg SerializeNetMessage(const char* pszCommand, const T& obj)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << CMessageHeader(pszCommand, 0) << obj;
+    return FinalizeNetMessage(ss);
+}
+
+/** Counters of a CRelayCache */
+struct CRelayCacheStats
+{
+    size_t nEntries;
+    size_t nBytes;
+    size_t nMaxBytes;
+    uint64_t nHits;
+    uint64_t nMisses;
+};
+
+/**
+ * Recently requested relay messages, complete and serialized, keyed by
+ * inventory. Entries are only made by CNode::PushCachedMessage(), so
+ * transactions no peer asks for are never serialized twice. An entry is shared with the send queue of every peer it
+ * is pushed to, so serving it to many peers serializes it once and copies it
+ * never. The least recently used entries are dropped once the cache exceeds
+ * its budget; peers still sending one keep it alive until they are done.
+ *
+ * Nothing calls PushCachedMessage() until the getdata handler in main.cpp
+ * does, so there is no -relaycachesize option or getnettotals report yet:
+ * both would only ever show an empty cache.
+ */
+class CRelayCache
+{
+private:
+    typedef std::list<std::pair<CInv, CSerializedNetMsg> > entry_list;
+
+    mutable CCriticalSection cs;
+    entry_list listEntries; // most recently used first
+    std::map<CInv, entry_list::iterator> mapEntries;
+    size_t nBytes;
+    size_t nMaxBytes;
+    uint64_t nHits;
+    uint64_t nMisses;
+
+    void Trim();
+
+public:
+    CRelayCache();
+
+    void SetMaxSize(size_t nMaxBytesIn);
+    /** The cached message for inv, or an empty pointer if it isn't cached */
+    CSerializedNetMsg Get(const CInv& inv);
+    void Insert(const CInv& inv, const CSerializedNetMsg& msg);
+    CRelayCacheStats GetStats() const;
+};
+
+extern CRelayCache relayCache;
+
 class CTransaction;
 void RelayTransaction(const CTransaction& tx);
 void RelayTransaction(const CTransaction& tx, const CDataStream& ss);
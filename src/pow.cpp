@@ -11,6 +11,8 @@
 #include "uint256.h"
 #include "util.h"
 
+#include <limits>
+
 unsigned int static GetNextWorkRequired_V0(const CBlockIndex* pindexLast, const CBlockHeader *pblock)
 {
 
@@ -481,3 +483,20 @@ uint256 GetBlockProof(const CBlockIndex& block)
     // or ~bnTarget / (nTarget+1) + 1.
     return (~bnTarget / (bnTarget + 1)) + 1;
 }
+
+int64_t GetBlockProofEquivalentTime(const CBlockIndex& to, const CBlockIndex& from, const CBlockIndex& tip)
+{
+    uint256 r;
+    int sign = 1;
+    if (to.nChainWork > from.nChainWork) {
+        r = to.nChainWork - from.nChainWork;
+    } else {
+        r = from.nChainWork - to.nChainWork;
+        sign = -1;
+    }
+    r = r * uint256(Params().TargetSpacing()) / GetBlockProof(tip);
+    if (r.bits() > 63) {
+        return sign * std::numeric_limits<int64_t>::max();
+    }
+    return sign * (int64_t)r.GetLow64();
+}
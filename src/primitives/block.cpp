@@ -9,9 +9,84 @@
 #include "tinyformat.h"
 #include "utilstrencodings.h"
 
+#include <string.h>
+
+#include <boost/thread/mutex.hpp>
+
+/**
+ * Locks for the hash caches, picked by header address so that a cache hit
+ * costs one uncontended lock and no global one. Each stripe counts its own
+ * hits under its lock.
+ */
+struct CHashCacheStripe
+{
+    boost::mutex mutex;
+    uint64_t nHits;
+    // Keep the stripes on separate cache lines
+    char pad[64];
+
+    CHashCacheStripe() : nHits(0) {}
+};
+
+static const unsigned int HASH_CACHE_STRIPES = 64;
+
+static CHashCacheStripe* GetHashCacheStripes()
+{
+    // Headers are hashed during static initialization (the genesis blocks in
+    // chainparams), so this cannot be a namespace-scope static
+    static CHashCacheStripe* stripes = new CHashCacheStripe[HASH_CACHE_STRIPES];
+    return stripes;
+}
+
+static CHashCacheStripe& GetHashCacheStripe(const CBlockHeader* pheader)
+{
+    return GetHashCacheStripes()[((size_t)pheader / sizeof(CBlockHeader)) % HASH_CACHE_STRIPES];
+}
+
+CBlockHeader& CBlockHeader::operator=(const CBlockHeader& other)
+{
+    if (this == &other)
+        return *this;
+    nVersion = other.nVersion;
+    hashPrevBlock = other.hashPrevBlock;
+    hashMerkleRoot = other.hashMerkleRoot;
+    nTime = other.nTime;
+    nBits = other.nBits;
+    nNonce = other.nNonce;
+
+    boost::mutex::scoped_lock lock(GetHashCacheStripe(&other).mutex);
+    fHashCached = other.fHashCached;
+    if (fHashCached) {
+        memcpy(vchHashedHeader, other.vchHashedHeader, sizeof(vchHashedHeader));
+        hashCached = other.hashCached;
+    }
+    return *this;
+}
+
 uint256 CBlockHeader::GetHash() const
 {
-    return bthhash(BEGIN(nVersion), END(nNonce));
+    const unsigned char* pbegin = (const unsigned char*)BEGIN(nVersion);
+    const unsigned char* pend = (const unsigned char*)END(nNonce);
+    assert(pend - pbegin == sizeof(vchHashedHeader));
+    CHashCacheStripe& stripe = GetHashCacheStripe(this);
+    {
+        boost::mutex::scoped_lock lock(stripe.mutex);
+        if (fHashCached && memcmp(vchHashedHeader, pbegin, sizeof(vchHashedHeader)) == 0) {
+            stripe.nHits++;
+            return hashCached;
+        }
+    }
+
+    // Hash outside the lock, and remember exactly the bytes that were hashed
+    unsigned char vchHeader[sizeof(vchHashedHeader)];
+    memcpy(vchHeader, pbegin, sizeof(vchHeader));
+    uint256 hash = bthhash(vchHeader, vchHeader + sizeof(vchHeader));
+
+    boost::mutex::scoped_lock lock(stripe.mutex);
+    memcpy(vchHashedHeader, vchHeader, sizeof(vchHashedHeader));
+    hashCached = hash;
+    fHashCached = true;
+    return hash;
     //uint256 thash;
     //quarkhash(BEGIN(nVersion), BEGIN(thash));
     //return thash;
@@ -28,6 +103,25 @@ uint256 CBlockHeader::GetPoWHash() const
     return GetHash();
 }
 
+void CBlockHeader::SetCachedHash(const uint256& hash) const
+{
+    boost::mutex::scoped_lock lock(GetHashCacheStripe(this).mutex);
+    memcpy(vchHashedHeader, BEGIN(nVersion), sizeof(vchHashedHeader));
+    hashCached = hash;
+    fHashCached = true;
+}
+
+uint64_t CBlockHeader::GetHashCacheHits()
+{
+    uint64_t nHits = 0;
+    CHashCacheStripe* stripes = GetHashCacheStripes();
+    for (unsigned int i = 0; i < HASH_CACHE_STRIPES; i++) {
+        boost::mutex::scoped_lock lock(stripes[i].mutex);
+        nHits += stripes[i].nHits;
+    }
+    return nHits;
+}
+
 uint256 CBlock::BuildMerkleTree(bool* fMutated) const
 {
     /* WARNING! If you're reading this because you're learning about crypto
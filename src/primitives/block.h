@@ -32,11 +32,30 @@ public:
     uint32_t nBits;
     uint32_t nNonce;
 
+private:
+    // memory only: the last computed hash and the header bytes it was computed
+    // from. The header fields are public and written to directly, so instead
+    // of invalidating on every write, GetHash() compares the current header
+    // against the bytes that were hashed. Const headers are shared between
+    // threads, so these are only accessed under the lock GetHash() picks for
+    // the header's address.
+    mutable bool fHashCached;
+    mutable unsigned char vchHashedHeader[80];
+    mutable uint256 hashCached;
+
+public:
     CBlockHeader()
     {
         SetNull();
     }
 
+    CBlockHeader(const CBlockHeader& other) : fHashCached(false)
+    {
+        *this = other;
+    }
+
+    CBlockHeader& operator=(const CBlockHeader& other);
+
     ADD_SERIALIZE_METHODS;
 
     template <typename Stream, typename Operation>
@@ -58,6 +77,7 @@ public:
         nTime = 0;
         nBits = 0;
         nNonce = 0;
+        fHashCached = false;
     }
 
     bool IsNull() const
@@ -65,10 +85,21 @@ public:
         return (nBits == 0);
     }
 
+    /** Return the bthhash of this header, reusing the last result if no field changed since. */
     uint256 GetHash() const;
 
     uint256 GetPoWHash() const;
 
+    /**
+     * Remember hash as the bthhash of the current header fields, for callers
+     * that computed it elsewhere (e.g. several headers at once with
+     * bthhash_batch). The next GetHash() returns it without hashing again.
+     */
+    void SetCachedHash(const uint256& hash) const;
+
+    /** Number of GetHash() calls, across all headers, answered from the cache. */
+    static uint64_t GetHashCacheHits();
+
     int64_t GetBlockTime() const
     {
         return (int64_t)nTime;
@@ -113,14 +144,8 @@ public:
 
     CBlockHeader GetBlockHeader() const
     {
-        CBlockHeader block;
-        block.nVersion       = nVersion;
-        block.hashPrevBlock  = hashPrevBlock;
-        block.hashMerkleRoot = hashMerkleRoot;
-        block.nTime          = nTime;
-        block.nBits          = nBits;
-        block.nNonce         = nNonce;
-        return block;
+        // Copy the header fields along with the cached hash.
+        return *this;
     }
 
     // Build the in-memory merkle tree for this block and return the merkle root.
@@ -66,6 +66,11 @@ public:
 /** nServices flags */
 enum {
     NODE_NETWORK = (1 << 0),
+    // NODE_COMPACT_BLOCKS means the node can serve blocks as short
+    // transaction IDs (cmpctblock) and answer getblocktxn requests. Nodes
+    // advertising it must also use at least COMPACT_BLOCKS_VERSION. Not set
+    // until the message handlers exist.
+    NODE_COMPACT_BLOCKS = (1 << 1),
 
     // Bits 24-31 are reserved for temporary experiments. Just pick a bit that
     // isn't getting used, or one not being used much, and notify the
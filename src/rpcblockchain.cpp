@@ -7,10 +7,13 @@
 #include "main.h"
 #include "rpcserver.h"
 #include "sync.h"
+#include "txdb.h"
 #include "util.h"
 
 #include <stdint.h>
 
+#include <boost/filesystem.hpp>
+
 #include "json/json_spirit_value.h"
 
 using namespace json_spirit;
@@ -181,10 +184,9 @@ Value getrawmempool(const Array& params, bool fHelp)
     {
         LOCK(mempool.cs);
         Object o;
-        BOOST_FOREACH(const PAIRTYPE(uint256, CTxMemPoolEntry)& entry, mempool.mapTx)
+        BOOST_FOREACH(const CTxMemPoolEntry& e, mempool.mapTx)
         {
-            const uint256& hash = entry.first;
-            const CTxMemPoolEntry& e = entry.second;
+            const uint256& hash = e.GetTx().GetHash();
             Object info;
             info.push_back(Pair("size", (int)e.GetTxSize()));
             info.push_back(Pair("fee", ValueFromAmount(e.GetFee())));
@@ -342,6 +344,145 @@ Value gettxoutsetinfo(const Array& params, bool fHelp)
     return ret;
 }
 
+//! Directory loadtxoutset builds the coin database in
+static const char* SNAPSHOT_CHAINSTATE_DIR = "chainstate_snapshot";
+
+//! Only one snapshot dump or load at a time
+static CCriticalSection cs_snapshot;
+
+static boost::filesystem::path SnapshotPath(const std::string& strPath)
+{
+    boost::filesystem::path path(strPath);
+    if (!path.is_complete())
+        path = GetDataDir() / path;
+    return path;
+}
+
+static Object SnapshotStatsToJSON(const CCoinsStats& stats)
+{
+    Object ret;
+    ret.push_back(Pair("height", (int64_t)stats.nHeight));
+    ret.push_back(Pair("bestblock", stats.hashBlock.GetHex()));
+    ret.push_back(Pair("transactions", (int64_t)stats.nTransactions));
+    ret.push_back(Pair("txouts", (int64_t)stats.nTransactionOutputs));
+    ret.push_back(Pair("bytes_serialized", (int64_t)stats.nSerializedSize));
+    ret.push_back(Pair("hash_serialized", stats.hashSerialized.GetHex()));
+    ret.push_back(Pair("total_amount", ValueFromAmount(stats.nTotalAmount)));
+    return ret;
+}
+
+Value dumptxoutset(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "dumptxoutset \"path\"\n"
+            "\nWrite the unspent transaction output set to a snapshot file.\n"
+            "Note this call may take some time.\n"
+            "\nArguments:\n"
+            "1. \"path\"     (string, required) The file to create, relative to the data directory unless absolute\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"path\": \"path\",         (string) The file written\n"
+            "  \"height\":n,             (numeric) The height of the block the snapshot was taken at\n"
+            "  \"bestblock\": \"hex\",     (string) the hash of that block\n"
+            "  \"transactions\": n,      (numeric) The number of transactions\n"
+            "  \"txouts\": n,            (numeric) The number of output transactions\n"
+            "  \"bytes_serialized\": n,  (numeric) The serialized size\n"
+            "  \"hash_serialized\": \"hash\",   (string) The serialized hash, as in gettxoutsetinfo\n"
+            "  \"total_amount\": x.xxx          (numeric) The total amount\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("dumptxoutset", "\"utxo.dat\"")
+            + HelpExampleRpc("dumptxoutset", "\"utxo.dat\"")
+        );
+
+    TRY_LOCK(cs_snapshot, lockSnapshot);
+    if (!lockSnapshot)
+        throw JSONRPCError(RPC_MISC_ERROR, "Another snapshot dump or load is in progress");
+
+    boost::filesystem::path path = SnapshotPath(params[0].get_str());
+    if (boost::filesystem::exists(path))
+        throw JSONRPCError(RPC_INVALID_PARAMETER, path.string() + " already exists");
+    // Write under a temporary name so a partial file is never mistaken for a snapshot
+    boost::filesystem::path pathTmp = path;
+    pathTmp += ".incomplete";
+
+    FlushStateToDisk();
+
+    CCoinsStats stats;
+    {
+        CAutoFile fileout(fopen(pathTmp.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+        if (fileout.IsNull())
+            throw JSONRPCError(RPC_MISC_ERROR, "Unable to open " + pathTmp.string() + " for writing");
+        if (!pcoinsdbview->DumpSnapshot(fileout, stats)) {
+            fileout.fclose();
+            boost::filesystem::remove(pathTmp);
+            throw JSONRPCError(RPC_INTERNAL_ERROR, "Failed to write the snapshot, see debug.log");
+        }
+        FileCommit(fileout.Get());
+    }
+    RenameOver(pathTmp, path);
+
+    Object ret = SnapshotStatsToJSON(stats);
+    ret.insert(ret.begin(), Pair("path", path.string()));
+    return ret;
+}
+
+Value loadtxoutset(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "loadtxoutset \"path\"\n"
+            "\nBuild a fresh coin database from a dumptxoutset snapshot file.\n"
+            "The database is written to the chainstate_snapshot directory in the data directory, replacing\n"
+            "any earlier one, and is kept only if the snapshot matches its checksum.\n"
+            "Note this call may take some time.\n"
+            "\nArguments:\n"
+            "1. \"path\"     (string, required) The snapshot file, relative to the data directory unless absolute\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"path\": \"path\",         (string) The coin database directory\n"
+            "  \"height\":n,             (numeric) The height of the block the snapshot was taken at\n"
+            "  \"bestblock\": \"hex\",     (string) the hash of that block\n"
+            "  \"transactions\": n,      (numeric) The number of transactions\n"
+            "  \"txouts\": n,            (numeric) The number of output transactions\n"
+            "  \"bytes_serialized\": n,  (numeric) The serialized size\n"
+            "  \"hash_serialized\": \"hash\",   (string) The serialized hash, as in gettxoutsetinfo\n"
+            "  \"total_amount\": x.xxx          (numeric) The total amount\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("loadtxoutset", "\"utxo.dat\"")
+            + HelpExampleRpc("loadtxoutset", "\"utxo.dat\"")
+        );
+
+    TRY_LOCK(cs_snapshot, lockSnapshot);
+    if (!lockSnapshot)
+        throw JSONRPCError(RPC_MISC_ERROR, "Another snapshot dump or load is in progress");
+
+    boost::filesystem::path path = SnapshotPath(params[0].get_str());
+    CAutoFile filein(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull())
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Unable to open " + path.string());
+
+    boost::filesystem::path pathDB = GetDataDir() / SNAPSHOT_CHAINSTATE_DIR;
+    CCoinsSnapshotHeader header;
+    CCoinsStats stats;
+    bool fLoaded;
+    {
+        CCoinsViewDB viewSnapshot(pathDB, nDefaultDbCache << 20, false, true);
+        fLoaded = viewSnapshot.LoadSnapshot(filein, header, stats);
+    }
+    if (!fLoaded) {
+        boost::filesystem::remove_all(pathDB);
+        throw JSONRPCError(RPC_DESERIALIZATION_ERROR, "Invalid snapshot, see debug.log");
+    }
+    LogPrintf("Loaded UTXO snapshot at height %d (%s) into %s\n", stats.nHeight, stats.hashBlock.ToString(), pathDB.string());
+
+    Object ret = SnapshotStatsToJSON(stats);
+    ret.insert(ret.begin(), Pair("path", pathDB.string()));
+    return ret;
+}
+
 Value gettxout(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() < 2 || params.size() > 3)
@@ -591,6 +732,9 @@ Value getmempoolinfo(const Array& params, bool fHelp)
             "{\n"
             "  \"size\": xxxxx                (numeric) Current tx count\n"
             "  \"bytes\": xxxxx               (numeric) Sum of all tx sizes\n"
+            "  \"usage\": xxxxx               (numeric) Total memory usage for the mempool\n"
+            "  \"maxmempool\": xxxxx          (numeric) Maximum memory usage for the mempool, 0 for no limit\n"
+            "  \"mempoolminfee\": xxxxx       (numeric) Fee rate in LTC/kB a transaction needs since the pool was last trimmed, 0 if only the relay minimum applies\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("getmempoolinfo", "")
@@ -600,6 +744,44 @@ Value getmempoolinfo(const Array& params, bool fHelp)
     Object ret;
     ret.push_back(Pair("size", (int64_t) mempool.size()));
     ret.push_back(Pair("bytes", (int64_t) mempool.GetTotalTxSize()));
+    ret.push_back(Pair("usage", (int64_t) mempool.DynamicMemoryUsage()));
+    ret.push_back(Pair("maxmempool", (int64_t) mempool.GetMaxUsage()));
+    ret.push_back(Pair("mempoolminfee", ValueFromAmount(mempool.GetMinFee().GetFeePerK())));
+
+    return ret;
+}
+
+Value getcoinscacheinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getcoinscacheinfo\n"
+            "\nReturns details on the in-memory cache of the UTXO set.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"entries\": xxxxx             (numeric) Transactions with cached outputs\n"
+            "  \"usage\": xxxxx               (numeric) Total memory usage for the cache\n"
+            "  \"maxusage\": xxxxx            (numeric) Memory usage above which the cache is flushed\n"
+            "  \"hits\": xxxxx                (numeric) Lookups answered from the cache\n"
+            "  \"misses\": xxxxx              (numeric) Lookups that went to the database\n"
+            "  \"hitrate\": x.xxx             (numeric) Fraction of lookups answered from the cache\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getcoinscacheinfo", "")
+            + HelpExampleRpc("getcoinscacheinfo", "")
+        );
+
+    LOCK(cs_main);
+
+    uint64_t nHits = pcoinsTip->GetCacheHits();
+    uint64_t nMisses = pcoinsTip->GetCacheMisses();
+    Object ret;
+    ret.push_back(Pair("entries", (int64_t) pcoinsTip->GetCacheSize()));
+    ret.push_back(Pair("usage", (int64_t) pcoinsTip->DynamicMemoryUsage()));
+    ret.push_back(Pair("maxusage", (int64_t) pcoinsTip->GetMaxUsage()));
+    ret.push_back(Pair("hits", (int64_t) nHits));
+    ret.push_back(Pair("misses", (int64_t) nMisses));
+    ret.push_back(Pair("hitrate", nHits + nMisses > 0 ? (double)nHits / (nHits + nMisses) : 0.0));
 
     return ret;
 }
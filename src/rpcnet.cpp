@@ -337,7 +337,7 @@ Value getnettotals(const Array& params, bool fHelp)
             "{\n"
             "  \"totalbytesrecv\": n,   (numeric) Total bytes received\n"
             "  \"totalbytessent\": n,   (numeric) Total bytes sent\n"
-            "  \"timemillis\": t        (numeric) Total cpu time\n"
+            "  \"timemillis\": t,       (numeric) Total cpu time\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("getnettotals", "")
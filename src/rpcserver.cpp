@@ -270,11 +270,14 @@ static const CRPCCommand vRPCCommands[] =
     { "blockchain",         "getblock",               &getblock,               true,      false,      false },
     { "blockchain",         "getblockhash",           &getblockhash,           true,      false,      false },
     { "blockchain",         "getchaintips",           &getchaintips,           true,      false,      false },
+    { "blockchain",         "getcoinscacheinfo",      &getcoinscacheinfo,      true,      false,      false },
     { "blockchain",         "getdifficulty",          &getdifficulty,          true,      false,      false },
     { "blockchain",         "getmempoolinfo",         &getmempoolinfo,         true,      true,       false },
     { "blockchain",         "getrawmempool",          &getrawmempool,          true,      false,      false },
     { "blockchain",         "gettxout",               &gettxout,               true,      false,      false },
     { "blockchain",         "gettxoutsetinfo",        &gettxoutsetinfo,        true,      false,      false },
+    { "blockchain",         "dumptxoutset",           &dumptxoutset,           true,      false,      false },
+    { "blockchain",         "loadtxoutset",           &loadtxoutset,           true,      false,      false },
     { "blockchain",         "verifychain",            &verifychain,            true,      false,      false },
     { "blockchain",         "invalidateblock",        &invalidateblock,        true,      true,       false },
     { "blockchain",         "reconsiderblock",        &reconsiderblock,        true,      true,       false },
@@ -315,6 +318,7 @@ static const CRPCCommand vRPCCommands[] =
 
 #ifdef ENABLE_WALLET
     /* Wallet */
+    { "wallet",             "abortrescan",            &abortrescan,            true,      true,       true },
     { "wallet",             "addmultisigaddress",     &addmultisigaddress,     true,      false,      true },
     { "wallet",             "backupwallet",           &backupwallet,           true,      false,      true },
     { "wallet",             "dumpprivkey",            &dumpprivkey,            true,      false,      true },
@@ -331,9 +335,9 @@ static const CRPCCommand vRPCCommands[] =
     { "wallet",             "gettransaction",         &gettransaction,         false,     false,      true },
     { "wallet",             "getunconfirmedbalance",  &getunconfirmedbalance,  false,     false,      true },
     { "wallet",             "getwalletinfo",          &getwalletinfo,          false,     false,      true },
-    { "wallet",             "importprivkey",          &importprivkey,          true,      false,      true },
-    { "wallet",             "importwallet",           &importwallet,           true,      false,      true },
-    { "wallet",             "importaddress",          &importaddress,          true,      false,      true },
+    { "wallet",             "importprivkey",          &importprivkey,          true,      true,       true },
+    { "wallet",             "importwallet",           &importwallet,           true,      true,       true },
+    { "wallet",             "importaddress",          &importaddress,          true,      true,       true },
     { "wallet",             "keypoolrefill",          &keypoolrefill,          true,      false,      true },
     { "wallet",             "listaccounts",           &listaccounts,           false,     false,      true },
     { "wallet",             "listaddressgroupings",   &listaddressgroupings,   false,     false,      true },
@@ -486,6 +486,31 @@ Value signmessage(const Array& params, bool fHelp)
     return EncodeBase64(&vchSig[0], vchSig.size());
 }
 
+/** Amount paid to scriptPubKey by non-coinbase wallet transactions with at least nMinDepth confirmations */
+static CAmount TallyReceivedByScript(const CScript& scriptPubKey, int nMinDepth)
+{
+    CAmount nAmount = 0;
+    map<CScript, set<uint256> >::const_iterator mi = pwalletMain->GetTxidsByScript().find(scriptPubKey);
+    if (mi == pwalletMain->GetTxidsByScript().end())
+        return 0;
+
+    BOOST_FOREACH(const uint256& hash, mi->second)
+    {
+        map<uint256, CWalletTx>::const_iterator it = pwalletMain->mapWallet.find(hash);
+        if (it == pwalletMain->mapWallet.end())
+            continue;
+        const CWalletTx& wtx = (*it).second;
+        if (wtx.IsCoinBase() || !IsFinalTx(wtx))
+            continue;
+
+        BOOST_FOREACH(const CTxOut& txout, wtx.vout)
+            if (txout.scriptPubKey == scriptPubKey)
+                if (wtx.GetDepthInMainChain() >= nMinDepth)
+                    nAmount += txout.nValue;
+    }
+    return nAmount;
+}
+
 Value getreceivedbyaddress(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() < 1 || params.size() > 2)
@@ -522,18 +547,7 @@ Value getreceivedbyaddress(const Array& params, bool fHelp)
         nMinDepth = params[1].get_int();
 
     // Tally
-    CAmount nAmount = 0;
-    for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); ++it)
-    {
-        const CWalletTx& wtx = (*it).second;
-        if (wtx.IsCoinBase() || !IsFinalTx(wtx))
-            continue;
-
-        BOOST_FOREACH(const CTxOut& txout, wtx.vout)
-            if (txout.scriptPubKey == scriptPubKey)
-                if (wtx.GetDepthInMainChain() >= nMinDepth)
-                    nAmount += txout.nValue;
-    }
+    CAmount nAmount = TallyReceivedByScript(scriptPubKey, nMinDepth);
 
     return  ValueFromAmount(nAmount);
 }
@@ -572,19 +586,11 @@ Value getreceivedbyaccount(const Array& params, bool fHelp)
 
     // Tally
     CAmount nAmount = 0;
-    for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); ++it)
+    for (map<CScript, set<uint256> >::const_iterator it = pwalletMain->GetTxidsByScript().begin(); it != pwalletMain->GetTxidsByScript().end(); ++it)
     {
-        const CWalletTx& wtx = (*it).second;
-        if (wtx.IsCoinBase() || !IsFinalTx(wtx))
-            continue;
-
-        BOOST_FOREACH(const CTxOut& txout, wtx.vout)
-        {
-            CTxDestination address;
-            if (ExtractDestination(txout.scriptPubKey, address) && IsMine(*pwalletMain, address) && setAddress.count(address))
-                if (wtx.GetDepthInMainChain() >= nMinDepth)
-                    nAmount += txout.nValue;
-        }
+        CTxDestination address;
+        if (ExtractDestination(it->first, address) && IsMine(*pwalletMain, address) && setAddress.count(address))
+            nAmount += TallyReceivedByScript(it->first, nMinDepth);
     }
 
     return (double)nAmount / (double)COIN;
@@ -990,33 +996,42 @@ Value ListReceived(const Array& params, bool fByAccounts)
 
     // Tally
     map<CBitcoinAddress, tallyitem> mapTally;
-    for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); ++it)
+    for (map<CScript, set<uint256> >::const_iterator mi = pwalletMain->GetTxidsByScript().begin(); mi != pwalletMain->GetTxidsByScript().end(); ++mi)
     {
-        const CWalletTx& wtx = (*it).second;
-
-        if (wtx.IsCoinBase() || !IsFinalTx(wtx))
+        CTxDestination address;
+        if (!ExtractDestination(mi->first, address))
             continue;
 
-        int nDepth = wtx.GetDepthInMainChain();
-        if (nDepth < nMinDepth)
+        isminefilter mine = IsMine(*pwalletMain, address);
+        if(!(mine & filter))
             continue;
 
-        BOOST_FOREACH(const CTxOut& txout, wtx.vout)
+        BOOST_FOREACH(const uint256& hash, mi->second)
         {
-            CTxDestination address;
-            if (!ExtractDestination(txout.scriptPubKey, address))
+            map<uint256, CWalletTx>::const_iterator it = pwalletMain->mapWallet.find(hash);
+            if (it == pwalletMain->mapWallet.end())
+                continue;
+            const CWalletTx& wtx = (*it).second;
+
+            if (wtx.IsCoinBase() || !IsFinalTx(wtx))
                 continue;
 
-            isminefilter mine = IsMine(*pwalletMain, address);
-            if(!(mine & filter))
+            int nDepth = wtx.GetDepthInMainChain();
+            if (nDepth < nMinDepth)
                 continue;
 
-            tallyitem& item = mapTally[address];
-            item.nAmount += txout.nValue;
-            item.nConf = min(item.nConf, nDepth);
-            item.txids.push_back(wtx.GetHash());
-            if (mine & ISMINE_WATCH_ONLY)
-                item.fIsWatchonly = true;
+            BOOST_FOREACH(const CTxOut& txout, wtx.vout)
+            {
+                if (txout.scriptPubKey != mi->first)
+                    continue;
+
+                tallyitem& item = mapTally[address];
+                item.nAmount += txout.nValue;
+                item.nConf = min(item.nConf, nDepth);
+                item.txids.push_back(wtx.GetHash());
+                if (mine & ISMINE_WATCH_ONLY)
+                    item.fIsWatchonly = true;
+            }
         }
     }
 
@@ -1995,6 +2010,19 @@ Value getwalletinfo(const Array& params, bool fHelp)
             "  \"keypoololdest\": xxxxxx,    (numeric) the timestamp (seconds since GMT epoch) of the oldest pre-generated key in the key pool\n"
             "  \"keypoolsize\": xxxx,        (numeric) how many new keys are pre-generated\n"
             "  \"unlocked_until\": ttt,      (numeric) the timestamp in seconds since epoch (midnight Jan 1 1970 GMT) that the wallet is unlocked for transfers, or 0 if the wallet is locked\n"
+            "  \"scanning\":                 (json object or false) false if no rescan is running\n"
+            "  {\n"
+            "    \"duration\": xxxx,           (numeric) seconds the rescan has been running\n"
+            "    \"height\": xxxx,             (numeric) height of the block being scanned\n"
+            "    \"progress\": x.xxx,          (numeric) fraction of the blocks scanned\n"
+            "  }\n"
+            "  \"lastcoinselection\":        (json object, optional) how the inputs of the last transaction created were selected\n"
+            "  {\n"
+            "    \"algorithm\": \"xxxx\",      (string) exact, all, bnb, approximate, largest, coincontrol, or none if the funds were insufficient\n"
+            "    \"duration\": x.xxx,          (numeric) seconds the selection took\n"
+            "    \"candidates\": xxxx,         (numeric) number of available coins\n"
+            "    \"inputs\": xxxx,             (numeric) number of coins selected\n"
+            "  }\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("getwalletinfo", "")
@@ -2009,5 +2037,45 @@ Value getwalletinfo(const Array& params, bool fHelp)
     obj.push_back(Pair("keypoolsize",   (int)pwalletMain->GetKeyPoolSize()));
     if (pwalletMain->IsCrypted())
         obj.push_back(Pair("unlocked_until", nWalletUnlockTime));
+    CRescanProgress progress = pwalletMain->GetRescanProgress();
+    if (progress.fScanning) {
+        Object scanning;
+        int nBlocks = progress.nStopHeight - progress.nStartHeight + 1;
+        scanning.push_back(Pair("duration", GetTime() - progress.nStartTime));
+        scanning.push_back(Pair("height", progress.nHeight));
+        scanning.push_back(Pair("progress", (double)(progress.nHeight - progress.nStartHeight) / std::max(1, nBlocks)));
+        obj.push_back(Pair("scanning", scanning));
+    } else {
+        obj.push_back(Pair("scanning", false));
+    }
+    CCoinSelectionInfo selection = pwalletMain->GetLastCoinSelection();
+    if (!selection.strAlgorithm.empty()) {
+        Object lastselection;
+        lastselection.push_back(Pair("algorithm", selection.strAlgorithm));
+        lastselection.push_back(Pair("duration", selection.nTimeMicros * 0.000001));
+        lastselection.push_back(Pair("candidates", (int)selection.nCandidates));
+        lastselection.push_back(Pair("inputs", (int)selection.nInputs));
+        obj.push_back(Pair("lastcoinselection", lastselection));
+    }
     return obj;
 }
+
+Value abortrescan(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "abortrescan\n"
+            "\nStops the wallet rescan started by an import call or -rescan, keeping what it found so far.\n"
+            "\nResult:\n"
+            "true|false    (boolean) Whether a rescan was running\n"
+            "\nExamples:\n"
+            "\nImport a private key\n"
+            + HelpExampleCli("importprivkey", "\"mykey\"") +
+            "\nAbort the running wallet rescan\n"
+            + HelpExampleCli("abortrescan", "") +
+            "\nAs a JSON-RPC call\n"
+            + HelpExampleRpc("abortrescan", "")
+        );
+
+    return pwalletMain->AbortRescan();
+}
@@ -5,86 +5,164 @@
 
 #include "sigcache.h"
 
+#include "crypto/common.h"
+#include "crypto/sha256.h"
 #include "pubkey.h"
 #include "random.h"
-#include "uint256.h"
 #include "util.h"
 
-#include <boost/thread.hpp>
-#include <boost/tuple/tuple_comparison.hpp>
+#include <algorithm>
+#include <string.h>
 
-namespace {
+CSignatureCache::CSignatureCache() : nBucketMask(0), nMaxMoves(0)
+{
+    GetRandBytes(nonce, sizeof(nonce));
+}
 
-/**
- * Valid signature cache, to avoid doing expensive ECDSA signature checking
- * twice for every transaction (once when accepted into memory pool, and
- * again when accepted into the block chain)
- */
-class CSignatureCache
+void CSignatureCache::Setup(size_t nBytes)
 {
-private:
-     //! sigdata_type is (signature hash, signature, public key):
-    typedef boost::tuple<uint256, std::vector<unsigned char>, CPubKey> sigdata_type;
-    std::set< sigdata_type> setValid;
-    boost::shared_mutex cs_sigcache;
-
-public:
-    bool
-    Get(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
-    {
-        boost::shared_lock<boost::shared_mutex> lock(cs_sigcache);
-
-        sigdata_type k(hash, vchSig, pubKey);
-        std::set<sigdata_type>::iterator mi = setValid.find(k);
-        if (mi != setValid.end())
-            return true;
-        return false;
+    // Round down to a power of two buckets so bucket indexes are a mask away.
+    size_t nBuckets = 1;
+    nMaxMoves = 1;
+    while (nBuckets * 2 * BUCKET_SIZE * sizeof(uint256) <= nBytes && nBuckets < 0x80000000U) {
+        nBuckets *= 2;
+        nMaxMoves++;
     }
+    nBucketMask = nBuckets - 1;
+    std::vector<uint256>(nBuckets * BUCKET_SIZE).swap(vTable);
+    std::vector<unsigned char>(nBuckets * BUCKET_SIZE, 0).swap(vfErased);
+}
+
+void CSignatureCache::ComputeEntry(uint256& entry, const uint256& hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubkey) const
+{
+    CSHA256().Write(nonce, sizeof(nonce)).Write(hash.begin(), 32).Write(&pubkey[0], pubkey.size()).Write(vchSig.empty() ? NULL : &vchSig[0], vchSig.size()).Finalize(entry.begin());
+}
+
+void CSignatureCache::GetBuckets(const uint256& entry, uint32_t& nBucket1, uint32_t& nBucket2) const
+{
+    nBucket1 = ReadLE32(entry.begin()) & nBucketMask;
+    nBucket2 = ReadLE32(entry.begin() + 4) & nBucketMask;
+    if (nBucket2 == nBucket1)
+        nBucket2 = nBucket1 ^ (1 & nBucketMask);
+}
+
+int CSignatureCache::Find(const uint256& entry, uint32_t nBucket) const
+{
+    const uint256* pslot = &vTable[nBucket * BUCKET_SIZE];
+    const volatile unsigned char* pfErased = &vfErased[nBucket * BUCKET_SIZE];
+    for (unsigned int i = 0; i < BUCKET_SIZE; i++) {
+        if (!pfErased[i] && memcmp(pslot[i].begin(), entry.begin(), 32) == 0)
+            return nBucket * BUCKET_SIZE + i;
+    }
+    return -1;
+}
+
+bool CSignatureCache::Contains(const uint256& entry, bool fErase)
+{
+    if (vTable.empty())
+        return false;
+    uint32_t nBucket1, nBucket2;
+    GetBuckets(entry, nBucket1, nBucket2);
+    boost::shared_lock<boost::shared_mutex> lock(cs_sigcache);
+    int nSlot = Find(entry, nBucket1);
+    if (nSlot < 0)
+        nSlot = Find(entry, nBucket2);
+    if (nSlot < 0)
+        return false;
+    // Erasing only flags the slot, so that it needs no exclusive lock. Two
+    // lookups flagging the same slot both write 1, which is harmless.
+    if (fErase)
+        *(volatile unsigned char*)&vfErased[nSlot] = 1;
+    return true;
+}
 
-    void Set(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
-    {
-        // DoS prevention: limit cache size to less than 10MB
-        // (~200 bytes per cache entry times 50,000 entries)
-        // Since there are a maximum of 20,000 signature operations per block
-        // 50,000 is a reasonable default.
-        int64_t nMaxCacheSize = GetArg("-maxsigcachesize", 50000);
-        if (nMaxCacheSize <= 0) return;
-
-        boost::unique_lock<boost::shared_mutex> lock(cs_sigcache);
-
-        while (static_cast<int64_t>(setValid.size()) > nMaxCacheSize)
-        {
-            // Evict a random entry. Random because that helps
-            // foil would-be DoS attackers who might try to pre-generate
-            // and re-use a set of valid signatures just-slightly-greater
-            // than our cache size.
-            uint256 randomHash = GetRandHash();
-            std::vector<unsigned char> unused;
-            std::set<sigdata_type>::iterator it =
-                setValid.lower_bound(sigdata_type(randomHash, unused, unused));
-            if (it == setValid.end())
-                it = setValid.begin();
-            setValid.erase(*it);
+bool CSignatureCache::IsFree(unsigned int nSlot) const
+{
+    return vfErased[nSlot] || vTable[nSlot] == 0;
+}
+
+void CSignatureCache::Insert(const uint256& entry)
+{
+    if (vTable.empty())
+        return;
+    boost::unique_lock<boost::shared_mutex> lock(cs_sigcache);
+    uint32_t nBucket1, nBucket2;
+    GetBuckets(entry, nBucket1, nBucket2);
+    if (Find(entry, nBucket1) >= 0 || Find(entry, nBucket2) >= 0)
+        return;
+
+    uint256 entryMove = entry;
+    uint32_t nBucket = nBucket1;
+    for (unsigned int nMove = 0; nMove <= nMaxMoves; nMove++) {
+        // Take a free slot in the bucket the entry goes to, or for a new
+        // entry in either of its buckets.
+        for (unsigned int i = 0; i < BUCKET_SIZE; i++) {
+            unsigned int nFree = nBucket * BUCKET_SIZE + i;
+            if (IsFree(nFree)) {
+                vTable[nFree] = entryMove;
+                vfErased[nFree] = 0;
+                return;
+            }
+        }
+        if (nMove == 0) {
+            for (unsigned int i = 0; i < BUCKET_SIZE; i++) {
+                unsigned int nFree = nBucket2 * BUCKET_SIZE + i;
+                if (IsFree(nFree)) {
+                    vTable[nFree] = entryMove;
+                    vfErased[nFree] = 0;
+                    return;
+                }
+            }
         }
 
-        sigdata_type k(hash, vchSig, pubKey);
-        setValid.insert(k);
+        // Both full: displace a random occupant to its other bucket. The
+        // entry displaced by the last move is dropped, which also keeps the
+        // contents of a full cache changing in a way attackers cannot predict.
+        uint256& slot = vTable[nBucket * BUCKET_SIZE + (insecure_rand() % BUCKET_SIZE)];
+        std::swap(slot, entryMove);
+        uint32_t nMovedBucket1, nMovedBucket2;
+        GetBuckets(entryMove, nMovedBucket1, nMovedBucket2);
+        nBucket = (nMovedBucket1 == nBucket) ? nMovedBucket2 : nMovedBucket1;
     }
-};
+}
+
+namespace {
+
+CSignatureCache signatureCache;
 
 }
 
+void InitSignatureCache()
+{
+    size_t nBytes;
+    if (mapArgs.count("-maxsigcachesize") && !mapArgs.count("-maxsigcachemb")) {
+        // The old option counts entries; keep honouring it with that meaning.
+        int64_t nEntries = std::min(std::max((int64_t)0, GetArg("-maxsigcachesize", 0)), (int64_t)MAX_MAX_SIG_CACHE_SIZE << 20);
+        nBytes = (size_t)nEntries * sizeof(uint256);
+        LogPrintf("-maxsigcachesize is deprecated, use -maxsigcachemb to size the signature cache in megabytes\n");
+    } else {
+        int64_t nMaxCacheSize = std::min(std::max((int64_t)0, GetArg("-maxsigcachemb", DEFAULT_MAX_SIG_CACHE_SIZE)), (int64_t)MAX_MAX_SIG_CACHE_SIZE);
+        nBytes = (size_t)nMaxCacheSize << 20;
+    }
+    signatureCache.Setup(nBytes);
+    LogPrintf("Using %u MiB out of %u requested for signature cache, able to store %u elements\n",
+              (signatureCache.GetSize() * sizeof(uint256)) >> 20, nBytes >> 20, signatureCache.GetSize());
+}
+
 bool CachingTransactionSignatureChecker::VerifySignature(const std::vector<unsigned char>& vchSig, const CPubKey& pubkey, const uint256& sighash) const
 {
-    static CSignatureCache signatureCache;
+    uint256 entry;
+    signatureCache.ComputeEntry(entry, sighash, vchSig, pubkey);
 
-    if (signatureCache.Get(sighash, vchSig, pubkey))
+    // Signatures checked without storing belong to a block being connected;
+    // they will not be needed again once it is.
+    if (signatureCache.Contains(entry, !store))
         return true;
 
     if (!TransactionSignatureChecker::VerifySignature(vchSig, pubkey, sighash))
         return false;
 
     if (store)
-        signatureCache.Set(sighash, vchSig, pubkey);
+        signatureCache.Insert(entry);
     return true;
 }
@@ -7,11 +7,71 @@
 #define BITCOIN_SCRIPT_SIGCACHE_H
 
 #include "script/interpreter.h"
+#include "uint256.h"
 
 #include <vector>
 
+#include <boost/thread/locks.hpp>
+#include <boost/thread/shared_mutex.hpp>
+
+/** Default for -maxsigcachemb, in megabytes */
+static const unsigned int DEFAULT_MAX_SIG_CACHE_SIZE = 32;
+/** Largest accepted -maxsigcachemb, in megabytes */
+static const unsigned int MAX_MAX_SIG_CACHE_SIZE = 1024;
+
 class CPubKey;
 
+/**
+ * Valid signature cache, to avoid doing expensive ECDSA signature checking
+ * twice for every transaction (once when accepted into memory pool, and
+ * again when accepted into the block chain).
+ *
+ * Entries are salted SHA256 digests of (signature hash, signature, public
+ * key), kept in a preallocated cuckoo hash table: every entry has one slot in
+ * each of two buckets of BUCKET_SIZE slots. Inserting into two full buckets
+ * moves an entry to its other bucket, and so on for a bounded number of
+ * steps, after which the last entry moved is dropped.
+ *
+ * Lookups share a read lock, so block validation threads do not serialize
+ * on one another. A lookup that erases its hit only flags the slot, which
+ * needs no exclusive lock: flagged slots no longer match and Insert() reuses
+ * them. Only inserts take the lock exclusively.
+ */
+class CSignatureCache
+{
+public:
+    static const unsigned int BUCKET_SIZE = 4;
+
+    CSignatureCache();
+
+    /** Allocate an empty table of at most nBytes (at least one bucket). Not thread safe. */
+    void Setup(size_t nBytes);
+    size_t GetSize() const { return vTable.size(); }
+
+    void ComputeEntry(uint256& entry, const uint256& hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubkey) const;
+    /** Look up an entry, removing it on a hit if fErase is set. */
+    bool Contains(const uint256& entry, bool fErase);
+    void Insert(const uint256& entry);
+
+private:
+    //! Random salt for the digests, so entries cannot be targeted at buckets
+    unsigned char nonce[32];
+    std::vector<uint256> vTable;
+    //! Per slot: erased by a lookup, so free for Insert() to reuse. One byte
+    //! each, so lookups flagging different slots never write the same byte.
+    std::vector<unsigned char> vfErased;
+    uint32_t nBucketMask;
+    unsigned int nMaxMoves;
+    boost::shared_mutex cs_sigcache;
+
+    void GetBuckets(const uint256& entry, uint32_t& nBucket1, uint32_t& nBucket2) const;
+    int Find(const uint256& entry, uint32_t nBucket) const;
+    bool IsFree(unsigned int nSlot) const;
+};
+
+/** Size the signature cache from -maxsigcachemb. Call once at startup. */
+void InitSignatureCache();
+
 class CachingTransactionSignatureChecker : public TransactionSignatureChecker
 {
 private:
@@ -0,0 +1,727 @@
+// Copyright (c) 2016 The HealthHeldToken developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "stratum.h"
+
+#include "base58.h"
+#include "chainparams.h"
+#include "hash.h"
+#include "main.h"
+#include "miner.h"
+#include "primitives/block.h"
+#include "script/standard.h"
+#include "streams.h"
+#include "timedata.h"
+#include "ui_interface.h"
+#include "util.h"
+#include "utilstrencodings.h"
+#include "version.h"
+
+#include <deque>
+#include <limits>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+
+#include "json/json_spirit_reader_template.h"
+#include "json/json_spirit_utils.h"
+#include "json/json_spirit_writer_template.h"
+
+using namespace json_spirit;
+using namespace std;
+
+namespace asio = boost::asio;
+using boost::asio::ip::tcp;
+
+namespace {
+
+/** Size in bytes of the per-connection extranonce1 */
+static const unsigned int STRATUM_EXTRANONCE1_SIZE = 4;
+/** Size in bytes of the extranonce2 that miners roll themselves */
+static const unsigned int STRATUM_EXTRANONCE2_SIZE = 4;
+/** Longest request line accepted from a miner */
+static const size_t STRATUM_MAX_LINE = 16 * 1024;
+/** Number of jobs kept for late submissions, on top of the current one */
+static const size_t STRATUM_MAX_JOBS = 16;
+/** Minimum age of a job before a mempool change alone causes a new one */
+static const int64_t STRATUM_JOB_REFRESH_SECONDS = 5;
+/** Target of a difficulty 1 share, using the usual pool convention */
+static const unsigned int STRATUM_DIFF1_BITS = 0x1d00ffff;
+
+// Stratum error codes, as used by common pool software.
+enum StratumError {
+    STRATUM_ERR_OTHER = 20,
+    STRATUM_ERR_JOB_NOT_FOUND = 21,
+    STRATUM_ERR_DUPLICATE_SHARE = 22,
+    STRATUM_ERR_LOW_DIFFICULTY = 23,
+    STRATUM_ERR_UNAUTHORIZED = 24,
+    STRATUM_ERR_NOT_SUBSCRIBED = 25,
+};
+
+/** Big-endian hex of a 32-bit header field, as Stratum sends version, nbits and ntime. */
+string HexBE32(uint32_t n)
+{
+    return strprintf("%08x", n);
+}
+
+bool ParseHexBE32(const string& str, uint32_t& n)
+{
+    if (str.size() != 8 || !IsHex(str))
+        return false;
+    n = (uint32_t)strtoul(str.c_str(), NULL, 16);
+    return true;
+}
+
+/**
+ * One unit of work pushed to miners: a block template with its coinbase split
+ * around the extranonce, and the merkle branch that links the coinbase to the
+ * root.
+ */
+struct CStratumJob
+{
+    string strId;
+    CBlockTemplate blocktemplate;
+    CBlockIndex* pindexPrev;
+    string strCoinbase1;
+    string strCoinbase2;
+    vector<uint256> vMerkleBranch;
+    uint256 hashTarget;
+    //! Header hashes of the shares already accepted for this job
+    set<uint256> setShares;
+
+    /** Coinbase transaction with the given extranonces filled in. */
+    bool BuildCoinbase(const string& strExtraNonce1, const string& strExtraNonce2, CTransaction& tx) const
+    {
+        vector<unsigned char> vch = ParseHex(strCoinbase1 + strExtraNonce1 + strExtraNonce2 + strCoinbase2);
+        CDataStream ss(vch, SER_NETWORK, PROTOCOL_VERSION);
+        try {
+            ss >> tx;
+        } catch (const std::exception&) {
+            return false;
+        }
+        return ss.empty();
+    }
+};
+
+class CStratumServer;
+
+/** A connected miner. All methods run on the server's io_service thread. */
+class CStratumClient : public boost::enable_shared_from_this<CStratumClient>
+{
+public:
+    tcp::socket socket;
+    string strPeer;
+    string strExtraNonce1;
+    bool fSubscribed;
+    bool fAuthorized;
+    string strWorker;
+    uint64_t nSharesAccepted;
+    uint64_t nSharesRejected;
+
+    CStratumClient(CStratumServer& serverIn, asio::io_service& io_service, const string& strExtraNonce1In) :
+        socket(io_service), strExtraNonce1(strExtraNonce1In), fSubscribed(false), fAuthorized(false),
+        nSharesAccepted(0), nSharesRejected(0), server(serverIn), bufRecv(STRATUM_MAX_LINE), fWriting(false),
+        nSubmitSecond(0), nSubmitsThisSecond(0)
+    {
+    }
+
+    void Start();
+    /** Count a share submission; false if this connection exceeded nMaxPerSecond in the current second. */
+    bool AllowSubmit(unsigned int nMaxPerSecond);
+    void Send(const Object& obj);
+    void Close();
+
+private:
+    CStratumServer& server;
+    asio::streambuf bufRecv;
+    std::deque<string> queueSend;
+    bool fWriting;
+    int64_t nSubmitSecond;
+    unsigned int nSubmitsThisSecond;
+
+    void StartRead();
+    void HandleRead(const boost::system::error_code& error, size_t nBytes);
+    void StartWrite();
+    void HandleWrite(const boost::system::error_code& error, size_t nBytes);
+};
+
+class CStratumServer
+{
+public:
+    CStratumServer(const CScript& scriptPubKeyIn, double dDifficultyIn, unsigned int nMaxConnectionsIn, unsigned int nMaxSubmitsIn) :
+        scriptPubKey(scriptPubKeyIn), dDifficulty(dDifficultyIn), nMaxConnections(nMaxConnectionsIn), nMaxSubmits(nMaxSubmitsIn),
+        acceptor(io_service), work(io_service), nExtraNonce1Next(0), nJobIdNext(0)
+    {
+        hashShareTarget.SetCompact(STRATUM_DIFF1_BITS);
+        // Scale by 1 / difficulty in 32-bit fixed point so fractional difficulties work.
+        // The diff1 target has over 200 trailing zero bits, so shifting first is exact,
+        // and for the accepted range (1/65536 to 65536) the factor fits in 49 bits
+        // and the product in 241.
+        hashShareTarget >>= 32;
+        hashShareTarget *= uint256((uint64_t)(4294967296.0 / dDifficulty + 0.5));
+    }
+
+    bool Listen(const tcp::endpoint& endpoint, string& strError);
+    void Start();
+    void Stop();
+
+    void Remove(const boost::shared_ptr<CStratumClient>& pclient) { setClients.erase(pclient); }
+    void HandleRequest(const boost::shared_ptr<CStratumClient>& pclient, const string& strLine);
+
+private:
+    const CScript scriptPubKey;
+    const double dDifficulty;
+    const unsigned int nMaxConnections;
+    const unsigned int nMaxSubmits;
+    uint256 hashShareTarget;
+
+    asio::io_service io_service;
+    tcp::acceptor acceptor;
+    asio::io_service::work work;
+    boost::thread_group threadGroup;
+
+    // Only touched on the io_service thread:
+    set<boost::shared_ptr<CStratumClient> > setClients;
+    uint32_t nExtraNonce1Next;
+    map<string, boost::shared_ptr<CStratumJob> > mapJobs;
+    std::deque<string> queueJobIds;
+    boost::shared_ptr<CStratumJob> pjobCurrent;
+
+    // Only touched on the job thread:
+    unsigned int nJobIdNext;
+
+    void StartAccept();
+    void HandleAccept(boost::shared_ptr<CStratumClient> pclient, const boost::system::error_code& error);
+    void ThreadJobs();
+    boost::shared_ptr<CStratumJob> CreateJob();
+    void PublishJob(boost::shared_ptr<CStratumJob> pjob, bool fClean);
+    Object NotifyMessage(const CStratumJob& job, bool fClean) const;
+    Value Submit(CStratumClient& client, const Array& params, Value& error);
+};
+
+Object Reply(const Value& id, const Value& result, const Value& error)
+{
+    Object reply;
+    reply.push_back(Pair("id", id));
+    reply.push_back(Pair("result", result));
+    reply.push_back(Pair("error", error));
+    return reply;
+}
+
+Array Error(int nCode, const string& strMessage)
+{
+    Array error;
+    error.push_back(nCode);
+    error.push_back(strMessage);
+    error.push_back(Value::null);
+    return error;
+}
+
+Object Notification(const string& strMethod, const Array& params)
+{
+    Object notification;
+    notification.push_back(Pair("id", Value::null));
+    notification.push_back(Pair("method", strMethod));
+    notification.push_back(Pair("params", params));
+    return notification;
+}
+
+void CStratumClient::Start()
+{
+    boost::system::error_code error;
+    tcp::endpoint endpoint = socket.remote_endpoint(error);
+    strPeer = error ? "unknown" : strprintf("%s:%u", endpoint.address().to_string(), endpoint.port());
+    LogPrint("stratum", "stratum: new connection from %s\n", strPeer);
+    StartRead();
+}
+
+bool CStratumClient::AllowSubmit(unsigned int nMaxPerSecond)
+{
+    int64_t nNow = GetTime();
+    if (nNow != nSubmitSecond) {
+        nSubmitSecond = nNow;
+        nSubmitsThisSecond = 0;
+    }
+    return ++nSubmitsThisSecond <= nMaxPerSecond;
+}
+
+void CStratumClient::StartRead()
+{
+    asio::async_read_until(socket, bufRecv, '\n',
+        boost::bind(&CStratumClient::HandleRead, shared_from_this(),
+            asio::placeholders::error, asio::placeholders::bytes_transferred));
+}
+
+void CStratumClient::HandleRead(const boost::system::error_code& error, size_t nBytes)
+{
+    if (error) {
+        // Also reached when a line exceeds STRATUM_MAX_LINE.
+        if (error != asio::error::operation_aborted)
+            LogPrint("stratum", "stratum: %s disconnected: %s\n", strPeer, error.message());
+        Close();
+        return;
+    }
+    std::istream stream(&bufRecv);
+    string strLine;
+    std::getline(stream, strLine);
+    if (!strLine.empty() && strLine[strLine.size() - 1] == '\r')
+        strLine.erase(strLine.size() - 1);
+    if (!strLine.empty())
+        server.HandleRequest(shared_from_this(), strLine);
+    if (socket.is_open())
+        StartRead();
+}
+
+void CStratumClient::Send(const Object& obj)
+{
+    if (!socket.is_open())
+        return;
+    queueSend.push_back(write_string(Value(obj), false) + "\n");
+    if (!fWriting)
+        StartWrite();
+}
+
+void CStratumClient::StartWrite()
+{
+    fWriting = true;
+    asio::async_write(socket, asio::buffer(queueSend.front()),
+        boost::bind(&CStratumClient::HandleWrite, shared_from_this(),
+            asio::placeholders::error, asio::placeholders::bytes_transferred));
+}
+
+void CStratumClient::HandleWrite(const boost::system::error_code& error, size_t nBytes)
+{
+    fWriting = false;
+    if (error) {
+        Close();
+        return;
+    }
+    queueSend.pop_front();
+    if (!queueSend.empty())
+        StartWrite();
+}
+
+void CStratumClient::Close()
+{
+    boost::system::error_code error;
+    if (socket.is_open()) {
+        socket.shutdown(tcp::socket::shutdown_both, error);
+        socket.close(error);
+    }
+    server.Remove(shared_from_this());
+}
+
+bool CStratumServer::Listen(const tcp::endpoint& endpoint, string& strError)
+{
+    try {
+        acceptor.open(endpoint.protocol());
+        acceptor.set_option(tcp::acceptor::reuse_address(true));
+        acceptor.bind(endpoint);
+        acceptor.listen(asio::socket_base::max_connections);
+    } catch (const boost::system::system_error& e) {
+        strError = strprintf(_("Unable to bind Stratum server to %s port %u: %s"), endpoint.address().to_string(), endpoint.port(), e.what());
+        return false;
+    }
+    LogPrintf("Stratum server listening on %s port %u\n", endpoint.address().to_string(), endpoint.port());
+    return true;
+}
+
+void CStratumServer::Start()
+{
+    StartAccept();
+    threadGroup.create_thread(boost::bind(&asio::io_service::run, &io_service));
+    threadGroup.create_thread(boost::bind(&CStratumServer::ThreadJobs, this));
+}
+
+void CStratumServer::Stop()
+{
+    threadGroup.interrupt_all();
+    io_service.stop();
+    threadGroup.join_all();
+    boost::system::error_code error;
+    acceptor.close(error);
+    BOOST_FOREACH(const boost::shared_ptr<CStratumClient>& pclient, setClients)
+        pclient->socket.close(error);
+    setClients.clear();
+}
+
+void CStratumServer::StartAccept()
+{
+    // extranonce1 values only need to be unique among the miners working on the same job.
+    string strExtraNonce1 = HexBE32(nExtraNonce1Next++);
+    boost::shared_ptr<CStratumClient> pclient(new CStratumClient(*this, io_service, strExtraNonce1));
+    acceptor.async_accept(pclient->socket,
+        boost::bind(&CStratumServer::HandleAccept, this, pclient, asio::placeholders::error));
+}
+
+void CStratumServer::HandleAccept(boost::shared_ptr<CStratumClient> pclient, const boost::system::error_code& error)
+{
+    if (error == asio::error::operation_aborted || !acceptor.is_open())
+        return;
+    if (!error) {
+        if (setClients.size() >= nMaxConnections) {
+            LogPrint("stratum", "stratum: connection limit of %u reached, refusing new miner\n", nMaxConnections);
+            boost::system::error_code errorClose;
+            pclient->socket.close(errorClose);
+        } else {
+            setClients.insert(pclient);
+            pclient->Start();
+        }
+    }
+    StartAccept();
+}
+
+void CStratumServer::HandleRequest(const boost::shared_ptr<CStratumClient>& pclient, const string& strLine)
+{
+    CStratumClient& client = *pclient;
+    Value valRequest;
+    if (!read_string(strLine, valRequest) || valRequest.type() != obj_type) {
+        LogPrint("stratum", "stratum: %s sent invalid JSON, disconnecting\n", client.strPeer);
+        client.Close();
+        return;
+    }
+    const Object& request = valRequest.get_obj();
+    Value id = find_value(request, "id");
+    Value valMethod = find_value(request, "method");
+    Value valParams = find_value(request, "params");
+    if (valMethod.type() != str_type) {
+        client.Send(Reply(id, Value::null, Error(STRATUM_ERR_OTHER, "Method not found")));
+        return;
+    }
+    const string& strMethod = valMethod.get_str();
+    Array params;
+    if (valParams.type() == array_type)
+        params = valParams.get_array();
+
+    if (strMethod == "mining.subscribe") {
+        Array subscription, subscriptions;
+        subscription.push_back("mining.notify");
+        subscription.push_back(client.strExtraNonce1);
+        subscriptions.push_back(subscription);
+        Array result;
+        result.push_back(subscriptions);
+        result.push_back(client.strExtraNonce1);
+        result.push_back((int)STRATUM_EXTRANONCE2_SIZE);
+        client.fSubscribed = true;
+        client.Send(Reply(id, result, Value::null));
+
+        Array paramsDifficulty;
+        paramsDifficulty.push_back(dDifficulty);
+        client.Send(Notification("mining.set_difficulty", paramsDifficulty));
+        if (pjobCurrent)
+            client.Send(NotifyMessage(*pjobCurrent, true));
+    } else if (strMethod == "mining.authorize") {
+        // Any worker name is accepted; payouts go to -stratumaddress.
+        if (params.size() > 0 && params[0].type() == str_type)
+            client.strWorker = params[0].get_str();
+        client.fAuthorized = true;
+        LogPrint("stratum", "stratum: %s authorized as \"%s\"\n", client.strPeer, client.strWorker);
+        client.Send(Reply(id, true, Value::null));
+    } else if (strMethod == "mining.submit") {
+        Value error = Value::null;
+        Value result = false;
+        // Checked before any parsing or hashing so a flooding miner costs little.
+        if (!client.AllowSubmit(nMaxSubmits))
+            error = Error(STRATUM_ERR_OTHER, "Too many submissions");
+        else
+            result = Submit(client, params, error);
+        if (error.type() == null_type)
+            client.nSharesAccepted++;
+        else
+            client.nSharesRejected++;
+        client.Send(Reply(id, result, error));
+    } else if (strMethod == "mining.extranonce.subscribe") {
+        // The extranonce never changes during a connection.
+        client.Send(Reply(id, true, Value::null));
+    } else {
+        client.Send(Reply(id, Value::null, Error(STRATUM_ERR_OTHER, "Method not found")));
+    }
+}
+
+Value CStratumServer::Submit(CStratumClient& client, const Array& params, Value& error)
+{
+    if (!client.fSubscribed) {
+        error = Error(STRATUM_ERR_NOT_SUBSCRIBED, "Not subscribed");
+        return false;
+    }
+    if (!client.fAuthorized) {
+        error = Error(STRATUM_ERR_UNAUTHORIZED, "Unauthorized worker");
+        return false;
+    }
+    // params: worker name, job id, extranonce2, ntime, nonce
+    if (params.size() < 5 || params[1].type() != str_type || params[2].type() != str_type ||
+        params[3].type() != str_type || params[4].type() != str_type) {
+        error = Error(STRATUM_ERR_OTHER, "Invalid parameters");
+        return false;
+    }
+    map<string, boost::shared_ptr<CStratumJob> >::iterator it = mapJobs.find(params[1].get_str());
+    if (it == mapJobs.end()) {
+        error = Error(STRATUM_ERR_JOB_NOT_FOUND, "Job not found");
+        return false;
+    }
+    CStratumJob& job = *it->second;
+
+    const string& strExtraNonce2 = params[2].get_str();
+    uint32_t nTime, nNonce;
+    if (strExtraNonce2.size() != 2 * STRATUM_EXTRANONCE2_SIZE || !IsHex(strExtraNonce2) ||
+        !ParseHexBE32(params[3].get_str(), nTime) || !ParseHexBE32(params[4].get_str(), nNonce)) {
+        error = Error(STRATUM_ERR_OTHER, "Malformed extranonce2, ntime or nonce");
+        return false;
+    }
+    if (nTime < job.blocktemplate.block.nTime || nTime > GetAdjustedTime() + 2 * 60 * 60) {
+        error = Error(STRATUM_ERR_OTHER, "ntime out of range");
+        return false;
+    }
+
+    CTransaction txCoinbase;
+    if (!job.BuildCoinbase(client.strExtraNonce1, strExtraNonce2, txCoinbase)) {
+        error = Error(STRATUM_ERR_OTHER, "Invalid coinbase");
+        return false;
+    }
+    CBlockHeader header = job.blocktemplate.block.GetBlockHeader();
+    header.hashMerkleRoot = CBlock::CheckMerkleBranch(txCoinbase.GetHash(), job.vMerkleBranch, 0);
+    header.nTime = nTime;
+    header.nNonce = nNonce;
+    uint256 hash = header.GetHash();
+
+    if (hash > hashShareTarget) {
+        error = Error(STRATUM_ERR_LOW_DIFFICULTY, "Low difficulty share");
+        return false;
+    }
+    if (!job.setShares.insert(hash).second) {
+        error = Error(STRATUM_ERR_DUPLICATE_SHARE, "Duplicate share");
+        return false;
+    }
+
+    if (hash <= job.hashTarget) {
+        CBlock block(job.blocktemplate.block);
+        block.vtx[0] = txCoinbase;
+        block.hashMerkleRoot = header.hashMerkleRoot;
+        block.nTime = nTime;
+        block.nNonce = nNonce;
+        LogPrintf("stratum: block found by %s (\"%s\")\n  hash: %s  \ntarget: %s\n", client.strPeer, client.strWorker,
+            hash.GetHex(), job.hashTarget.GetHex());
+        CValidationState state;
+        if (!ProcessNewBlock(state, NULL, &block))
+            LogPrintf("stratum: ProcessNewBlock, block not accepted: %s\n", state.GetRejectReason());
+    }
+    return true;
+}
+
+boost::shared_ptr<CStratumJob> CStratumServer::CreateJob()
+{
+    boost::shared_ptr<CStratumJob> pjob;
+    auto_ptr<CBlockTemplate> pblocktemplate(CreateNewBlock(scriptPubKey));
+    if (!pblocktemplate.get())
+        return pjob;
+
+    // The tip may have moved since the caller looked, so take the parent
+    // the template was actually built on
+    CBlockIndex* pindexPrev;
+    {
+        LOCK(cs_main);
+        BlockMap::iterator mi = mapBlockIndex.find(pblocktemplate->block.hashPrevBlock);
+        if (mi == mapBlockIndex.end())
+            return pjob;
+        pindexPrev = mi->second;
+    }
+
+    pjob.reset(new CStratumJob());
+    pjob->strId = strprintf("%x", ++nJobIdNext);
+    pjob->blocktemplate = *pblocktemplate;
+    pjob->pindexPrev = pindexPrev;
+    CBlock& block = pjob->blocktemplate.block;
+    pjob->hashTarget.SetCompact(block.nBits);
+
+    // Rebuild the coinbase with a placeholder for extranonce1 + extranonce2, and
+    // split its serialization around it.
+    CScript scriptHeight = CScript() << (pindexPrev->nHeight + 1);
+    std::vector<unsigned char> vchPlaceholder(STRATUM_EXTRANONCE1_SIZE + STRATUM_EXTRANONCE2_SIZE, 0);
+    CMutableTransaction txCoinbase(block.vtx[0]);
+    txCoinbase.vin[0].scriptSig = (CScript(scriptHeight) << vchPlaceholder) + COINBASE_FLAGS;
+    assert(txCoinbase.vin[0].scriptSig.size() <= 100);
+    block.vtx[0] = txCoinbase;
+
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << block.vtx[0];
+    string strCoinbase = HexStr(ss.begin(), ss.end());
+    // version, input count, prevout, script length, height push, placeholder push opcode
+    size_t nOffset = 4 + GetSizeOfCompactSize(txCoinbase.vin.size()) + 36 +
+                     GetSizeOfCompactSize(txCoinbase.vin[0].scriptSig.size()) + scriptHeight.size() + 1;
+    pjob->strCoinbase1 = strCoinbase.substr(0, 2 * nOffset);
+    pjob->strCoinbase2 = strCoinbase.substr(2 * (nOffset + vchPlaceholder.size()));
+
+    block.BuildMerkleTree();
+    pjob->vMerkleBranch = block.GetMerkleBranch(0);
+    return pjob;
+}
+
+Object CStratumServer::NotifyMessage(const CStratumJob& job, bool fClean) const
+{
+    const CBlock& block = job.blocktemplate.block;
+
+    // The previous block hash is sent as eight 32-bit words, each byte swapped.
+    uint256 hashPrev = block.hashPrevBlock;
+    unsigned char* p = hashPrev.begin();
+    for (int i = 0; i < 32; i += 4) {
+        std::swap(p[i], p[i + 3]);
+        std::swap(p[i + 1], p[i + 2]);
+    }
+    Array branch;
+    BOOST_FOREACH(const uint256& hash, job.vMerkleBranch)
+        branch.push_back(HexStr(hash.begin(), hash.end()));
+
+    Array params;
+    params.push_back(job.strId);
+    params.push_back(HexStr(hashPrev.begin(), hashPrev.end()));
+    params.push_back(job.strCoinbase1);
+    params.push_back(job.strCoinbase2);
+    params.push_back(branch);
+    params.push_back(HexBE32(block.nVersion));
+    params.push_back(HexBE32(block.nBits));
+    params.push_back(HexBE32(block.nTime));
+    params.push_back(fClean);
+    return Notification("mining.notify", params);
+}
+
+void CStratumServer::PublishJob(boost::shared_ptr<CStratumJob> pjob, bool fClean)
+{
+    if (fClean) {
+        mapJobs.clear();
+        queueJobIds.clear();
+    }
+    mapJobs[pjob->strId] = pjob;
+    queueJobIds.push_back(pjob->strId);
+    while (queueJobIds.size() > STRATUM_MAX_JOBS + 1) {
+        mapJobs.erase(queueJobIds.front());
+        queueJobIds.pop_front();
+    }
+    pjobCurrent = pjob;
+
+    Object notify = NotifyMessage(*pjob, fClean);
+    // Send() may drop a client whose socket is gone, so iterate over a copy.
+    set<boost::shared_ptr<CStratumClient> > setCopy = setClients;
+    BOOST_FOREACH(const boost::shared_ptr<CStratumClient>& pclient, setCopy)
+        if (pclient->fSubscribed)
+            pclient->Send(notify);
+    LogPrint("stratum", "stratum: job %s (height %d, %u transactions, clean %d) sent to %u miners\n", pjob->strId,
+        pjob->pindexPrev->nHeight + 1, pjob->blocktemplate.block.vtx.size(), fClean, setCopy.size());
+}
+
+void CStratumServer::ThreadJobs()
+{
+    RenameThread("healthheldtoken-stratum");
+    CBlockIndex* pindexPrevJob = NULL;
+    while (true) {
+        unsigned int nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
+        CBlockIndex* pindexPrev;
+        {
+            LOCK(cs_main);
+            pindexPrev = chainActive.Tip();
+        }
+        boost::shared_ptr<CStratumJob> pjob;
+        if (pindexPrev && !IsInitialBlockDownload()) {
+            try {
+                pjob = CreateJob();
+            } catch (const std::runtime_error& e) {
+                LogPrintf("stratum: could not create block template: %s\n", e.what());
+            }
+        }
+        if (pjob) {
+            // Wait below for a tip change from the block the job builds on
+            pindexPrev = pjob->pindexPrev;
+            bool fClean = pindexPrev != pindexPrevJob;
+            pindexPrevJob = pindexPrev;
+            io_service.post(boost::bind(&CStratumServer::PublishJob, this, pjob, fClean));
+        }
+
+        // Wait for a new tip, or for enough mempool changes to refresh the job.
+        int64_t nStart = GetTime();
+        while (true) {
+            {
+                boost::unique_lock<boost::mutex> lock(csBestBlock);
+                if (chainActive.Tip() == pindexPrev)
+                    cvBlockChange.timed_wait(lock, boost::posix_time::seconds(1));
+            }
+            if (chainActive.Tip() != pindexPrev || !pjob)
+                break;
+            if (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLast && GetTime() - nStart >= STRATUM_JOB_REFRESH_SECONDS)
+                break;
+        }
+    }
+}
+
+CStratumServer* pstratum = NULL;
+
+} // anon namespace
+
+bool StartStratumServer(string& strError)
+{
+    assert(pstratum == NULL);
+
+    CBitcoinAddress address(GetArg("-stratumaddress", ""));
+    if (!address.IsValid()) {
+        strError = _("The Stratum server needs a valid -stratumaddress to pay block rewards to");
+        return false;
+    }
+    double dDifficulty = DEFAULT_STRATUM_DIFFICULTY;
+    if (mapArgs.count("-stratumdifficulty")) {
+        dDifficulty = atof(mapArgs["-stratumdifficulty"].c_str());
+        if (dDifficulty < 1.0 / 65536 || dDifficulty > 65536) {
+            strError = strprintf(_("Invalid -stratumdifficulty: '%s' (must be between %f and %u)"), mapArgs["-stratumdifficulty"], 1.0 / 65536, 65536);
+            return false;
+        }
+    }
+
+    int64_t nMaxConnections = GetArg("-stratummaxconnections", DEFAULT_STRATUM_MAX_CONNECTIONS);
+    if (nMaxConnections < 1 || nMaxConnections > std::numeric_limits<int>::max()) {
+        strError = strprintf(_("Invalid -stratummaxconnections: '%s'"), mapArgs["-stratummaxconnections"]);
+        return false;
+    }
+    int64_t nMaxSubmits = GetArg("-stratummaxsubmits", DEFAULT_STRATUM_MAX_SUBMITS);
+    if (nMaxSubmits < 1 || nMaxSubmits > std::numeric_limits<int>::max()) {
+        strError = strprintf(_("Invalid -stratummaxsubmits: '%s'"), mapArgs["-stratummaxsubmits"]);
+        return false;
+    }
+
+    // Miners are not authenticated, so only listen locally unless told otherwise.
+    tcp::endpoint endpoint(asio::ip::address_v4::loopback(), GetArg("-stratumport", DEFAULT_STRATUM_PORT));
+    if (mapArgs.count("-stratumbind")) {
+        boost::system::error_code error;
+        asio::ip::address bindAddress = asio::ip::address::from_string(mapArgs["-stratumbind"], error);
+        if (error) {
+            strError = strprintf(_("Could not parse -stratumbind value %s as network address"), mapArgs["-stratumbind"]);
+            return false;
+        }
+        endpoint.address(bindAddress);
+    }
+
+    CStratumServer* pserver = new CStratumServer(GetScriptForDestination(address.Get()), dDifficulty,
+        (unsigned int)nMaxConnections, (unsigned int)nMaxSubmits);
+    if (!pserver->Listen(endpoint, strError)) {
+        delete pserver;
+        return false;
+    }
+    pserver->Start();
+    pstratum = pserver;
+    return true;
+}
+
+void StopStratumServer()
+{
+    if (pstratum == NULL)
+        return;
+    pstratum->Stop();
+    delete pstratum;
+    pstratum = NULL;
+}
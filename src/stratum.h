@@ -0,0 +1,29 @@
+// Copyright (c) 2016 The HealthHeldToken developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_STRATUM_H
+#define BITCOIN_STRATUM_H
+
+#include <string>
+
+/** Default TCP port of the built-in Stratum server */
+static const unsigned short DEFAULT_STRATUM_PORT = 3333;
+/** Default share difficulty handed out to Stratum miners */
+static const double DEFAULT_STRATUM_DIFFICULTY = 1.0;
+/** Default maximum number of miners connected to the Stratum server at once */
+static const unsigned int DEFAULT_STRATUM_MAX_CONNECTIONS = 64;
+/** Default maximum number of shares one Stratum connection may submit per second */
+static const unsigned int DEFAULT_STRATUM_MAX_SUBMITS = 20;
+
+/**
+ * Start the Stratum v1 mining server (-stratum). Jobs are built from the same
+ * block templates getblocktemplate uses and pushed to connected miners on
+ * every new tip or mempool change. Returns false and sets strError if the
+ * configuration is invalid or no listening socket could be opened.
+ */
+bool StartStratumServer(std::string& strError);
+/** Stop the Stratum server and disconnect all miners. Safe to call if it was never started. */
+void StopStratumServer();
+
+#endif // BITCOIN_STRATUM_H
@@ -291,6 +291,12 @@ public:
         return (*this);
     }
 
+    /** Exchange the underlying buffer with data and rewind; lets callers reuse allocated memory */
+    void SwapBuffer(CSerializeData &data) {
+        vch.swap(data);
+        nReadPos = 0;
+    }
+
     void GetAndClear(CSerializeData &data) {
         data.insert(data.end(), begin(), end());
         clear();
@@ -8,6 +8,9 @@
 
 #include "checkpoints.h"
 
+#include "chainparams.h"
+#include "main.h"
+#include "pow.h"
 #include "uint256.h"
 
 #include <boost/test/unit_test.hpp>
@@ -35,4 +38,46 @@ BOOST_AUTO_TEST_CASE(sanity)
     BOOST_CHECK(Checkpoints::GetTotalBlocksEstimate() >= 120000);
 }    
 
+BOOST_AUTO_TEST_CASE(assumevalid)
+{
+    // Two weeks of blocks at the target spacing, and a few more
+    const int nBury = 60 * 60 * 24 * 7 * 2 / Params().TargetSpacing();
+    std::vector<uint256> vHashes(nBury + 200);
+    std::vector<CBlockIndex> vBlocks(vHashes.size());
+    for (size_t i = 0; i < vBlocks.size(); i++) {
+        vHashes[i] = i + 1;
+        vBlocks[i].phashBlock = &vHashes[i];
+        vBlocks[i].nHeight = i;
+        vBlocks[i].pprev = i ? &vBlocks[i - 1] : NULL;
+        vBlocks[i].nBits = 0x1e0ffff0;
+        vBlocks[i].nChainWork = (i ? vBlocks[i - 1].nChainWork : 0) + GetBlockProof(vBlocks[i]);
+        vBlocks[i].BuildSkip();
+    }
+    CBlockIndex* pindexTip = &vBlocks.back();
+
+    Checkpoints::hashAssumeValid = 0;
+    BOOST_CHECK(!Checkpoints::IsAssumedValid(&vBlocks[50], pindexTip));
+
+    // Not assumed until the header of the assumed-valid block is known
+    Checkpoints::hashAssumeValid = vHashes[100];
+    BOOST_CHECK(!Checkpoints::IsAssumedValid(&vBlocks[50], pindexTip));
+    mapBlockIndex[vHashes[100]] = &vBlocks[100];
+
+    BOOST_CHECK(Checkpoints::IsAssumedValid(&vBlocks[0], pindexTip));
+    BOOST_CHECK(Checkpoints::IsAssumedValid(&vBlocks[50], pindexTip));
+    BOOST_CHECK(Checkpoints::IsAssumedValid(&vBlocks[100], pindexTip));
+    // Descendants are verified as usual
+    BOOST_CHECK(!Checkpoints::IsAssumedValid(&vBlocks[101], pindexTip));
+
+    // Not buried under two weeks of work yet
+    BOOST_CHECK(!Checkpoints::IsAssumedValid(&vBlocks[100], &vBlocks[nBury + 50]));
+    BOOST_CHECK(Checkpoints::IsAssumedValid(&vBlocks[10], &vBlocks[nBury + 50]));
+
+    // The assumed-valid block must be on the best header chain
+    BOOST_CHECK(!Checkpoints::IsAssumedValid(&vBlocks[10], &vBlocks[50]));
+
+    mapBlockIndex.erase(vHashes[100]);
+    Checkpoints::hashAssumeValid = 0;
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,156 @@
+// Copyright (c) 2016 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockencodings.h"
+#include "random.h"
+#include "streams.h"
+#include "txmempool.h"
+#include "version.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(blockencodings_tests)
+
+static CBlock BuildBlockTestCase()
+{
+    CBlock block;
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].scriptSig.resize(10);
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 42;
+
+    block.vtx.resize(3);
+    block.vtx[0] = tx;
+    block.nVersion = 42;
+    block.hashPrevBlock = GetRandHash();
+    block.nBits = 0x207fffff;
+
+    tx.vin[0].prevout.hash = GetRandHash();
+    tx.vin[0].prevout.n = 0;
+    block.vtx[1] = tx;
+
+    tx.vin.resize(10);
+    for (size_t i = 0; i < tx.vin.size(); i++) {
+        tx.vin[i].prevout.hash = GetRandHash();
+        tx.vin[i].prevout.n = 0;
+    }
+    block.vtx[2] = tx;
+
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    return block;
+}
+
+BOOST_AUTO_TEST_CASE(SimpleRoundTripTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    CBlock block(BuildBlockTestCase());
+
+    pool.addUnchecked(block.vtx[2].GetHash(), CTxMemPoolEntry(block.vtx[2], 0, 0, 0.0, 1));
+
+    // Do a simple ShortTxIDs round-trip
+    CBlockHeaderAndShortTxIDs shortIDs(block);
+
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << shortIDs;
+
+    CBlockHeaderAndShortTxIDs shortIDs2;
+    stream >> shortIDs2;
+    BOOST_CHECK_EQUAL(shortIDs2.BlockTxCount(), 3U);
+    BOOST_CHECK_EQUAL(shortIDs2.GetShortID(block.vtx[1].GetHash()), shortIDs.GetShortID(block.vtx[1].GetHash()));
+
+    PartiallyDownloadedBlock partialBlock(&pool);
+    BOOST_CHECK(partialBlock.InitData(shortIDs2) == READ_STATUS_OK);
+    BOOST_CHECK(partialBlock.IsTxAvailable(0));
+    BOOST_CHECK(!partialBlock.IsTxAvailable(1));
+    BOOST_CHECK(partialBlock.IsTxAvailable(2));
+    BOOST_CHECK_EQUAL(partialBlock.GetPrefilledCount(), 1U);
+    BOOST_CHECK_EQUAL(partialBlock.GetMempoolCount(), 1U);
+
+    std::vector<uint16_t> vMissing;
+    partialBlock.GetMissingIndexes(vMissing);
+    BOOST_CHECK_EQUAL(vMissing.size(), 1U);
+    BOOST_CHECK_EQUAL(vMissing[0], 1);
+
+    // Round-trip the request and answer for the missing transaction
+    BlockTransactionsRequest req;
+    req.blockhash = block.GetHash();
+    req.indexes = vMissing;
+    stream << req;
+    BlockTransactionsRequest req2;
+    stream >> req2;
+    BOOST_CHECK(req2.blockhash == block.GetHash());
+    BOOST_CHECK(req2.indexes == vMissing);
+
+    BlockTransactions resp(req2);
+    resp.txn[0] = block.vtx[req2.indexes[0]];
+
+    // A wrong transaction in the gap fails the merkle check without
+    // blaming the peer
+    {
+        PartiallyDownloadedBlock partialBlockCopy = partialBlock;
+        std::vector<CTransaction> vtxWrong(1, block.vtx[2]);
+        CBlock block2;
+        BOOST_CHECK(partialBlockCopy.FillBlock(block2, vtxWrong) == READ_STATUS_FAILED);
+    }
+
+    // Too many or too few transactions are malformed
+    {
+        PartiallyDownloadedBlock partialBlockCopy = partialBlock;
+        CBlock block2;
+        BOOST_CHECK(partialBlockCopy.FillBlock(block2, std::vector<CTransaction>()) == READ_STATUS_INVALID);
+    }
+
+    CBlock block3;
+    BOOST_CHECK(partialBlock.FillBlock(block3, resp.txn) == READ_STATUS_OK);
+    BOOST_CHECK_EQUAL(block.GetHash().ToString(), block3.GetHash().ToString());
+    BOOST_CHECK_EQUAL(block.hashMerkleRoot.ToString(), block3.BuildMerkleTree().ToString());
+}
+
+BOOST_AUTO_TEST_CASE(EmptyBlockRoundTripTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    CBlock block(BuildBlockTestCase());
+    block.vtx.resize(1);
+    block.hashMerkleRoot = block.BuildMerkleTree();
+
+    CBlockHeaderAndShortTxIDs shortIDs(block);
+
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << shortIDs;
+
+    CBlockHeaderAndShortTxIDs shortIDs2;
+    stream >> shortIDs2;
+
+    PartiallyDownloadedBlock partialBlock(&pool);
+    BOOST_CHECK(partialBlock.InitData(shortIDs2) == READ_STATUS_OK);
+    BOOST_CHECK(partialBlock.IsTxAvailable(0));
+
+    CBlock block2;
+    BOOST_CHECK(partialBlock.FillBlock(block2, std::vector<CTransaction>()) == READ_STATUS_OK);
+    BOOST_CHECK_EQUAL(block.GetHash().ToString(), block2.GetHash().ToString());
+}
+
+BOOST_AUTO_TEST_CASE(TransactionsRequestSerializationTest)
+{
+    BlockTransactionsRequest req1;
+    req1.blockhash = GetRandHash();
+    req1.indexes.push_back(0);
+    req1.indexes.push_back(1);
+    req1.indexes.push_back(3);
+    req1.indexes.push_back(4);
+
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << req1;
+    // blockhash, count and one byte per differentially encoded index
+    BOOST_CHECK_EQUAL(stream.size(), 32U + 1 + 4);
+
+    BlockTransactionsRequest req2;
+    stream >> req2;
+
+    BOOST_CHECK_EQUAL(req1.blockhash.ToString(), req2.blockhash.ToString());
+    BOOST_CHECK(req1.indexes == req2.indexes);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
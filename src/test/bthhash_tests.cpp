@@ -0,0 +1,123 @@
+// Copyright (c) 2016 The HealthHeldToken developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "crypto/bthhash.h"
+#include "crypto/bthhash_batch.h"
+#include "crypto/bthhash_midstate.h"
+#include "primitives/block.h"
+#include "random.h"
+#include "uint256.h"
+#include "utilstrencodings.h"
+
+#include <string.h>
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(bthhash_tests)
+
+static void CheckBatchMatchesScalar(size_t nCount)
+{
+    std::vector<unsigned char> vHeaders(nCount * BTHHASH_HEADER_SIZE);
+    for (size_t i = 0; i < vHeaders.size(); i++)
+        vHeaders[i] = insecure_rand();
+    std::vector<unsigned char> vOut(nCount * BTHHASH_OUTPUT_SIZE + 1);
+
+    bthhash_batch(nCount ? &vHeaders[0] : NULL, nCount, &vOut[0]);
+    for (size_t i = 0; i < nCount; i++) {
+        const unsigned char* pheader = &vHeaders[i * BTHHASH_HEADER_SIZE];
+        uint256 hash = bthhash(pheader, pheader + BTHHASH_HEADER_SIZE);
+        BOOST_CHECK(memcmp(hash.begin(), &vOut[i * BTHHASH_OUTPUT_SIZE], BTHHASH_OUTPUT_SIZE) == 0);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(bthhash_batch_matches_scalar)
+{
+    // Odd sizes exercise the partially filled SIMD groups and empty branch buckets.
+    const size_t sizes[] = { 0, 1, 3, 4, 5, 17, 64, 131 };
+    for (int fSimd = 0; fSimd < 2; fSimd++) {
+        if (fSimd)
+            bthhash_detect_simd();
+        else
+            bthhash_use_scalar();
+        for (unsigned int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+            CheckBatchMatchesScalar(sizes[i]);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(bthhash_batch_nonce_range)
+{
+    bthhash_detect_simd();
+    unsigned char header[BTHHASH_HEADER_SIZE];
+    for (size_t i = 0; i < sizeof(header); i++)
+        header[i] = insecure_rand();
+
+    // Start just below the wrap-around to check the nonce encoding.
+    const uint32_t nStart = 0xfffffff8;
+    const size_t nCount = 19;
+    std::vector<unsigned char> vOut(nCount * BTHHASH_OUTPUT_SIZE);
+    bthhash_batch_nonces(header, nStart, nCount, &vOut[0]);
+    for (size_t i = 0; i < nCount; i++) {
+        uint32_t nNonce = nStart + i;
+        header[76] = nNonce & 0xff;
+        header[77] = (nNonce >> 8) & 0xff;
+        header[78] = (nNonce >> 16) & 0xff;
+        header[79] = (nNonce >> 24) & 0xff;
+        uint256 hash = bthhash(header, header + BTHHASH_HEADER_SIZE);
+        BOOST_CHECK(memcmp(hash.begin(), &vOut[i * BTHHASH_OUTPUT_SIZE], BTHHASH_OUTPUT_SIZE) == 0);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(bthhash_midstate)
+{
+    unsigned char header[BTHHASH_HEADER_SIZE];
+    for (int nHeader = 0; nHeader < 8; nHeader++) {
+        for (size_t i = 0; i < sizeof(header); i++)
+            header[i] = insecure_rand();
+        // The midstate must not depend on whatever nonce the header held.
+        CBthHashMidstate midstate(header);
+        const uint32_t nonces[] = { 0, 1, 0x80, 0xff00ff00, 0xffffffff, insecure_rand() };
+        for (unsigned int i = 0; i < sizeof(nonces) / sizeof(nonces[0]); i++) {
+            header[76] = nonces[i] & 0xff;
+            header[77] = (nonces[i] >> 8) & 0xff;
+            header[78] = (nonces[i] >> 16) & 0xff;
+            header[79] = (nonces[i] >> 24) & 0xff;
+            BOOST_CHECK(midstate.GetHash(nonces[i]) == bthhash(header, header + BTHHASH_HEADER_SIZE));
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(block_header_hash_cache)
+{
+    CBlockHeader header;
+    header.nVersion = 2;
+    header.hashPrevBlock = GetRandHash();
+    header.hashMerkleRoot = GetRandHash();
+    header.nTime = 1461110400;
+    header.nBits = 0x1e0ffff0;
+
+    uint256 hash = header.GetHash();
+    BOOST_CHECK(hash == bthhash(BEGIN(header.nVersion), END(header.nNonce)));
+    uint64_t nHits = CBlockHeader::GetHashCacheHits();
+    BOOST_CHECK(header.GetHash() == hash);
+    BOOST_CHECK(CBlockHeader::GetHashCacheHits() == nHits + 1);
+
+    // Writing any field directly must be noticed by the next call.
+    header.nNonce++;
+    BOOST_CHECK(header.GetHash() == bthhash(BEGIN(header.nVersion), END(header.nNonce)));
+    BOOST_CHECK(header.GetHash() != hash);
+    header.nNonce--;
+    BOOST_CHECK(header.GetHash() == hash);
+    header.hashMerkleRoot = GetRandHash();
+    BOOST_CHECK(header.GetHash() == bthhash(BEGIN(header.nVersion), END(header.nNonce)));
+
+    // Copies keep the cached hash valid.
+    CBlock block(header);
+    nHits = CBlockHeader::GetHashCacheHits();
+    BOOST_CHECK(block.GetHash() == header.GetHash());
+    BOOST_CHECK(block.GetBlockHeader().GetHash() == header.GetHash());
+    BOOST_CHECK(CBlockHeader::GetHashCacheHits() == nHits + 4);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -3,12 +3,17 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "coins.h"
+#include "main.h"
 #include "random.h"
+#include "script/script.h"
+#include "txdb.h"
 #include "uint256.h"
 
+#include <stdio.h>
 #include <vector>
 #include <map>
 
+#include <boost/filesystem.hpp>
 #include <boost/test/unit_test.hpp>
 
 namespace
@@ -41,7 +46,7 @@ public:
 
     uint256 GetBestBlock() const { return hashBestBlock_; }
 
-    bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock)
+    bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock, bool fErase = true)
     {
         for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end(); ) {
             map_[it->first] = it->second.coins;
@@ -49,15 +54,45 @@ public:
                 // Randomly delete empty entries on write.
                 map_.erase(it->first);
             }
-            mapCoins.erase(it++);
+            if (fErase)
+                mapCoins.erase(it++);
+            else
+                it++;
         }
-        mapCoins.clear();
+        if (fErase)
+            mapCoins.clear();
         hashBestBlock_ = hashBlock;
         return true;
     }
 
     bool GetStats(CCoinsStats& stats) const { return false; }
 };
+
+class CCoinsViewCacheTest : public CCoinsViewCache
+{
+public:
+    CCoinsViewCacheTest(CCoinsView* base) : CCoinsViewCache(base) {}
+
+    void SelfTest() const
+    {
+        // Manually recompute the dynamic usage of the whole data, and compare it.
+        size_t ret = memusage::DynamicUsage(cacheCoins);
+        for (CCoinsMap::iterator it = cacheCoins.begin(); it != cacheCoins.end(); it++) {
+            ret += it->second.coins.DynamicMemoryUsage();
+        }
+        BOOST_CHECK_EQUAL(DynamicMemoryUsage(), ret);
+    }
+
+    size_t DirtyCount() const
+    {
+        size_t ret = 0;
+        for (CCoinsMap::iterator it = cacheCoins.begin(); it != cacheCoins.end(); it++) {
+            if (it->second.flags & CCoinsCacheEntry::DIRTY)
+                ret++;
+        }
+        return ret;
+    }
+};
 }
 
 BOOST_AUTO_TEST_SUITE(coins_tests)
@@ -83,14 +118,15 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
     bool updated_an_entry = false;
     bool found_an_entry = false;
     bool missed_an_entry = false;
+    bool synced_a_cache = false;
 
     // A simple map to track what we expect the cache stack to represent.
     std::map<uint256, CCoins> result;
 
     // The cache stack.
     CCoinsViewTest base; // A CCoinsViewTest at the bottom.
-    std::vector<CCoinsViewCache*> stack; // A stack of CCoinsViewCaches on top.
-    stack.push_back(new CCoinsViewCache(&base)); // Start with one cache.
+    std::vector<CCoinsViewCacheTest*> stack; // A stack of CCoinsViewCaches on top.
+    stack.push_back(new CCoinsViewCacheTest(&base)); // Start with one cache.
 
     // Use a limited set of random transaction ids, so we do test overwriting entries.
     std::vector<uint256> txids;
@@ -135,6 +171,21 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
                     missed_an_entry = true;
                 }
             }
+            for (unsigned int j = 0; j < stack.size(); j++) {
+                stack[j]->SelfTest();
+            }
+        }
+
+        if (insecure_rand() % 100 == 0) {
+            // Every 100 iterations, sync and trim a random cache, which keeps
+            // the stack consistent while entries below are written or dropped.
+            if (stack.size() > 0 && insecure_rand() % 2 == 0) {
+                CCoinsViewCacheTest* cache = stack[insecure_rand() % stack.size()];
+                BOOST_CHECK(cache->Sync());
+                BOOST_CHECK_EQUAL(cache->DirtyCount(), 0U);
+                cache->Trim(cache->DynamicMemoryUsage() / 2);
+                synced_a_cache = true;
+            }
         }
 
         if (insecure_rand() % 100 == 0) {
@@ -151,7 +202,7 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
                 } else {
                     removed_all_caches = true;
                 }
-                stack.push_back(new CCoinsViewCache(tip));
+                stack.push_back(new CCoinsViewCacheTest(tip));
                 if (stack.size() == 4) {
                     reached_4_caches = true;
                 }
@@ -173,6 +224,219 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
     BOOST_CHECK(updated_an_entry);
     BOOST_CHECK(found_an_entry);
     BOOST_CHECK(missed_an_entry);
+    BOOST_CHECK(synced_a_cache);
+}
+
+BOOST_AUTO_TEST_CASE(ccoins_spend_memory)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vout.resize(8);
+    for (unsigned int i = 0; i < tx.vout.size(); i++) {
+        tx.vout[i].nValue = i + 1;
+        tx.vout[i].scriptPubKey = CScript() << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20, i) << OP_EQUALVERIFY << OP_CHECKSIG;
+    }
+    CCoins coins(tx, 100);
+    size_t nUsage = coins.DynamicMemoryUsage();
+
+    // The spent script moves to the undo data
+    CTxInUndo undo;
+    BOOST_CHECK(coins.Spend(COutPoint(0, 2), undo));
+    BOOST_CHECK(undo.txout == tx.vout[2]);
+    BOOST_CHECK_EQUAL(undo.nHeight, 0U);
+    BOOST_CHECK_EQUAL(coins.vout[2].scriptPubKey.capacity(), 0U);
+    BOOST_CHECK_EQUAL(coins.DynamicMemoryUsage(), nUsage - RecursiveDynamicUsage(tx.vout[2].scriptPubKey));
+
+    // Spending the tail gives back the unused part of vout
+    for (unsigned int i = 7; i >= 3; i--)
+        BOOST_CHECK(coins.Spend(COutPoint(0, i), undo));
+    BOOST_CHECK_EQUAL(coins.vout.size(), 2U);
+    BOOST_CHECK_EQUAL(coins.vout.capacity(), 2U);
+    BOOST_CHECK(coins.vout[1] == tx.vout[1]);
+
+    BOOST_CHECK(coins.Spend(COutPoint(0, 0), undo));
+    BOOST_CHECK(coins.Spend(COutPoint(0, 1), undo));
+    BOOST_CHECK(coins.IsPruned());
+    BOOST_CHECK_EQUAL(coins.DynamicMemoryUsage(), 0U);
+    BOOST_CHECK_EQUAL(undo.nHeight, 100U);
+}
+
+BOOST_AUTO_TEST_CASE(coins_cache_sync_trim)
+{
+    CCoinsViewTest base;
+    CCoinsViewCacheTest cache(&base);
+
+    // Copies of the same scripts, so every entry uses the same memory
+    CScript scriptSmall = CScript() << OP_TRUE;
+    CScript scriptLarge = CScript() << std::vector<unsigned char>(100, 0x42) << OP_DROP << OP_TRUE;
+    std::vector<uint256> txids(20);
+    for (unsigned int i = 0; i < txids.size(); i++) {
+        txids[i] = GetRandHash();
+        CCoinsModifier entry = cache.ModifyCoins(txids[i]);
+        entry->nVersion = 1;
+        entry->vout.resize(2);
+        entry->vout[0].nValue = i + 1;
+        entry->vout[0].scriptPubKey = scriptSmall;
+        entry->vout[1].nValue = i + 1;
+        entry->vout[1].scriptPubKey = scriptLarge;
+    }
+    cache.SelfTest();
+    BOOST_CHECK_EQUAL(cache.GetCacheMisses(), 20U);
+    BOOST_CHECK(cache.DynamicMemoryUsage() > 20 * 2 * 100);
+
+    // Dirty entries are never dropped
+    size_t nUsage = cache.DynamicMemoryUsage();
+    cache.Trim(0);
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 20U);
+    BOOST_CHECK_EQUAL(cache.DynamicMemoryUsage(), nUsage);
+
+    // Sync writes everything but keeps it cached; spent entries are dropped
+    {
+        CCoinsModifier entry = cache.ModifyCoins(txids[0]);
+        entry->Clear();
+    }
+    cache.SetBestBlock(txids[0]);
+    BOOST_CHECK(cache.Sync());
+    cache.SelfTest();
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 19U);
+    BOOST_CHECK_EQUAL(cache.DirtyCount(), 0U);
+    BOOST_CHECK(base.GetBestBlock() == txids[0]);
+    CCoins coins;
+    BOOST_CHECK(base.GetCoins(txids[1], coins));
+    BOOST_CHECK_EQUAL(coins.vout[0].nValue, 2);
+
+    uint64_t nHits = cache.GetCacheHits();
+    uint64_t nMisses = cache.GetCacheMisses();
+    BOOST_CHECK(cache.HaveCoins(txids[1]));
+    BOOST_CHECK_EQUAL(cache.GetCacheHits(), nHits + 1);
+
+    // A trim pass clears the accessed marks, so entries used after it
+    // survive the next one while the others go first
+    nUsage = cache.DynamicMemoryUsage();
+    cache.Trim(nUsage - 1);
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 18U);
+    size_t nEntryUsage = nUsage - cache.DynamicMemoryUsage();
+    for (unsigned int i = 10; i < txids.size(); i++)
+        BOOST_CHECK(cache.AccessCoins(txids[i]));
+    cache.Trim(cache.DynamicMemoryUsage() - (cache.GetCacheSize() - 10) * nEntryUsage);
+    cache.SelfTest();
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 10U);
+    nMisses = cache.GetCacheMisses();
+    for (unsigned int i = 10; i < txids.size(); i++)
+        BOOST_CHECK(cache.AccessCoins(txids[i]));
+    BOOST_CHECK_EQUAL(cache.GetCacheMisses(), nMisses);
+    cache.Trim(0);
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 0U);
+    cache.SelfTest();
+
+    // Dropped entries are read back from the base
+    nMisses = cache.GetCacheMisses();
+    const CCoins* pcoins = cache.AccessCoins(txids[5]);
+    BOOST_CHECK(pcoins && pcoins->vout[1].nValue == 6);
+    BOOST_CHECK_EQUAL(cache.GetCacheMisses(), nMisses + 1);
+    BOOST_CHECK(!cache.HaveCoins(txids[0]));
+
+    // With a memory budget, Flush() writes through and trims rather than emptying
+    for (unsigned int i = 1; i < txids.size(); i++)
+        BOOST_CHECK(cache.AccessCoins(txids[i]));
+    {
+        CCoinsModifier entry = cache.ModifyCoins(txids[1]);
+        entry->vout[0].nValue = 100;
+    }
+    nUsage = cache.DynamicMemoryUsage();
+    cache.SetMaxUsage(nUsage);
+    BOOST_CHECK(cache.Flush());
+    cache.SelfTest();
+    BOOST_CHECK_EQUAL(cache.DirtyCount(), 0U);
+    BOOST_CHECK(cache.GetCacheSize() > 0);
+    BOOST_CHECK(cache.DynamicMemoryUsage() <= nUsage / 4 * 3);
+    BOOST_CHECK(base.GetCoins(txids[1], coins));
+    BOOST_CHECK_EQUAL(coins.vout[0].nValue, 100);
+
+    // An entry limit is trimmed to as well, even when the memory budget is not reached
+    for (unsigned int i = 1; i < txids.size(); i++)
+        BOOST_CHECK(cache.AccessCoins(txids[i]));
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 19U);
+    cache.SetMaxUsage(cache.DynamicMemoryUsage() * 2, 8);
+    BOOST_CHECK(cache.Flush());
+    cache.SelfTest();
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 6U);
+}
+
+BOOST_AUTO_TEST_CASE(coins_snapshot_roundtrip)
+{
+    CCoinsViewDB dbSource(1 << 20, true);
+    CCoinsViewCache cache(&dbSource);
+    for (int i = 0; i < 200; i++) {
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout.hash = GetRandHash();
+        tx.vout.resize(1 + insecure_rand() % 3);
+        for (unsigned int j = 0; j < tx.vout.size(); j++) {
+            tx.vout[j].nValue = insecure_rand() % 100000;
+            tx.vout[j].scriptPubKey = CScript() << OP_TRUE;
+        }
+        cache.ModifyCoins(CTransaction(tx).GetHash())->FromTx(tx, i);
+    }
+    uint256 hashBlock = GetRandHash();
+    cache.SetBestBlock(hashBlock);
+    BOOST_CHECK(cache.Flush());
+
+    CBlockIndex index;
+    index.phashBlock = &hashBlock;
+    index.nHeight = 199;
+    mapBlockIndex[hashBlock] = &index;
+
+    CCoinsStats statsSource;
+    BOOST_CHECK(dbSource.GetStats(statsSource));
+
+    boost::filesystem::path path = GetTempPath() / strprintf("test_snapshot_%lu", (unsigned long)GetRand(1000000));
+    {
+        CAutoFile fileout(fopen(path.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+        CCoinsStats statsDump;
+        BOOST_CHECK(dbSource.DumpSnapshot(fileout, statsDump));
+        BOOST_CHECK_EQUAL(statsDump.nTransactions, 200U);
+        BOOST_CHECK_EQUAL(statsDump.hashSerialized.ToString(), statsSource.hashSerialized.ToString());
+    }
+
+    {
+        CCoinsViewDB dbLoad(GetTempPath() / "snapshot_load", 1 << 20, true);
+        CAutoFile filein(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+        CCoinsSnapshotHeader header;
+        CCoinsStats statsLoad;
+        BOOST_CHECK(dbLoad.LoadSnapshot(filein, header, statsLoad));
+        BOOST_CHECK_EQUAL(header.nHeight, 199);
+        BOOST_CHECK(dbLoad.GetBestBlock() == hashBlock);
+
+        // The loaded database hashes the same as the one that was dumped
+        CCoinsStats statsLoaded;
+        BOOST_CHECK(dbLoad.GetStats(statsLoaded));
+        BOOST_CHECK_EQUAL(statsLoaded.hashSerialized.ToString(), statsSource.hashSerialized.ToString());
+        BOOST_CHECK_EQUAL(statsLoaded.nTotalAmount, statsSource.nTotalAmount);
+        BOOST_CHECK_EQUAL(statsLoad.nSerializedSize, statsSource.nSerializedSize);
+    }
+
+    // A corrupted snapshot is refused and leaves the best block unset
+    {
+        FILE* file = fopen(path.string().c_str(), "r+b");
+        fseek(file, 0, SEEK_END);
+        long nSize = ftell(file);
+        fseek(file, nSize / 2, SEEK_SET);
+        int ch = fgetc(file);
+        fseek(file, nSize / 2, SEEK_SET);
+        fputc(ch ^ 0x01, file);
+        fclose(file);
+
+        CCoinsViewDB dbLoad(GetTempPath() / "snapshot_corrupt", 1 << 20, true);
+        CAutoFile filein(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+        CCoinsSnapshotHeader header;
+        CCoinsStats statsLoad;
+        BOOST_CHECK(!dbLoad.LoadSnapshot(filein, header, statsLoad));
+        BOOST_CHECK(dbLoad.GetBestBlock() == 0);
+    }
+
+    mapBlockIndex.erase(hashBlock);
+    boost::filesystem::remove(path);
 }
 
 BOOST_AUTO_TEST_SUITE_END()
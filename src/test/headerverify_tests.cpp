@@ -0,0 +1,89 @@
+// Copyright (c) 2016 The HealthHeldToken developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "chainparams.h"
+#include "crypto/bthhash.h"
+#include "headerverify.h"
+#include "pow.h"
+#include "random.h"
+
+#include <boost/bind.hpp>
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+BOOST_AUTO_TEST_SUITE(headerverify_tests)
+
+static std::vector<CBlockHeader> BuildHeaders(size_t nCount)
+{
+    std::vector<CBlockHeader> vHeaders(nCount);
+    uint256 hashPrev = GetRandHash();
+    for (size_t i = 0; i < nCount; i++) {
+        CBlockHeader& header = vHeaders[i];
+        header.hashPrevBlock = hashPrev;
+        header.hashMerkleRoot = GetRandHash();
+        header.nTime = 1400000000 + i * 30;
+        header.nBits = 0x207fffff;
+        while (!CheckProofOfWork(header.GetHash(), header.nBits))
+            header.nNonce++;
+        hashPrev = header.GetHash();
+    }
+    return vHeaders;
+}
+
+BOOST_AUTO_TEST_CASE(headerverify_pipeline)
+{
+    // The regtest limit lets the headers be ground in a couple of tries
+    SelectParams(CBaseChainParams::REGTEST);
+
+    CHeaderVerifyQueue queue(2);
+    boost::thread_group threadGroup;
+    for (int i = 0; i < 3; i++)
+        threadGroup.create_thread(boost::bind(&CHeaderVerifyQueue::Thread, &queue));
+
+    std::vector<CBlockHeader> vHeaders1 = BuildHeaders(150);
+    std::vector<CBlockHeader> vHeaders2 = BuildHeaders(10);
+    std::vector<CBlockHeader> vExpected1 = vHeaders1;
+    // Break the proof-of-work of one header in the third chunk
+    vHeaders1[140].nBits = 0x03000001;
+
+    queue.Push(1, vHeaders1);
+    queue.Push(2, vHeaders2);
+    BOOST_CHECK(vHeaders1.empty());
+
+    CHeaderVerifyQueue::Batch batch;
+    BOOST_CHECK(queue.Pop(batch));
+    BOOST_CHECK_EQUAL(batch.nPeer, 1);
+    BOOST_CHECK_EQUAL(batch.vHeaders.size(), 150U);
+    BOOST_CHECK_EQUAL(batch.nValid, 140U);
+    // The batch hashes seeded the cache with the scalar bthhash result
+    for (size_t i = 0; i < batch.vHeaders.size(); i += 7) {
+        const unsigned char* pbegin = (const unsigned char*)&batch.vHeaders[i].nVersion;
+        uint256 hash = bthhash(pbegin, pbegin + 80);
+        uint64_t nHits = CBlockHeader::GetHashCacheHits();
+        BOOST_CHECK(batch.vHeaders[i].GetHash() == hash);
+        BOOST_CHECK_EQUAL(CBlockHeader::GetHashCacheHits(), nHits + 1);
+        if (i != 140)
+            BOOST_CHECK(hash == vExpected1[i].GetHash());
+    }
+
+    BOOST_CHECK(queue.Pop(batch));
+    BOOST_CHECK_EQUAL(batch.nPeer, 2);
+    BOOST_CHECK_EQUAL(batch.nValid, 10U);
+    BOOST_CHECK(!queue.Pop(batch, false));
+
+    // An empty batch completes immediately
+    std::vector<CBlockHeader> vEmpty;
+    queue.Push(3, vEmpty);
+    BOOST_CHECK(queue.Pop(batch, false));
+    BOOST_CHECK_EQUAL(batch.nPeer, 3);
+    BOOST_CHECK(batch.vHeaders.empty());
+    BOOST_CHECK_EQUAL(queue.Size(), 0U);
+
+    threadGroup.interrupt_all();
+    threadGroup.join_all();
+
+    SelectParams(CBaseChainParams::UNITTEST);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
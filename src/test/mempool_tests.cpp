@@ -11,6 +11,19 @@
 
 BOOST_AUTO_TEST_SUITE(mempool_tests)
 
+/** A one-input, one-output transaction spending output n of hashPrev. */
+static CMutableTransaction MakeTestTx(const uint256& hashPrev, uint32_t n)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].scriptSig = CScript() << OP_11;
+    tx.vin[0].prevout = COutPoint(hashPrev, n);
+    tx.vout.resize(1);
+    tx.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx.vout[0].nValue = 10000LL;
+    return tx;
+}
+
 BOOST_AUTO_TEST_CASE(MempoolRemoveTest)
 {
     // Test CTxMemPool::remove functionality
@@ -99,4 +112,163 @@ BOOST_AUTO_TEST_CASE(MempoolRemoveTest)
     removed.clear();
 }
 
+BOOST_AUTO_TEST_CASE(MempoolMiningIndexTest)
+{
+    // Test that the fee rate and priority indexes follow mapTx
+    CTxMemPool testPool(CFeeRate(0));
+    CMutableTransaction tx[3];
+    for (int i = 0; i < 3; i++)
+    {
+        tx[i] = MakeTestTx(uint256(), i);
+        // Same size, so fee rate follows fee; priority falls as fee rises
+        testPool.addUnchecked(tx[i].GetHash(), CTxMemPoolEntry(tx[i], 1000 * (i + 1), 0, 3.0 - i, 1));
+    }
+    const CTxMemPool::indexed_transaction_set::index<fee_rate_score>::type& byFeeRate = testPool.mapTx.get<fee_rate_score>();
+    const CTxMemPool::indexed_transaction_set::index<priority_score>::type& byPriority = testPool.mapTx.get<priority_score>();
+    BOOST_CHECK_EQUAL(byFeeRate.size(), 3);
+    BOOST_CHECK(byFeeRate.rbegin()->GetTx().GetHash() == tx[2].GetHash());
+    BOOST_CHECK(byPriority.rbegin()->GetTx().GetHash() == tx[0].GetHash());
+
+    // Prioritising re-sorts the indexes, clearing it restores the order
+    testPool.PrioritiseTransaction(tx[0].GetHash(), tx[0].GetHash().ToString(), 10.0, 5000);
+    BOOST_CHECK_EQUAL(byFeeRate.size(), 3);
+    BOOST_CHECK(byFeeRate.rbegin()->GetTx().GetHash() == tx[0].GetHash());
+    testPool.PrioritiseTransaction(tx[2].GetHash(), tx[2].GetHash().ToString(), 20.0, 0);
+    BOOST_CHECK(byPriority.rbegin()->GetTx().GetHash() == tx[2].GetHash());
+    testPool.ClearPrioritisation(tx[0].GetHash());
+    testPool.ClearPrioritisation(tx[2].GetHash());
+    BOOST_CHECK(byFeeRate.rbegin()->GetTx().GetHash() == tx[2].GetHash());
+    BOOST_CHECK(byPriority.rbegin()->GetTx().GetHash() == tx[0].GetHash());
+
+    std::list<CTransaction> removed;
+    size_t nUsage = testPool.DynamicMemoryUsage();
+    testPool.remove(tx[2], removed, false);
+    BOOST_CHECK(testPool.DynamicMemoryUsage() < nUsage);
+    BOOST_CHECK_EQUAL(byFeeRate.size(), 2);
+    BOOST_CHECK_EQUAL(byPriority.size(), 2);
+    BOOST_CHECK(byFeeRate.rbegin()->GetTx().GetHash() == tx[1].GetHash());
+
+    testPool.clear();
+    BOOST_CHECK(byFeeRate.empty());
+    BOOST_CHECK(byPriority.empty());
+}
+
+BOOST_AUTO_TEST_CASE(MempoolDescendantStateTest)
+{
+    // A chain parent -> child -> grandchild, with the parent's fee bumped
+    CMutableTransaction txChain[3];
+    for (int i = 0; i < 3; i++)
+        txChain[i] = MakeTestTx(i > 0 ? txChain[i - 1].GetHash() : uint256(), 0);
+
+    CTxMemPool testPool(CFeeRate(0));
+    testPool.addUnchecked(txChain[0].GetHash(), CTxMemPoolEntry(txChain[0], 100, 0, 0.0, 1));
+    testPool.addUnchecked(txChain[1].GetHash(), CTxMemPoolEntry(txChain[1], 200, 0, 0.0, 1));
+    testPool.PrioritiseTransaction(txChain[0].GetHash(), txChain[0].GetHash().ToString(), 0.0, 1000);
+    // Grandchild enters after the parent was prioritised
+    testPool.addUnchecked(txChain[2].GetHash(), CTxMemPoolEntry(txChain[2], 400, 0, 0.0, 1));
+
+    CTxMemPool::txiter it = testPool.mapTx.find(txChain[0].GetHash());
+    size_t nTxSize = it->GetTxSize();
+    BOOST_CHECK_EQUAL(it->GetCountWithDescendants(), 3);
+    BOOST_CHECK_EQUAL(it->GetSizeWithDescendants(), 3 * nTxSize);
+    BOOST_CHECK_EQUAL(it->GetModFeesWithDescendants(), 1700);
+    it = testPool.mapTx.find(txChain[1].GetHash());
+    BOOST_CHECK_EQUAL(it->GetCountWithDescendants(), 2);
+    BOOST_CHECK_EQUAL(it->GetModFeesWithDescendants(), 600);
+
+    // The cheapest package is the child with the grandchild; the parent is
+    // scored by its own, prioritised, fee rate
+    BOOST_CHECK(testPool.mapTx.get<descendant_score>().begin()->GetTx().GetHash() == txChain[1].GetHash());
+
+    // Removing the parent for a block leaves the child's package alone
+    std::list<CTransaction> removed;
+    testPool.remove(txChain[0], removed, false);
+    it = testPool.mapTx.find(txChain[1].GetHash());
+    BOOST_CHECK_EQUAL(it->GetCountWithDescendants(), 2);
+
+    // Removing the grandchild shrinks the child's package
+    testPool.remove(txChain[2], removed, false);
+    it = testPool.mapTx.find(txChain[1].GetHash());
+    BOOST_CHECK_EQUAL(it->GetCountWithDescendants(), 1);
+    BOOST_CHECK_EQUAL(it->GetSizeWithDescendants(), nTxSize);
+    BOOST_CHECK_EQUAL(it->GetModFeesWithDescendants(), 200);
+
+    // Putting the parent back (as in a re-org) adds the child to its package
+    testPool.addUnchecked(txChain[0].GetHash(), CTxMemPoolEntry(txChain[0], 100, 0, 0.0, 1));
+    it = testPool.mapTx.find(txChain[0].GetHash());
+    BOOST_CHECK_EQUAL(it->GetCountWithDescendants(), 2);
+    BOOST_CHECK_EQUAL(it->GetModFeesWithDescendants(), 1300);
+
+    // Recursive removal takes the whole package
+    testPool.remove(txChain[0], removed, true);
+    BOOST_CHECK_EQUAL(testPool.size(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolSizeLimitTest)
+{
+    // Three unrelated transactions at increasing fee rate and entry time
+    CTxMemPool testPool(CFeeRate(0));
+    CMutableTransaction tx[3];
+    for (int i = 0; i < 3; i++)
+    {
+        tx[i] = MakeTestTx(uint256(), i);
+        testPool.addUnchecked(tx[i].GetHash(), CTxMemPoolEntry(tx[i], 1000 * (i + 1), 100 * (i + 1), 0.0, 1));
+    }
+
+    // Trimming drops the cheapest transaction first
+    testPool.TrimToSize(testPool.DynamicMemoryUsage() - 1);
+    BOOST_CHECK_EQUAL(testPool.size(), 2);
+    BOOST_CHECK(!testPool.exists(tx[0].GetHash()));
+
+    // Expiry drops what entered before the given time
+    BOOST_CHECK_EQUAL(testPool.Expire(250), 1);
+    BOOST_CHECK(!testPool.exists(tx[1].GetHash()));
+    BOOST_CHECK(testPool.exists(tx[2].GetHash()));
+
+    // With a limit set, a transaction that does not fit is not kept
+    testPool.SetLimits(testPool.DynamicMemoryUsage(), 0);
+    BOOST_CHECK(!testPool.addUnchecked(tx[0].GetHash(), CTxMemPoolEntry(tx[0], 1000, 100, 0.0, 1)));
+    BOOST_CHECK_EQUAL(testPool.size(), 1);
+    BOOST_CHECK(testPool.exists(tx[2].GetHash()));
+    BOOST_CHECK_EQUAL(testPool.GetMaxUsage(), testPool.DynamicMemoryUsage());
+}
+
+BOOST_AUTO_TEST_CASE(MempoolRollingMinFeeTest)
+{
+    int64_t nStart = GetTime();
+    SetMockTime(nStart);
+    CTxMemPool testPool(CFeeRate(1000));
+    CMutableTransaction tx[2];
+    for (int i = 0; i < 2; i++)
+    {
+        tx[i] = MakeTestTx(uint256(), i);
+        testPool.addUnchecked(tx[i].GetHash(), CTxMemPoolEntry(tx[i], 1000 * (i + 1), nStart, 0.0, 1));
+    }
+    BOOST_CHECK(testPool.GetMinFee() == CFeeRate(0));
+
+    // Evicting a package sets the minimum to its fee rate plus the relay minimum
+    size_t nTxSize = testPool.mapTx.find(tx[0].GetHash())->GetTxSize();
+    testPool.TrimToSize(testPool.DynamicMemoryUsage() - 1);
+    BOOST_CHECK_EQUAL(testPool.size(), 1);
+    CFeeRate feeRateMin(CFeeRate(1000, nTxSize).GetFeePerK() + 1000);
+    BOOST_CHECK(testPool.GetMinFee() == feeRateMin);
+
+    // It holds until a block arrives...
+    SetMockTime(nStart + 3600);
+    BOOST_CHECK(testPool.GetMinFee() == feeRateMin);
+
+    // ...and then decays...
+    std::vector<CTransaction> vtx;
+    std::list<CTransaction> conflicts;
+    testPool.removeForBlock(vtx, 1, conflicts);
+    SetMockTime(nStart + 2 * 3600);
+    BOOST_CHECK(testPool.GetMinFee() < feeRateMin);
+    BOOST_CHECK(testPool.GetMinFee() > CFeeRate(1000));
+
+    // ...until it is no longer worth enforcing
+    SetMockTime(nStart + 30 * 24 * 3600);
+    BOOST_CHECK(testPool.GetMinFee() == CFeeRate(0));
+    SetMockTime(0);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,169 @@
+// Copyright (c) 2016 The HealthHeldToken developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "net.h"
+
+#include "chainparams.h"
+#include "hash.h"
+#include "primitives/transaction.h"
+#include "random.h"
+#include "version.h"
+
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+static CDataStream MakeMessage(const char* pszCommand, const vector<unsigned char>& vPayload)
+{
+    CMessageHeader hdr(pszCommand, vPayload.size());
+    uint256 hash = Hash(vPayload.begin(), vPayload.end());
+    memcpy(&hdr.nChecksum, &hash, sizeof(hdr.nChecksum));
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << hdr;
+    if (!vPayload.empty())
+        ss.write((const char*)&vPayload[0], vPayload.size());
+    return ss;
+}
+
+// Feed a message to a CNetMessage in pieces of nChunk bytes
+static void ReadMessage(CNetMessage& msg, const CDataStream& ss, unsigned int nChunk)
+{
+    const char* pch = &ss[0];
+    unsigned int nBytes = ss.size();
+    while (nBytes > 0) {
+        unsigned int nPiece = std::min(nChunk, nBytes);
+        int handled = msg.in_data ? msg.readData(pch, nPiece) : msg.readHeader(pch, nPiece);
+        BOOST_REQUIRE(handled > 0);
+        pch += handled;
+        nBytes -= handled;
+    }
+}
+
+BOOST_AUTO_TEST_SUITE(net_tests)
+
+BOOST_AUTO_TEST_CASE(netmessage_fragments)
+{
+    vector<unsigned char> vPayload(300000);
+    for (unsigned int i = 0; i < vPayload.size(); i++)
+        vPayload[i] = insecure_rand();
+    CDataStream ss = MakeMessage("block", vPayload);
+    uint256 hashExpected = Hash(vPayload.begin(), vPayload.end());
+
+    unsigned int vChunks[] = {1, 7, 24, 1000, 0x10000, ss.size()};
+    for (unsigned int i = 0; i < sizeof(vChunks) / sizeof(vChunks[0]); i++) {
+        // Recycled buffers from earlier rounds must not leak old data or sizes
+        CNetMessage msg(SER_NETWORK, PROTOCOL_VERSION);
+        ReadMessage(msg, ss, vChunks[i]);
+        BOOST_REQUIRE(msg.complete());
+        BOOST_CHECK_EQUAL(msg.hdr.GetCommand(), "block");
+        BOOST_CHECK_EQUAL(msg.hdr.nMessageSize, vPayload.size());
+        BOOST_CHECK_EQUAL(msg.vRecv.size(), vPayload.size());
+        BOOST_CHECK(memcmp(&msg.vRecv[0], &vPayload[0], vPayload.size()) == 0);
+        BOOST_CHECK(memcmp(&msg.hdr.nChecksum, &hashExpected, sizeof(msg.hdr.nChecksum)) == 0);
+    }
+
+    // A smaller message after the large ones gets a buffer sized to its own payload
+    vector<unsigned char> vSmall(1000, 0x5a);
+    CNetMessage msg(SER_NETWORK, PROTOCOL_VERSION);
+    ReadMessage(msg, MakeMessage("tx", vSmall), 100);
+    BOOST_REQUIRE(msg.complete());
+    BOOST_CHECK_EQUAL(msg.vRecv.size(), vSmall.size());
+    BOOST_CHECK(memcmp(&msg.vRecv[0], &vSmall[0], vSmall.size()) == 0);
+}
+
+BOOST_AUTO_TEST_CASE(netmessage_direct_receive)
+{
+    // Part of the payload received in place, as the socket handler does, the rest copied
+    vector<unsigned char> vPayload(100000);
+    for (unsigned int i = 0; i < vPayload.size(); i++)
+        vPayload[i] = insecure_rand();
+    CDataStream ss = MakeMessage("block", vPayload);
+    CNetMessage msg(SER_NETWORK, PROTOCOL_VERSION);
+    const char* pch = &ss[0];
+    BOOST_REQUIRE_EQUAL(msg.readHeader(pch, CMessageHeader::HEADER_SIZE), CMessageHeader::HEADER_SIZE);
+    pch += CMessageHeader::HEADER_SIZE;
+
+    unsigned int nSpace = 0;
+    char* pchData = msg.GetDataBuffer(nSpace);
+    BOOST_REQUIRE(nSpace > 1000);
+    memcpy(pchData, pch, 1000);
+    msg.DataReceived(1000);
+    pch += 1000;
+    while (!msg.complete()) {
+        int handled = msg.readData(pch, 7000);
+        BOOST_REQUIRE(handled > 0);
+        pch += handled;
+    }
+    BOOST_CHECK(pch == &ss[0] + ss.size());
+    BOOST_CHECK_EQUAL(msg.vRecv.size(), vPayload.size());
+    BOOST_CHECK(memcmp(&msg.vRecv[0], &vPayload[0], vPayload.size()) == 0);
+}
+
+BOOST_AUTO_TEST_CASE(netmessage_empty_payload)
+{
+    CNetMessage msg(SER_NETWORK, PROTOCOL_VERSION);
+    ReadMessage(msg, MakeMessage("verack", vector<unsigned char>()), 5);
+    BOOST_REQUIRE(msg.complete());
+    BOOST_CHECK(msg.vRecv.empty());
+}
+
+BOOST_AUTO_TEST_CASE(relaycache_lru)
+{
+    CRelayCache cache;
+    vector<unsigned char> vPayload(10000, 0x42);
+    CSerializedNetMsg msg = SerializeNetMessage("tx", vPayload);
+
+    // The serialized message is what a peer would parse
+    CNetMessage netmsg(SER_NETWORK, PROTOCOL_VERSION);
+    CDataStream ss(msg->begin(), msg->end(), SER_NETWORK, PROTOCOL_VERSION);
+    ReadMessage(netmsg, ss, 1000);
+    BOOST_REQUIRE(netmsg.complete());
+    BOOST_CHECK_EQUAL(netmsg.hdr.GetCommand(), "tx");
+    uint256 hashPayload = Hash(netmsg.vRecv.begin(), netmsg.vRecv.end());
+    BOOST_CHECK(memcmp(&netmsg.hdr.nChecksum, &hashPayload, sizeof(netmsg.hdr.nChecksum)) == 0);
+
+    // Room for about four entries
+    cache.SetMaxSize(4 * (msg->capacity() + 200));
+    for (int i = 0; i < 4; i++)
+        cache.Insert(CInv(MSG_TX, i), msg);
+    BOOST_CHECK(cache.Get(CInv(MSG_TX, 0)) == msg);
+    // Evicts the least recently used entry, which is 1 now that 0 was looked up
+    cache.Insert(CInv(MSG_TX, 4), msg);
+    BOOST_CHECK(cache.Get(CInv(MSG_TX, 0)));
+    BOOST_CHECK(!cache.Get(CInv(MSG_TX, 1)));
+    BOOST_CHECK(cache.Get(CInv(MSG_TX, 4)));
+
+    CRelayCacheStats stats = cache.GetStats();
+    BOOST_CHECK_EQUAL(stats.nEntries, 4U);
+    BOOST_CHECK_EQUAL(stats.nHits, 3U);
+    BOOST_CHECK_EQUAL(stats.nMisses, 1U);
+    BOOST_CHECK(stats.nBytes <= stats.nMaxBytes);
+}
+
+BOOST_AUTO_TEST_CASE(relaycache_fill_on_request)
+{
+    CMutableTransaction mtx;
+    mtx.vin.resize(1);
+    mtx.vout.resize(1);
+    mtx.vout[0].nValue = insecure_rand();
+    CTransaction tx(mtx);
+    CInv inv(MSG_TX, tx.GetHash());
+
+    // Relaying only records the transaction; nothing is serialized for the cache yet
+    CRelayCacheStats statsBefore = relayCache.GetStats();
+    RelayTransaction(tx);
+    BOOST_CHECK_EQUAL(relayCache.GetStats().nEntries, statsBefore.nEntries);
+
+    // The first request fills the cache from mapRelay, the next one is served from it
+    CNode node(INVALID_SOCKET, CAddress(CService("127.0.0.1", Params().GetDefaultPort())), "", true);
+    BOOST_CHECK(node.PushCachedMessage(inv));
+    BOOST_CHECK(node.PushCachedMessage(inv));
+    BOOST_CHECK(!node.PushCachedMessage(CInv(MSG_TX, 1)));
+    CRelayCacheStats stats = relayCache.GetStats();
+    BOOST_CHECK_EQUAL(stats.nEntries, statsBefore.nEntries + 1);
+    BOOST_CHECK_EQUAL(stats.nHits, statsBefore.nHits + 1);
+    BOOST_CHECK_EQUAL(stats.nMisses, statsBefore.nMisses + 2);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
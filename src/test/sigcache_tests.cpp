@@ -0,0 +1,65 @@
+// Copyright (c) 2016 The HealthHeldToken developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "pubkey.h"
+#include "random.h"
+#include "script/sigcache.h"
+
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(sigcache_tests)
+
+BOOST_AUTO_TEST_CASE(sigcache_insert_erase)
+{
+    CSignatureCache cache;
+    cache.Setup(1 << 20);
+    BOOST_CHECK_EQUAL(cache.GetSize(), (1 << 20) / 32);
+
+    std::vector<unsigned char> vchSig(72, 0x30);
+    std::vector<unsigned char> vchPubKey(33, 0x02);
+    CPubKey pubkey(vchPubKey);
+    uint256 entry, entryOther;
+    cache.ComputeEntry(entry, GetRandHash(), vchSig, pubkey);
+    cache.ComputeEntry(entryOther, GetRandHash(), vchSig, pubkey);
+    BOOST_CHECK(entry != entryOther);
+
+    BOOST_CHECK(!cache.Contains(entry, false));
+    cache.Insert(entry);
+    BOOST_CHECK(cache.Contains(entry, false));
+    BOOST_CHECK(!cache.Contains(entryOther, false));
+
+    // A hit with erase removes the entry
+    BOOST_CHECK(cache.Contains(entry, true));
+    BOOST_CHECK(!cache.Contains(entry, false));
+    BOOST_CHECK(!cache.Contains(entry, true));
+
+    // and its slot can be used again
+    cache.Insert(entry);
+    BOOST_CHECK(cache.Contains(entry, false));
+
+    // An empty cache stores nothing
+    CSignatureCache cacheEmpty;
+    cacheEmpty.Insert(entry);
+    BOOST_CHECK(!cacheEmpty.Contains(entry, false));
+}
+
+BOOST_AUTO_TEST_CASE(sigcache_load)
+{
+    // Fill a small table to its capacity: cuckoo moves keep nearly all of it usable
+    CSignatureCache cache;
+    cache.Setup(64 * CSignatureCache::BUCKET_SIZE * 32);
+    std::vector<uint256> vEntries;
+    for (unsigned int i = 0; i < cache.GetSize(); i++) {
+        vEntries.push_back(GetRandHash());
+        cache.Insert(vEntries.back());
+    }
+    unsigned int nFound = 0;
+    for (unsigned int i = 0; i < vEntries.size(); i++)
+        nFound += cache.Contains(vEntries[i], false);
+    BOOST_CHECK(nFound >= vEntries.size() * 9 / 10);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -9,6 +9,7 @@
 #include <utility>
 #include <vector>
 
+#include <boost/assign/list_of.hpp>
 #include <boost/foreach.hpp>
 #include <boost/test/unit_test.hpp>
 
@@ -23,6 +24,8 @@ using namespace std;
 
 typedef set<pair<const CWalletTx*,unsigned int> > CoinSet;
 
+extern CWallet* pwalletMain;
+
 BOOST_AUTO_TEST_SUITE(wallet_tests)
 
 static CWallet wallet;
@@ -305,4 +308,189 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
     empty_wallet();
 }
 
+BOOST_AUTO_TEST_CASE(coin_selection_bnb)
+{
+    CoinSet setCoinsRet;
+    CAmount nValueRet;
+
+    LOCK(wallet.cs_wallet);
+
+    // 51 cents can only be made with the single 1 cent coin and 25 of the 2 cent ones
+    empty_wallet();
+    for (int i = 0; i < 1000; i++)
+        add_coin(2 * CENT);
+    add_coin(1 * CENT);
+
+    BOOST_CHECK(wallet.SelectCoinsMinConf(51 * CENT, 1, 6, vCoins, setCoinsRet, nValueRet));
+    BOOST_CHECK_EQUAL(nValueRet, 51 * CENT);
+    BOOST_CHECK_EQUAL(setCoinsRet.size(), 26U);
+    BOOST_CHECK_EQUAL(wallet.GetLastCoinSelection().strAlgorithm, "bnb");
+
+    // Without an exact match the bounded stochastic search still gets close
+    BOOST_CHECK(wallet.SelectCoinsMinConf(1501 * CENT + 1, 1, 6, vCoins, setCoinsRet, nValueRet));
+    BOOST_CHECK_GT(nValueRet, 1501 * CENT);
+    BOOST_CHECK(nValueRet <= 1505 * CENT);
+    BOOST_CHECK_EQUAL(wallet.GetLastCoinSelection().strAlgorithm, "approximate");
+    // The exact search ran out of branches rather than into its limit
+    BOOST_CHECK_GT(wallet.GetLastCoinSelection().nTries, 0U);
+    BOOST_CHECK_LT(wallet.GetLastCoinSelection().nTries, MAX_BNB_TRIES);
+
+    // No subset of even coins makes an odd target; the few branches are exhausted
+    empty_wallet();
+    add_coin(2 * CENT); add_coin(4 * CENT); add_coin(6 * CENT);
+    BOOST_CHECK(wallet.SelectCoinsMinConf(7 * CENT, 1, 6, vCoins, setCoinsRet, nValueRet));
+    BOOST_CHECK_EQUAL(nValueRet, 8 * CENT);
+    BOOST_CHECK_EQUAL(wallet.GetLastCoinSelection().strAlgorithm, "approximate");
+    BOOST_CHECK_GT(wallet.GetLastCoinSelection().nTries, 0U);
+    BOOST_CHECK_LT(wallet.GetLastCoinSelection().nTries, MAX_BNB_TRIES);
+
+    empty_wallet();
+}
+
+BOOST_AUTO_TEST_CASE(rescan_filter)
+{
+    CWallet keystore;
+    CKey key[4];
+    for (int i = 0; i < 4; i++)
+        key[i].MakeNewKey(i % 2 == 0);
+    CScript scriptMultisig = GetScriptForMultisig(1, std::vector<CPubKey>(1, key[1].GetPubKey()));
+    CScript scriptWatch = CScript() << OP_RETURN << std::vector<unsigned char>(4, 0x42);
+    {
+        LOCK(keystore.cs_wallet);
+        BOOST_CHECK(keystore.AddKeyPubKey(key[0], key[0].GetPubKey()));
+        BOOST_CHECK(keystore.AddKeyPubKey(key[1], key[1].GetPubKey()));
+        BOOST_CHECK(keystore.AddCScript(scriptMultisig));
+        BOOST_CHECK(keystore.AddWatchOnly(scriptWatch));
+    }
+    CWalletScanFilter filter;
+    keystore.GetScanFilter(filter);
+
+    std::vector<CScript> vScripts;
+    for (int i = 0; i < 4; i++) {
+        vScripts.push_back(GetScriptForDestination(key[i].GetPubKey().GetID()));
+        vScripts.push_back(CScript() << ToByteVector(key[i].GetPubKey()) << OP_CHECKSIG);
+    }
+    vScripts.push_back(GetScriptForDestination(CScriptID(scriptMultisig)));
+    vScripts.push_back(GetScriptForDestination(CScriptID(CScript() << OP_TRUE)));
+    vScripts.push_back(scriptWatch);
+    vScripts.push_back(CScript() << OP_RETURN);
+
+    // The filter never misses what IsMine() accepts
+    BOOST_FOREACH(const CScript& script, vScripts) {
+        if (::IsMine(keystore, script) != ISMINE_NO)
+            BOOST_CHECK(filter.IsRelevant(script));
+    }
+    BOOST_CHECK(filter.IsRelevant(vScripts[0]));
+    BOOST_CHECK(filter.IsRelevant(vScripts[3]));
+    BOOST_CHECK(!filter.IsRelevant(vScripts[4]));
+    BOOST_CHECK(!filter.IsRelevant(vScripts[7]));
+    BOOST_CHECK(filter.IsRelevant(vScripts[8]));
+    BOOST_CHECK(!filter.IsRelevant(vScripts[9]));
+    BOOST_CHECK(filter.IsRelevant(scriptWatch));
+    BOOST_CHECK(!filter.IsRelevant(vScripts[11]));
+
+    // A multisig output with one of our keys is worth a closer look, even
+    // though IsMine() wants all of them
+    CScript scriptShared = GetScriptForMultisig(1, boost::assign::list_of(key[2].GetPubKey())(key[1].GetPubKey()));
+    BOOST_CHECK(::IsMine(keystore, scriptShared) == ISMINE_NO);
+    BOOST_CHECK(filter.IsRelevant(scriptShared));
+}
+
+BOOST_AUTO_TEST_CASE(unspent_tx_index)
+{
+    LOCK2(cs_main, pwalletMain->cs_wallet);
+    CScript scriptWatch = CScript() << OP_RETURN << std::vector<unsigned char>(4, 0x17);
+    CScript scriptOther = CScript() << OP_RETURN << std::vector<unsigned char>(4, 0x18);
+
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    tx.vout.resize(2);
+    tx.vout[0].nValue = COIN;
+    tx.vout[0].scriptPubKey = scriptWatch;
+    tx.vout[1].nValue = 2 * COIN;
+    tx.vout[1].scriptPubKey = scriptOther;
+    CWalletTx wtxReceive(pwalletMain, tx);
+    // Unconfirmed transactions only count while they are in the mempool
+    mempool.addUnchecked(wtxReceive.GetHash(), CTxMemPoolEntry(wtxReceive, 0, 0, 0.0, 1));
+    BOOST_CHECK(pwalletMain->AddToWallet(wtxReceive));
+    BOOST_CHECK(!pwalletMain->GetTxidsByScript().count(scriptWatch));
+    BOOST_CHECK_EQUAL(pwalletMain->GetUnconfirmedWatchOnlyBalance(), 0);
+
+    // Watching the script afterwards picks up the transaction already in the wallet
+    BOOST_CHECK(pwalletMain->AddWatchOnly(scriptWatch));
+    pwalletMain->MarkDirty();
+    BOOST_CHECK(pwalletMain->GetTxidsByScript().count(scriptWatch));
+    BOOST_CHECK(pwalletMain->GetTxidsByScript().find(scriptWatch)->second.count(wtxReceive.GetHash()));
+    BOOST_CHECK(!pwalletMain->GetTxidsByScript().count(scriptOther));
+    BOOST_CHECK_EQUAL(pwalletMain->GetUnconfirmedWatchOnlyBalance(), COIN);
+
+    // Spent by an unconfirmed wallet transaction
+    tx.vin[0].prevout = COutPoint(wtxReceive.GetHash(), 0);
+    tx.vout.resize(1);
+    tx.vout[0].scriptPubKey = scriptOther;
+    tx.vout[0].nValue = COIN;
+    CWalletTx wtxSpend(pwalletMain, tx);
+    mempool.addUnchecked(wtxSpend.GetHash(), CTxMemPoolEntry(wtxSpend, 0, 0, 0.0, 1));
+    pwalletMain->SyncTransaction(wtxSpend, NULL);
+    BOOST_CHECK(pwalletMain->mapWallet.count(wtxSpend.GetHash()));
+    BOOST_CHECK_EQUAL(pwalletMain->GetUnconfirmedWatchOnlyBalance(), 0);
+
+    // Without the spend the output counts again
+    pwalletMain->EraseFromWallet(wtxSpend.GetHash());
+    BOOST_CHECK_EQUAL(pwalletMain->GetUnconfirmedWatchOnlyBalance(), COIN);
+
+    pwalletMain->EraseFromWallet(wtxReceive.GetHash());
+    BOOST_CHECK(!pwalletMain->GetTxidsByScript().count(scriptWatch));
+    BOOST_CHECK_EQUAL(pwalletMain->GetUnconfirmedWatchOnlyBalance(), 0);
+    mempool.clear();
+}
+
+BOOST_AUTO_TEST_CASE(parallel_wallet_load)
+{
+    // Enough keys and transactions for LoadWallet to decode them on threads
+    const unsigned int nRecords = WALLET_LOAD_PARALLEL_MIN / 2 + 10;
+    std::vector<CPubKey> vPubKeys;
+    std::vector<uint256> vTxids;
+    {
+        CWallet walletOut("wallet_load_test.dat");
+        LOCK2(cs_main, walletOut.cs_wallet);
+        for (unsigned int i = 0; i < nRecords; i++)
+        {
+            vPubKeys.push_back(walletOut.GenerateNewKey());
+
+            CMutableTransaction tx;
+            tx.vin.resize(1);
+            tx.vin[0].prevout = COutPoint(GetRandHash(), i);
+            tx.vout.resize(1);
+            tx.vout[0].nValue = COIN;
+            tx.vout[0].scriptPubKey = GetScriptForDestination(vPubKeys.back().GetID());
+            CWalletTx wtx(&walletOut, tx);
+            BOOST_CHECK(walletOut.AddToWallet(wtx));
+            vTxids.push_back(wtx.GetHash());
+        }
+    }
+
+    CWallet walletIn("wallet_load_test.dat");
+    bool fFirstRun;
+    BOOST_CHECK_EQUAL(walletIn.LoadWallet(fFirstRun), DB_LOAD_OK);
+    LOCK2(cs_main, walletIn.cs_wallet);
+    BOOST_CHECK_EQUAL(walletIn.mapWallet.size(), nRecords);
+    BOOST_FOREACH(const CPubKey& pubkey, vPubKeys)
+        BOOST_CHECK(walletIn.HaveKey(pubkey.GetID()));
+
+    // Loaded in file order, the order positions survive
+    std::set<int64_t> setOrderPos;
+    BOOST_FOREACH(const uint256& hash, vTxids)
+    {
+        BOOST_CHECK(walletIn.mapWallet.count(hash));
+        setOrderPos.insert(walletIn.mapWallet[hash].nOrderPos);
+    }
+    BOOST_CHECK_EQUAL(setOrderPos.size(), nRecords);
+
+    // The script index is built on the first query after the load
+    BOOST_CHECK_EQUAL(walletIn.GetTxidsByScript().size(), nRecords);
+    BOOST_CHECK(walletIn.GetTxidsByScript().count(walletIn.mapWallet[vTxids[0]].vout[0].scriptPubKey));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,178 @@
+// Copyright (c) 2016 The HealthHeldToken developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "walletlog.h"
+
+#include "clientversion.h"
+#include "streams.h"
+#include "util.h"
+
+#include <string>
+#include <utility>
+
+#include <boost/filesystem.hpp>
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+// Records are keyed the way CDB serializes them
+template <typename T>
+static CSerializeData Ser(const T& obj)
+{
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << obj;
+    return CSerializeData(ss.begin(), ss.end());
+}
+
+static CWalletLog::Op Put(const CSerializeData& key, const CSerializeData& value)
+{
+    CWalletLog::Op op;
+    op.fErase = false;
+    op.key = key;
+    op.value = value;
+    return op;
+}
+
+static CWalletLog::Op Erase(const CSerializeData& key)
+{
+    CWalletLog::Op op;
+    op.fErase = true;
+    op.key = key;
+    return op;
+}
+
+static boost::filesystem::path LogPath(const string& strName)
+{
+    boost::filesystem::path path = GetDataDir() / strName;
+    boost::filesystem::remove(path);
+    return path;
+}
+
+BOOST_AUTO_TEST_SUITE(walletlog_tests)
+
+BOOST_AUTO_TEST_CASE(walletlog_replay)
+{
+    boost::filesystem::path path = LogPath("walletlog_replay.dat");
+    CWalletLog log;
+    BOOST_CHECK(!log.Open(path, false));
+    BOOST_CHECK(log.Open(path, true));
+    BOOST_CHECK(CWalletLog::IsLogFile(path));
+
+    CWalletLog::Batch batch;
+    batch.push_back(Put(Ser(string("a")), Ser(1)));
+    batch.push_back(Put(Ser(string("b")), Ser(2)));
+    batch.push_back(Put(Ser(string("c")), Ser(3)));
+    BOOST_CHECK(log.Write(batch, true));
+    batch.clear();
+    batch.push_back(Put(Ser(string("a")), Ser(4)));
+    batch.push_back(Erase(Ser(string("b"))));
+    BOOST_CHECK(log.Write(batch, false));
+    log.Close();
+
+    BOOST_CHECK(log.Open(path, false));
+    CSerializeData value;
+    BOOST_CHECK(log.Read(Ser(string("a")), value) && value == Ser(4));
+    BOOST_CHECK(!log.Exists(Ser(string("b"))));
+    BOOST_CHECK(log.Read(Ser(string("c")), value) && value == Ser(3));
+    log.Close();
+}
+
+BOOST_AUTO_TEST_CASE(walletlog_torn_write)
+{
+    boost::filesystem::path path = LogPath("walletlog_torn.dat");
+    CWalletLog log;
+    BOOST_CHECK(log.Open(path, true));
+    BOOST_CHECK(log.Write(CWalletLog::Batch(1, Put(Ser(string("a")), Ser(1))), true));
+    uintmax_t nSize = boost::filesystem::file_size(path);
+
+    // A crash in the middle of the second batch loses all of it
+    CWalletLog::Batch batch;
+    batch.push_back(Put(Ser(string("a")), Ser(2)));
+    batch.push_back(Put(Ser(string("b")), Ser(2)));
+    BOOST_CHECK(log.Write(batch, true));
+    log.Close();
+    uintmax_t nSizeTorn = boost::filesystem::file_size(path) - 5;
+    boost::filesystem::resize_file(path, nSizeTorn);
+
+    BOOST_CHECK(log.Open(path, false));
+    BOOST_CHECK_EQUAL(boost::filesystem::file_size(path), nSize);
+    // The cut off frame could have had a damaged size, so it is kept aside
+    uintmax_t nSizeTail = 0;
+    for (boost::filesystem::directory_iterator it(path.parent_path()); it != boost::filesystem::directory_iterator(); it++) {
+        string strName = it->path().filename().string();
+        if (strName.find(path.filename().string() + ".") == 0 && it->path().extension() == ".corrupt") {
+            nSizeTail = boost::filesystem::file_size(it->path());
+            boost::filesystem::remove(it->path());
+            break;
+        }
+    }
+    BOOST_CHECK_EQUAL(nSizeTail, nSizeTorn - nSize);
+    CSerializeData value;
+    BOOST_CHECK(log.Read(Ser(string("a")), value) && value == Ser(1));
+    BOOST_CHECK(!log.Exists(Ser(string("b"))));
+
+    // and the log takes new writes after the cut
+    BOOST_CHECK(log.Write(CWalletLog::Batch(1, Put(Ser(string("b")), Ser(3))), true));
+    log.Close();
+    BOOST_CHECK(log.Open(path, false));
+    BOOST_CHECK(log.Read(Ser(string("b")), value) && value == Ser(3));
+    log.Close();
+}
+
+BOOST_AUTO_TEST_CASE(walletlog_seek_order)
+{
+    boost::filesystem::path path = LogPath("walletlog_seek.dat");
+    CWalletLog log;
+    BOOST_CHECK(log.Open(path, true));
+
+    // Keys sort as unsigned bytes, like a Berkeley DB btree
+    CWalletLog::Batch batch;
+    batch.push_back(Put(Ser((unsigned char)0x80), Ser(2)));
+    batch.push_back(Put(Ser((unsigned char)0x01), Ser(1)));
+    batch.push_back(Put(Ser(make_pair((unsigned char)0x01, 0)), Ser(3)));
+    BOOST_CHECK(log.Write(batch, false));
+
+    CSerializeData key, value;
+    BOOST_CHECK(log.Seek(CSerializeData(), false, key, value) && value == Ser(1));
+    BOOST_CHECK(log.Seek(key, true, key, value) && value == Ser(3));
+    BOOST_CHECK(log.Seek(key, true, key, value) && value == Ser(2));
+    BOOST_CHECK(!log.Seek(key, true, key, value));
+    BOOST_CHECK(log.Seek(Ser((unsigned char)0x02), false, key, value) && value == Ser(2));
+    log.Close();
+}
+
+BOOST_AUTO_TEST_CASE(walletlog_compact)
+{
+    boost::filesystem::path path = LogPath("walletlog_compact.dat");
+    CWalletLog log;
+    BOOST_CHECK(log.Open(path, true));
+    BOOST_CHECK(!log.NeedsCompaction());
+
+    string strValue(10000, 'x');
+    for (int i = 0; i < 200; i++)
+        BOOST_CHECK(log.Write(CWalletLog::Batch(1, Put(Ser(string("name")), Ser(strValue))), false));
+    CWalletLog::Batch batch;
+    for (int64_t n = 1; n <= 10; n++)
+        batch.push_back(Put(Ser(make_pair(string("pool"), n)), Ser(n)));
+    BOOST_CHECK(log.Write(batch, false));
+    BOOST_CHECK(log.NeedsCompaction());
+
+    uintmax_t nSize = boost::filesystem::file_size(path);
+    BOOST_CHECK(log.Compact("\x04pool"));
+    BOOST_CHECK(!log.NeedsCompaction());
+    BOOST_CHECK(boost::filesystem::file_size(path) < nSize / 100);
+    BOOST_CHECK(!log.Exists(Ser(make_pair(string("pool"), (int64_t)1))));
+
+    // The rewritten file takes appends and replays
+    BOOST_CHECK(log.Write(CWalletLog::Batch(1, Put(Ser(string("other")), Ser(1))), true));
+    log.Close();
+    BOOST_CHECK(log.Open(path, false));
+    CSerializeData value;
+    BOOST_CHECK(log.Read(Ser(string("name")), value) && value == Ser(strValue));
+    BOOST_CHECK(log.Exists(Ser(string("other"))));
+    BOOST_CHECK(!log.Exists(Ser(make_pair(string("pool"), (int64_t)10))));
+    log.Close();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -5,11 +5,16 @@
 
 #include "txdb.h"
 
+#include "chainparams.h"
+#include "hash.h"
 #include "pow.h"
 #include "uint256.h"
 
+#include <algorithm>
 #include <stdint.h>
+#include <string.h>
 
+#include <boost/bind.hpp>
 #include <boost/thread.hpp>
 
 using namespace std;
@@ -25,9 +30,34 @@ void static BatchWriteHashBestChain(CLevelDBBatch &batch, const uint256 &hash) {
     batch.Write('B', hash);
 }
 
+//! Marks the start of a dumptxoutset file
+static const unsigned char pchSnapshotMagic[4] = { 'u', 't', 'x', 'o' };
+
+/** Add one transaction's unspent outputs to the UTXO set statistics and hash (gettxoutsetinfo). */
+void static ApplyStats(CCoinsStats &stats, CHashWriter& ss, const uint256& hash, const CCoins& coins) {
+    ss << hash;
+    ss << VARINT(coins.nVersion);
+    ss << (coins.fCoinBase ? 'c' : 'n');
+    ss << VARINT(coins.nHeight);
+    stats.nTransactions++;
+    for (unsigned int i=0; i<coins.vout.size(); i++) {
+        const CTxOut &out = coins.vout[i];
+        if (!out.IsNull()) {
+            stats.nTransactionOutputs++;
+            ss << VARINT(i+1);
+            ss << out;
+            stats.nTotalAmount += out.nValue;
+        }
+    }
+    ss << VARINT(0);
+}
+
 CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe) {
 }
 
+CCoinsViewDB::CCoinsViewDB(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory, bool fWipe) : db(path, nCacheSize, fMemory, fWipe) {
+}
+
 bool CCoinsViewDB::GetCoins(const uint256 &txid, CCoins &coins) const {
     return db.Read(make_pair('c', txid), coins);
 }
@@ -43,7 +73,7 @@ uint256 CCoinsViewDB::GetBestBlock() const {
     return hashBestChain;
 }
 
-bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) {
+bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock, bool fErase) {
     CLevelDBBatch batch;
     size_t count = 0;
     size_t changed = 0;
@@ -53,8 +83,12 @@ bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) {
             changed++;
         }
         count++;
-        CCoinsMap::iterator itOld = it++;
-        mapCoins.erase(itOld);
+        if (fErase) {
+            CCoinsMap::iterator itOld = it++;
+            mapCoins.erase(itOld);
+        } else {
+            it++;
+        }
     }
     if (hashBlock != uint256(0))
         BatchWriteHashBestChain(batch, hashBlock);
@@ -68,7 +102,10 @@ CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevel
 
 bool CBlockTreeDB::WriteBlockIndex(const CDiskBlockIndex& blockindex)
 {
-    return Write(make_pair('b', blockindex.GetBlockHash()), blockindex);
+    // Entries built from an in-memory CBlockIndex already know their hash;
+    // only fall back to rehashing the header when it is not available.
+    uint256 hash = blockindex.phashBlock ? *blockindex.phashBlock : blockindex.GetBlockHash();
+    return Write(make_pair('b', hash), blockindex);
 }
 
 bool CBlockTreeDB::WriteBlockFileInfo(int nFile, const CBlockFileInfo &info) {
@@ -109,7 +146,6 @@ bool CCoinsViewDB::GetStats(CCoinsStats &stats) const {
     CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
     stats.hashBlock = GetBestBlock();
     ss << stats.hashBlock;
-    CAmount nTotalAmount = 0;
     while (pcursor->Valid()) {
         boost::this_thread::interruption_point();
         try {
@@ -124,22 +160,8 @@ bool CCoinsViewDB::GetStats(CCoinsStats &stats) const {
                 ssValue >> coins;
                 uint256 txhash;
                 ssKey >> txhash;
-                ss << txhash;
-                ss << VARINT(coins.nVersion);
-                ss << (coins.fCoinBase ? 'c' : 'n');
-                ss << VARINT(coins.nHeight);
-                stats.nTransactions++;
-                for (unsigned int i=0; i<coins.vout.size(); i++) {
-                    const CTxOut &out = coins.vout[i];
-                    if (!out.IsNull()) {
-                        stats.nTransactionOutputs++;
-                        ss << VARINT(i+1);
-                        ss << out;
-                        nTotalAmount += out.nValue;
-                    }
-                }
+                ApplyStats(stats, ss, txhash, coins);
                 stats.nSerializedSize += 32 + slValue.size();
-                ss << VARINT(0);
             }
             pcursor->Next();
         } catch (std::exception &e) {
@@ -148,7 +170,135 @@ bool CCoinsViewDB::GetStats(CCoinsStats &stats) const {
     }
     stats.nHeight = mapBlockIndex.find(GetBestBlock())->second->nHeight;
     stats.hashSerialized = ss.GetHash();
-    stats.nTotalAmount = nTotalAmount;
+    return true;
+}
+
+bool CCoinsViewDB::DumpSnapshot(CAutoFile& fileout, CCoinsStats &stats) const {
+    // One iterator for the best block and the coins, so both come from the
+    // same implicit LevelDB snapshot even if the tip is flushed meanwhile.
+    boost::scoped_ptr<leveldb::Iterator> pcursor(const_cast<CLevelDBWrapper*>(&db)->NewIterator());
+
+    CDataStream ssKeyBest(SER_DISK, CLIENT_VERSION);
+    ssKeyBest << 'B';
+    pcursor->Seek(leveldb::Slice(&ssKeyBest[0], ssKeyBest.size()));
+    if (!pcursor->Valid() || pcursor->key() != leveldb::Slice(&ssKeyBest[0], ssKeyBest.size()))
+        return error("%s : coin database has no best block", __func__);
+    try {
+        leveldb::Slice slValue = pcursor->value();
+        CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+        ssValue >> stats.hashBlock;
+    } catch (std::exception &e) {
+        return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+    }
+    {
+        LOCK(cs_main);
+        BlockMap::const_iterator mi = mapBlockIndex.find(stats.hashBlock);
+        if (mi == mapBlockIndex.end())
+            return error("%s : best block %s not in block index", __func__, stats.hashBlock.ToString());
+        stats.nHeight = mi->second->nHeight;
+    }
+
+    CCoinsSnapshotHeader header;
+    memcpy(header.pchMagic, pchSnapshotMagic, sizeof(header.pchMagic));
+    header.nVersion = SNAPSHOT_VERSION;
+    memcpy(header.pchMessageStart, Params().MessageStart(), sizeof(header.pchMessageStart));
+    header.hashBlock = stats.hashBlock;
+    header.nHeight = stats.nHeight;
+
+    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+    ss << stats.hashBlock;
+    try {
+        fileout << header;
+
+        // Coins keys sort by txid, which lets the loader append in order
+        CDataStream ssKeyCoins(SER_DISK, CLIENT_VERSION);
+        ssKeyCoins << 'c';
+        for (pcursor->Seek(leveldb::Slice(&ssKeyCoins[0], ssKeyCoins.size())); pcursor->Valid(); pcursor->Next()) {
+            boost::this_thread::interruption_point();
+            leveldb::Slice slKey = pcursor->key();
+            CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+            char chType;
+            ssKey >> chType;
+            if (chType != 'c')
+                break;
+            uint256 txhash;
+            ssKey >> txhash;
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+            CCoins coins;
+            ssValue >> coins;
+            ApplyStats(stats, ss, txhash, coins);
+            stats.nSerializedSize += 32 + slValue.size();
+            fileout << txhash << coins;
+        }
+        stats.hashSerialized = ss.GetHash();
+        fileout << uint256(0) << stats.nTransactions << stats.hashSerialized;
+    } catch (std::exception &e) {
+        return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+    }
+    return true;
+}
+
+bool CCoinsViewDB::LoadSnapshot(CAutoFile& filein, CCoinsSnapshotHeader& header, CCoinsStats &stats) {
+    try {
+        filein >> header;
+        if (memcmp(header.pchMagic, pchSnapshotMagic, sizeof(header.pchMagic)) != 0)
+            return error("%s : not a UTXO snapshot", __func__);
+        if (header.nVersion < 1)
+            return error("%s : invalid snapshot version %d", __func__, header.nVersion);
+        if (header.nVersion > SNAPSHOT_VERSION)
+            return error("%s : up-version (%d) snapshot", __func__, header.nVersion);
+        if (memcmp(header.pchMessageStart, Params().MessageStart(), sizeof(header.pchMessageStart)) != 0)
+            return error("%s : snapshot is for another network", __func__);
+        stats.hashBlock = header.hashBlock;
+        stats.nHeight = header.nHeight;
+
+        CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+        ss << stats.hashBlock;
+        CLevelDBBatch batch;
+        size_t nBatchSize = 0;
+        uint256 txhashPrev = 0;
+        while (true) {
+            boost::this_thread::interruption_point();
+            uint256 txhash;
+            filein >> txhash;
+            if (txhash == 0)
+                break;
+            // Sorted input keeps LevelDB appending to fresh tables instead of
+            // compacting overlapping ones, and rules out duplicates
+            if (stats.nTransactions > 0 && memcmp(txhash.begin(), txhashPrev.begin(), 32) <= 0)
+                return error("%s : snapshot coins out of order at %s", __func__, txhash.ToString());
+            txhashPrev = txhash;
+            CCoins coins;
+            filein >> coins;
+            if (coins.IsPruned())
+                return error("%s : snapshot contains spent coins %s", __func__, txhash.ToString());
+            ApplyStats(stats, ss, txhash, coins);
+            size_t nSize = ::GetSerializeSize(coins, SER_DISK, CLIENT_VERSION);
+            stats.nSerializedSize += 32 + nSize;
+            BatchWriteCoins(batch, txhash, coins);
+            nBatchSize += 33 + nSize;
+            if (nBatchSize >= SNAPSHOT_LOAD_BATCH_SIZE) {
+                if (!db.WriteBatch(batch))
+                    return error("%s : failed to write coin database", __func__);
+                batch = CLevelDBBatch();
+                nBatchSize = 0;
+            }
+        }
+
+        uint64_t nTransactions;
+        uint256 hashSerialized;
+        filein >> nTransactions >> hashSerialized;
+        stats.hashSerialized = ss.GetHash();
+        if (nTransactions != stats.nTransactions || hashSerialized != stats.hashSerialized)
+            return error("%s : snapshot checksum mismatch", __func__);
+
+        BatchWriteHashBestChain(batch, stats.hashBlock);
+        if (!db.WriteBatch(batch, true))
+            return error("%s : failed to write coin database", __func__);
+    } catch (std::exception &e) {
+        return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+    }
     return true;
 }
 
@@ -175,10 +325,48 @@ bool CBlockTreeDB::ReadFlag(const std::string &name, bool &fValue) {
     return true;
 }
 
+/** Recompute the header hash of every entry in [nBegin, nEnd) and compare it to the key it was stored under. */
+static void CheckBlockIndexHashesRange(const std::vector<CBlockIndex*>* pvIndex, size_t nBegin, size_t nEnd, char* pfOk)
+{
+    for (size_t i = nBegin; i < nEnd; i++) {
+        const CBlockIndex* pindex = (*pvIndex)[i];
+        if (pindex->GetBlockHeader().GetHash() != pindex->GetBlockHash()) {
+            LogPrintf("CheckBlockIndexHashes() : hash mismatch for %s\n", pindex->ToString());
+            *pfOk = false;
+            return;
+        }
+    }
+}
+
+/** Verify the stored hashes of all loaded block index entries, spreading the work over all cores. */
+static bool CheckBlockIndexHashes(const std::vector<CBlockIndex*>& vIndex)
+{
+    int64_t nStart = GetTimeMillis();
+    size_t nThreads = std::max(1u, boost::thread::hardware_concurrency());
+    size_t nPerThread = (vIndex.size() + nThreads - 1) / nThreads;
+    std::vector<char> vOk(nThreads, true);
+
+    boost::thread_group threadGroup;
+    for (size_t i = 0; i < nThreads; i++) {
+        size_t nBegin = std::min(vIndex.size(), i * nPerThread);
+        size_t nEnd = std::min(vIndex.size(), nBegin + nPerThread);
+        threadGroup.create_thread(boost::bind(&CheckBlockIndexHashesRange, &vIndex, nBegin, nEnd, &vOk[i]));
+    }
+    threadGroup.join_all();
+
+    LogPrintf("Checked %u block index hashes on %u threads in %dms\n", vIndex.size(), nThreads, GetTimeMillis() - nStart);
+    return std::find(vOk.begin(), vOk.end(), (char)false) == vOk.end();
+}
+
 bool CBlockTreeDB::LoadBlockIndexGuts()
 {
     boost::scoped_ptr<leveldb::Iterator> pcursor(NewIterator());
 
+    // The block hash is the key of every entry, so there is no need to rehash
+    // the headers here. -checkblockindexhashes re-verifies them after loading.
+    bool fCheckHashes = GetBoolArg("-checkblockindexhashes", false);
+    std::vector<CBlockIndex*> vLoaded;
+
     CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
     ssKeySet << make_pair('b', uint256(0));
     pcursor->Seek(ssKeySet.str());
@@ -196,9 +384,11 @@ bool CBlockTreeDB::LoadBlockIndexGuts()
                 CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
                 CDiskBlockIndex diskindex;
                 ssValue >> diskindex;
+                uint256 hash;
+                ssKey >> hash;
 
                 // Construct block index object
-                CBlockIndex* pindexNew = InsertBlockIndex(diskindex.GetBlockHash());
+                CBlockIndex* pindexNew = InsertBlockIndex(hash);
                 pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
                 pindexNew->nHeight        = diskindex.nHeight;
                 pindexNew->nFile          = diskindex.nFile;
@@ -221,6 +411,9 @@ bool CBlockTreeDB::LoadBlockIndexGuts()
                 //if (!CheckProofOfWork(pindexNew->GetBlockPoWHash(), pindexNew->nBits))
                 //    return error("LoadBlockIndex() : CheckProofOfWork failed: %s", pindexNew->ToString());
 
+                if (fCheckHashes)
+                    vLoaded.push_back(pindexNew);
+
                 pcursor->Next();
             } else {
                 break; // if shutdown requested or finished loading block index
@@ -230,5 +423,8 @@ bool CBlockTreeDB::LoadBlockIndexGuts()
         }
     }
 
+    if (fCheckHashes && !CheckBlockIndexHashes(vLoaded))
+        return error("%s : block index contains entries whose header does not match their hash", __func__);
+
     return true;
 }
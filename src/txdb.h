@@ -14,6 +14,7 @@
 #include <utility>
 #include <vector>
 
+class CAutoFile;
 class CCoins;
 class uint256;
 
@@ -24,6 +25,39 @@ static const int64_t nMaxDbCache = sizeof(void*) > 4 ? 4096 : 1024;
 //! min. -dbcache in (MiB)
 static const int64_t nMinDbCache = 4;
 
+//! Current version of the UTXO snapshot format (dumptxoutset)
+static const int SNAPSHOT_VERSION = 1;
+//! Flush the coin database batch every this many bytes while loading a snapshot
+static const size_t SNAPSHOT_LOAD_BATCH_SIZE = 16 << 20;
+
+/**
+ * Header of a UTXO set snapshot file. It is followed by (txid, CCoins)
+ * records in txid order, a null txid, the number of records and the
+ * gettxoutsetinfo hash_serialized of the set, which loading checks.
+ */
+class CCoinsSnapshotHeader
+{
+public:
+    unsigned char pchMagic[4];
+    int nVersion;
+    unsigned char pchMessageStart[4];
+    uint256 hashBlock;
+    int nHeight;
+
+    CCoinsSnapshotHeader() : nVersion(0), hashBlock(0), nHeight(0) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(FLATDATA(pchMagic));
+        READWRITE(this->nVersion);
+        READWRITE(FLATDATA(pchMessageStart));
+        READWRITE(hashBlock);
+        READWRITE(nHeight);
+    }
+};
+
 /** CCoinsView backed by the LevelDB coin database (chainstate/) */
 class CCoinsViewDB : public CCoinsView
 {
@@ -31,14 +65,23 @@ protected:
     CLevelDBWrapper db;
 public:
     CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+    //! Coin database in another directory, e.g. one being built from a snapshot
+    CCoinsViewDB(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory = false, bool fWipe = false);
 
     bool GetCoins(const uint256 &txid, CCoins &coins) const;
     bool HaveCoins(const uint256 &txid) const;
     uint256 GetBestBlock() const;
-    bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock);
+    bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock, bool fErase = true);
     bool GetStats(CCoinsStats &stats) const;
+    //! Stream the whole coin database into a snapshot file
+    bool DumpSnapshot(CAutoFile& fileout, CCoinsStats &stats) const;
+    //! Fill this empty database from a snapshot file; the best block is only set once the checksum matched
+    bool LoadSnapshot(CAutoFile& filein, CCoinsSnapshotHeader& header, CCoinsStats &stats);
 };
 
+//! The coin database under pcoinsTip, set up by AppInit2
+extern CCoinsViewDB *pcoinsdbview;
+
 /** Access to the block database (blocks/index/) */
 class CBlockTreeDB : public CLevelDBWrapper
 {
@@ -6,18 +6,24 @@
 #include "txmempool.h"
 
 #include "clientversion.h"
+#include "core_memusage.h"
 #include "main.h"
+#include "random.h"
 #include "streams.h"
 #include "util.h"
 #include "utilmoneystr.h"
 #include "version.h"
 
+#include <math.h>
+
 #include <boost/circular_buffer.hpp>
 
 using namespace std;
 
 CTxMemPoolEntry::CTxMemPoolEntry():
-    nFee(0), nTxSize(0), nModSize(0), nTime(0), dPriority(0.0)
+    nFee(0), nTxSize(0), nModSize(0), nUsageSize(0), nTime(0), dPriority(0.0),
+    dPriorityDelta(0.0), nFeeDelta(0), nCountWithDescendants(0), nSizeWithDescendants(0),
+    nModFeesWithDescendants(0)
 {
     nHeight = MEMPOOL_HEIGHT;
 }
@@ -25,11 +31,17 @@ CTxMemPoolEntry::CTxMemPoolEntry():
 CTxMemPoolEntry::CTxMemPoolEntry(const CTransaction& _tx, const CAmount& _nFee,
                                  int64_t _nTime, double _dPriority,
                                  unsigned int _nHeight):
-    tx(_tx), nFee(_nFee), nTime(_nTime), dPriority(_dPriority), nHeight(_nHeight)
+    tx(_tx), nFee(_nFee), nTime(_nTime), dPriority(_dPriority), nHeight(_nHeight),
+    dPriorityDelta(0.0), nFeeDelta(0)
 {
     nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
 
     nModSize = tx.CalculateModifiedSize(nTxSize);
+    nUsageSize = RecursiveDynamicUsage(tx);
+
+    nCountWithDescendants = 1;
+    nSizeWithDescendants = nTxSize;
+    nModFeesWithDescendants = nFee;
 }
 
 CTxMemPoolEntry::CTxMemPoolEntry(const CTxMemPoolEntry& other)
@@ -46,6 +58,31 @@ CTxMemPoolEntry::GetPriority(unsigned int currentHeight) const
     return dResult;
 }
 
+void CTxMemPoolEntry::UpdateDeltas(double dNewPriorityDelta, CAmount nNewFeeDelta)
+{
+    nModFeesWithDescendants += nNewFeeDelta - nFeeDelta;
+    dPriorityDelta = dNewPriorityDelta;
+    nFeeDelta = nNewFeeDelta;
+}
+
+void CTxMemPoolEntry::UpdateDescendantState(int64_t modifySize, CAmount modifyFee, int64_t modifyCount)
+{
+    nSizeWithDescendants += modifySize;
+    assert(int64_t(nSizeWithDescendants) > 0);
+    nModFeesWithDescendants += modifyFee;
+    nCountWithDescendants += modifyCount;
+    assert(int64_t(nCountWithDescendants) > 0);
+}
+
+SaltedTxidHasher::SaltedTxidHasher()
+{
+    // One key per process: entries hash identically in every pool.
+    static uint64_t nKey0 = GetRand(std::numeric_limits<uint64_t>::max());
+    static uint64_t nKey1 = GetRand(std::numeric_limits<uint64_t>::max());
+    k0 = nKey0;
+    k1 = nKey1;
+}
+
 /**
  * Keep track of fee/priority for transactions confirmed within N blocks
  */
@@ -373,7 +410,14 @@ public:
 
 CTxMemPool::CTxMemPool(const CFeeRate& _minRelayFee) :
     nTransactionsUpdated(0),
-    minRelayFee(_minRelayFee)
+    minRelayFee(_minRelayFee),
+    totalTxSize(0),
+    cachedInnerUsage(0),
+    nMaxUsage(0),
+    nExpiryAge(0),
+    rollingMinimumFeeRate(0),
+    lastRollingFeeUpdate(GetTime()),
+    blockSinceLastRollingFeeBump(false)
 {
     // Sanity checks off by default for performance, because otherwise
     // accepting transactions becomes O(N^2) where N is the number
@@ -397,12 +441,10 @@ void CTxMemPool::pruneSpent(const uint256 &hashTx, CCoins &coins)
 {
     LOCK(cs);
 
-    std::map<COutPoint, CInPoint>::iterator it = mapNextTx.lower_bound(COutPoint(hashTx, 0));
-
-    // iterate over all COutPoints in mapNextTx whose hash equals the provided hashTx
-    while (it != mapNextTx.end() && it->first.hash == hashTx) {
-        coins.Spend(it->first.n); // and remove those outputs from coins
-        it++;
+    // remove the outputs of hashTx that are spent by mempool transactions
+    for (unsigned int i = 0; i < coins.vout.size(); i++) {
+        if (mapNextTx.count(COutPoint(hashTx, i)))
+            coins.Spend(i);
     }
 }
 
@@ -419,6 +461,58 @@ void CTxMemPool::AddTransactionsUpdated(unsigned int n)
 }
 
 
+void CTxMemPool::CalculateAncestors(const CTransaction& tx, std::set<uint256>& setAncestors) const
+{
+    std::vector<const CTransaction*> vToVisit(1, &tx);
+    while (!vToVisit.empty()) {
+        const CTransaction* ptx = vToVisit.back();
+        vToVisit.pop_back();
+        BOOST_FOREACH(const CTxIn& txin, ptx->vin) {
+            txiter it = mapTx.find(txin.prevout.hash);
+            if (it != mapTx.end() && setAncestors.insert(txin.prevout.hash).second)
+                vToVisit.push_back(&it->GetTx());
+        }
+    }
+}
+
+void CTxMemPool::CalculateDescendants(const uint256& hash, std::set<uint256>& setDescendants) const
+{
+    std::vector<uint256> vToVisit(1, hash);
+    while (!vToVisit.empty()) {
+        uint256 hashCur = vToVisit.back();
+        vToVisit.pop_back();
+        txiter it = mapTx.find(hashCur);
+        if (it == mapTx.end())
+            continue;
+        for (unsigned int i = 0; i < it->GetTx().vout.size(); i++) {
+            boost::unordered_map<COutPoint, CInPoint, SaltedOutpointHasher>::const_iterator itNext = mapNextTx.find(COutPoint(hashCur, i));
+            if (itNext == mapNextTx.end())
+                continue;
+            const uint256& hashChild = itNext->second.ptx->GetHash();
+            if (setDescendants.insert(hashChild).second)
+                vToVisit.push_back(hashChild);
+        }
+    }
+}
+
+void CTxMemPool::UpdateDescendantState(const uint256& hash, int64_t modifySize, CAmount modifyFee, int64_t modifyCount)
+{
+    txiter it = mapTx.find(hash);
+    if (it != mapTx.end())
+        mapTx.modify(it, update_descendant_state(modifySize, modifyFee, modifyCount));
+}
+
+void CTxMemPool::UpdateAncestorsOf(const CTransaction& tx, const std::set<uint256>& setExclude,
+                                   int64_t modifySize, CAmount modifyFee, int64_t modifyCount)
+{
+    std::set<uint256> setAncestors;
+    CalculateAncestors(tx, setAncestors);
+    BOOST_FOREACH(const uint256& hashAncestor, setAncestors) {
+        if (!setExclude.count(hashAncestor))
+            UpdateDescendantState(hashAncestor, modifySize, modifyFee, modifyCount);
+    }
+}
+
 bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry)
 {
     // Add to memory pool without checking anything.
@@ -426,14 +520,57 @@ bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry)
     // all the appropriate checks.
     LOCK(cs);
     {
-        mapTx[hash] = entry;
-        const CTransaction& tx = mapTx[hash].GetTx();
+        if (mapTx.count(hash))
+            return false;
+        txiter newit = mapTx.insert(entry).first;
+        std::map<uint256, std::pair<double, CAmount> >::const_iterator pos = mapDeltas.find(hash);
+        if (pos != mapDeltas.end())
+            mapTx.modify(newit, update_deltas(pos->second.first, pos->second.second));
+        const CTransaction& tx = newit->GetTx();
         for (unsigned int i = 0; i < tx.vin.size(); i++)
             mapNextTx[tx.vin[i].prevout] = CInPoint(&tx, i);
         nTransactionsUpdated++;
         totalTxSize += entry.GetTxSize();
+        cachedInnerUsage += entry.DynamicMemoryUsage();
+
+        // Count the new transaction in the package of each of its ancestors.
+        std::set<uint256> setNone;
+        UpdateAncestorsOf(tx, setNone, newit->GetTxSize(), newit->GetModifiedFee(), 1);
+
+        // A transaction put back into the pool during a re-org can already have
+        // children here; they join its package and those of its ancestors.
+        // Recount those packages from scratch rather than risk counting a
+        // descendant twice through two parents.
+        std::set<uint256> setDescendants;
+        CalculateDescendants(hash, setDescendants);
+        if (!setDescendants.empty()) {
+            std::set<uint256> setAffected;
+            CalculateAncestors(tx, setAffected);
+            setAffected.insert(hash);
+            BOOST_FOREACH(const uint256& hashAffected, setAffected) {
+                txiter it = mapTx.find(hashAffected);
+                std::set<uint256> setPackage;
+                CalculateDescendants(hashAffected, setPackage);
+                int64_t nSize = it->GetTxSize();
+                CAmount nModFees = it->GetModifiedFee();
+                BOOST_FOREACH(const uint256& hashDescendant, setPackage) {
+                    txiter itDescendant = mapTx.find(hashDescendant);
+                    nSize += itDescendant->GetTxSize();
+                    nModFees += itDescendant->GetModifiedFee();
+                }
+                mapTx.modify(it, update_descendant_state(nSize - it->GetSizeWithDescendants(),
+                                                         nModFees - it->GetModFeesWithDescendants(),
+                                                         (int64_t)setPackage.size() + 1 - it->GetCountWithDescendants()));
+            }
+        }
+
+        // Keep the pool within its limits; the new transaction may be what goes.
+        if (nExpiryAge > 0)
+            Expire(GetTime() - nExpiryAge);
+        if (nMaxUsage > 0)
+            TrimToSize(nMaxUsage);
     }
-    return true;
+    return mapTx.count(hash) != 0;
 }
 
 
@@ -450,33 +587,49 @@ void CTxMemPool::remove(const CTransaction &origTx, std::list<CTransaction>& rem
             // happen during chain re-orgs if origTx isn't re-accepted into
             // the mempool for any reason.
             for (unsigned int i = 0; i < origTx.vout.size(); i++) {
-                std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(COutPoint(origTx.GetHash(), i));
+                boost::unordered_map<COutPoint, CInPoint, SaltedOutpointHasher>::iterator it = mapNextTx.find(COutPoint(origTx.GetHash(), i));
                 if (it == mapNextTx.end())
                     continue;
                 txToRemove.push_back(it->second.ptx->GetHash());
             }
         }
+        std::vector<uint256> vRemove;
+        std::set<uint256> setRemove;
         while (!txToRemove.empty())
         {
             uint256 hash = txToRemove.front();
             txToRemove.pop_front();
-            if (!mapTx.count(hash))
+            txiter it = mapTx.find(hash);
+            if (it == mapTx.end() || !setRemove.insert(hash).second)
                 continue;
-            const CTransaction& tx = mapTx[hash].GetTx();
+            vRemove.push_back(hash);
             if (fRecursive) {
-                for (unsigned int i = 0; i < tx.vout.size(); i++) {
-                    std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(COutPoint(hash, i));
-                    if (it == mapNextTx.end())
+                for (unsigned int i = 0; i < it->GetTx().vout.size(); i++) {
+                    boost::unordered_map<COutPoint, CInPoint, SaltedOutpointHasher>::iterator itNext = mapNextTx.find(COutPoint(hash, i));
+                    if (itNext == mapNextTx.end())
                         continue;
-                    txToRemove.push_back(it->second.ptx->GetHash());
+                    txToRemove.push_back(itNext->second.ptx->GetHash());
                 }
             }
+        }
+
+        // Take the removed transactions out of the packages of the ancestors
+        // that stay, while the links to those ancestors still exist.
+        BOOST_FOREACH(const uint256& hash, setRemove) {
+            txiter it = mapTx.find(hash);
+            UpdateAncestorsOf(it->GetTx(), setRemove, -(int64_t)it->GetTxSize(), -it->GetModifiedFee(), -1);
+        }
+
+        BOOST_FOREACH(const uint256& hash, vRemove) {
+            txiter it = mapTx.find(hash);
+            const CTransaction& tx = it->GetTx();
             BOOST_FOREACH(const CTxIn& txin, tx.vin)
                 mapNextTx.erase(txin.prevout);
 
             removed.push_back(tx);
-            totalTxSize -= mapTx[hash].GetTxSize();
-            mapTx.erase(hash);
+            totalTxSize -= it->GetTxSize();
+            cachedInnerUsage -= it->DynamicMemoryUsage();
+            mapTx.erase(it);
             nTransactionsUpdated++;
         }
     }
@@ -487,10 +640,10 @@ void CTxMemPool::removeCoinbaseSpends(const CCoinsViewCache *pcoins, unsigned in
     // Remove transactions spending a coinbase which are now immature
     LOCK(cs);
     list<CTransaction> transactionsToRemove;
-    for (std::map<uint256, CTxMemPoolEntry>::const_iterator it = mapTx.begin(); it != mapTx.end(); it++) {
-        const CTransaction& tx = it->second.GetTx();
+    for (txiter it = mapTx.begin(); it != mapTx.end(); it++) {
+        const CTransaction& tx = it->GetTx();
         BOOST_FOREACH(const CTxIn& txin, tx.vin) {
-            std::map<uint256, CTxMemPoolEntry>::const_iterator it2 = mapTx.find(txin.prevout.hash);
+            txiter it2 = mapTx.find(txin.prevout.hash);
             if (it2 != mapTx.end())
                 continue;
             const CCoins *coins = pcoins->AccessCoins(txin.prevout.hash);
@@ -513,7 +666,7 @@ void CTxMemPool::removeConflicts(const CTransaction &tx, std::list<CTransaction>
     list<CTransaction> result;
     LOCK(cs);
     BOOST_FOREACH(const CTxIn &txin, tx.vin) {
-        std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(txin.prevout);
+        boost::unordered_map<COutPoint, CInPoint, SaltedOutpointHasher>::iterator it = mapNextTx.find(txin.prevout);
         if (it != mapNextTx.end()) {
             const CTransaction &txConflict = *it->second.ptx;
             if (txConflict != tx)
@@ -534,9 +687,9 @@ void CTxMemPool::removeForBlock(const std::vector<CTransaction>& vtx, unsigned i
     std::vector<CTxMemPoolEntry> entries;
     BOOST_FOREACH(const CTransaction& tx, vtx)
     {
-        uint256 hash = tx.GetHash();
-        if (mapTx.count(hash))
-            entries.push_back(mapTx[hash]);
+        txiter it = mapTx.find(tx.GetHash());
+        if (it != mapTx.end())
+            entries.push_back(*it);
     }
     minerPolicyEstimator->seenBlock(entries, nBlockHeight, minRelayFee);
     BOOST_FOREACH(const CTransaction& tx, vtx)
@@ -546,15 +699,98 @@ void CTxMemPool::removeForBlock(const std::vector<CTransaction>& vtx, unsigned i
         removeConflicts(tx, conflicts);
         ClearPrioritisation(tx.GetHash());
     }
+    lastRollingFeeUpdate = GetTime();
+    blockSinceLastRollingFeeBump = true;
 }
 
 
+void CTxMemPool::SetLimits(size_t nMaxUsageIn, int64_t nExpiryAgeIn)
+{
+    LOCK(cs);
+    nMaxUsage = nMaxUsageIn;
+    nExpiryAge = nExpiryAgeIn;
+}
+
+int CTxMemPool::Expire(int64_t nTime)
+{
+    LOCK(cs);
+    std::vector<CTransaction> vExpired;
+    const indexed_transaction_set::index<entry_time>::type& byTime = mapTx.get<entry_time>();
+    for (indexed_transaction_set::index<entry_time>::type::const_iterator it = byTime.begin();
+         it != byTime.end() && it->GetTime() < nTime; it++)
+        vExpired.push_back(it->GetTx());
+
+    std::list<CTransaction> removed;
+    BOOST_FOREACH(const CTransaction& tx, vExpired)
+        remove(tx, removed, true);
+    if (!removed.empty())
+        LogPrint("mempool", "Expired %u transactions from the memory pool\n", removed.size());
+    return removed.size();
+}
+
+void CTxMemPool::TrimToSize(size_t nSizeLimit)
+{
+    LOCK(cs);
+    unsigned int nTxnRemoved = 0;
+    CFeeRate maxFeeRateRemoved(0);
+    while (!mapTx.empty() && DynamicMemoryUsage() > nSizeLimit) {
+        const CTxMemPoolEntry& entry = *mapTx.get<descendant_score>().begin();
+        CFeeRate feeRate(entry.GetModFeesWithDescendants(), entry.GetSizeWithDescendants());
+        if (feeRate > maxFeeRateRemoved)
+            maxFeeRateRemoved = feeRate;
+        // Re-entering must pay at least the evicted package's rate plus the relay minimum.
+        double dFeeRateRequired = feeRate.GetFeePerK() + minRelayFee.GetFeePerK();
+        if (dFeeRateRequired > rollingMinimumFeeRate) {
+            rollingMinimumFeeRate = dFeeRateRequired;
+            blockSinceLastRollingFeeBump = false;
+        }
+        CTransaction tx = entry.GetTx();
+        std::list<CTransaction> removed;
+        remove(tx, removed, true);
+        nTxnRemoved += removed.size();
+    }
+    if (nTxnRemoved > 0)
+        LogPrint("mempool", "Evicted %u transactions (package fee rate up to %s) to stay under %u bytes\n",
+                 nTxnRemoved, maxFeeRateRemoved.ToString(), nSizeLimit);
+}
+
+CFeeRate CTxMemPool::GetMinFee() const
+{
+    LOCK(cs);
+    if (!blockSinceLastRollingFeeBump || rollingMinimumFeeRate == 0)
+        return CFeeRate((CAmount)rollingMinimumFeeRate);
+
+    int64_t nNow = GetTime();
+    if (nNow > lastRollingFeeUpdate + 10) {
+        double dHalfLife = ROLLING_FEE_HALFLIFE;
+        size_t nUsage = DynamicMemoryUsage();
+        if (nUsage < nMaxUsage / 4)
+            dHalfLife /= 4;
+        else if (nUsage < nMaxUsage / 2)
+            dHalfLife /= 2;
+
+        rollingMinimumFeeRate = rollingMinimumFeeRate / pow(2.0, (nNow - lastRollingFeeUpdate) / dHalfLife);
+        lastRollingFeeUpdate = nNow;
+
+        // Once it is down to half the relay minimum, it no longer matters.
+        if (rollingMinimumFeeRate < minRelayFee.GetFeePerK() / 2 || rollingMinimumFeeRate < 1) {
+            rollingMinimumFeeRate = 0;
+            return CFeeRate(0);
+        }
+    }
+    return CFeeRate((CAmount)rollingMinimumFeeRate);
+}
+
 void CTxMemPool::clear()
 {
     LOCK(cs);
     mapTx.clear();
     mapNextTx.clear();
     totalTxSize = 0;
+    cachedInnerUsage = 0;
+    lastRollingFeeUpdate = GetTime();
+    blockSinceLastRollingFeeBump = false;
+    rollingMinimumFeeRate = 0;
     ++nTransactionsUpdated;
 }
 
@@ -566,21 +802,23 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
     LogPrint("mempool", "Checking mempool with %u transactions and %u inputs\n", (unsigned int)mapTx.size(), (unsigned int)mapNextTx.size());
 
     uint64_t checkTotal = 0;
+    uint64_t innerUsage = 0;
 
     CCoinsViewCache mempoolDuplicate(const_cast<CCoinsViewCache*>(pcoins));
 
     LOCK(cs);
     list<const CTxMemPoolEntry*> waitingOnDependants;
-    for (std::map<uint256, CTxMemPoolEntry>::const_iterator it = mapTx.begin(); it != mapTx.end(); it++) {
+    for (txiter it = mapTx.begin(); it != mapTx.end(); it++) {
         unsigned int i = 0;
-        checkTotal += it->second.GetTxSize();
-        const CTransaction& tx = it->second.GetTx();
+        checkTotal += it->GetTxSize();
+        innerUsage += it->DynamicMemoryUsage();
+        const CTransaction& tx = it->GetTx();
         bool fDependsWait = false;
         BOOST_FOREACH(const CTxIn &txin, tx.vin) {
             // Check that every mempool transaction's inputs refer to available coins, or other mempool tx's.
-            std::map<uint256, CTxMemPoolEntry>::const_iterator it2 = mapTx.find(txin.prevout.hash);
+            txiter it2 = mapTx.find(txin.prevout.hash);
             if (it2 != mapTx.end()) {
-                const CTransaction& tx2 = it2->second.GetTx();
+                const CTransaction& tx2 = it2->GetTx();
                 assert(tx2.vout.size() > txin.prevout.n && !tx2.vout[txin.prevout.n].IsNull());
                 fDependsWait = true;
             } else {
@@ -588,14 +826,27 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
                 assert(coins && coins->IsAvailable(txin.prevout.n));
             }
             // Check whether its inputs are marked in mapNextTx.
-            std::map<COutPoint, CInPoint>::const_iterator it3 = mapNextTx.find(txin.prevout);
+            boost::unordered_map<COutPoint, CInPoint, SaltedOutpointHasher>::const_iterator it3 = mapNextTx.find(txin.prevout);
             assert(it3 != mapNextTx.end());
             assert(it3->second.ptx == &tx);
             assert(it3->second.n == i);
             i++;
         }
+        // Check the package totals against a walk of the descendants.
+        std::set<uint256> setDescendants;
+        CalculateDescendants(tx.GetHash(), setDescendants);
+        uint64_t nSizeCheck = it->GetTxSize();
+        CAmount nFeesCheck = it->GetModifiedFee();
+        BOOST_FOREACH(const uint256& hashDescendant, setDescendants) {
+            txiter itDescendant = mapTx.find(hashDescendant);
+            nSizeCheck += itDescendant->GetTxSize();
+            nFeesCheck += itDescendant->GetModifiedFee();
+        }
+        assert(it->GetCountWithDescendants() == setDescendants.size() + 1);
+        assert(it->GetSizeWithDescendants() == nSizeCheck);
+        assert(it->GetModFeesWithDescendants() == nFeesCheck);
         if (fDependsWait)
-            waitingOnDependants.push_back(&it->second);
+            waitingOnDependants.push_back(&(*it));
         else {
             CValidationState state; CTxUndo undo;
             assert(CheckInputs(tx, state, mempoolDuplicate, false, 0, false, NULL));
@@ -618,17 +869,18 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
             stepsSinceLastRemove = 0;
         }
     }
-    for (std::map<COutPoint, CInPoint>::const_iterator it = mapNextTx.begin(); it != mapNextTx.end(); it++) {
+    for (boost::unordered_map<COutPoint, CInPoint, SaltedOutpointHasher>::const_iterator it = mapNextTx.begin(); it != mapNextTx.end(); it++) {
         uint256 hash = it->second.ptx->GetHash();
-        map<uint256, CTxMemPoolEntry>::const_iterator it2 = mapTx.find(hash);
-        const CTransaction& tx = it2->second.GetTx();
+        txiter it2 = mapTx.find(hash);
         assert(it2 != mapTx.end());
+        const CTransaction& tx = it2->GetTx();
         assert(&tx == it->second.ptx);
         assert(tx.vin.size() > it->second.n);
         assert(it->first == it->second.ptx->vin[it->second.n].prevout);
     }
 
     assert(totalTxSize == checkTotal);
+    assert(innerUsage == cachedInnerUsage);
 }
 
 void CTxMemPool::queryHashes(vector<uint256>& vtxid)
@@ -637,16 +889,16 @@ void CTxMemPool::queryHashes(vector<uint256>& vtxid)
 
     LOCK(cs);
     vtxid.reserve(mapTx.size());
-    for (map<uint256, CTxMemPoolEntry>::iterator mi = mapTx.begin(); mi != mapTx.end(); ++mi)
-        vtxid.push_back((*mi).first);
+    for (txiter mi = mapTx.begin(); mi != mapTx.end(); ++mi)
+        vtxid.push_back(mi->GetTx().GetHash());
 }
 
 bool CTxMemPool::lookup(uint256 hash, CTransaction& result) const
 {
     LOCK(cs);
-    map<uint256, CTxMemPoolEntry>::const_iterator i = mapTx.find(hash);
+    txiter i = mapTx.find(hash);
     if (i == mapTx.end()) return false;
-    result = i->second.GetTx();
+    result = i->GetTx();
     return true;
 }
 
@@ -703,6 +955,7 @@ void CTxMemPool::PrioritiseTransaction(const uint256 hash, const string strHash,
         std::pair<double, CAmount> &deltas = mapDeltas[hash];
         deltas.first += dPriorityDelta;
         deltas.second += nFeeDelta;
+        UpdateEntryDeltas(hash, deltas.first, deltas.second);
     }
     LogPrintf("PrioritiseTransaction: %s priority += %f, fee += %d\n", strHash, dPriorityDelta, FormatMoney(nFeeDelta));
 }
@@ -722,6 +975,28 @@ void CTxMemPool::ClearPrioritisation(const uint256 hash)
 {
     LOCK(cs);
     mapDeltas.erase(hash);
+    UpdateEntryDeltas(hash, 0.0, 0);
+}
+
+void CTxMemPool::UpdateEntryDeltas(const uint256& hash, double dPriorityDelta, CAmount nFeeDelta)
+{
+    txiter it = mapTx.find(hash);
+    if (it == mapTx.end())
+        return;
+    CAmount nModFeeChange = nFeeDelta - (it->GetModifiedFee() - it->GetFee());
+    mapTx.modify(it, update_deltas(dPriorityDelta, nFeeDelta));
+    std::set<uint256> setNone;
+    UpdateAncestorsOf(it->GetTx(), setNone, 0, nModFeeChange, 0);
+}
+
+size_t CTxMemPool::DynamicMemoryUsage() const
+{
+    LOCK(cs);
+    // Each pooled mapTx node holds the entry, a hash chain link and three
+    // pointers per ordered index, plus the bucket array of the hash index.
+    return (sizeof(CTxMemPoolEntry) + 14 * sizeof(void*)) * mapTx.size() +
+        memusage::MallocUsage(sizeof(void*) * mapTx.bucket_count()) +
+        memusage::DynamicUsage(mapNextTx) + memusage::DynamicUsage(mapDeltas) + cachedInnerUsage;
 }
 
 
@@ -7,12 +7,21 @@
 #define BITCOIN_TXMEMPOOL_H
 
 #include <list>
+#include <set>
 
+#include "allocators.h"
 #include "amount.h"
 #include "coins.h"
+#include "hash.h"
 #include "primitives/transaction.h"
 #include "sync.h"
 
+#include <boost/multi_index_container.hpp>
+#include <boost/multi_index/hashed_index.hpp>
+#include <boost/multi_index/identity.hpp>
+#include <boost/multi_index/ordered_index.hpp>
+#include <boost/unordered_map.hpp>
+
 class CAutoFile;
 
 inline double AllowFreeThreshold()
@@ -27,6 +36,11 @@ inline bool AllowFree(double dPriority)
     return dPriority > AllowFreeThreshold();
 }
 
+/** Default for -maxmempool, maximum megabytes of mempool memory usage */
+static const unsigned int DEFAULT_MAX_MEMPOOL_SIZE = 300;
+/** Default for -mempoolexpiry, expiration time for mempool transactions in hours */
+static const unsigned int DEFAULT_MEMPOOL_EXPIRY = 72;
+
 /** Fake height value used in CCoins to signify they are only in the memory pool (since 0.8) */
 static const unsigned int MEMPOOL_HEIGHT = 0x7FFFFFFF;
 
@@ -40,9 +54,17 @@ private:
     CAmount nFee; //! Cached to avoid expensive parent-transaction lookups
     size_t nTxSize; //! ... and avoid recomputing tx size
     size_t nModSize; //! ... and modified size for priority
+    size_t nUsageSize; //! ... and total memory usage
     int64_t nTime; //! Local time when entering the mempool
     double dPriority; //! Priority when entering the mempool
     unsigned int nHeight; //! Chain height when entering the mempool
+    double dPriorityDelta; //! prioritisetransaction priority delta
+    CAmount nFeeDelta; //! prioritisetransaction fee delta
+
+    //! This transaction and all its in-mempool descendants
+    uint64_t nCountWithDescendants;
+    uint64_t nSizeWithDescendants;
+    CAmount nModFeesWithDescendants; //! ... including fee deltas
 
 public:
     CTxMemPoolEntry(const CTransaction& _tx, const CAmount& _nFee,
@@ -56,8 +78,164 @@ public:
     size_t GetTxSize() const { return nTxSize; }
     int64_t GetTime() const { return nTime; }
     unsigned int GetHeight() const { return nHeight; }
+    size_t DynamicMemoryUsage() const { return nUsageSize; }
+
+    /** Priority at entry and fee with any prioritisetransaction deltas applied */
+    double GetModifiedPriority() const { return dPriority + dPriorityDelta; }
+    CAmount GetModifiedFee() const { return nFee + nFeeDelta; }
+    double GetPriorityDelta() const { return dPriorityDelta; }
+
+    uint64_t GetCountWithDescendants() const { return nCountWithDescendants; }
+    uint64_t GetSizeWithDescendants() const { return nSizeWithDescendants; }
+    CAmount GetModFeesWithDescendants() const { return nModFeesWithDescendants; }
+
+    void UpdateDeltas(double dNewPriorityDelta, CAmount nNewFeeDelta);
+    void UpdateDescendantState(int64_t modifySize, CAmount modifyFee, int64_t modifyCount);
+};
+
+// Helpers for modifying CTxMemPool::mapTx, which is a boost multi_index.
+struct update_deltas
+{
+    update_deltas(double _dPriorityDelta, CAmount _nFeeDelta) :
+        dPriorityDelta(_dPriorityDelta), nFeeDelta(_nFeeDelta)
+    {}
+
+    void operator() (CTxMemPoolEntry &e)
+        { e.UpdateDeltas(dPriorityDelta, nFeeDelta); }
+
+private:
+    double dPriorityDelta;
+    CAmount nFeeDelta;
+};
+
+struct update_descendant_state
+{
+    update_descendant_state(int64_t _modifySize, CAmount _modifyFee, int64_t _modifyCount) :
+        modifySize(_modifySize), modifyFee(_modifyFee), modifyCount(_modifyCount)
+    {}
+
+    void operator() (CTxMemPoolEntry &e)
+        { e.UpdateDescendantState(modifySize, modifyFee, modifyCount); }
+
+private:
+    int64_t modifySize;
+    CAmount modifyFee;
+    int64_t modifyCount;
+};
+
+/** Extracts a CTxMemPoolEntry's transaction hash, the primary key of mapTx */
+struct mempoolentry_txid
+{
+    typedef uint256 result_type;
+    result_type operator() (const CTxMemPoolEntry &entry) const
+    {
+        return entry.GetTx().GetHash();
+    }
+};
+
+/**
+ * Hash table hasher for txids: SipHash keyed with a per-process secret, so
+ * peers cannot grind transactions into the same bucket.
+ */
+class SaltedTxidHasher
+{
+protected:
+    uint64_t k0, k1;
+
+public:
+    SaltedTxidHasher();
+
+    size_t operator()(const uint256& txid) const {
+        return (size_t)SipHashUint256(k0, k1, txid);
+    }
+};
+
+class SaltedOutpointHasher : private SaltedTxidHasher
+{
+public:
+    size_t operator()(const COutPoint& outpoint) const {
+        return (size_t)SipHashUint256Extra(k0, k1, outpoint.hash, outpoint.n);
+    }
+};
+
+/** Sort by priority at entry (with deltas), then txid */
+class CompareTxMemPoolEntryByPriority
+{
+public:
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
+    {
+        if (a.GetModifiedPriority() == b.GetModifiedPriority())
+            return a.GetTx().GetHash() < b.GetTx().GetHash();
+        return a.GetModifiedPriority() < b.GetModifiedPriority();
+    }
 };
 
+/** Sort by fee rate (with deltas), then txid */
+class CompareTxMemPoolEntryByFeeRate
+{
+public:
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
+    {
+        double f1 = (double)a.GetModifiedFee() * b.GetTxSize();
+        double f2 = (double)b.GetModifiedFee() * a.GetTxSize();
+        if (f1 == f2)
+            return a.GetTx().GetHash() < b.GetTx().GetHash();
+        return f1 < f2;
+    }
+};
+
+/** Sort by entry time, oldest first */
+class CompareTxMemPoolEntryByEntryTime
+{
+public:
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
+    {
+        return a.GetTime() < b.GetTime();
+    }
+};
+
+/**
+ * Sort by the better of a transaction's own fee rate and the fee rate of the
+ * package of it and its descendants, then entry time, newest first. The
+ * lowest entry is the cheapest package to drop from the pool.
+ */
+class CompareTxMemPoolEntryByDescendantScore
+{
+public:
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
+    {
+        bool fUseADescendants = UseDescendantFeeRate(a);
+        bool fUseBDescendants = UseDescendantFeeRate(b);
+
+        double aFees = fUseADescendants ? a.GetModFeesWithDescendants() : a.GetModifiedFee();
+        double aSize = fUseADescendants ? a.GetSizeWithDescendants() : a.GetTxSize();
+        double bFees = fUseBDescendants ? b.GetModFeesWithDescendants() : b.GetModifiedFee();
+        double bSize = fUseBDescendants ? b.GetSizeWithDescendants() : b.GetTxSize();
+
+        double f1 = aFees * bSize;
+        double f2 = aSize * bFees;
+        if (f1 == f2) {
+            if (a.GetTime() == b.GetTime())
+                return a.GetTx().GetHash() < b.GetTx().GetHash();
+            return a.GetTime() > b.GetTime();
+        }
+        return f1 < f2;
+    }
+
+    bool UseDescendantFeeRate(const CTxMemPoolEntry& e) const
+    {
+        double f1 = (double)e.GetModifiedFee() * e.GetSizeWithDescendants();
+        double f2 = (double)e.GetModFeesWithDescendants() * e.GetTxSize();
+        return f2 > f1;
+    }
+};
+
+// Tags for the secondary indexes of CTxMemPool::mapTx
+struct priority_score {};
+struct fee_rate_score {};
+struct entry_time {};
+struct descendant_score {};
+
 class CMinerPolicyEstimator;
 
 /** An inpoint - a combination of a transaction and an index n into its vin */
@@ -93,12 +271,83 @@ private:
     CFeeRate minRelayFee; //! Passed to constructor to avoid dependency on main
     uint64_t totalTxSize; //! sum of all mempool tx' byte sizes
 
+    uint64_t cachedInnerUsage; //! sum of dynamic memory usage of all the map elements (NOT the maps themselves)
+    size_t nMaxUsage; //! DynamicMemoryUsage() limit enforced by addUnchecked, 0 for none
+    int64_t nExpiryAge; //! Seconds a transaction may stay in the pool, 0 for no limit
+
+    //! Fee rate (satoshis per 1000 bytes) a transaction must beat to get back in after trimming; decays in GetMinFee
+    mutable double rollingMinimumFeeRate;
+    mutable int64_t lastRollingFeeUpdate;
+    //! The rolling minimum only decays once a block has been connected since it was last raised
+    mutable bool blockSinceLastRollingFeeBump;
+
 public:
+    /** Half-life in seconds of the rolling minimum fee while the pool is at least half full */
+    static const int ROLLING_FEE_HALFLIFE = 60 * 60 * 12;
+
+    /**
+     * The mempool entries, looked up by txid through a hash table and kept
+     * in four orders:
+     * - priority_score and fee_rate_score: best-first walks for
+     *   CreateNewBlock. Priority is the priority at entry to the pool, as all
+     *   priorities grow with the chain height. Both include any
+     *   prioritisetransaction deltas.
+     * - entry_time: oldest first.
+     * - descendant_score: cheapest package (a transaction and its in-pool
+     *   descendants) first.
+     * Nodes come from a pool allocator; they do not move while in the pool,
+     * so pointers to their transactions (see mapNextTx) stay valid.
+     */
+    typedef boost::multi_index_container<
+        CTxMemPoolEntry,
+        boost::multi_index::indexed_by<
+            // sorted by txid
+            boost::multi_index::hashed_unique<mempoolentry_txid, SaltedTxidHasher>,
+            // sorted by priority
+            boost::multi_index::ordered_non_unique<
+                boost::multi_index::tag<priority_score>,
+                boost::multi_index::identity<CTxMemPoolEntry>,
+                CompareTxMemPoolEntryByPriority
+            >,
+            // sorted by fee rate
+            boost::multi_index::ordered_non_unique<
+                boost::multi_index::tag<fee_rate_score>,
+                boost::multi_index::identity<CTxMemPoolEntry>,
+                CompareTxMemPoolEntryByFeeRate
+            >,
+            // sorted by entry time
+            boost::multi_index::ordered_non_unique<
+                boost::multi_index::tag<entry_time>,
+                boost::multi_index::identity<CTxMemPoolEntry>,
+                CompareTxMemPoolEntryByEntryTime
+            >,
+            // sorted by package fee rate
+            boost::multi_index::ordered_non_unique<
+                boost::multi_index::tag<descendant_score>,
+                boost::multi_index::identity<CTxMemPoolEntry>,
+                CompareTxMemPoolEntryByDescendantScore
+            >
+        >,
+        node_pool_allocator<CTxMemPoolEntry>
+    > indexed_transaction_set;
+
+    typedef indexed_transaction_set::nth_index<0>::type::iterator txiter;
+
     mutable CCriticalSection cs;
-    std::map<uint256, CTxMemPoolEntry> mapTx;
-    std::map<COutPoint, CInPoint> mapNextTx;
+    indexed_transaction_set mapTx;
+    boost::unordered_map<COutPoint, CInPoint, SaltedOutpointHasher> mapNextTx;
     std::map<uint256, std::pair<double, CAmount> > mapDeltas;
 
+private:
+    void CalculateAncestors(const CTransaction& tx, std::set<uint256>& setAncestors) const;
+    void CalculateDescendants(const uint256& hash, std::set<uint256>& setDescendants) const;
+    void UpdateAncestorsOf(const CTransaction& tx, const std::set<uint256>& setExclude,
+                           int64_t modifySize, CAmount modifyFee, int64_t modifyCount);
+    void UpdateDescendantState(const uint256& hash, int64_t modifySize, CAmount modifyFee, int64_t modifyCount);
+    void UpdateEntryDeltas(const uint256& hash, double dPriorityDelta, CAmount nFeeDelta);
+
+public:
+
     CTxMemPool(const CFeeRate& _minRelayFee);
     ~CTxMemPool();
 
@@ -111,6 +360,15 @@ public:
     void check(const CCoinsViewCache *pcoins) const;
     void setSanityCheck(bool _fSanityCheck) { fSanityCheck = _fSanityCheck; }
 
+    /**
+     * Limit the pool to nMaxUsageIn bytes of DynamicMemoryUsage() and its
+     * transactions to nExpiryAgeIn seconds; 0 disables a limit. Both are
+     * enforced whenever a transaction is added.
+     */
+    void SetLimits(size_t nMaxUsageIn, int64_t nExpiryAgeIn);
+    /** The DynamicMemoryUsage() limit set by SetLimits, 0 for none */
+    size_t GetMaxUsage() const { LOCK(cs); return nMaxUsage; }
+
     bool addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry);
     void remove(const CTransaction &tx, std::list<CTransaction>& removed, bool fRecursive = false);
     void removeCoinbaseSpends(const CCoinsViewCache *pcoins, unsigned int nMemPoolHeight);
@@ -118,6 +376,20 @@ public:
     void removeForBlock(const std::vector<CTransaction>& vtx, unsigned int nBlockHeight,
                         std::list<CTransaction>& conflicts);
     void clear();
+    /** Remove transactions that entered the pool before nTime, and their descendants. Returns the number removed. */
+    int Expire(int64_t nTime);
+    /**
+     * Evict the lowest fee rate packages until DynamicMemoryUsage() is at most
+     * nSizeLimit, raising the rolling minimum fee above the best package evicted.
+     */
+    void TrimToSize(size_t nSizeLimit);
+    /**
+     * The fee rate a new transaction needs to enter the pool, or 0 when only
+     * the relay minimum applies. It is raised by TrimToSize and, once a block has been
+     * connected, halves every ROLLING_FEE_HALFLIFE seconds (faster while the
+     * pool is less than half full) until it drops back to zero.
+     */
+    CFeeRate GetMinFee() const;
     void queryHashes(std::vector<uint256>& vtxid);
     void pruneSpent(const uint256& hash, CCoins &coins);
     unsigned int GetTransactionsUpdated() const;
@@ -138,6 +410,8 @@ public:
         LOCK(cs);
         return totalTxSize;
     }
+    /** Estimated heap memory held by the pool, its indexes and its transactions */
+    size_t DynamicMemoryUsage() const;
 
     bool exists(uint256 hash)
     {
@@ -67,6 +67,11 @@
 #include <sys/prctl.h>
 #endif
 
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
 #include <boost/algorithm/string/case_conv.hpp> // for to_lower()
 #include <boost/algorithm/string/join.hpp>
 #include <boost/algorithm/string/predicate.hpp> // for startswith() and endswith()
@@ -742,3 +747,23 @@ void SetThreadPriority(int nPriority)
 #endif // PRIO_THREAD
 #endif // WIN32
 }
+
+bool SetThreadAffinity(int nCore)
+{
+#if defined(WIN32)
+    if (nCore < 0 || nCore >= (int)(sizeof(DWORD_PTR) * 8))
+        return false;
+    return SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << nCore) != 0;
+#elif defined(__linux__)
+    if (nCore < 0 || nCore >= CPU_SETSIZE)
+        return false;
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(nCore, &cpuset);
+    return pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset) == 0;
+#else
+    // Prevent warnings for unused parameters...
+    (void)nCore;
+    return false;
+#endif
+}
@@ -162,6 +162,8 @@ bool SoftSetArg(const std::string& strArg, const std::string& strValue);
 bool SoftSetBoolArg(const std::string& strArg, bool fValue);
 
 void SetThreadPriority(int nPriority);
+/** Restrict the calling thread to run on the given CPU core. Returns false if unsupported or failed. */
+bool SetThreadAffinity(int nCore);
 void RenameThread(const char* name);
 
 /**
@@ -34,4 +34,8 @@ static const int BIP0031_VERSION = 60000;
 //! "mempool" command, enhanced "getdata" behavior starts with this version
 static const int MEMPOOL_GD_VERSION = 60002;
 
+//! "sendcmpct", "cmpctblock", "getblocktxn" and "blocktxn" are supported starting with this version.
+//! PROTOCOL_VERSION only reaches it once the message handlers do.
+static const int COMPACT_BLOCKS_VERSION = 70004;
+
 #endif // BITCOIN_VERSION_H
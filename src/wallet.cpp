@@ -419,6 +419,112 @@ void CWallet::AddToSpends(const uint256& wtxid)
         AddToSpends(txin.prevout, wtxid);
 }
 
+void CWallet::AddToTxIndexes(const CWalletTx& wtx) const
+{
+    AssertLockHeld(cs_wallet);
+    if (fTxIndexesStale)
+        return;
+    const uint256& hash = wtx.GetHash();
+    BOOST_FOREACH(const CTxOut& txout, wtx.vout)
+    {
+        CTxDestination address;
+        if (IsMine(txout) != ISMINE_NO)
+        {
+            setUnspentTxids.insert(hash);
+            mapTxidsByScript[txout.scriptPubKey].insert(hash);
+        }
+        else if (ExtractDestination(txout.scriptPubKey, address) && ::IsMine(*this, address) != ISMINE_NO)
+            mapTxidsByScript[txout.scriptPubKey].insert(hash);
+    }
+
+    // The outputs this transaction spends become unspent again if it ends up
+    // conflicted or its block is disconnected; both come through here.
+    if (wtx.IsCoinBase())
+        return;
+    BOOST_FOREACH(const CTxIn& txin, wtx.vin)
+    {
+        if (mapWallet.count(txin.prevout.hash))
+            setUnspentTxids.insert(txin.prevout.hash);
+    }
+}
+
+void CWallet::MarkTxIndexesStale()
+{
+    AssertLockHeld(cs_wallet);
+    fTxIndexesStale = true;
+}
+
+void CWallet::UpdateTxIndexes() const
+{
+    AssertLockHeld(cs_wallet);
+    if (!fTxIndexesStale)
+        return;
+    int64_t nStart = GetTimeMillis();
+    fTxIndexesStale = false;
+    setUnspentTxids.clear();
+    mapTxidsByScript.clear();
+    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        AddToTxIndexes(it->second);
+    LogPrint("db", "CWallet::UpdateTxIndexes : indexed %u transactions in %dms\n", mapWallet.size(), GetTimeMillis() - nStart);
+}
+
+const std::map<CScript, std::set<uint256> >& CWallet::GetTxidsByScript() const
+{
+    UpdateTxIndexes();
+    return mapTxidsByScript;
+}
+
+/**
+ * True if every output of ours in wtx is spent by a wallet transaction that
+ * is in the main chain. Only a disconnect can undo that.
+ */
+bool CWallet::IsSpentByConfirmed(const uint256& hash, const CWalletTx& wtx) const
+{
+    for (unsigned int i = 0; i < wtx.vout.size(); i++)
+    {
+        if (IsMine(wtx.vout[i]) == ISMINE_NO)
+            continue;
+
+        bool fSpent = false;
+        pair<TxSpends::const_iterator, TxSpends::const_iterator> range;
+        range = mapTxSpends.equal_range(COutPoint(hash, i));
+        for (TxSpends::const_iterator it = range.first; it != range.second && !fSpent; ++it)
+        {
+            std::map<uint256, CWalletTx>::const_iterator mit = mapWallet.find(it->second);
+            fSpent = mit != mapWallet.end() && mit->second.GetDepthInMainChain() > 0;
+        }
+        if (!fSpent)
+            return false;
+    }
+    return true;
+}
+
+/**
+ * The wallet transactions that may have unspent outputs of ours, in txid
+ * order. Drops the ones that have none left from setUnspentTxids on the way.
+ */
+std::vector<const CWalletTx*> CWallet::GetUnspentCandidates() const
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+    UpdateTxIndexes();
+    std::vector<const CWalletTx*> vCandidates;
+    vCandidates.reserve(setUnspentTxids.size());
+    std::set<uint256>::iterator it = setUnspentTxids.begin();
+    while (it != setUnspentTxids.end())
+    {
+        std::map<uint256, CWalletTx>::const_iterator mit = mapWallet.find(*it);
+        if (mit == mapWallet.end() || IsSpentByConfirmed(mit->first, mit->second))
+        {
+            setUnspentTxids.erase(it++);
+            continue;
+        }
+        vCandidates.push_back(&mit->second);
+        ++it;
+    }
+    return vCandidates;
+}
+
 bool CWallet::EncryptWallet(const SecureString& strWalletPassphrase)
 {
     if (IsCrypted())
@@ -555,6 +661,9 @@ void CWallet::MarkDirty()
         LOCK(cs_wallet);
         BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
             item.second.MarkDirty();
+        // Called when keys or watch-only scripts were added, which can make
+        // outputs of existing transactions ours
+        MarkTxIndexesStale();
     }
 }
 
@@ -661,6 +770,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
 
         // Break debit/credit balance caches:
         wtx.MarkDirty();
+        AddToTxIndexes(wtx);
 
         // Notify UI of new or updated transaction
         NotifyTransactionChanged(this, hash, fInsertedNew ? CT_NEW : CT_UPDATED);
@@ -723,8 +833,36 @@ void CWallet::EraseFromWallet(const uint256 &hash)
         return;
     {
         LOCK(cs_wallet);
-        if (mapWallet.erase(hash))
+        map<uint256, CWalletTx>::iterator it = mapWallet.find(hash);
+        if (it != mapWallet.end())
+        {
+            BOOST_FOREACH(const CTxOut& txout, it->second.vout)
+            {
+                map<CScript, set<uint256> >::iterator mi = mapTxidsByScript.find(txout.scriptPubKey);
+                if (mi != mapTxidsByScript.end())
+                {
+                    mi->second.erase(hash);
+                    if (mi->second.empty())
+                        mapTxidsByScript.erase(mi);
+                }
+            }
+            // What it spent is unspent again
+            if (!it->second.IsCoinBase())
+            {
+                BOOST_FOREACH(const CTxIn& txin, it->second.vin)
+                {
+                    map<uint256, CWalletTx>::iterator mi = mapWallet.find(txin.prevout.hash);
+                    if (mi != mapWallet.end())
+                    {
+                        mi->second.MarkDirty();
+                        setUnspentTxids.insert(txin.prevout.hash);
+                    }
+                }
+            }
+            setUnspentTxids.erase(hash);
+            mapWallet.erase(it);
             CWalletDB(strWalletFile).EraseTx(hash);
+        }
     }
     return;
 }
@@ -924,6 +1062,48 @@ bool CWalletTx::WriteToDisk()
     return CWalletDB(pwallet->strWalletFile).WriteTx(GetHash(), *this);
 }
 
+/** Copy the keys and scripts that make an output ours, for the rescan threads */
+void CWallet::GetScanFilter(CWalletScanFilter& filter) const
+{
+    LOCK(cs_KeyStore);
+    std::set<CKeyID> setKeys;
+    GetKeys(setKeys);
+    BOOST_FOREACH(const CKeyID& keyid, setKeys)
+        filter.AddKeyID(keyid);
+    for (ScriptMap::const_iterator it = mapScripts.begin(); it != mapScripts.end(); it++)
+        filter.AddScriptID(it->first);
+    BOOST_FOREACH(const CScript& script, setWatchOnly)
+        filter.AddWatchOnly(script);
+}
+
+bool CWallet::AbortRescan()
+{
+    LOCK(cs_rescan);
+    if (!rescanProgress.fScanning)
+        return false;
+    fAbortRescan = true;
+    return true;
+}
+
+CRescanProgress CWallet::GetRescanProgress() const
+{
+    LOCK(cs_rescan);
+    return rescanProgress;
+}
+
+bool CWallet::IsRescanAbortRequested()
+{
+    LOCK(cs_rescan);
+    return fAbortRescan;
+}
+
+void CWallet::SetRescanHeight(int nHeight)
+{
+    LOCK(cs_rescan);
+    rescanProgress.nHeight = nHeight;
+    rescanProgress.nStopHeight = std::max(rescanProgress.nStopHeight, nHeight);
+}
+
 /**
  * Scan the block chain (starting in pindexStart) for transactions
  * from or to us. If fUpdate is true, found transactions that already
@@ -931,42 +1111,131 @@ bool CWalletTx::WriteToDisk()
  */
 int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
 {
+    // Claim the scan before doing any work, so that two callers can't both
+    // see no scan running and start one each
+    {
+        LOCK(cs_rescan);
+        if (rescanProgress.fScanning)
+            return -2;
+        rescanProgress = CRescanProgress();
+        rescanProgress.fScanning = true;
+        rescanProgress.nStartTime = GetTime();
+        fAbortRescan = false;
+    }
+
     int ret = 0;
     int64_t nNow = GetTime();
+    unsigned int nThreads = std::min(MAX_RESCAN_THREADS, std::max(1u, boost::thread::hardware_concurrency()));
+
+    // Outputs are matched against a copy of the keys and scripts, inputs
+    // against the txids of the wallet transactions, so that only committing
+    // the matches of a block needs cs_main and cs_wallet.
+    CWalletScanFilter filter;
+    GetScanFilter(filter);
+    std::set<uint256> setWalletTxids;
+    {
+        LOCK(cs_wallet);
+        for (std::map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); it++)
+            setWalletTxids.insert(it->first);
+    }
 
     CBlockIndex* pindex = pindexStart;
+    double dProgressStart, dProgressTip;
     {
-        LOCK2(cs_main, cs_wallet);
+        LOCK2(cs_main, cs_rescan);
 
         // no need to read and scan block, if block was created before
         // our wallet birthday (as adjusted for block time variability)
         while (pindex && nTimeFirstKey && (pindex->GetBlockTime() < (nTimeFirstKey - 7200)))
             pindex = chainActive.Next(pindex);
 
-        ShowProgress(_("Rescanning..."), 0); // show rescan progress in GUI as dialog or on splashscreen, if -rescan on startup
-        double dProgressStart = Checkpoints::GuessVerificationProgress(pindex, false);
-        double dProgressTip = Checkpoints::GuessVerificationProgress(chainActive.Tip(), false);
-        while (pindex)
+        dProgressStart = Checkpoints::GuessVerificationProgress(pindex, false);
+        dProgressTip = Checkpoints::GuessVerificationProgress(chainActive.Tip(), false);
+
+        rescanProgress.nStartHeight = pindex ? pindex->nHeight : chainActive.Height();
+        rescanProgress.nHeight = rescanProgress.nStartHeight;
+        rescanProgress.nStopHeight = chainActive.Height();
+    }
+
+    ShowProgress(_("Rescanning..."), 0); // show rescan progress in GUI as dialog or on splashscreen, if -rescan on startup
+    bool fAborted = false;
+    while (pindex && !fAborted)
+    {
+        // Scan up to the tip as it is now; blocks connected in the meantime
+        // are picked up by the next round.
+        std::vector<CBlockIndex*> vBlocks;
         {
-            if (pindex->nHeight % 100 == 0 && dProgressTip - dProgressStart > 0.0)
-                ShowProgress(_("Rescanning..."), std::max(1, std::min(99, (int)((Checkpoints::GuessVerificationProgress(pindex, false) - dProgressStart) / (dProgressTip - dProgressStart) * 100))));
+            LOCK(cs_main);
+            for (; pindex; pindex = chainActive.Next(pindex))
+                vBlocks.push_back(pindex);
+        }
 
-            CBlock block;
-            ReadBlockFromDisk(block, pindex);
-            BOOST_FOREACH(CTransaction& tx, block.vtx)
-            {
-                if (AddToWalletIfInvolvingMe(tx, &block, fUpdate))
-                    ret++;
+        CWalletRescanQueue queue(filter, vBlocks, nThreads);
+        CWalletRescanQueue::Item item;
+        CBlockIndex* pindexLast = NULL;
+        while (queue.Next(item))
+        {
+            if (IsRescanAbortRequested()) {
+                fAborted = true;
+                break;
             }
-            pindex = chainActive.Next(pindex);
+            pindexLast = item.pindex;
+            SetRescanHeight(item.pindex->nHeight);
+            if (item.pindex->nHeight % 100 == 0 && dProgressTip - dProgressStart > 0.0)
+                ShowProgress(_("Rescanning..."), std::max(1, std::min(99, (int)((Checkpoints::GuessVerificationProgress(item.pindex, false) - dProgressStart) / (dProgressTip - dProgressStart) * 100))));
             if (GetTime() >= nNow + 60) {
                 nNow = GetTime();
-                LogPrintf("Still rescanning. At block %d. Progress=%f\n", pindex->nHeight, Checkpoints::GuessVerificationProgress(pindex));
+                LogPrintf("Still rescanning. At block %d. Progress=%f\n", item.pindex->nHeight, Checkpoints::GuessVerificationProgress(item.pindex));
+            }
+
+            if (!item.fRead) {
+                LogPrintf("%s: failed to read block %s\n", __func__, item.pindex->GetBlockHash().ToString());
+                continue;
+            }
+
+            // A transaction is a candidate if an output matched, if it is
+            // already in the wallet, or if it spends a wallet transaction.
+            // Only a candidate can make a later one in the block a candidate.
+            bool fCandidates = false;
+            for (unsigned int i = 0; i < item.block.vtx.size() && !fCandidates; i++) {
+                const CTransaction& tx = item.block.vtx[i];
+                fCandidates = item.vMatch[i] || setWalletTxids.count(tx.GetHash());
+                for (unsigned int j = 0; j < tx.vin.size() && !fCandidates; j++)
+                    fCandidates = setWalletTxids.count(tx.vin[j].prevout.hash) > 0;
+            }
+            if (!fCandidates)
+                continue;
+
+            LOCK2(cs_main, cs_wallet);
+            for (unsigned int i = 0; i < item.block.vtx.size(); i++) {
+                const CTransaction& tx = item.block.vtx[i];
+                bool fCandidate = item.vMatch[i] || setWalletTxids.count(tx.GetHash());
+                for (unsigned int j = 0; j < tx.vin.size() && !fCandidate; j++)
+                    fCandidate = setWalletTxids.count(tx.vin[j].prevout.hash) > 0;
+                if (!fCandidate)
+                    continue;
+                if (AddToWalletIfInvolvingMe(tx, &item.block, fUpdate))
+                    ret++;
+                if (mapWallet.count(tx.GetHash()))
+                    setWalletTxids.insert(tx.GetHash());
             }
         }
-        ShowProgress(_("Rescanning..."), 100); // hide progress dialog in GUI
+
+        if (!fAborted && pindexLast) {
+            LOCK(cs_main);
+            pindex = chainActive.Next(pindexLast);
+        }
     }
-    return ret;
+    ShowProgress(_("Rescanning..."), 100); // hide progress dialog in GUI
+
+    {
+        LOCK(cs_rescan);
+        if (fAborted)
+            LogPrintf("Rescan aborted at block %d\n", rescanProgress.nHeight);
+        rescanProgress = CRescanProgress();
+        fAbortRescan = false;
+    }
+    return fAborted ? -1 : ret;
 }
 
 void CWallet::ReacceptWalletTransactions()
@@ -1066,9 +1335,8 @@ CAmount CWallet::GetBalance() const
     CAmount nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        BOOST_FOREACH(const CWalletTx* pcoin, GetUnspentCandidates())
         {
-            const CWalletTx* pcoin = &(*it).second;
             if (pcoin->IsTrusted())
                 nTotal += pcoin->GetAvailableCredit();
         }
@@ -1082,9 +1350,8 @@ CAmount CWallet::GetUnconfirmedBalance() const
     CAmount nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        BOOST_FOREACH(const CWalletTx* pcoin, GetUnspentCandidates())
         {
-            const CWalletTx* pcoin = &(*it).second;
             if (!IsFinalTx(*pcoin) || (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0))
                 nTotal += pcoin->GetAvailableCredit();
         }
@@ -1097,9 +1364,8 @@ CAmount CWallet::GetImmatureBalance() const
     CAmount nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        BOOST_FOREACH(const CWalletTx* pcoin, GetUnspentCandidates())
         {
-            const CWalletTx* pcoin = &(*it).second;
             nTotal += pcoin->GetImmatureCredit();
         }
     }
@@ -1111,9 +1377,8 @@ CAmount CWallet::GetWatchOnlyBalance() const
     CAmount nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        BOOST_FOREACH(const CWalletTx* pcoin, GetUnspentCandidates())
         {
-            const CWalletTx* pcoin = &(*it).second;
             if (pcoin->IsTrusted())
                 nTotal += pcoin->GetAvailableWatchOnlyCredit();
         }
@@ -1127,9 +1392,8 @@ CAmount CWallet::GetUnconfirmedWatchOnlyBalance() const
     CAmount nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        BOOST_FOREACH(const CWalletTx* pcoin, GetUnspentCandidates())
         {
-            const CWalletTx* pcoin = &(*it).second;
             if (!IsFinalTx(*pcoin) || (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0))
                 nTotal += pcoin->GetAvailableWatchOnlyCredit();
         }
@@ -1142,9 +1406,8 @@ CAmount CWallet::GetImmatureWatchOnlyBalance() const
     CAmount nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        BOOST_FOREACH(const CWalletTx* pcoin, GetUnspentCandidates())
         {
-            const CWalletTx* pcoin = &(*it).second;
             nTotal += pcoin->GetImmatureWatchOnlyCredit();
         }
     }
@@ -1160,10 +1423,9 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
 
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        BOOST_FOREACH(const CWalletTx* pcoin, GetUnspentCandidates())
         {
-            const uint256& wtxid = it->first;
-            const CWalletTx* pcoin = &(*it).second;
+            const uint256& wtxid = pcoin->GetHash();
 
             if (!IsFinalTx(*pcoin))
                 continue;
@@ -1181,15 +1443,15 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
             for (unsigned int i = 0; i < pcoin->vout.size(); i++) {
                 isminetype mine = IsMine(pcoin->vout[i]);
                 if (!(IsSpent(wtxid, i)) && mine != ISMINE_NO &&
-                    !IsLockedCoin((*it).first, i) && pcoin->vout[i].nValue >= nMinimumInputThreshold &&
-                    (!coinControl || !coinControl->HasSelected() || coinControl->IsSelected((*it).first, i)))
+                    !IsLockedCoin(wtxid, i) && pcoin->vout[i].nValue >= nMinimumInputThreshold &&
+                    (!coinControl || !coinControl->HasSelected() || coinControl->IsSelected(wtxid, i)))
                         vCoins.push_back(COutput(pcoin, i, nDepth, (mine & ISMINE_SPENDABLE) != ISMINE_NO));
             }
         }
     }
 }
 
-static void ApproximateBestSubset(vector<pair<CAmount, pair<const CWalletTx*,unsigned int> > >vValue, const CAmount& nTotalLower, const CAmount& nTargetValue,
+static void ApproximateBestSubset(const vector<pair<CAmount, pair<const CWalletTx*,unsigned int> > >& vValue, const CAmount& nTotalLower, const CAmount& nTargetValue,
                                   vector<char>& vfBest, CAmount& nBest, int iterations = 1000)
 {
     vector<char> vfIncluded;
@@ -1235,11 +1497,62 @@ static void ApproximateBestSubset(vector<pair<CAmount, pair<const CWalletTx*,uns
     }
 }
 
-bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int nConfTheirs, vector<COutput> vCoins,
+/**
+ * Depth-first search for a subset of vValue, sorted by descending value, that
+ * adds up to exactly nTargetValue. Branches that overshoot or can no longer
+ * reach the target are cut, and it gives up after MAX_BNB_TRIES nodes.
+ */
+static bool SelectCoinsBnB(const vector<pair<CAmount, pair<const CWalletTx*,unsigned int> > >& vValue, const CAmount& nTargetValue,
+                           vector<char>& vfBest, unsigned int& nTries)
+{
+    // What the coins from each position on add up to
+    vector<CAmount> vRemaining(vValue.size() + 1, 0);
+    for (unsigned int i = vValue.size(); i > 0; i--)
+        vRemaining[i - 1] = vRemaining[i] + vValue[i - 1].first;
+
+    vector<char> vfIncluded(vValue.size(), false);
+    CAmount nTotal = 0;
+    unsigned int i = 0;
+    for (nTries = 0; nTries < MAX_BNB_TRIES; nTries++)
+    {
+        if (nTotal == nTargetValue)
+        {
+            vfBest = vfIncluded;
+            return true;
+        }
+
+        if (nTotal + vRemaining[i] >= nTargetValue)
+        {
+            // Take the coin unless it overshoots; the branch without it comes later
+            if (nTotal + vValue[i].first <= nTargetValue)
+            {
+                nTotal += vValue[i].first;
+                vfIncluded[i] = true;
+            }
+            i++;
+            continue;
+        }
+
+        // Dead end: drop the last coin taken and go on without it
+        while (i > 0 && !vfIncluded[i - 1])
+            i--;
+        if (i == 0)
+            return false;
+        vfIncluded[i - 1] = false;
+        nTotal -= vValue[i - 1].first;
+        // Taking an equal coin instead would only repeat what was just tried
+        while (i < vValue.size() && vValue[i].first == vValue[i - 1].first)
+            i++;
+    }
+    return false;
+}
+
+bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int nConfTheirs, const vector<COutput>& vCoinsIn,
                                  set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet) const
 {
     setCoinsRet.clear();
     nValueRet = 0;
+    lastCoinSelection.nTries = 0;
 
     // List of values less than target
     pair<CAmount, pair<const CWalletTx*,unsigned int> > coinLowestLarger;
@@ -1248,10 +1561,17 @@ bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int
     vector<pair<CAmount, pair<const CWalletTx*,unsigned int> > > vValue;
     CAmount nTotalLower = 0;
 
+    // Shuffle pointers rather than copying the outputs; ties between equal
+    // values are broken by this order
+    vector<const COutput*> vCoins;
+    vCoins.reserve(vCoinsIn.size());
+    BOOST_FOREACH(const COutput &output, vCoinsIn)
+        vCoins.push_back(&output);
     random_shuffle(vCoins.begin(), vCoins.end(), GetRandInt);
 
-    BOOST_FOREACH(const COutput &output, vCoins)
+    BOOST_FOREACH(const COutput *poutput, vCoins)
     {
+        const COutput &output = *poutput;
         if (!output.fSpendable)
             continue;
 
@@ -1269,6 +1589,7 @@ bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int
         {
             setCoinsRet.insert(coin.second);
             nValueRet += coin.first;
+            lastCoinSelection.strAlgorithm = "exact";
             return true;
         }
         else if (n < nTargetValue + CENT)
@@ -1289,6 +1610,7 @@ bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int
             setCoinsRet.insert(vValue[i].second);
             nValueRet += vValue[i].first;
         }
+        lastCoinSelection.strAlgorithm = "all";
         return true;
     }
 
@@ -1298,17 +1620,32 @@ bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int
             return false;
         setCoinsRet.insert(coinLowestLarger.second);
         nValueRet += coinLowestLarger.first;
+        lastCoinSelection.strAlgorithm = "largest";
         return true;
     }
 
-    // Solve subset sum by stochastic approximation
-    sort(vValue.rbegin(), vValue.rend(), CompareValueOnly());
+    // Look for an exact subset first; this is stable in shuffled order, so equal coins are still picked at random
+    stable_sort(vValue.rbegin(), vValue.rend(), CompareValueOnly());
     vector<char> vfBest;
     CAmount nBest;
 
-    ApproximateBestSubset(vValue, nTotalLower, nTargetValue, vfBest, nBest, 1000);
+    if (SelectCoinsBnB(vValue, nTargetValue, vfBest, lastCoinSelection.nTries))
+    {
+        for (unsigned int i = 0; i < vValue.size(); i++)
+            if (vfBest[i])
+            {
+                setCoinsRet.insert(vValue[i].second);
+                nValueRet += vValue[i].first;
+            }
+        lastCoinSelection.strAlgorithm = "bnb";
+        return true;
+    }
+
+    // Solve subset sum by stochastic approximation, with the work bounded for large wallets
+    int nIterations = std::max(1, std::min(1000, (int)(MAX_APPROXIMATE_SUBSET_WORK / vValue.size())));
+    ApproximateBestSubset(vValue, nTotalLower, nTargetValue, vfBest, nBest, nIterations);
     if (nBest != nTargetValue && nTotalLower >= nTargetValue + CENT)
-        ApproximateBestSubset(vValue, nTotalLower, nTargetValue + CENT, vfBest, nBest, 1000);
+        ApproximateBestSubset(vValue, nTotalLower, nTargetValue + CENT, vfBest, nBest, nIterations);
 
     // If we have a bigger coin and (either the stochastic approximation didn't find a good solution,
     //                                   or the next bigger coin is closer), return the bigger coin
@@ -1317,8 +1654,10 @@ bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int
     {
         setCoinsRet.insert(coinLowestLarger.second);
         nValueRet += coinLowestLarger.first;
+        lastCoinSelection.strAlgorithm = "largest";
     }
     else {
+        lastCoinSelection.strAlgorithm = "approximate";
         for (unsigned int i = 0; i < vValue.size(); i++)
             if (vfBest[i])
             {
@@ -1338,9 +1677,14 @@ bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int
 
 bool CWallet::SelectCoins(const CAmount& nTargetValue, set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet, const CCoinControl* coinControl) const
 {
+    int64_t nStart = GetTimeMicros();
     vector<COutput> vCoins;
     AvailableCoins(vCoins, true, coinControl);
 
+    bool fFound;
+    lastCoinSelection.strAlgorithm = "none";
+    lastCoinSelection.nTries = 0;
+
     // coin control -> return all selected outputs (we want all selected to go into the transaction for sure)
     if (coinControl && coinControl->HasSelected())
     {
@@ -1351,12 +1695,23 @@ bool CWallet::SelectCoins(const CAmount& nTargetValue, set<pair<const CWalletTx*
             nValueRet += out.tx->vout[out.i].nValue;
             setCoinsRet.insert(make_pair(out.tx, out.i));
         }
-        return (nValueRet >= nTargetValue);
+        fFound = (nValueRet >= nTargetValue);
+        if (fFound)
+            lastCoinSelection.strAlgorithm = "coincontrol";
+    }
+    else
+    {
+        fFound = (SelectCoinsMinConf(nTargetValue, 1, 6, vCoins, setCoinsRet, nValueRet) ||
+                  SelectCoinsMinConf(nTargetValue, 1, 1, vCoins, setCoinsRet, nValueRet) ||
+                  (bSpendZeroConfChange && SelectCoinsMinConf(nTargetValue, 0, 1, vCoins, setCoinsRet, nValueRet)));
     }
 
-    return (SelectCoinsMinConf(nTargetValue, 1, 6, vCoins, setCoinsRet, nValueRet) ||
-            SelectCoinsMinConf(nTargetValue, 1, 1, vCoins, setCoinsRet, nValueRet) ||
-            (bSpendZeroConfChange && SelectCoinsMinConf(nTargetValue, 0, 1, vCoins, setCoinsRet, nValueRet)));
+    lastCoinSelection.nTimeMicros = GetTimeMicros() - nStart;
+    lastCoinSelection.nCandidates = vCoins.size();
+    lastCoinSelection.nInputs = fFound ? setCoinsRet.size() : 0;
+    LogPrint("selectcoins", "SelectCoins() %s: %u of %u coins in %.3fms\n", lastCoinSelection.strAlgorithm,
+             lastCoinSelection.nInputs, lastCoinSelection.nCandidates, lastCoinSelection.nTimeMicros * 0.001);
+    return fFound;
 }
 
 
@@ -1652,6 +2007,13 @@ DBErrors CWallet::LoadWallet(bool& fFirstRunRet)
         return nLoadWalletRet;
     fFirstRunRet = !vchDefaultKey.IsValid();
 
+    {
+        // Transactions are read before the watch-only scripts, so IsMine()
+        // is only complete now; classifying them waits for the first query
+        LOCK(cs_wallet);
+        MarkTxIndexesStale();
+    }
+
     uiInterface.LoadWallet(this);
 
     return DB_LOAD_OK;
@@ -1783,15 +2145,23 @@ bool CWallet::TopUpKeyPool(unsigned int kpSize)
         else
             nTargetSize = max(GetArg("-keypool", 100), (int64_t) 0);
 
-        while (setKeyPool.size() < (nTargetSize + 1))
+        // One synced write for the whole top up on the log store. The new
+        // indexes only join setKeyPool once their records are committed.
+        std::vector<int64_t> vNewIndexes;
+        int64_t nEnd = setKeyPool.empty() ? 1 : *(--setKeyPool.end()) + 1;
+        walletdb.BatchBegin();
+        while (setKeyPool.size() + vNewIndexes.size() < (nTargetSize + 1))
         {
-            int64_t nEnd = 1;
-            if (!setKeyPool.empty())
-                nEnd = *(--setKeyPool.end()) + 1;
             if (!walletdb.WritePool(nEnd, CKeyPool(GenerateNewKey())))
                 throw runtime_error("TopUpKeyPool() : writing generated key failed");
-            setKeyPool.insert(nEnd);
-            LogPrintf("keypool added key %d, size=%u\n", nEnd, setKeyPool.size());
+            vNewIndexes.push_back(nEnd++);
+        }
+        if (!walletdb.BatchCommit())
+            throw runtime_error("TopUpKeyPool() : writing key pool failed");
+        BOOST_FOREACH(int64_t nIndex, vNewIndexes)
+        {
+            setKeyPool.insert(nIndex);
+            LogPrintf("keypool added key %d, size=%u\n", nIndex, setKeyPool.size());
         }
     }
     return true;
@@ -1880,11 +2250,9 @@ std::map<CTxDestination, CAmount> CWallet::GetAddressBalances()
     map<CTxDestination, CAmount> balances;
 
     {
-        LOCK(cs_wallet);
-        BOOST_FOREACH(PAIRTYPE(uint256, CWalletTx) walletEntry, mapWallet)
+        LOCK2(cs_main, cs_wallet);
+        BOOST_FOREACH(const CWalletTx* pcoin, GetUnspentCandidates())
         {
-            CWalletTx *pcoin = &walletEntry.second;
-
             if (!IsFinalTx(*pcoin) || !pcoin->IsTrusted())
                 continue;
 
@@ -1903,7 +2271,7 @@ std::map<CTxDestination, CAmount> CWallet::GetAddressBalances()
                 if(!ExtractDestination(pcoin->vout[i].scriptPubKey, addr))
                     continue;
 
-                CAmount n = IsSpent(walletEntry.first, i) ? 0 : pcoin->vout[i].nValue;
+                CAmount n = IsSpent(pcoin->GetHash(), i) ? 0 : pcoin->vout[i].nValue;
 
                 if (!balances.count(addr))
                     balances[addr] = 0;
@@ -15,6 +15,7 @@
 #include "main.h"
 #include "ui_interface.h"
 #include "wallet_ismine.h"
+#include "wallet_rescan.h"
 #include "walletdb.h"
 
 #include <algorithm>
@@ -48,6 +49,10 @@ static const CAmount DEFAULT_TRANSACTION_MAXFEE = 0.1 * COIN;
 static const CAmount nHighTransactionMaxFeeWarning = 100 * nHighTransactionFeeWarning;
 //! Largest (in bytes) free transaction we're willing to create
 static const unsigned int MAX_FREE_TRANSACTION_CREATE_SIZE = 5000;
+//! Nodes the branch and bound coin selection may visit looking for an exact match
+static const unsigned int MAX_BNB_TRIES = 100000;
+//! Coins the stochastic subset search may visit, summed over its iterations
+static const unsigned int MAX_APPROXIMATE_SUBSET_WORK = 4000000;
 
 class CAccountingEntry;
 class CCoinControl;
@@ -105,6 +110,20 @@ public:
     StringMap destdata;
 };
 
+/** How the last SelectCoins call picked its inputs, reported by getwalletinfo */
+struct CCoinSelectionInfo
+{
+    //! "exact", "all", "bnb", "approximate", "largest", "coincontrol" or "none"
+    std::string strAlgorithm;
+    int64_t nTimeMicros;
+    unsigned int nCandidates;
+    unsigned int nInputs;
+    //! Nodes visited by the branch and bound search
+    unsigned int nTries;
+
+    CCoinSelectionInfo() : nTimeMicros(0), nCandidates(0), nInputs(0), nTries(0) {}
+};
+
 /** 
  * A CWallet is an extension of a keystore, which also maintains a set of transactions and balances,
  * and provides the ability to create new transactions.
@@ -137,6 +156,35 @@ private:
 
     void SyncMetaData(std::pair<TxSpends::iterator, TxSpends::iterator>);
 
+    /**
+     * Wallet transactions that may still have an output of ours that no
+     * confirmed wallet transaction spends. This is a superset of the
+     * transactions with unspent outputs: a transaction leaves it lazily, in
+     * GetUnspentCandidates(), and is put back when a transaction spending it
+     * is added, updated or disconnected. Balance queries and coin selection
+     * only look at these instead of all of mapWallet.
+     */
+    mutable std::set<uint256> setUnspentTxids;
+    //! Wallet transactions paying to each of our scripts, for the getreceivedby* calls
+    mutable std::map<CScript, std::set<uint256> > mapTxidsByScript;
+    //! The indexes are built on first use after a load or MarkDirty(), not each time
+    mutable bool fTxIndexesStale;
+    void AddToTxIndexes(const CWalletTx& wtx) const;
+    void MarkTxIndexesStale();
+    void UpdateTxIndexes() const;
+    bool IsSpentByConfirmed(const uint256& hash, const CWalletTx& wtx) const;
+    std::vector<const CWalletTx*> GetUnspentCandidates() const;
+
+    //! Progress of ScanForWalletTransactions and the request to abort it
+    mutable CCriticalSection cs_rescan;
+    CRescanProgress rescanProgress;
+    bool fAbortRescan;
+
+    bool IsRescanAbortRequested();
+    void SetRescanHeight(int nHeight);
+
+    mutable CCoinSelectionInfo lastCoinSelection;
+
 public:
     /*
      * Main wallet lock.
@@ -187,9 +235,12 @@ public:
         nNextResend = 0;
         nLastResend = 0;
         nTimeFirstKey = 0;
+        fAbortRescan = false;
+        fTxIndexesStale = false;
     }
 
     std::map<uint256, CWalletTx> mapWallet;
+    const std::map<CScript, std::set<uint256> >& GetTxidsByScript() const;
 
     int64_t nOrderPosNext;
     std::map<uint256, int> mapRequestCount;
@@ -208,7 +259,12 @@ public:
     bool CanSupportFeature(enum WalletFeature wf) { AssertLockHeld(cs_wallet); return nWalletMaxVersion >= wf; }
 
     void AvailableCoins(std::vector<COutput>& vCoins, bool fOnlyConfirmed=true, const CCoinControl *coinControl = NULL) const;
-    bool SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int nConfTheirs, std::vector<COutput> vCoins, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet) const;
+    bool SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int nConfTheirs, const std::vector<COutput>& vCoins, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet) const;
+    CCoinSelectionInfo GetLastCoinSelection() const
+    {
+        LOCK(cs_wallet);
+        return lastCoinSelection;
+    }
 
     bool IsSpent(const uint256& hash, unsigned int n) const;
 
@@ -281,7 +337,19 @@ public:
     void SyncTransaction(const CTransaction& tx, const CBlock* pblock);
     bool AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pblock, bool fUpdate);
     void EraseFromWallet(const uint256 &hash);
+    void GetScanFilter(CWalletScanFilter& filter) const;
+    /**
+     * Scan the active chain from pindexStart for transactions involving the
+     * wallet. Blocks are read and matched on worker threads; cs_main and
+     * cs_wallet are only taken to commit the matches of a block, so the
+     * caller should not hold them. Returns the number of transactions added
+     * or updated, -1 if AbortRescan() stopped the scan, or -2 without
+     * scanning if another scan is already running.
+     */
     int ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate = false);
+    //! Ask a running ScanForWalletTransactions to stop; false if none is running
+    bool AbortRescan();
+    CRescanProgress GetRescanProgress() const;
     void ReacceptWalletTransactions();
     void ResendWalletTransactions();
     CAmount GetBalance() const;
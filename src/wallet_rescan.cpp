@@ -0,0 +1,121 @@
+// Copyright (c) 2016 The HealthHeldToken developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "wallet_rescan.h"
+
+#include "main.h"
+#include "util.h"
+
+#include <boost/bind.hpp>
+#include <boost/foreach.hpp>
+#include <boost/thread/locks.hpp>
+
+typedef std::vector<unsigned char> valtype;
+
+bool CWalletScanFilter::IsRelevant(const CScript& scriptPubKey) const
+{
+    if (setWatchOnly.count(scriptPubKey))
+        return true;
+
+    std::vector<valtype> vSolutions;
+    txnouttype whichType;
+    if (!Solver(scriptPubKey, whichType, vSolutions))
+        return false;
+
+    switch (whichType)
+    {
+    case TX_NONSTANDARD:
+    case TX_NULL_DATA:
+        break;
+    case TX_PUBKEY:
+        return setKeyIDs.count(CPubKey(vSolutions[0]).GetID()) > 0;
+    case TX_PUBKEYHASH:
+        return setKeyIDs.count(CKeyID(uint160(vSolutions[0]))) > 0;
+    case TX_SCRIPTHASH:
+        return setScriptIDs.count(CScriptID(uint160(vSolutions[0]))) > 0;
+    case TX_MULTISIG:
+        for (unsigned int i = 1; i + 1 < vSolutions.size(); i++) {
+            if (setKeyIDs.count(CPubKey(vSolutions[i]).GetID()))
+                return true;
+        }
+        break;
+    }
+    return false;
+}
+
+CWalletRescanQueue::CWalletRescanQueue(const CWalletScanFilter& filterIn, const std::vector<CBlockIndex*>& vBlocksIn, unsigned int nThreads, size_t nWindow) :
+    filter(filterIn), vBlocks(vBlocksIn), vSlots(std::max((size_t)1, nWindow)), nNextRead(0), nNextTake(0), fStop(false)
+{
+    for (unsigned int i = 0; i < std::max(1u, nThreads); i++)
+        threadGroup.create_thread(boost::bind(&CWalletRescanQueue::Thread, this));
+}
+
+CWalletRescanQueue::~CWalletRescanQueue()
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fStop = true;
+    }
+    condWorker.notify_all();
+    threadGroup.join_all();
+}
+
+void CWalletRescanQueue::Thread()
+{
+    RenameThread("healthheldtoken-rescan");
+    while (true) {
+        size_t nIndex;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            while (!fStop && (nNextRead == vBlocks.size() || nNextRead >= nNextTake + vSlots.size()))
+                condWorker.wait(lock);
+            if (fStop)
+                return;
+            nIndex = nNextRead++;
+        }
+
+        // The slot is ours until it is marked ready: Next() has emptied it
+        // and does not look at it before then.
+        Slot& slot = vSlots[nIndex % vSlots.size()];
+        Item& item = slot.item;
+        item.pindex = vBlocks[nIndex];
+        item.block.SetNull();
+        item.fRead = ReadBlockFromDisk(item.block, item.pindex);
+        item.vMatch.assign(item.block.vtx.size(), false);
+        for (unsigned int i = 0; i < item.block.vtx.size(); i++) {
+            BOOST_FOREACH(const CTxOut& txout, item.block.vtx[i].vout) {
+                if (filter.IsRelevant(txout.scriptPubKey)) {
+                    item.vMatch[i] = true;
+                    break;
+                }
+            }
+        }
+
+        boost::unique_lock<boost::mutex> lock(mutex);
+        slot.fReady = true;
+        if (nIndex == nNextTake)
+            condReady.notify_one();
+    }
+}
+
+bool CWalletRescanQueue::Next(Item& item)
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    if (nNextTake == vBlocks.size())
+        return false;
+    Slot& slot = vSlots[nNextTake % vSlots.size()];
+    while (!slot.fReady)
+        condReady.wait(lock);
+
+    item.pindex = slot.item.pindex;
+    item.fRead = slot.item.fRead;
+    item.vMatch.swap(slot.item.vMatch);
+    item.block.SetNull();
+    static_cast<CBlockHeader&>(item.block) = slot.item.block;
+    item.block.vtx.swap(slot.item.block.vtx);
+    slot.fReady = false;
+    nNextTake++;
+    condWorker.notify_all();
+    return true;
+}
@@ -0,0 +1,117 @@
+// Copyright (c) 2016 The HealthHeldToken developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_WALLET_RESCAN_H
+#define BITCOIN_WALLET_RESCAN_H
+
+#include "primitives/block.h"
+#include "pubkey.h"
+#include "script/script.h"
+#include "script/standard.h"
+
+#include <set>
+#include <stdint.h>
+#include <vector>
+
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+class CBlockIndex;
+
+/** Most threads a rescan reads and matches blocks on */
+static const unsigned int MAX_RESCAN_THREADS = 8;
+/** Blocks the rescan threads may run ahead of the wallet commits */
+static const unsigned int RESCAN_WINDOW_SIZE = 64;
+
+/**
+ * The keys, P2SH scripts and watch-only scripts of a wallet, copied so rescan
+ * threads can match outputs without holding cs_wallet. A match means IsMine()
+ * may be true: a bare multisig output with any one of our keys matches,
+ * and AddToWalletIfInvolvingMe makes the final decision.
+ */
+class CWalletScanFilter
+{
+private:
+    std::set<CKeyID> setKeyIDs;
+    std::set<CScriptID> setScriptIDs;
+    std::set<CScript> setWatchOnly;
+
+public:
+    void AddKeyID(const CKeyID& keyid) { setKeyIDs.insert(keyid); }
+    void AddScriptID(const CScriptID& scriptid) { setScriptIDs.insert(scriptid); }
+    void AddWatchOnly(const CScript& script) { setWatchOnly.insert(script); }
+
+    bool IsRelevant(const CScript& scriptPubKey) const;
+};
+
+/** State of a running rescan, reported by getwalletinfo */
+struct CRescanProgress
+{
+    bool fScanning;
+    int nStartHeight;
+    int nHeight;
+    int nStopHeight;
+    int64_t nStartTime;
+
+    CRescanProgress() : fScanning(false), nStartHeight(0), nHeight(0), nStopHeight(0), nStartTime(0) {}
+};
+
+/**
+ * Reads the given blocks from disk on a pool of threads and matches their
+ * outputs against a CWalletScanFilter. The caller takes the blocks back in
+ * chain order with Next() and commits what matched; the threads stay at most
+ * nWindow blocks ahead of it, which bounds the memory held.
+ */
+class CWalletRescanQueue
+{
+public:
+    struct Item
+    {
+        CBlockIndex* pindex;
+        CBlock block;
+        //! False if the block could not be read
+        bool fRead;
+        //! Per transaction, whether one of its outputs matched the filter
+        std::vector<bool> vMatch;
+
+        Item() : pindex(NULL), fRead(false) {}
+    };
+
+private:
+    struct Slot
+    {
+        Item item;
+        bool fReady;
+
+        Slot() : fReady(false) {}
+    };
+
+    const CWalletScanFilter& filter;
+    const std::vector<CBlockIndex*>& vBlocks;
+    std::vector<Slot> vSlots;
+    //! Next block a thread reads, and next block Next() returns
+    size_t nNextRead;
+    size_t nNextTake;
+    bool fStop;
+
+    boost::mutex mutex;
+    //! Threads wait for a free slot on this
+    boost::condition_variable condWorker;
+    //! Next() waits for its block on this
+    boost::condition_variable condReady;
+    boost::thread_group threadGroup;
+
+    void Thread();
+
+public:
+    CWalletRescanQueue(const CWalletScanFilter& filterIn, const std::vector<CBlockIndex*>& vBlocksIn, unsigned int nThreads, size_t nWindow = RESCAN_WINDOW_SIZE);
+    //! Stops and joins the threads, also when not all blocks were taken
+    ~CWalletRescanQueue();
+
+    //! Take the next block in order, waiting for it to be read; false after the last one
+    bool Next(Item& item);
+};
+
+#endif // BITCOIN_WALLET_RESCAN_H
@@ -13,9 +13,13 @@
 #include "utiltime.h"
 #include "wallet.h"
 
+#include <deque>
+
+#include <boost/bind.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/foreach.hpp>
 #include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/thread.hpp>
 
 using namespace boost;
@@ -209,7 +213,7 @@ void CWalletDB::ListAccountCreditDebit(const string& strAccount, list<CAccountin
 {
     bool fAllAccounts = (strAccount == "*");
 
-    Dbc* pcursor = GetCursor();
+    CDBCursor* pcursor = GetCursor();
     if (!pcursor)
         throw runtime_error("CWalletDB::ListAccountCreditDebit() : cannot create DB cursor");
     unsigned int fFlags = DB_SET_RANGE;
@@ -226,7 +230,7 @@ void CWalletDB::ListAccountCreditDebit(const string& strAccount, list<CAccountin
             break;
         else if (ret != 0)
         {
-            pcursor->close();
+            CloseCursor(pcursor);
             throw runtime_error("CWalletDB::ListAccountCreditDebit() : error scanning DB");
         }
 
@@ -245,7 +249,7 @@ void CWalletDB::ListAccountCreditDebit(const string& strAccount, list<CAccountin
         entries.push_back(acentry);
     }
 
-    pcursor->close();
+    CloseCursor(pcursor);
 }
 
 DBErrors CWalletDB::ReorderTransactions(CWallet* pwallet)
@@ -342,36 +346,55 @@ public:
     }
 };
 
-bool
-ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
-             CWalletScanState &wss, string& strType, string& strErr)
+/**
+ * A wallet record as LoadWallet reads it. Transactions and keys, the records
+ * that take the time, are decoded and checked in here by the load threads;
+ * the rest is left for the loading thread. The decoded transaction or key is
+ * only allocated for records of that type: each CKey locks its memory, which
+ * would be wasted on every other record.
+ */
+struct CWalletLoadRecord
 {
+    string strType;
+    CDataStream ssKey;
+    CDataStream ssValue;
+
+    bool fDecoded;
+    bool fOk;
+    string strErr;
+    //! "tx"
+    uint256 hash;
+    boost::shared_ptr<CWalletTx> pwtx;
+    bool fUpgraded;
+    //! "key" and "wkey"
+    CPubKey vchPubKey;
+    boost::shared_ptr<CKey> pkey;
+
+    CWalletLoadRecord() : ssKey(SER_DISK, CLIENT_VERSION), ssValue(SER_DISK, CLIENT_VERSION),
+                          fDecoded(false), fOk(false), fUpgraded(false) {}
+};
+
+static bool IsDecodedType(const string& strType)
+{
+    return (strType == "tx" || strType == "key" || strType == "wkey");
+}
+
+/** Decode a record of an IsDecodedType() type; touches nothing but the record */
+static void DecodeRecord(const string& strType, CDataStream& ssKey, CDataStream& ssValue, CWalletLoadRecord& record)
+{
+    record.fDecoded = true;
+    record.fOk = false;
     try {
-        // Unserialize
-        // Taking advantage of the fact that pair serialization
-        // is just the two items serialized one after the other
-        ssKey >> strType;
-        if (strType == "name")
-        {
-            string strAddress;
-            ssKey >> strAddress;
-            ssValue >> pwallet->mapAddressBook[CBitcoinAddress(strAddress).Get()].name;
-        }
-        else if (strType == "purpose")
+        if (strType == "tx")
         {
-            string strAddress;
-            ssKey >> strAddress;
-            ssValue >> pwallet->mapAddressBook[CBitcoinAddress(strAddress).Get()].purpose;
-        }
-        else if (strType == "tx")
-        {
-            uint256 hash;
+            uint256& hash = record.hash;
+            record.pwtx.reset(new CWalletTx());
+            CWalletTx& wtx = *record.pwtx;
             ssKey >> hash;
-            CWalletTx wtx;
             ssValue >> wtx;
             CValidationState state;
             if (!(CheckTransaction(wtx, state) && (wtx.GetHash() == hash) && state.IsValid()))
-                return false;
+                return;
 
             // Undo serialize changes in 31600
             if (31404 <= wtx.fTimeReceivedIsTxTime && wtx.fTimeReceivedIsTxTime <= 31703)
@@ -381,69 +404,32 @@ ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
                     char fTmp;
                     char fUnused;
                     ssValue >> fTmp >> fUnused >> wtx.strFromAccount;
-                    strErr = strprintf("LoadWallet() upgrading tx ver=%d %d '%s' %s",
-                                       wtx.fTimeReceivedIsTxTime, fTmp, wtx.strFromAccount, hash.ToString());
+                    record.strErr = strprintf("LoadWallet() upgrading tx ver=%d %d '%s' %s",
+                                              wtx.fTimeReceivedIsTxTime, fTmp, wtx.strFromAccount, hash.ToString());
                     wtx.fTimeReceivedIsTxTime = fTmp;
                 }
                 else
                 {
-                    strErr = strprintf("LoadWallet() repairing tx ver=%d %s", wtx.fTimeReceivedIsTxTime, hash.ToString());
+                    record.strErr = strprintf("LoadWallet() repairing tx ver=%d %s", wtx.fTimeReceivedIsTxTime, hash.ToString());
                     wtx.fTimeReceivedIsTxTime = 0;
                 }
-                wss.vWalletUpgrade.push_back(hash);
+                record.fUpgraded = true;
             }
-
-            if (wtx.nOrderPos == -1)
-                wss.fAnyUnordered = true;
-
-            pwallet->AddToWallet(wtx, true);
         }
-        else if (strType == "acentry")
-        {
-            string strAccount;
-            ssKey >> strAccount;
-            uint64_t nNumber;
-            ssKey >> nNumber;
-            if (nNumber > nAccountingEntryNumber)
-                nAccountingEntryNumber = nNumber;
-
-            if (!wss.fAnyUnordered)
-            {
-                CAccountingEntry acentry;
-                ssValue >> acentry;
-                if (acentry.nOrderPos == -1)
-                    wss.fAnyUnordered = true;
-            }
-        }
-        else if (strType == "watchs")
-        {
-            CScript script;
-            ssKey >> script;
-            char fYes;
-            ssValue >> fYes;
-            if (fYes == '1')
-                pwallet->LoadWatchOnly(script);
-
-            // Watch-only addresses have no birthday information for now,
-            // so set the wallet birthday to the beginning of time.
-            pwallet->nTimeFirstKey = 1;
-        }
-        else if (strType == "key" || strType == "wkey")
+        else
         {
-            CPubKey vchPubKey;
+            CPubKey& vchPubKey = record.vchPubKey;
             ssKey >> vchPubKey;
             if (!vchPubKey.IsValid())
             {
-                strErr = "Error reading wallet database: CPubKey corrupt";
-                return false;
+                record.strErr = "Error reading wallet database: CPubKey corrupt";
+                return;
             }
-            CKey key;
             CPrivKey pkey;
             uint256 hash = 0;
 
             if (strType == "key")
             {
-                wss.nKeys++;
                 ssValue >> pkey;
             } else {
                 CWalletKey wkey;
@@ -474,24 +460,107 @@ ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
 
                 if (Hash(vchKey.begin(), vchKey.end()) != hash)
                 {
-                    strErr = "Error reading wallet database: CPubKey/CPrivKey corrupt";
-                    return false;
+                    record.strErr = "Error reading wallet database: CPubKey/CPrivKey corrupt";
+                    return;
                 }
 
                 fSkipCheck = true;
             }
 
-            if (!key.Load(pkey, vchPubKey, fSkipCheck))
+            record.pkey.reset(new CKey());
+            if (!record.pkey->Load(pkey, vchPubKey, fSkipCheck))
             {
-                strErr = "Error reading wallet database: CPrivKey corrupt";
-                return false;
+                record.strErr = "Error reading wallet database: CPrivKey corrupt";
+                return;
             }
-            if (!pwallet->LoadKey(key, vchPubKey))
+        }
+    } catch (...) {
+        return;
+    }
+    record.fOk = true;
+}
+
+/** Add a record decoded by DecodeRecord to the wallet */
+static bool LoadDecodedRecord(CWallet* pwallet, const CWalletLoadRecord& record, CWalletScanState& wss, string& strErr)
+{
+    strErr = record.strErr;
+    if (record.strType == "key")
+        wss.nKeys++;
+    if (!record.fOk)
+        return false;
+
+    if (record.strType == "tx")
+    {
+        if (record.fUpgraded)
+            wss.vWalletUpgrade.push_back(record.hash);
+
+        if (record.pwtx->nOrderPos == -1)
+            wss.fAnyUnordered = true;
+
+        pwallet->AddToWallet(*record.pwtx, true);
+    }
+    else if (!pwallet->LoadKey(*record.pkey, record.vchPubKey))
+    {
+        strErr = "Error reading wallet database: LoadKey failed";
+        return false;
+    }
+    return true;
+}
+
+/** Add a record to the wallet, decoding it here if it is of an IsDecodedType() type */
+static bool ReadRecord(CWallet* pwallet, const string& strType, CDataStream& ssKey, CDataStream& ssValue,
+                       CWalletScanState &wss, string& strErr)
+{
+    try {
+        if (strType == "name")
+        {
+            string strAddress;
+            ssKey >> strAddress;
+            ssValue >> pwallet->mapAddressBook[CBitcoinAddress(strAddress).Get()].name;
+        }
+        else if (strType == "purpose")
+        {
+            string strAddress;
+            ssKey >> strAddress;
+            ssValue >> pwallet->mapAddressBook[CBitcoinAddress(strAddress).Get()].purpose;
+        }
+        else if (IsDecodedType(strType))
+        {
+            CWalletLoadRecord record;
+            record.strType = strType;
+            DecodeRecord(strType, ssKey, ssValue, record);
+            return LoadDecodedRecord(pwallet, record, wss, strErr);
+        }
+        else if (strType == "acentry")
+        {
+            string strAccount;
+            ssKey >> strAccount;
+            uint64_t nNumber;
+            ssKey >> nNumber;
+            if (nNumber > nAccountingEntryNumber)
+                nAccountingEntryNumber = nNumber;
+
+            if (!wss.fAnyUnordered)
             {
-                strErr = "Error reading wallet database: LoadKey failed";
-                return false;
+                CAccountingEntry acentry;
+                ssValue >> acentry;
+                if (acentry.nOrderPos == -1)
+                    wss.fAnyUnordered = true;
             }
         }
+        else if (strType == "watchs")
+        {
+            CScript script;
+            ssKey >> script;
+            char fYes;
+            ssValue >> fYes;
+            if (fYes == '1')
+                pwallet->LoadWatchOnly(script);
+
+            // Watch-only addresses have no birthday information for now,
+            // so set the wallet birthday to the beginning of time.
+            pwallet->nTimeFirstKey = 1;
+        }
         else if (strType == "mkey")
         {
             unsigned int nID;
@@ -597,6 +666,34 @@ ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
     return true;
 }
 
+bool
+ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
+             CWalletScanState &wss, string& strType, string& strErr)
+{
+    try {
+        // Unserialize
+        // Taking advantage of the fact that pair serialization
+        // is just the two items serialized one after the other
+        ssKey >> strType;
+    } catch (...)
+    {
+        return false;
+    }
+    return ReadRecord(pwallet, strType, ssKey, ssValue, wss, strErr);
+}
+
+static void DecodeRecordsThread(deque<CWalletLoadRecord>* pvRecords, const vector<size_t>* pvDecode, size_t nFirst, size_t nStep)
+{
+    RenameThread("healthheldtoken-walletload");
+    for (size_t i = nFirst; i < pvDecode->size(); i += nStep)
+    {
+        CWalletLoadRecord& record = (*pvRecords)[(*pvDecode)[i]];
+        DecodeRecord(record.strType, record.ssKey, record.ssValue, record);
+        // The decoded copy is all that is needed from here
+        record.ssValue.clear();
+    }
+}
+
 static bool IsKeyType(string strType)
 {
     return (strType== "key" || strType == "wkey" ||
@@ -620,31 +717,80 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
             pwallet->LoadMinVersion(nMinVersion);
         }
 
-        // Get cursor
-        Dbc* pcursor = GetCursor();
+        // Read all records first, so the cursor is not held while they are
+        // decoded
+        int64_t nStart = GetTimeMillis();
+        CDBCursor* pcursor = GetCursor();
         if (!pcursor)
         {
             LogPrintf("Error getting wallet database cursor\n");
             return DB_CORRUPT;
         }
 
+        // A deque, so that growing it doesn't copy the records read so far
+        deque<CWalletLoadRecord> vRecords;
+        vector<size_t> vDecode;
         while (true)
         {
             // Read next record
-            CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-            CDataStream ssValue(SER_DISK, CLIENT_VERSION);
-            int ret = ReadAtCursor(pcursor, ssKey, ssValue);
+            vRecords.push_back(CWalletLoadRecord());
+            CWalletLoadRecord& record = vRecords.back();
+            int ret = ReadAtCursor(pcursor, record.ssKey, record.ssValue);
             if (ret == DB_NOTFOUND)
+            {
+                vRecords.pop_back();
                 break;
+            }
             else if (ret != 0)
             {
                 LogPrintf("Error reading next record from wallet database\n");
+                CloseCursor(pcursor);
                 return DB_CORRUPT;
             }
 
+            // Taking advantage of the fact that pair serialization
+            // is just the two items serialized one after the other
+            try {
+                record.ssKey >> record.strType;
+            } catch (...) {
+                fNoncriticalErrors = true;
+                vRecords.pop_back();
+                continue;
+            }
+            if (IsDecodedType(record.strType))
+                vDecode.push_back(vRecords.size() - 1);
+        }
+        CloseCursor(pcursor);
+        int64_t nRead = GetTimeMillis();
+
+        // Transactions and keys are independent of each other: decode them
+        // in parallel, each thread taking every nThreads-th one
+        unsigned int nThreads = std::min(MAX_WALLET_LOAD_THREADS, std::max(1u, boost::thread::hardware_concurrency()));
+        if (vDecode.size() < WALLET_LOAD_PARALLEL_MIN)
+            nThreads = 1;
+        if (nThreads == 1)
+            DecodeRecordsThread(&vRecords, &vDecode, 0, 1);
+        else
+        {
+            boost::thread_group threadGroup;
+            for (unsigned int i = 0; i < nThreads; i++)
+                threadGroup.create_thread(boost::bind(&DecodeRecordsThread, &vRecords, &vDecode, i, nThreads));
+            threadGroup.join_all();
+        }
+        int64_t nDecoded = GetTimeMillis();
+
+        // Add them to the wallet in file order, as a sequential load would,
+        // dropping each record once it has been added
+        size_t nRecords = vRecords.size();
+        for (; !vRecords.empty(); vRecords.pop_front())
+        {
+            CWalletLoadRecord& record = vRecords.front();
             // Try to be tolerant of single corrupt records:
-            string strType, strErr;
-            if (!ReadKeyValue(pwallet, ssKey, ssValue, wss, strType, strErr))
+            string& strType = record.strType;
+            string strErr;
+            bool fRead = record.fDecoded ? LoadDecodedRecord(pwallet, record, wss, strErr) :
+                                           ReadRecord(pwallet, strType, record.ssKey, record.ssValue, wss, strErr);
+            if (!fRead)
             {
                 // losing keys is considered a catastrophic error, anything else
                 // we assume the user can live with:
@@ -662,7 +808,8 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
             if (!strErr.empty())
                 LogPrintf("%s\n", strErr);
         }
-        pcursor->close();
+        LogPrint("db", "CWalletDB::LoadWallet : %u records read in %dms, %u decoded on %u threads in %dms, added in %dms\n",
+                 nRecords, nRead - nStart, vDecode.size(), nThreads, nDecoded - nRead, GetTimeMillis() - nDecoded);
     }
     catch (boost::thread_interrupted) {
         throw;
@@ -721,7 +868,7 @@ DBErrors CWalletDB::FindWalletTx(CWallet* pwallet, vector<uint256>& vTxHash, vec
         }
 
         // Get cursor
-        Dbc* pcursor = GetCursor();
+        CDBCursor* pcursor = GetCursor();
         if (!pcursor)
         {
             LogPrintf("Error getting wallet database cursor\n");
@@ -755,7 +902,7 @@ DBErrors CWalletDB::FindWalletTx(CWallet* pwallet, vector<uint256>& vTxHash, vec
                 vWtx.push_back(wtx);
             }
         }
-        pcursor->close();
+        CloseCursor(pcursor);
     }
     catch (boost::thread_interrupted) {
         throw;
@@ -28,6 +28,11 @@ class CWalletTx;
 class uint160;
 class uint256;
 
+/** Most threads LoadWallet decodes transactions and keys on */
+static const unsigned int MAX_WALLET_LOAD_THREADS = 8;
+/** Below this many transactions and keys LoadWallet decodes them on its own thread */
+static const unsigned int WALLET_LOAD_PARALLEL_MIN = 1000;
+
 /** Error statuses for the wallet database */
 enum DBErrors
 {
@@ -0,0 +1,369 @@
+// Copyright (c) 2016 The HealthHeldToken developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "walletlog.h"
+
+#include "clientversion.h"
+#include "hash.h"
+#include "streams.h"
+#include "uint256.h"
+#include "util.h"
+
+#include <string.h>
+
+#include <boost/filesystem.hpp>
+#include <boost/foreach.hpp>
+
+using namespace std;
+
+static const unsigned char pchWalletLogMagic[8] = {'h', 'h', 't', 'w', 'l', 'o', 'g', 0};
+static const int WALLETLOG_VERSION = 1;
+static const size_t WALLETLOG_HEADER_SIZE = sizeof(pchWalletLogMagic) + sizeof(int);
+
+enum
+{
+    WALLETLOG_PUT = 1,
+    WALLETLOG_ERASE = 2,
+};
+
+static bool WriteHeader(FILE* fileout)
+{
+    CDataStream ssHeader(SER_DISK, CLIENT_VERSION);
+    ssHeader.write((const char*)pchWalletLogMagic, sizeof(pchWalletLogMagic));
+    ssHeader << WALLETLOG_VERSION;
+    return fwrite(&ssHeader[0], 1, ssHeader.size(), fileout) == ssHeader.size();
+}
+
+bool CWalletLog::KeyCompare::operator()(const CSerializeData& a, const CSerializeData& b) const
+{
+    size_t nSize = std::min(a.size(), b.size());
+    int nCmp = nSize ? memcmp(&a[0], &b[0], nSize) : 0;
+    return nCmp < 0 || (nCmp == 0 && a.size() < b.size());
+}
+
+CWalletLog::CWalletLog() : file(NULL), nLiveBytes(0), nFileBytes(0)
+{
+}
+
+CWalletLog::~CWalletLog()
+{
+    Close();
+}
+
+bool CWalletLog::IsLogFile(const boost::filesystem::path& pathIn)
+{
+    FILE* filein = fopen(pathIn.string().c_str(), "rb");
+    if (!filein)
+        return false;
+    unsigned char pchMagic[sizeof(pchWalletLogMagic)];
+    bool fLog = fread(pchMagic, 1, sizeof(pchMagic), filein) == sizeof(pchMagic) &&
+                memcmp(pchMagic, pchWalletLogMagic, sizeof(pchMagic)) == 0;
+    fclose(filein);
+    return fLog;
+}
+
+bool CWalletLog::Open(const boost::filesystem::path& pathIn, bool fCreate)
+{
+    LOCK(cs_log);
+    if (file)
+        return true;
+    path = pathIn;
+
+    if (!boost::filesystem::exists(path)) {
+        if (!fCreate)
+            return error("CWalletLog::Open : %s does not exist", path.string());
+        FILE* fileout = fopen(path.string().c_str(), "wb");
+        if (!fileout)
+            return error("CWalletLog::Open : cannot create %s", path.string());
+        bool fOk = WriteHeader(fileout);
+        FileCommit(fileout);
+        fclose(fileout);
+        if (!fOk)
+            return error("CWalletLog::Open : cannot write %s", path.string());
+    }
+
+    if (!Replay())
+        return false;
+
+    file = fopen(path.string().c_str(), "ab");
+    if (!file)
+        return error("CWalletLog::Open : cannot open %s for writing", path.string());
+    LogPrint("db", "CWalletLog::Open : %s, %u records, %u of %u bytes live\n",
+             path.string(), mapRecords.size(), nLiveBytes, nFileBytes);
+    return true;
+}
+
+void CWalletLog::Close()
+{
+    LOCK(cs_log);
+    if (file) {
+        FileCommit(file);
+        fclose(file);
+        file = NULL;
+    }
+    mapRecords.clear();
+    nLiveBytes = 0;
+    nFileBytes = 0;
+}
+
+bool CWalletLog::Replay()
+{
+    FILE* filein = fopen(path.string().c_str(), "rb");
+    if (!filein)
+        return error("CWalletLog::Replay : cannot open %s", path.string());
+    CSerializeData data;
+    if (fseek(filein, 0, SEEK_END) == 0) {
+        long nSize = ftell(filein);
+        if (nSize > 0) {
+            data.resize(nSize);
+            rewind(filein);
+            if (fread(&data[0], 1, data.size(), filein) != data.size())
+                data.clear();
+        }
+    }
+    fclose(filein);
+
+    if (data.size() < WALLETLOG_HEADER_SIZE || memcmp(&data[0], pchWalletLogMagic, sizeof(pchWalletLogMagic)) != 0)
+        return error("CWalletLog::Replay : %s is not a wallet log", path.string());
+    int nVersion;
+    memcpy(&nVersion, &data[sizeof(pchWalletLogMagic)], sizeof(nVersion));
+    if (nVersion > WALLETLOG_VERSION)
+        return error("CWalletLog::Replay : %s has unknown version %d", path.string(), nVersion);
+
+    mapRecords.clear();
+    nLiveBytes = 0;
+    size_t nPos = WALLETLOG_HEADER_SIZE;
+    // Whether the bytes after nPos may hold more than an interrupted write
+    bool fKeepTail = false;
+    while (nPos < data.size()) {
+        // Frame: payload size, payload, hash of the payload
+        uint32_t nSize;
+        if (data.size() - nPos < sizeof(nSize) + sizeof(uint256))
+            break;
+        memcpy(&nSize, &data[nPos], sizeof(nSize));
+        size_t nEnd = nPos + sizeof(nSize) + nSize + sizeof(uint256);
+        if (nEnd > data.size() || nEnd < nPos) {
+            // Either the last frame was torn or its size is damaged, and
+            // then the bytes after it may be intact frames
+            fKeepTail = true;
+            break;
+        }
+
+        const char* pbegin = &data[nPos + sizeof(nSize)];
+        uint256 hashStored;
+        memcpy(hashStored.begin(), pbegin + nSize, sizeof(hashStored));
+        if (Hash(pbegin, pbegin + nSize) != hashStored) {
+            // Only the last frame can have been torn by a crash
+            if (nEnd < data.size())
+                return error("CWalletLog::Replay : bad checksum at offset %u of %s", nPos, path.string());
+            break;
+        }
+
+        try {
+            CDataStream ssFrame(pbegin, pbegin + nSize, SER_DISK, CLIENT_VERSION);
+            while (!ssFrame.empty()) {
+                Op op;
+                unsigned char chType;
+                ssFrame >> chType >> op.key;
+                op.fErase = (chType == WALLETLOG_ERASE);
+                if (!op.fErase)
+                    ssFrame >> op.value;
+                Apply(op);
+            }
+        } catch (const std::exception& e) {
+            return error("CWalletLog::Replay : bad frame at offset %u of %s: %s", nPos, path.string(), e.what());
+        }
+        nPos = nEnd;
+    }
+
+    if (nPos < data.size()) {
+        if (fKeepTail) {
+            // Set the rest aside before cutting it off, so nothing is lost if it wasn't a torn write
+            boost::filesystem::path pathTail = strprintf("%s.%d.corrupt", path.string(), GetTime());
+            FILE* fileout = fopen(pathTail.string().c_str(), "wb");
+            if (!fileout)
+                return error("CWalletLog::Replay : cannot create %s", pathTail.string());
+            bool fOk = fwrite(&data[nPos], 1, data.size() - nPos, fileout) == data.size() - nPos;
+            FileCommit(fileout);
+            fclose(fileout);
+            if (!fOk)
+                return error("CWalletLog::Replay : cannot write %s", pathTail.string());
+            LogPrintf("CWalletLog::Replay : frame at offset %u of %s runs past the end, moved the last %u bytes to %s\n",
+                      nPos, path.string(), data.size() - nPos, pathTail.string());
+        } else {
+            LogPrintf("CWalletLog::Replay : dropping %u bytes of an interrupted write at the end of %s\n",
+                      data.size() - nPos, path.string());
+        }
+        boost::filesystem::resize_file(path, nPos);
+    }
+    nFileBytes = nPos;
+    return true;
+}
+
+void CWalletLog::Apply(const Op& op)
+{
+    RecordMap::iterator it = mapRecords.find(op.key);
+    if (it != mapRecords.end()) {
+        nLiveBytes -= it->first.size() + it->second.size();
+        if (op.fErase) {
+            mapRecords.erase(it);
+        } else {
+            it->second = op.value;
+            nLiveBytes += it->first.size() + it->second.size();
+        }
+        return;
+    }
+    if (op.fErase)
+        return;
+    mapRecords.insert(make_pair(op.key, op.value));
+    nLiveBytes += op.key.size() + op.value.size();
+}
+
+bool CWalletLog::WriteFrame(FILE* fileout, const CSerializeData& payload, uint64_t& nBytes)
+{
+    uint32_t nSize = payload.size();
+    uint256 hash = Hash(payload.begin(), payload.end());
+    CSerializeData frame(sizeof(nSize) + payload.size() + sizeof(hash));
+    memcpy(&frame[0], &nSize, sizeof(nSize));
+    if (!payload.empty())
+        memcpy(&frame[sizeof(nSize)], &payload[0], payload.size());
+    memcpy(&frame[sizeof(nSize) + payload.size()], hash.begin(), sizeof(hash));
+    if (fwrite(&frame[0], 1, frame.size(), fileout) != frame.size())
+        return false;
+    nBytes += frame.size();
+    return true;
+}
+
+bool CWalletLog::Read(const CSerializeData& key, CSerializeData& value) const
+{
+    LOCK(cs_log);
+    RecordMap::const_iterator it = mapRecords.find(key);
+    if (it == mapRecords.end())
+        return false;
+    value = it->second;
+    return true;
+}
+
+bool CWalletLog::Exists(const CSerializeData& key) const
+{
+    LOCK(cs_log);
+    return mapRecords.count(key) > 0;
+}
+
+bool CWalletLog::Write(const Batch& batch, bool fSync)
+{
+    if (batch.empty())
+        return true;
+
+    CDataStream ssPayload(SER_DISK, CLIENT_VERSION);
+    BOOST_FOREACH(const Op& op, batch) {
+        ssPayload << (unsigned char)(op.fErase ? WALLETLOG_ERASE : WALLETLOG_PUT) << op.key;
+        if (!op.fErase)
+            ssPayload << op.value;
+    }
+    CSerializeData payload;
+    ssPayload.GetAndClear(payload);
+
+    LOCK(cs_log);
+    if (!file)
+        return false;
+    uint64_t nOldBytes = nFileBytes;
+    if (!WriteFrame(file, payload, nFileBytes) || fflush(file) != 0) {
+        // Do not leave a torn frame in front of the next one
+        TruncateFile(file, nOldBytes);
+        nFileBytes = nOldBytes;
+        return error("CWalletLog::Write : cannot write to %s", path.string());
+    }
+    if (fSync)
+        FileCommit(file);
+
+    BOOST_FOREACH(const Op& op, batch)
+        Apply(op);
+    return true;
+}
+
+bool CWalletLog::Seek(const CSerializeData& key, bool fAfter, CSerializeData& keyRet, CSerializeData& valueRet) const
+{
+    LOCK(cs_log);
+    RecordMap::const_iterator it = fAfter ? mapRecords.upper_bound(key) : mapRecords.lower_bound(key);
+    if (it == mapRecords.end())
+        return false;
+    keyRet = it->first;
+    valueRet = it->second;
+    return true;
+}
+
+bool CWalletLog::Flush()
+{
+    LOCK(cs_log);
+    if (!file)
+        return false;
+    FileCommit(file);
+    return true;
+}
+
+bool CWalletLog::NeedsCompaction() const
+{
+    LOCK(cs_log);
+    return nFileBytes >= WALLETLOG_COMPACT_MIN_SIZE && nFileBytes / 2 > nLiveBytes;
+}
+
+bool CWalletLog::Compact(const char* pszSkip)
+{
+    LOCK(cs_log);
+    if (!file)
+        return false;
+
+    int64_t nStart = GetTimeMillis();
+    boost::filesystem::path pathTmp(path.string() + ".rewrite");
+    FILE* fileout = fopen(pathTmp.string().c_str(), "wb");
+    if (!fileout)
+        return error("CWalletLog::Compact : cannot create %s", pathTmp.string());
+
+    bool fOk = WriteHeader(fileout);
+    uint64_t nBytes = WALLETLOG_HEADER_SIZE;
+    vector<CSerializeData> vSkipped;
+    CDataStream ssPayload(SER_DISK, CLIENT_VERSION);
+    for (RecordMap::const_iterator it = mapRecords.begin(); fOk && it != mapRecords.end(); ++it) {
+        if (pszSkip && strncmp(&it->first[0], pszSkip, std::min(it->first.size(), strlen(pszSkip))) == 0) {
+            vSkipped.push_back(it->first);
+            continue;
+        }
+        ssPayload << (unsigned char)WALLETLOG_PUT << it->first << it->second;
+        if (ssPayload.size() >= WALLETLOG_COMPACT_FRAME_SIZE) {
+            CSerializeData payload;
+            ssPayload.GetAndClear(payload);
+            fOk = WriteFrame(fileout, payload, nBytes);
+        }
+    }
+    if (fOk && !ssPayload.empty()) {
+        CSerializeData payload;
+        ssPayload.GetAndClear(payload);
+        fOk = WriteFrame(fileout, payload, nBytes);
+    }
+    FileCommit(fileout);
+    fclose(fileout);
+    if (!fOk) {
+        boost::filesystem::remove(pathTmp);
+        return error("CWalletLog::Compact : cannot write %s", pathTmp.string());
+    }
+
+    fclose(file);
+    file = NULL;
+    bool fRenamed = RenameOver(pathTmp, path);
+    file = fopen(path.string().c_str(), "ab");
+    if (!fRenamed || !file)
+        return error("CWalletLog::Compact : cannot replace %s", path.string());
+
+    BOOST_FOREACH(const CSerializeData& key, vSkipped) {
+        Op op;
+        op.fErase = true;
+        op.key = key;
+        Apply(op);
+    }
+    LogPrint("db", "CWalletLog::Compact : rewrote %s from %u to %u bytes in %dms\n",
+             path.string(), nFileBytes, nBytes, GetTimeMillis() - nStart);
+    nFileBytes = nBytes;
+    return true;
+}
@@ -0,0 +1,92 @@
+// Copyright (c) 2016 The HealthHeldToken developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_WALLETLOG_H
+#define BITCOIN_WALLETLOG_H
+
+#include "allocators.h"
+#include "sync.h"
+
+#include <map>
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
+
+#include <boost/filesystem/path.hpp>
+
+/** Log store files grow to at least this size before they are compacted */
+static const uint64_t WALLETLOG_COMPACT_MIN_SIZE = 1 << 20;
+/** Compaction writes the live records in frames of about this size */
+static const size_t WALLETLOG_COMPACT_FRAME_SIZE = 1 << 20;
+
+/**
+ * A wallet file kept as an append-only log of record batches, with all live
+ * records indexed in memory. Each batch is one frame, written with a single
+ * fwrite and replayed on open only if its checksum matches, so a batch is
+ * applied completely or not at all. A torn frame at the end of the file is
+ * cut off on open; if its size runs past the end of the file, which could
+ * also be a damaged size field, the cut off bytes are first saved to a
+ * .corrupt file next to it. Overwritten and erased records stay in the file until
+ * Compact() rewrites it with only the live ones.
+ *
+ * Keys and values are the serialized CDB records, so CDB can use this as a
+ * drop-in for a Berkeley DB file.
+ */
+class CWalletLog
+{
+public:
+    struct Op
+    {
+        bool fErase;
+        CSerializeData key;
+        CSerializeData value;
+    };
+    typedef std::vector<Op> Batch;
+
+private:
+    //! Bytewise unsigned, the order of a Berkeley DB btree, so cursors see the same sequence
+    struct KeyCompare
+    {
+        bool operator()(const CSerializeData& a, const CSerializeData& b) const;
+    };
+    typedef std::map<CSerializeData, CSerializeData, KeyCompare> RecordMap;
+
+    mutable CCriticalSection cs_log;
+    boost::filesystem::path path;
+    FILE* file;
+    RecordMap mapRecords;
+    //! Bytes of the live keys and values, and of the whole file
+    uint64_t nLiveBytes;
+    uint64_t nFileBytes;
+
+    bool Replay();
+    void Apply(const Op& op);
+    bool WriteFrame(FILE* fileout, const CSerializeData& payload, uint64_t& nBytes);
+
+public:
+    CWalletLog();
+    ~CWalletLog();
+
+    bool Open(const boost::filesystem::path& pathIn, bool fCreate);
+    void Close();
+
+    bool Read(const CSerializeData& key, CSerializeData& value) const;
+    bool Exists(const CSerializeData& key) const;
+    //! Append the batch as one frame; fSync also commits it to disk
+    bool Write(const Batch& batch, bool fSync);
+    //! The first record with a key at or, with fAfter, past key; false at the end
+    bool Seek(const CSerializeData& key, bool fAfter, CSerializeData& keyRet, CSerializeData& valueRet) const;
+
+    //! Commit everything written so far to disk
+    bool Flush();
+    //! Whether most of the file is dead records
+    bool NeedsCompaction() const;
+    //! Rewrite the file with only the live records, dropping the keys that start with pszSkip
+    bool Compact(const char* pszSkip = NULL);
+
+    //! Whether the file at path is a log store rather than a Berkeley DB file
+    static bool IsLogFile(const boost::filesystem::path& path);
+};
+
+#endif // BITCOIN_WALLETLOG_H